@@ -25,122 +25,211 @@
 #include "user_interface.h"
 #include "gpio.h"
 #include "driver/dht22.h"
+#include "metrics.h"
 
-enum DHTType sensor_type;
-#define sleepms(x) os_delay_us(x*1000);
+enum {
+	DHT_IDLE,
+	DHT_WAKE,
+	DHT_START
+};
+
+static const struct {
+	uint32_t mux;
+	uint8_t func;
+} dht_pins[16] = {
+	{ PERIPHS_IO_MUX_GPIO0_U, FUNC_GPIO0 },
+	{ PERIPHS_IO_MUX_U0TXD_U, FUNC_GPIO1 },
+	{ PERIPHS_IO_MUX_GPIO2_U, FUNC_GPIO2 },
+	{ PERIPHS_IO_MUX_U0RXD_U, FUNC_GPIO3 },
+	{ PERIPHS_IO_MUX_GPIO4_U, FUNC_GPIO4 },
+	{ PERIPHS_IO_MUX_GPIO5_U, FUNC_GPIO5 },
+	{ 0, 0 }, { 0, 0 }, { 0, 0 },	/* 6-8 drive the SPI flash */
+	{ PERIPHS_IO_MUX_SD_DATA2_U, FUNC_GPIO9 },
+	{ PERIPHS_IO_MUX_SD_DATA3_U, FUNC_GPIO10 },
+	{ 0, 0 },						/* 11 drives the SPI flash */
+	{ PERIPHS_IO_MUX_MTDI_U, FUNC_GPIO12 },
+	{ PERIPHS_IO_MUX_MTCK_U, FUNC_GPIO13 },
+	{ PERIPHS_IO_MUX_MTMS_U, FUNC_GPIO14 },
+	{ PERIPHS_IO_MUX_MTDO_U, FUNC_GPIO15 }
+};
 
-static inline float scale_humidity(int *data) {
-	if(sensor_type == DHT11) {
-		return data[0];
+static os_timer_t scan_timer;
+static DHT_SENSOR *scan_sensors;
+static uint8_t scan_count;
+static DHTScanCb scan_cb;
+static uint8_t scan_phase = DHT_IDLE;
+
+/* Both scale functions return tenths so no soft-float code is pulled in */
+static inline uint16_t scale_humidity(enum DHTType type, uint8_t *data) {
+	if(type == DHT11) {
+		return data[0] * 10;
 	} else {
-		float humidity = data[0] * 256 + data[1];
-		return humidity /= 10;
+		return (data[0] << 8) | data[1];
 	}
 }
 
-static inline float scale_temperature(int *data) {
-	if(sensor_type == DHT11) {
-		return data[2];
+static inline int16_t scale_temperature(enum DHTType type, uint8_t *data) {
+	if(type == DHT11) {
+		return data[2] * 10;
 	} else {
-		float temperature = data[2] & 0x7f;
-		temperature *= 256;
-		temperature += data[3];
-		temperature /= 10;
+		int16_t temperature = ((data[2] & 0x7f) << 8) | data[3];
 		if (data[2] & 0x80)
-			temperature *= -1;
+			temperature = -temperature;
 		return temperature;
 	}
 }
 
-static struct dht_sensor_data reading = {
-	.success = 0
-};
+/*
+ * Time every level on the line until it stays put for DHT_TIMEOUT_US,
+ * starting low. Durations come from the microsecond system timer rather
+ * than from counting os_delay_us() iterations.
+ */
+static uint16_t ICACHE_FLASH_ATTR dht_capture(uint8_t pin, uint16_t *pulses, uint16_t max)
+{
+	uint32_t start = system_get_time();
+	uint32_t now;
+	int level = 0;
+	uint16_t n = 0;
+
+	while (n < max) {
+		do {
+			now = system_get_time();
+			if (now - start > DHT_TIMEOUT_US)
+				return n;
+		} while (GPIO_INPUT_GET(pin) == level);
+		pulses[n++] = now - start;
+		start = now;
+		level = !level;
+	}
+	return n;
+}
 
-struct dht_sensor_data *ICACHE_FLASH_ATTR DHTRead(void)
+/* Ends the start signal of one sensor whose line is held low and reads it */
+static void ICACHE_FLASH_ATTR dht_read(DHT_SENSOR *sensor)
 {
-	int counter = 0;
-	int laststate = 1;
+	struct dht_sensor_data *reading = &sensor->reading;
 	int i = 0;
-	int j = 0;
-	int checksum = 0;
-	int data[100];
-	data[0] = data[1] = data[2] = data[3] = data[4] = 0;
-
-	// Wake up device, 250ms of high
-	GPIO_OUTPUT_SET(DHT_PIN, 1);
-	sleepms(250);
-	// Hold low for 20ms
-	GPIO_OUTPUT_SET(DHT_PIN, 0);
-	sleepms(20);
-	// High for 40ns
-	GPIO_OUTPUT_SET(DHT_PIN, 1);
+	uint16_t pulses[DHT_MAX_PULSES];
+	uint16_t count;
+	uint8_t data[5];
+
+	// High for 40us
+	GPIO_OUTPUT_SET(sensor->pin, 1);
 	os_delay_us(40);
-	// Set DHT_PIN pin as an input
-	GPIO_DIS_OUTPUT(DHT_PIN);
+	// Set the pin as an input
+	GPIO_DIS_OUTPUT(sensor->pin);
 
 	// wait for pin to drop?
-	while (GPIO_INPUT_GET(DHT_PIN) == 1 && i < DHT_MAXCOUNT) {
+	while (GPIO_INPUT_GET(sensor->pin) == 1 && i < DHT_MAXCOUNT) {
 		os_delay_us(1);
 		i++;
 	}
 
-	if(i == DHT_MAXCOUNT) {
-		reading.success = 0;
-                os_printf("DHT: Failed to get reading, dying\r\n");
-                return &reading;
-        }
-
-        // read data
-        for (i = 0; i < DHT_MAXTIMINGS; i++)
-        {
-                // Count high time (in approx us)
-                counter = 0;
-                while (GPIO_INPUT_GET(DHT_PIN) == laststate)
-                {
-                        counter++;
-                        os_delay_us(1);
-                        if (counter == 1000)
-                                break;
-                }
-                laststate = GPIO_INPUT_GET(DHT_PIN);
-                if (counter == 1000)
-                        break;
-                // store data after 3 reads
-                if ((i>3) && (i%2 == 0)) {
-                        // shove each bit into the storage bytes
-                        data[j/8] <<= 1;
-                        if (counter > DHT_BREAKTIME)
-                                data[j/8] |= 1;
-                        j++;
-                }
-        }
-
-        if (j >= 39) {
-                checksum = (data[0] + data[1] + data[2] + data[3]) & 0xFF;
-//              os_printf("DHT: %02x %02x %02x %02x [%02x] CS: %02x\r\n", data[0], data[1],data[2],data[3],data[4],checksum);
-                if (data[4] == checksum) {
-                        // checksum is valid
-                        reading.temperature = scale_temperature(data);
-                        reading.humidity = scale_humidity(data);
-                        //os_printf("Temperature =  %d *C, Humidity = %d %%\r\n", (int)(reading.temperature * 100), (int)(reading.humidity * 100));
-                        reading.success = 1;
-                } else {
-                        os_printf("DHT: Checksum was incorrect after %d bits. Expected %d but got %d\r\n", j, data[4], checksum);
-                        reading.success = 0;
-                }
-        } else {
-                os_printf("DHT: Got too few bits: %d should be at least 40\r\n", j);
-                reading.success = 0;
-        }
-        return &reading;
+	count = i == DHT_MAXCOUNT ? 0 : dht_capture(sensor->pin, pulses, DHT_MAX_PULSES);
+
+#ifdef DHT_CAPTURE
+	os_printf("DHT: trace %d:", count);
+	for (i = 0; i < count; i++)
+		os_printf(" %d", pulses[i]);
+	os_printf("\r\n");
+#endif
+
+	reading->time = system_get_time();
+	reading->status = DHTDecode(pulses, count, data);
+	reading->success = reading->status == DHT_OK;
+	METRIC_INC(METRIC_DHT_READS);
+	switch (reading->status) {
+	case DHT_OK:
+		reading->temperature = scale_temperature(sensor->type, data);
+		reading->humidity = scale_humidity(sensor->type, data);
+		break;
+	case DHT_NO_RESPONSE:
+		METRIC_INC(METRIC_DHT_NO_RESPONSE);
+		os_printf("DHT: GPIO%d failed to get reading, dying\r\n", sensor->pin);
+		break;
+	case DHT_TOO_FEW_BITS:
+		METRIC_INC(METRIC_DHT_TOO_FEW_BITS);
+		os_printf("DHT: GPIO%d got too few bits: %d should be at least 40\r\n",
+				sensor->pin, count > 2 ? (count - 2) / 2 : 0);
+		break;
+	case DHT_BAD_CHECKSUM:
+		METRIC_INC(METRIC_DHT_BAD_CHECKSUM);
+		os_printf("DHT: GPIO%d checksum was incorrect. Expected %d but got %d\r\n",
+				sensor->pin, data[4], (data[0] + data[1] + data[2] + data[3]) & 0xFF);
+		break;
+	}
+}
+
+/*
+ * The wake and start periods of all sensors overlap, only the ~5ms
+ * reads themselves run back to back. A later sensor's start low is
+ * stretched by the reads before it, which both types tolerate.
+ */
+static void ICACHE_FLASH_ATTR dht_scan_step(void *arg)
+{
+	uint8_t i;
+
+	if (scan_phase == DHT_WAKE) {
+		for (i = 0; i < scan_count; i++)
+			GPIO_OUTPUT_SET(scan_sensors[i].pin, 0);
+		scan_phase = DHT_START;
+		os_timer_arm(&scan_timer, DHT_START_MS, 0);
+		return;
+	}
+
+	for (i = 0; i < scan_count; i++)
+		dht_read(&scan_sensors[i]);
+	scan_phase = DHT_IDLE;
+	if (scan_cb)
+		scan_cb(scan_sensors, scan_count);
 }
 
+/**
+  * @brief  Read a set of sensors without blocking for the start sequence.
+  * @param  sensors: array set up with DHTInit
+  * @param  count: number of sensors in the array
+  * @param  cb: called with the array once every reading is filled in
+  * @retval FALSE if a scan is already running
+  */
+BOOL ICACHE_FLASH_ATTR DHTScan(DHT_SENSOR *sensors, uint8_t count, DHTScanCb cb)
+{
+	uint8_t i;
+
+	if (scan_phase != DHT_IDLE)
+		return FALSE;
+	scan_sensors = sensors;
+	scan_count = count;
+	scan_cb = cb;
+
+	// Wake up every device, 250ms of high
+	for (i = 0; i < count; i++)
+		GPIO_OUTPUT_SET(sensors[i].pin, 1);
+	scan_phase = DHT_WAKE;
+	os_timer_disarm(&scan_timer);
+	os_timer_setfn(&scan_timer, (os_timer_func_t *)dht_scan_step, NULL);
+	os_timer_arm(&scan_timer, DHT_WAKE_MS, 0);
+	return TRUE;
+}
 
-void ICACHE_FLASH_ATTR DHTInit(enum DHTType dht_type)
+/**
+  * @brief  Whether a sensor can go on the pin, the check DHTInit makes
+  */
+BOOL ICACHE_FLASH_ATTR DHTPinUsable(uint8_t pin)
 {
-	sensor_type = dht_type;
-	PIN_FUNC_SELECT(DHT_MUX, DHT_FUNC);
-	PIN_PULLUP_EN(DHT_MUX);
-	os_printf("DHT setup for type %d\r\n", dht_type);
+	return pin < 16 && dht_pins[pin].mux != 0;
 }
 
+BOOL ICACHE_FLASH_ATTR DHTInit(DHT_SENSOR *sensor, uint8_t pin, enum DHTType type)
+{
+	if (!DHTPinUsable(pin)) {
+		os_printf("DHT: GPIO%d can not be used\r\n", pin);
+		return FALSE;
+	}
+	sensor->pin = pin;
+	sensor->type = type;
+	sensor->reading.success = 0;
+	PIN_FUNC_SELECT(dht_pins[pin].mux, dht_pins[pin].func);
+	PIN_PULLUP_EN(dht_pins[pin].mux);
+	os_printf("DHT setup for type %d on GPIO%d\r\n", type, pin);
+	return TRUE;
+}
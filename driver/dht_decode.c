@@ -0,0 +1,41 @@
+/*
+    Pulse-width decoder for the DHT11/DHT22 one-wire protocol.
+
+    Kept free of GPIO and SDK calls so traces captured with DHT_CAPTURE can
+    be replayed through it off target.
+*/
+
+#include "c_types.h"
+#include "driver/dht22.h"
+
+/*
+ * pulses[] holds the length in microseconds of each level after the host
+ * releases the line and the sensor pulls it low: the 80us response low,
+ * the 80us response high, then a ~50us low and a 26-28us (0) or ~70us (1)
+ * high for each of the 40 bits. Comparing each high with the low before it
+ * makes the decision independent of the CPU clock and loop overhead.
+ */
+DHTStatus ICACHE_FLASH_ATTR
+DHTDecode(const uint16_t *pulses, uint16_t count, uint8_t *data)
+{
+	uint16_t bit, i;
+	uint8_t checksum;
+
+	data[0] = data[1] = data[2] = data[3] = data[4] = 0;
+	if (count < 2)
+		return DHT_NO_RESPONSE;
+
+	for (bit = 0; bit < DHT_BITS; bit++) {
+		i = 2 + bit * 2;
+		if (i + 1 >= count)
+			return DHT_TOO_FEW_BITS;
+		data[bit / 8] <<= 1;
+		if (pulses[i + 1] > pulses[i])
+			data[bit / 8] |= 1;
+	}
+
+	checksum = data[0] + data[1] + data[2] + data[3];
+	if (data[4] != checksum)
+		return DHT_BAD_CHECKSUM;
+	return DHT_OK;
+}
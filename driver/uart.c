@@ -14,13 +14,38 @@
 #include "driver/uart.h"
 #include "osapi.h"
 #include "driver/uart_register.h"
+#include "user_interface.h"
+#include "user_config.h"
 //#include "ssc.h"
 
 
+#define UART_TX_FIFO_LIMIT	126		/* keep the 128 byte hardware FIFO from overrunning */
+#define UART_TX_EMPTY_THRHD	0x10	/* refill interrupt fires below this many queued bytes */
+
+/* keep ring data accesses on the right side of the index update */
+#define UART_BARRIER()		__asm__ __volatile__("" ::: "memory")
+
 // UartDev is defined and initialized in rom code.
 extern UartDevice    UartDev;
 //extern os_event_t    at_recvTaskQueue[at_recvTaskQueueLen];
 
+/* Software TX FIFO for UART0. The head is only advanced by the task side and
+ * the tail only by the TXFIFO_EMPTY interrupt, both as free running indices. */
+LOCAL uint8 uart0_tx_ring[TX_BUFF_SIZE];
+LOCAL volatile uint16 uart0_tx_head;
+LOCAL volatile uint16 uart0_tx_tail;
+LOCAL UartTxOverflow uart0_tx_overflow = UART_TX_BLOCK;
+
+/* RX ring for UART0, the mirror image: the interrupt owns the head and the
+ * task registered through uart0_set_rx_task() owns the tail. */
+LOCAL uint8 uart0_rx_ring[RX_BUFF_SIZE];
+LOCAL volatile uint16 uart0_rx_head;
+LOCAL volatile uint16 uart0_rx_tail;
+LOCAL volatile BOOL uart0_rx_posted;
+LOCAL uint8 uart0_rx_task_prio = UART_RX_NO_TASK;
+LOCAL volatile uint32 uart0_rx_dropped;
+LOCAL volatile uint32 uart0_rx_frm_err;
+
 LOCAL void uart0_rx_intr_handler(void *para);
 
 /******************************************************************************
@@ -65,14 +90,16 @@ uart_config(uint8 uart_no)
 //                 UART_RX_FLOW_EN);
   if (uart_no == UART0)
   {
-    //set rx fifo trigger
+    //set rx fifo trigger and the tx refill level
     WRITE_PERI_REG(UART_CONF1(uart_no),
                    ((0x10 & UART_RXFIFO_FULL_THRHD) << UART_RXFIFO_FULL_THRHD_S) |
+                   ((UART_TX_EMPTY_THRHD & UART_TXFIFO_EMPTY_THRHD) << UART_TXFIFO_EMPTY_THRHD_S) |
                    ((0x10 & UART_RX_FLOW_THRHD) << UART_RX_FLOW_THRHD_S) |
                    UART_RX_FLOW_EN |
                    (0x02 & UART_RX_TOUT_THRHD) << UART_RX_TOUT_THRHD_S |
                    UART_RX_TOUT_EN);
     SET_PERI_REG_MASK(UART_INT_ENA(uart_no), UART_RXFIFO_TOUT_INT_ENA |
+                      UART_RXFIFO_OVF_INT_ENA |
                       UART_FRM_ERR_INT_ENA);
   }
   else
@@ -100,7 +127,7 @@ uart_tx_one_char(uint8 uart, uint8 TxChar)
     while (true)
     {
       uint32 fifo_cnt = READ_PERI_REG(UART_STATUS(uart)) & (UART_TXFIFO_CNT<<UART_TXFIFO_CNT_S);
-      if ((fifo_cnt >> UART_TXFIFO_CNT_S & UART_TXFIFO_CNT) < 126) {
+      if ((fifo_cnt >> UART_TXFIFO_CNT_S & UART_TXFIFO_CNT) < UART_TX_FIFO_LIMIT) {
         break;
       }
     }
@@ -109,6 +136,81 @@ uart_tx_one_char(uint8 uart, uint8 TxChar)
     return OK;
 }
 
+/******************************************************************************
+ * FunctionName : uart0_tx_fill
+ * Description  : Internal used function
+ *                Move queued bytes from the software FIFO into the hardware
+ *                FIFO until either one runs out. Runs from the TX interrupt,
+ *                or from task context with the UART interrupt masked.
+ * Parameters   : NONE
+ * Returns      : NONE
+*******************************************************************************/
+LOCAL void
+uart0_tx_fill(void)
+{
+  uint16 tail = uart0_tx_tail;
+  uint32 fifo_cnt = (READ_PERI_REG(UART_STATUS(UART0)) >> UART_TXFIFO_CNT_S) & UART_TXFIFO_CNT;
+
+  while (tail != uart0_tx_head && fifo_cnt < UART_TX_FIFO_LIMIT)
+  {
+    WRITE_PERI_REG(UART_FIFO(UART0), uart0_tx_ring[tail & (TX_BUFF_SIZE - 1)]);
+    tail++;
+    fifo_cnt++;
+  }
+  UART_BARRIER();
+  uart0_tx_tail = tail;
+}
+
+/******************************************************************************
+ * FunctionName : uart0_tx_put
+ * Description  : Internal used function
+ *                Queue one char into the software FIFO, applying the
+ *                overflow policy when it is full
+ * Parameters   : uint8 c - character to queue
+ * Returns      : TRUE if the character was queued
+*******************************************************************************/
+LOCAL BOOL ICACHE_FLASH_ATTR
+uart0_tx_put(uint8 c)
+{
+  while ((uint16)(uart0_tx_head - uart0_tx_tail) >= TX_BUFF_SIZE)
+  {
+    if (uart0_tx_overflow == UART_TX_DROP_NEW)
+      return FALSE;
+
+    ETS_UART_INTR_DISABLE();
+    if (uart0_tx_overflow == UART_TX_DROP_OLD)
+      uart0_tx_tail++;
+    else
+      uart0_tx_fill();
+    ETS_UART_INTR_ENABLE();
+  }
+
+  uart0_tx_ring[uart0_tx_head & (TX_BUFF_SIZE - 1)] = c;
+  UART_BARRIER();
+  uart0_tx_head++;
+  return TRUE;
+}
+
+/******************************************************************************
+ * FunctionName : uart0_tx_kick
+ * Description  : Internal used function
+ *                Arm the TXFIFO_EMPTY interrupt so the ISR drains what was
+ *                queued; it disarms itself once the software FIFO is empty.
+ *                While it is armed the ISR is bound to see what was just
+ *                queued, so only the first write of a burst masks interrupts.
+ * Parameters   : NONE
+ * Returns      : NONE
+*******************************************************************************/
+LOCAL void ICACHE_FLASH_ATTR
+uart0_tx_kick(void)
+{
+  if (READ_PERI_REG(UART_INT_ENA(UART0)) & UART_TXFIFO_EMPTY_INT_ENA)
+    return;
+  ETS_UART_INTR_DISABLE();
+  SET_PERI_REG_MASK(UART_INT_ENA(UART0), UART_TXFIFO_EMPTY_INT_ENA);
+  ETS_UART_INTR_ENABLE();
+}
+
 /******************************************************************************
  * FunctionName : uart1_write_char
  * Description  : Internal used function
@@ -138,17 +240,86 @@ uart0_write_char(char c)
 {
   if (c == '\n')
   {
-    uart_tx_one_char(UART0, '\r');
-    uart_tx_one_char(UART0, '\n');
+    uart0_tx_put('\r');
+    uart0_tx_put('\n');
   }
   else if (c == '\r')
   {
   }
   else
   {
-    uart_tx_one_char(UART0, c);
+    uart0_tx_put(c);
   }
+  uart0_tx_kick();
 }
+
+/******************************************************************************
+ * FunctionName : uart0_tx_write
+ * Description  : queue a buffer for transmission on uart0 without waiting for
+ *                the wire, unless the overflow policy is UART_TX_BLOCK
+ * Parameters   : const uint8 *buf - point to send buffer
+ *                uint16 len - buffer len
+ * Returns      : number of bytes accepted into the software FIFO
+*******************************************************************************/
+uint16 ICACHE_FLASH_ATTR
+uart0_tx_write(const uint8 *buf, uint16 len)
+{
+  uint16 i;
+
+  for (i = 0; i < len; i++)
+  {
+    if (!uart0_tx_put(buf[i]))
+      break;
+  }
+  if (i > 0)
+    uart0_tx_kick();
+  return i;
+}
+
+/******************************************************************************
+ * FunctionName : uart0_tx_free
+ * Description  : free space left in the uart0 software TX FIFO
+ * Parameters   : NONE
+ * Returns      : number of bytes that can be queued without overflowing
+*******************************************************************************/
+uint16 ICACHE_FLASH_ATTR
+uart0_tx_free(void)
+{
+  return TX_BUFF_SIZE - (uint16)(uart0_tx_head - uart0_tx_tail);
+}
+
+/******************************************************************************
+ * FunctionName : uart0_tx_flush
+ * Description  : wait until everything queued has left the hardware FIFO,
+ *                e.g. before a deep sleep cuts the line off
+ * Parameters   : NONE
+ * Returns      : NONE
+*******************************************************************************/
+void ICACHE_FLASH_ATTR
+uart0_tx_flush(void)
+{
+  while (uart0_tx_tail != uart0_tx_head)
+  {
+    ETS_UART_INTR_DISABLE();
+    uart0_tx_fill();
+    ETS_UART_INTR_ENABLE();
+  }
+  while ((READ_PERI_REG(UART_STATUS(UART0)) >> UART_TXFIFO_CNT_S) & UART_TXFIFO_CNT)
+    ;
+}
+
+/******************************************************************************
+ * FunctionName : uart0_set_tx_overflow
+ * Description  : select what happens when the software TX FIFO is full
+ * Parameters   : UartTxOverflow policy - drop new, drop old or block
+ * Returns      : NONE
+*******************************************************************************/
+void ICACHE_FLASH_ATTR
+uart0_set_tx_overflow(UartTxOverflow policy)
+{
+  uart0_tx_overflow = policy;
+}
+
 /******************************************************************************
  * FunctionName : uart0_tx_buffer
  * Description  : use uart0 to transfer buffer
@@ -159,12 +330,7 @@ uart0_write_char(char c)
 void ICACHE_FLASH_ATTR
 uart0_tx_buffer(uint8 *buf, uint16 len)
 {
-  uint16 i;
-
-  for (i = 0; i < len; i++)
-  {
-    uart_tx_one_char(UART0, buf[i]);
-  }
+  uart0_tx_write(buf, len);
 }
 
 /******************************************************************************
@@ -177,10 +343,39 @@ uart0_tx_buffer(uint8 *buf, uint16 len)
 void ICACHE_FLASH_ATTR
 uart0_sendStr(const char *str)
 {
-	while(*str)
-	{
-		uart_tx_one_char(UART0, *str++);
-	}
+	uart0_tx_write((const uint8 *)str, os_strlen(str));
+}
+
+/******************************************************************************
+ * FunctionName : uart0_rx_drain
+ * Description  : Internal used function
+ *                Move everything in the RX hardware FIFO into the software
+ *                ring. Bytes that do not fit are read out and dropped so the
+ *                FIFO cannot stall.
+ * Parameters   : NONE
+ * Returns      : NONE
+*******************************************************************************/
+LOCAL void
+uart0_rx_drain(void)
+{
+  uint16 head = uart0_rx_head;
+  uint8 RcvChar;
+
+  while ((READ_PERI_REG(UART_STATUS(UART0)) >> UART_RXFIFO_CNT_S) & UART_RXFIFO_CNT)
+  {
+    RcvChar = READ_PERI_REG(UART_FIFO(UART0)) & 0xFF;
+    if ((uint16)(head - uart0_rx_tail) < RX_BUFF_SIZE)
+    {
+      uart0_rx_ring[head & (RX_BUFF_SIZE - 1)] = RcvChar;
+      head++;
+    }
+    else
+    {
+      uart0_rx_dropped++;
+    }
+  }
+  UART_BARRIER();
+  uart0_rx_head = head;
 }
 
 /******************************************************************************
@@ -190,91 +385,95 @@ uart0_sendStr(const char *str)
  * Parameters   : void *para - point to ETS_UART_INTR_ATTACH's arg
  * Returns      : NONE
 *******************************************************************************/
-//extern void at_recvTask(void);
-
 LOCAL void
 uart0_rx_intr_handler(void *para)
 {
   /* uart0 and uart1 intr combine togther, when interrupt occur, see reg 0x3ff20020, bit2, bit0 represents
     * uart1 and uart0 respectively
     */
-//  RcvMsgBuff *pRxBuff = (RcvMsgBuff *)para;
-  uint8 RcvChar;
   uint8 uart_no = UART0;//UartDev.buff_uart_no;
+  uint32 status = READ_PERI_REG(UART_INT_ST(uart_no));
+
+  if(status & UART_TXFIFO_EMPTY_INT_ST)
+  {
+    uart0_tx_fill();
+    if (uart0_tx_tail == uart0_tx_head)
+      CLEAR_PERI_REG_MASK(UART_INT_ENA(uart_no), UART_TXFIFO_EMPTY_INT_ENA);
+    WRITE_PERI_REG(UART_INT_CLR(uart_no), UART_TXFIFO_EMPTY_INT_CLR);
+  }
 
-//  if (UART_RXFIFO_FULL_INT_ST != (READ_PERI_REG(UART_INT_ST(uart_no)) & UART_RXFIFO_FULL_INT_ST))
-//  {
-//    return;
-//  }
-//  if (UART_RXFIFO_FULL_INT_ST == (READ_PERI_REG(UART_INT_ST(uart_no)) & UART_RXFIFO_FULL_INT_ST))
-//  {
-////    at_recvTask();
-//    RcvChar = READ_PERI_REG(UART_FIFO(uart_no)) & 0xFF;
-//    system_os_post(at_recvTaskPrio, NULL, RcvChar);
-//    WRITE_PERI_REG(UART_INT_CLR(uart_no), UART_RXFIFO_FULL_INT_CLR);
-//  }
-  if(UART_FRM_ERR_INT_ST == (READ_PERI_REG(UART_INT_ST(uart_no)) & UART_FRM_ERR_INT_ST))
+  if(status & UART_FRM_ERR_INT_ST)
   {
-    os_printf("FRM_ERR\r\n");
+    uart0_rx_frm_err++;
     WRITE_PERI_REG(UART_INT_CLR(uart_no), UART_FRM_ERR_INT_CLR);
   }
 
-  if(UART_RXFIFO_FULL_INT_ST == (READ_PERI_REG(UART_INT_ST(uart_no)) & UART_RXFIFO_FULL_INT_ST))
+  if(status & (UART_RXFIFO_FULL_INT_ST | UART_RXFIFO_TOUT_INT_ST | UART_RXFIFO_OVF_INT_ST))
   {
-//    os_printf("fifo full\r\n");
-    ETS_UART_INTR_DISABLE();/////////
-
-    //system_os_post(at_recvTaskPrio, 0, 0);
-
-//    WRITE_PERI_REG(UART_INT_CLR(uart_no), UART_RXFIFO_FULL_INT_CLR);
-//    while (READ_PERI_REG(UART_STATUS(uart_no)) & (UART_RXFIFO_CNT << UART_RXFIFO_CNT_S))
-//    {
-////      at_recvTask();
-//      RcvChar = READ_PERI_REG(UART_FIFO(uart_no)) & 0xFF;
-//      system_os_post(at_recvTaskPrio, NULL, RcvChar);
-//    }
+    uart0_rx_drain();
+    WRITE_PERI_REG(UART_INT_CLR(uart_no), UART_RXFIFO_FULL_INT_CLR | UART_RXFIFO_TOUT_INT_CLR | UART_RXFIFO_OVF_INT_CLR);
+
+    if (uart0_rx_task_prio != UART_RX_NO_TASK && !uart0_rx_posted)
+    {
+      uart0_rx_posted = TRUE;
+      system_os_post(uart0_rx_task_prio, 0, 0);
+    }
   }
-  else if(UART_RXFIFO_TOUT_INT_ST == (READ_PERI_REG(UART_INT_ST(uart_no)) & UART_RXFIFO_TOUT_INT_ST))
+}
+
+/******************************************************************************
+ * FunctionName : uart0_rx_read
+ * Description  : take received bytes out of the uart0 RX ring. Must only be
+ *                called from the task registered with uart0_set_rx_task.
+ * Parameters   : uint8 *buf - destination buffer
+ *                uint16 len - buffer len
+ * Returns      : number of bytes copied into buf
+*******************************************************************************/
+uint16 ICACHE_FLASH_ATTR
+uart0_rx_read(uint8 *buf, uint16 len)
+{
+  uint16 tail = uart0_rx_tail;
+  uint16 i = 0;
+
+  // clear before reading so an interrupt arriving now posts the task again
+  uart0_rx_posted = FALSE;
+
+  while (i < len && tail != uart0_rx_head)
   {
-    ETS_UART_INTR_DISABLE();/////////
-
-    //system_os_post(at_recvTaskPrio, 0, 0);
-
-//    WRITE_PERI_REG(UART_INT_CLR(uart_no), UART_RXFIFO_TOUT_INT_CLR);
-////    os_printf("rx time over\r\n");
-//    while (READ_PERI_REG(UART_STATUS(uart_no)) & (UART_RXFIFO_CNT << UART_RXFIFO_CNT_S))
-//    {
-////      os_printf("process recv\r\n");
-////      at_recvTask();
-//      RcvChar = READ_PERI_REG(UART_FIFO(uart_no)) & 0xFF;
-//      system_os_post(at_recvTaskPrio, NULL, RcvChar);
-//    }
+    buf[i++] = uart0_rx_ring[tail & (RX_BUFF_SIZE - 1)];
+    tail++;
   }
+  UART_BARRIER();
+  uart0_rx_tail = tail;
+  return i;
+}
+
+/******************************************************************************
+ * FunctionName : uart0_set_rx_task
+ * Description  : select the task the RX interrupt posts to when data arrives
+ * Parameters   : uint8 prio - task priority given to system_os_task, or
+ *                UART_RX_NO_TASK to stop posting
+ * Returns      : NONE
+*******************************************************************************/
+void ICACHE_FLASH_ATTR
+uart0_set_rx_task(uint8 prio)
+{
+  uart0_rx_posted = FALSE;
+  uart0_rx_task_prio = prio;
+}
 
-//  WRITE_PERI_REG(UART_INT_CLR(uart_no), UART_RXFIFO_FULL_INT_CLR);
-
-//  if (READ_PERI_REG(UART_STATUS(uart_no)) & (UART_RXFIFO_CNT << UART_RXFIFO_CNT_S))
-//  {
-//    RcvChar = READ_PERI_REG(UART_FIFO(uart_no)) & 0xFF;
-//    at_recvTask();
-//    *(pRxBuff->pWritePos) = RcvChar;
-
-//    system_os_post(at_recvTaskPrio, NULL, RcvChar);
-
-//    //insert here for get one command line from uart
-//    if (RcvChar == '\r')
-//    {
-//      pRxBuff->BuffState = WRITE_OVER;
-//    }
-//
-//    pRxBuff->pWritePos++;
-//
-//    if (pRxBuff->pWritePos == (pRxBuff->pRcvMsgBuff + RX_BUFF_SIZE))
-//    {
-//      // overflow ...we may need more error handle here.
-//      pRxBuff->pWritePos = pRxBuff->pRcvMsgBuff ;
-//    }
-//  }
+/******************************************************************************
+ * FunctionName : uart0_rx_errors
+ * Description  : read the RX error counters kept by the interrupt handler
+ * Parameters   : uint32 *dropped - bytes lost because the ring was full
+ *                uint32 *frm_err - framing errors seen on the line
+ * Returns      : NONE
+*******************************************************************************/
+void ICACHE_FLASH_ATTR
+uart0_rx_errors(uint32 *dropped, uint32 *frm_err)
+{
+  *dropped = uart0_rx_dropped;
+  *frm_err = uart0_rx_frm_err;
 }
 
 /******************************************************************************
@@ -294,8 +493,12 @@ uart_init(UartBautRate uart0_br, UartBautRate uart1_br)
   uart_config(UART1);
   ETS_UART_INTR_ENABLE();
 
-  // install uart1 putc callback
+#ifdef SERIAL_BRIDGE
+  // UART0 carries the bridge frames, the console goes out on UART1 (GPIO2)
+  os_install_putc1((void *)uart1_write_char);
+#else
   os_install_putc1((void *)uart0_write_char);
+#endif
 }
 
 void ICACHE_FLASH_ATTR
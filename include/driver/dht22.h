@@ -31,20 +31,43 @@ enum DHTType{
 	DHT22
 };
 
+typedef enum {
+	DHT_OK,
+	DHT_NO_RESPONSE,		/* sensor never pulled the line low */
+	DHT_TOO_FEW_BITS,		/* trace ended before 40 bits */
+	DHT_BAD_CHECKSUM
+} DHTStatus;
+
 struct dht_sensor_data {
-	float temperature;
-	float humidity;
+	int16_t temperature;	/* tenths of a degree Celsius */
+	uint16_t humidity;		/* tenths of a percent relative humidity */
 	BOOL success;
+	DHTStatus status;
+	uint32_t time;			/* system_get_time() of the read */
 };
 
-#define DHT_MAXTIMINGS	10000
-#define DHT_BREAKTIME	20
+//#define DHT_CAPTURE			/* print every raw pulse trace as "DHT: trace n: us us ..." */
+
+#define DHT_BITS		40
+#define DHT_MAX_PULSES	(2 + 2 * DHT_BITS + 2)	/* response, 40 bits, a little slack */
+#define DHT_TIMEOUT_US	200		/* no edge for this long ends the frame */
 #define DHT_MAXCOUNT	32000
-#define DHT_MUX			PERIPHS_IO_MUX_GPIO2_U
-#define DHT_FUNC		FUNC_GPIO2
-#define DHT_PIN			2
+#define DHT_PIN			2		/* default pin of the first sensor */
+#define DHT_MAX_SENSORS	4
+#define DHT_WAKE_MS		250
+#define DHT_START_MS	20
+
+typedef struct {
+	uint8_t pin;			/* GPIO 0-5, 9, 10, 12-15 */
+	enum DHTType type;
+	struct dht_sensor_data reading;
+} DHT_SENSOR;
+
+typedef void (*DHTScanCb)(DHT_SENSOR *sensors, uint8_t count);
 
-void DHTInit(enum DHTType dht_type);
-struct dht_sensor_data *DHTRead(void);
+BOOL DHTPinUsable(uint8_t pin);
+BOOL DHTInit(DHT_SENSOR *sensor, uint8_t pin, enum DHTType type);
+BOOL DHTScan(DHT_SENSOR *sensors, uint8_t count, DHTScanCb cb);
+DHTStatus DHTDecode(const uint16_t *pulses, uint16_t count, uint8_t *data);
 
 #endif
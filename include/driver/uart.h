@@ -5,11 +5,13 @@
 #include "eagle_soc.h"
 #include "c_types.h"
 
-#define RX_BUFF_SIZE    256
-#define TX_BUFF_SIZE    100
+#define RX_BUFF_SIZE    1024	/* software RX ring, must be a power of two */
+#define TX_BUFF_SIZE    1024	/* software TX FIFO, must be a power of two */
 #define UART0   0
 #define UART1   1
 
+#define UART_RX_NO_TASK	0xFF
+
 typedef enum {
     FIVE_BITS = 0x0,
     SIX_BITS = 0x1,
@@ -81,6 +83,12 @@ typedef enum {
     RCV_ESC_CHAR,
 } RcvMsgState;
 
+typedef enum {
+    UART_TX_DROP_NEW,      // reject bytes that do not fit
+    UART_TX_DROP_OLD,      // discard the oldest queued bytes to make room
+    UART_TX_BLOCK          // spin until the hardware FIFO frees up room
+} UartTxOverflow;
+
 typedef struct {
     UartBautRate 	     baut_rate;
     UartBitsNum4Char  data_bits;
@@ -97,5 +105,13 @@ typedef struct {
 
 void uart_init(UartBautRate uart0_br, UartBautRate uart1_br);
 void uart0_sendStr(const char *str);
+void uart0_tx_buffer(uint8 *buf, uint16 len);
+uint16 uart0_tx_write(const uint8 *buf, uint16 len);
+uint16 uart0_tx_free(void);
+void uart0_tx_flush(void);
+void uart0_set_tx_overflow(UartTxOverflow policy);
+uint16 uart0_rx_read(uint8 *buf, uint16 len);
+void uart0_set_rx_task(uint8 prio);
+void uart0_rx_errors(uint32 *dropped, uint32 *frm_err);
 #endif
 
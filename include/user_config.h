@@ -1,8 +1,14 @@
 #ifndef _USER_CONFIG_H_
 #define _USER_CONFIG_H_
 
-#define CFG_HOLDER	0x00FF55A4	/* Change this value to load default configurations */
+#define CFG_HOLDER	0x00FF55A9	/* Change this value to load default configurations */
+#ifdef OTA_UPDATE				/* two-slot layout with boot loader, set by make OTA=1 */
+#define CFG_LOCATION	0x7C	/* free sectors between the slots of a 1 MB flash */
+#else
 #define CFG_LOCATION	0x3C	/* Please don't change or if you know what you doing */
+#endif
+#define CFG_SECTORS		4		/* ring of record sectors starting at CFG_LOCATION */
+#define CFG_VERSION		4		/* bump when fields are appended to SYSCFG, CFG_HOLDER for anything else */
 #define CLIENT_SSL_ENABLE
 
 /*DEFAULT CONFIGURATIONS*/
@@ -20,14 +26,46 @@
 #define STA_SSID "DeviceX"
 #define STA_PASS "password"
 #define STA_TYPE AUTH_WPA2_PSK
+#define STA_NETS				3	/* further networks in config besides STA_SSID */
+#define ROAM_RSSI				75	/* roam off an AP weaker than -ROAM_RSSI dBm, 0 disables */
+#define POWER_SLEEP				2	/* radio between deadlines: 0 always on, 1 modem sleep, 2 light sleep */
 
 #define MQTT_RECONNECT_TIMEOUT 	5	/*second*/
 
+#define FILTER_MEDIAN			3	/* samples in the spike rejecting median, 1 disables */
+#define FILTER_TEMP_DEADBAND	2	/* tenths of a degree */
+#define FILTER_HUM_DEADBAND		10	/* tenths of a percent */
+#define FILTER_HEARTBEAT		300	/* seconds, publish at least this often */
+#define AGGR_WINDOW				0	/* seconds per min/max/mean summary, 0 disables */
+
+#define SAMPLE_MIN				2000	/* milliseconds, fastest sampling while the signal moves */
+#define SAMPLE_MAX				60000	/* milliseconds, slowest sampling while it is flat */
+#define SAMPLE_THRESHOLD		5		/* tenths per minute that counts as moving */
+
+#define SNTP_HOST				"pool.ntp.org"
+#define SNTP_INTERVAL			3600	/* seconds between time syncs */
+#define BATCH_SIZE				0		/* timestamped samples per publish, at most BATCH_MAX, 0 disables */
+
 #define DEFAULT_SECURITY	0
 #define QUEUE_BUFFER_SIZE		 		2048
 
+//#define DEEP_SLEEP_MODE			/* wake, sample, publish, deep sleep instead of staying awake */
+#define DEEP_SLEEP_US			(60 * 1000000)	/* microseconds asleep between samples */
+#define DEEP_SLEEP_TIMEOUT		10000	/* milliseconds awake before giving up on a cycle */
+
+//#define SERIAL_BRIDGE				/* publish 0x7E..0x7F framed UART0 packets to MQTT, console on UART1 (GPIO2) */
+#define SERIAL_BRIDGE_BAUD		BIT_RATE_921600
+#define SERIAL_BRIDGE_TOPIC		"serial"
+#define SERIAL_BRIDGE_FRAME		256
+
+#define OTA_SLOT1				0x01000	/* user1.bin */
+#define OTA_SLOT2				0x81000	/* user2.bin */
+#define OTA_SLOT_SIZE			0x7B000
+#define OTA_CONFIRM_MS			300000	/* an updated image has this long to reach the broker */
+#define OTA_MAX_BOOTS			3		/* resets of an unconfirmed image before rolling back */
+
 #define PROTOCOL_NAMEv31	/*MQTT version 3.1 compatible with Mosquitto v0.15*/
 //PROTOCOL_NAMEv311			/*MQTT version 3.11 compatible with https://eclipse.org/paho/clients/testing/*/
 #endif
 
-#define DELAY 5000	/* milliseconds */
+#define DELAY 5000	/* milliseconds, first sampling interval before it adapts */
@@ -0,0 +1,49 @@
+/*
+ * aggregate.c
+ *
+ *  The window itself is driven by the caller; this only folds samples in.
+ */
+#include "ets_sys.h"
+#include "osapi.h"
+#include "os_type.h"
+#include "aggregate.h"
+
+void ICACHE_FLASH_ATTR
+AGGR_Reset(AGGR *a)
+{
+	a->min = 0;
+	a->max = 0;
+	a->last = 0;
+	a->sum = 0;
+	a->count = 0;
+}
+
+void ICACHE_FLASH_ATTR
+AGGR_Add(AGGR *a, int32_t value)
+{
+	if (a->count == 0xFFFF)
+		return;		// window far longer than anyone asked for, keep what we have
+
+	if (a->count == 0 || value < a->min)
+		a->min = value;
+	if (a->count == 0 || value > a->max)
+		a->max = value;
+	a->last = value;
+	a->sum += value;
+	a->count++;
+}
+
+/**
+  * @brief  Mean of the window, rounded half away from zero
+  * @param  a: aggregate
+  * @retval mean, 0 for an empty window
+  */
+int32_t ICACHE_FLASH_ATTR
+AGGR_Mean(const AGGR *a)
+{
+	if (a->count == 0)
+		return 0;
+	if (a->sum < 0)
+		return -((-a->sum + a->count / 2) / a->count);
+	return (a->sum + a->count / 2) / a->count;
+}
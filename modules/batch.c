@@ -0,0 +1,69 @@
+/*
+ * batch.c
+ *
+ *  Samples keep their local timestamp and are converted to Unix time only
+ *  when formatted, so readings taken before the first SNTP answer still
+ *  go out with the right time.
+ */
+#include "ets_sys.h"
+#include "osapi.h"
+#include "os_type.h"
+#include "batch.h"
+#include "clock.h"
+#include "utils.h"
+
+void ICACHE_FLASH_ATTR
+BATCH_Reset(BATCH *b)
+{
+	b->first = 0;
+	b->count = 0;
+}
+
+/**
+  * @brief  Queue a sample, the oldest one is dropped once BATCH_MAX are queued
+  */
+void ICACHE_FLASH_ATTR
+BATCH_Add(BATCH *b, uint32_t millis, int16_t temperature, uint16_t humidity)
+{
+	BATCH_SAMPLE *s;
+
+	if (b->count == BATCH_MAX) {
+		b->first = (b->first + 1) % BATCH_MAX;
+		b->count--;
+	}
+	s = &b->samples[(b->first + b->count) % BATCH_MAX];
+	s->millis = millis;
+	s->temperature = temperature;
+	s->humidity = humidity;
+	b->count++;
+}
+
+/**
+  * @brief  Write the queue as [[ts,temperature,humidity],...], oldest first
+  * @param  buf: at least BATCH_MAX * BATCH_SAMPLE_LEN + 2 bytes
+  * @retval Number of characters written
+  */
+int ICACHE_FLASH_ATTR
+BATCH_Format(const BATCH *b, char *buf)
+{
+	const BATCH_SAMPLE *s;
+	char *p = buf;
+	uint8_t i;
+
+	*p++ = '[';
+	for (i = 0; i < b->count; i++) {
+		s = &b->samples[(b->first + i) % BATCH_MAX];
+		if (i)
+			*p++ = ',';
+		*p++ = '[';
+		p += CLOCK_Format(p, s->millis);
+		*p++ = ',';
+		p += UTILS_FormatTenths(p, s->temperature);
+		*p++ = ',';
+		p += UTILS_FormatTenths(p, s->humidity);
+		*p++ = ']';
+	}
+	*p++ = ']';
+	*p = 0;
+	return p - buf;
+}
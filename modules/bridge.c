@@ -0,0 +1,94 @@
+/*
+ * bridge.c
+ *
+ *  Serial to MQTT bridge. The UART0 interrupt fills the driver's RX ring,
+ *  this task feeds the bytes through the 0x7E/0x7D/0x7F PROTO parser and
+ *  publishes every completed frame as one MQTT message.
+ */
+#include "ets_sys.h"
+#include "osapi.h"
+#include "os_type.h"
+#include "user_interface.h"
+#include "driver/uart.h"
+#include "proto.h"
+#include "mqtt.h"
+#include "debug.h"
+#include "user_config.h"
+#include "config.h"
+#include "metrics.h"
+#include "bridge.h"
+
+#define BRIDGE_TASK_PRIO		1
+#define BRIDGE_TASK_QUEUE_SIZE	1
+#define BRIDGE_CHUNK			64
+
+#ifndef SERIAL_BRIDGE_FRAME
+#define SERIAL_BRIDGE_FRAME		256
+#endif
+
+#ifndef SERIAL_BRIDGE_TOPIC
+#define SERIAL_BRIDGE_TOPIC		"serial"
+#endif
+
+LOCAL os_event_t bridge_procTaskQueue[BRIDGE_TASK_QUEUE_SIZE];
+LOCAL PROTO_PARSER bridge_parser;
+LOCAL U8 bridge_frame[SERIAL_BRIDGE_FRAME];
+LOCAL MQTT_Client *bridge_client;
+
+LOCAL void ICACHE_FLASH_ATTR
+bridge_frame_cb()
+{
+	char topic[48];
+
+	// 0x7F without a preceding 0x7E is line noise, not a frame
+	if (!bridge_parser.isBegin || bridge_parser.dataLen == 0)
+		return;
+
+	// the tail is gone, passing the rest on would hand the far end a corrupt packet
+	if (bridge_parser.isOverflow) {
+		INFO("BRIDGE: Frame over %d bytes, dropped\r\n", SERIAL_BRIDGE_FRAME);
+		METRIC_INC(METRIC_BRIDGE_DROPS);
+		return;
+	}
+	if (bridge_client->connState != MQTT_DATA) {
+		INFO("BRIDGE: Not connected, dropping %d byte frame\r\n", bridge_parser.dataLen);
+		METRIC_INC(METRIC_BRIDGE_DROPS);
+		return;
+	}
+	// built per frame, a topic changed over <topic>config applies right away
+	os_sprintf(topic, "%s%s", config.mqtt_topic, SERIAL_BRIDGE_TOPIC);
+	MQTT_Publish(bridge_client, topic, bridge_frame, bridge_parser.dataLen, 0, 0);
+}
+
+LOCAL void ICACHE_FLASH_ATTR
+bridge_task(os_event_t *e)
+{
+	U8 chunk[BRIDGE_CHUNK];
+	uint16_t len;
+	uint16_t budget = RX_BUFF_SIZE;
+
+	while (budget > 0 && (len = uart0_rx_read(chunk, sizeof chunk)) > 0) {
+		PROTO_Parse(&bridge_parser, chunk, len);
+		budget = len < budget ? budget - len : 0;
+	}
+
+	// yield to WiFi and MQTT under a continuous stream, pick up the rest next round
+	if (budget == 0)
+		system_os_post(BRIDGE_TASK_PRIO, 0, 0);
+}
+
+/**
+  * @brief  Start forwarding framed UART0 packets to MQTT
+  * @param  client: MQTT_Client used for publishing
+  * @retval None
+  */
+void ICACHE_FLASH_ATTR
+BRIDGE_Init(MQTT_Client *client)
+{
+	bridge_client = client;
+	PROTO_Init(&bridge_parser, bridge_frame_cb, bridge_frame, sizeof bridge_frame);
+
+	system_os_task(bridge_task, BRIDGE_TASK_PRIO, bridge_procTaskQueue, BRIDGE_TASK_QUEUE_SIZE);
+	uart0_set_rx_task(BRIDGE_TASK_PRIO);
+	INFO("BRIDGE: Publishing serial frames to %s%s\r\n", config.mqtt_topic, SERIAL_BRIDGE_TOPIC);
+}
@@ -0,0 +1,189 @@
+/*
+ * cfgstore.c
+ *
+ *  Records are written header first, so a save cut short by a reset
+ *  leaves a record whose CRC fails and the previous one stays current.
+ *  Mounting walks every sector once to find the newest valid record and
+ *  the end of the sector it lives in.
+ */
+#include <stddef.h>
+#include "ets_sys.h"
+#include "osapi.h"
+#include "os_type.h"
+#include "spi_flash.h"
+#include "cfgstore.h"
+#include "utils.h"
+#include "debug.h"
+
+#define CFGSTORE_ALIGN(n)	(((n) + 3) & ~3)
+#define CFGSTORE_CHUNK		64
+
+LOCAL BOOL ICACHE_FLASH_ATTR
+spi_read(uint32_t addr, void *buf, uint32_t len)
+{
+	return spi_flash_read(addr, (uint32 *)buf, len) == SPI_FLASH_RESULT_OK;
+}
+
+LOCAL BOOL ICACHE_FLASH_ATTR
+spi_write(uint32_t addr, const void *buf, uint32_t len)
+{
+	return spi_flash_write(addr, (uint32 *)buf, len) == SPI_FLASH_RESULT_OK;
+}
+
+LOCAL BOOL ICACHE_FLASH_ATTR
+spi_erase(uint16_t sector)
+{
+	return spi_flash_erase_sector(sector) == SPI_FLASH_RESULT_OK;
+}
+
+const CFGSTORE_FLASH CFGSTORE_SpiFlash = { spi_read, spi_write, spi_erase };
+
+LOCAL uint32_t ICACHE_FLASH_ATTR
+cfgstore_addr(CFGSTORE *s, uint8_t index, uint16_t offset)
+{
+	return (uint32_t)(s->first + index) * CFGSTORE_SECTOR_SIZE + offset;
+}
+
+/* CRC of a record as it sits in flash, FALSE if it can not be read */
+LOCAL BOOL ICACHE_FLASH_ATTR
+cfgstore_check(CFGSTORE *s, uint32_t addr, const CFGSTORE_RECORD *r)
+{
+	uint32_t buf[CFGSTORE_CHUNK / 4];
+	uint32_t crc = UTILS_Crc32(0, r, offsetof(CFGSTORE_RECORD, crc));
+	uint16_t done, n;
+
+	addr += sizeof(CFGSTORE_RECORD);
+	for (done = 0; done < r->len; done += n) {
+		n = r->len - done < CFGSTORE_CHUNK ? r->len - done : CFGSTORE_CHUNK;
+		if (!s->flash->read(addr + done, buf, CFGSTORE_ALIGN(n)))
+			return FALSE;
+		crc = UTILS_Crc32(crc, buf, n);
+	}
+	return crc == r->crc;
+}
+
+/**
+  * @brief  Scan the ring for the newest valid record and the append position
+  * @param  s:       store state
+  * @param  flash:   flash access, usually &CFGSTORE_SpiFlash
+  * @param  first:   first sector of the ring
+  * @param  sectors: sectors in the ring, at least 2
+  * @retval None
+  */
+void ICACHE_FLASH_ATTR
+CFGSTORE_Mount(CFGSTORE *s, const CFGSTORE_FLASH *flash, uint16_t first, uint8_t sectors)
+{
+	CFGSTORE_RECORD r;
+	uint16_t offset, end;
+	uint8_t i;
+
+	s->flash = flash;
+	s->first = first;
+	s->sectors = sectors;
+	s->seq = 0;
+	s->addr = 0;
+	s->head = 0;
+	s->offset = CFGSTORE_SECTOR_SIZE;
+
+	for (i = 0; i < sectors; i++) {
+		end = CFGSTORE_SECTOR_SIZE;
+		for (offset = 0; offset + sizeof(r) <= CFGSTORE_SECTOR_SIZE; ) {
+			if (!flash->read(cfgstore_addr(s, i, offset), &r, sizeof(r)))
+				break;
+			if (r.seq == CFGSTORE_ERASED) {
+				end = offset;
+				break;
+			}
+			// a torn header can not be skipped over, treat the rest as used
+			if (offset + sizeof(r) + CFGSTORE_ALIGN(r.len) > CFGSTORE_SECTOR_SIZE)
+				break;
+			if (r.seq > s->seq && cfgstore_check(s, cfgstore_addr(s, i, offset), &r)) {
+				s->seq = r.seq;
+				s->addr = cfgstore_addr(s, i, offset);
+				s->head = i;
+				s->offset = 0;	/* set below once the sector is walked */
+			}
+			offset += sizeof(r) + CFGSTORE_ALIGN(r.len);
+		}
+		if (s->seq && s->head == i && s->offset == 0)
+			s->offset = end;
+	}
+	INFO("CFG: mounted %d sectors at 0x%X, newest record %d\r\n", sectors, first, s->seq);
+}
+
+/**
+  * @brief  Read the newest record
+  * @param  s:       mounted store
+  * @param  version: receives the schema the record was written with
+  * @param  buf:     destination
+  * @param  len:     size of buf, a longer record is truncated
+  * @retval Bytes copied into buf, 0 if the store holds no valid record
+  */
+int ICACHE_FLASH_ATTR
+CFGSTORE_Load(CFGSTORE *s, uint16_t *version, void *buf, uint16_t len)
+{
+	CFGSTORE_RECORD r;
+	uint32_t tail;
+	uint16_t n;
+
+	if (s->seq == 0 || !s->flash->read(s->addr, &r, sizeof(r)))
+		return 0;
+	n = r.len < len ? r.len : len;
+	// the flash reads whole words, the last partial one goes through a bounce word
+	if (!s->flash->read(s->addr + sizeof(r), buf, n & ~3))
+		return 0;
+	if (n & 3) {
+		if (!s->flash->read(s->addr + sizeof(r) + (n & ~3), &tail, 4))
+			return 0;
+		os_memcpy((uint8_t *)buf + (n & ~3), &tail, n & 3);
+	}
+	*version = r.version;
+	return n;
+}
+
+/**
+  * @brief  Append a record, moving on to the next sector if this one is full
+  * @param  s:       mounted store
+  * @param  version: schema of the payload
+  * @param  buf:     payload, word aligned
+  * @param  len:     payload bytes, at most a sector minus the header
+  * @retval TRUE once the record is written and reads back valid
+  */
+BOOL ICACHE_FLASH_ATTR
+CFGSTORE_Save(CFGSTORE *s, uint16_t version, const void *buf, uint16_t len)
+{
+	CFGSTORE_RECORD r;
+	uint32_t addr, tail = CFGSTORE_ERASED;
+	uint16_t size = sizeof(r) + CFGSTORE_ALIGN(len);
+
+	if (size > CFGSTORE_SECTOR_SIZE)
+		return FALSE;
+	if (s->offset + size > CFGSTORE_SECTOR_SIZE) {
+		s->head = (s->head + 1) % s->sectors;
+		s->offset = 0;
+		if (!s->flash->erase(s->first + s->head))
+			return FALSE;
+		INFO("CFG: erased sector 0x%X\r\n", s->first + s->head);
+	}
+
+	r.seq = s->seq + 1;
+	r.version = version;
+	r.len = len;
+	r.crc = UTILS_Crc32(UTILS_Crc32(0, &r, offsetof(CFGSTORE_RECORD, crc)), buf, len);
+
+	addr = cfgstore_addr(s, s->head, s->offset);
+	s->offset += size;
+	if (!s->flash->write(addr, &r, sizeof(r)) ||
+			!s->flash->write(addr + sizeof(r), buf, len & ~3))
+		return FALSE;
+	if (len & 3) {
+		os_memcpy(&tail, (const uint8_t *)buf + (len & ~3), len & 3);
+		if (!s->flash->write(addr + sizeof(r) + (len & ~3), &tail, 4))
+			return FALSE;
+	}
+	if (!cfgstore_check(s, addr, &r))
+		return FALSE;
+	s->seq = r.seq;
+	s->addr = addr;
+	return TRUE;
+}
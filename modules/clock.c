@@ -0,0 +1,234 @@
+/*
+ * clock.c
+ *
+ *  Minimal SNTP client. Each answer anchors Unix time to the local
+ *  millisecond counter; the rate difference seen between two anchors is
+ *  kept as a rate correction so timestamps between syncs do not wander
+ *  with the crystal.
+ */
+#include "ets_sys.h"
+#include "osapi.h"
+#include "os_type.h"
+#include "user_interface.h"
+#include "espconn.h"
+#include "mem.h"
+#include "clock.h"
+#include "debug.h"
+
+#define NTP_PORT		123
+#define NTP_PACKET_LEN	48
+#define NTP_UNIX_OFFSET	2208988800UL	/* seconds from 1900 to 1970 */
+
+LOCAL struct espconn ntpConn;
+LOCAL esp_udp ntpUdp;
+LOCAL ip_addr_t ntpIp;
+LOCAL os_timer_t clockTimer;
+LOCAL const char *ntpServer;
+LOCAL uint32_t syncInterval;	/* ms */
+LOCAL uint32_t sinceSync;		/* ms */
+LOCAL uint32_t sentAt;
+LOCAL BOOL connCreated;
+
+LOCAL uint32_t lastUs;
+LOCAL uint32_t usWraps;
+
+LOCAL BOOL synced;
+LOCAL uint32_t baseMillis;		/* local time of the last anchor */
+LOCAL uint64_t baseUnixMs;		/* Unix time at that moment */
+LOCAL uint32_t refMillis;		/* start of the span the drift is measured over */
+LOCAL uint64_t refUnixMs;
+LOCAL int32_t driftPpb;			/* how much faster Unix time runs than the local counter */
+LOCAL BOOL hasDrift;
+
+/**
+  * @brief  Milliseconds since boot. Wraps after 49 days.
+  */
+uint32_t ICACHE_FLASH_ATTR
+CLOCK_Millis(void)
+{
+	uint32_t now = system_get_time();
+
+	// extend the 32-bit microsecond counter, called at least every CLOCK_TICK_MS
+	if (now < lastUs)
+		usWraps++;
+	lastUs = now;
+	return (uint32_t)((((uint64_t)usWraps << 32) | now) / 1000);
+}
+
+LOCAL uint64_t ICACHE_FLASH_ATTR
+clock_unix_ms(uint32_t millis)
+{
+	int32_t elapsed = (int32_t)(millis - baseMillis);
+
+	return baseUnixMs + elapsed + (int64_t)elapsed * driftPpb / 1000000000;
+}
+
+/**
+  * @brief  Convert a CLOCK_Millis() stamp to Unix time
+  * @retval FALSE while the clock has never been synced
+  */
+BOOL ICACHE_FLASH_ATTR
+CLOCK_Unix(uint32_t millis, uint32_t *sec, uint16_t *ms)
+{
+	uint64_t t;
+
+	if (!synced)
+		return FALSE;
+	t = clock_unix_ms(millis);
+	*sec = (uint32_t)(t / 1000);
+	*ms = (uint16_t)(t % 1000);
+	return TRUE;
+}
+
+/**
+  * @brief  Write a CLOCK_Millis() stamp as Unix seconds with three decimals,
+  *         or "null" while unsynced
+  * @retval Number of characters written
+  */
+int ICACHE_FLASH_ATTR
+CLOCK_Format(char *buf, uint32_t millis)
+{
+	uint32_t sec;
+	uint16_t ms;
+
+	if (!CLOCK_Unix(millis, &sec, &ms))
+		return os_sprintf(buf, "null");
+	return os_sprintf(buf, "%u.%03u", sec, ms);
+}
+
+LOCAL void ICACHE_FLASH_ATTR
+clock_anchor(uint32_t millis, uint64_t unixMs)
+{
+	uint32_t span = millis - refMillis;
+	int32_t ppb;
+
+	if (!synced) {
+		refMillis = millis;
+		refUnixMs = unixMs;
+	} else {
+		INFO("SNTP: offset %d ms, drift %d ppb\r\n",
+				(int32_t)(unixMs - clock_unix_ms(millis)), driftPpb);
+		// short spans are dominated by network jitter, only the offset is taken from them
+		if (span >= CLOCK_MIN_SPAN_MS) {
+			ppb = (int32_t)(((int64_t)(unixMs - refUnixMs) - span) * 1000000000 / span);
+			if (ppb > -CLOCK_MAX_PPM * 1000 && ppb < CLOCK_MAX_PPM * 1000) {
+				driftPpb = hasDrift ? (3 * driftPpb + ppb) / 4 : ppb;
+				hasDrift = TRUE;
+			}
+			refMillis = millis;
+			refUnixMs = unixMs;
+		}
+	}
+	baseMillis = millis;
+	baseUnixMs = unixMs;
+	synced = TRUE;
+}
+
+LOCAL void ICACHE_FLASH_ATTR
+clock_recv(void *arg, char *pdata, unsigned short len)
+{
+	uint8_t *p = (uint8_t *)pdata;
+	uint32_t now = CLOCK_Millis();
+	uint32_t sec, frac;
+	uint64_t unixMs;
+
+	// server mode, not a kiss-of-death (stratum 0)
+	if (len < NTP_PACKET_LEN || (p[0] & 0x07) != 4 || p[1] == 0)
+		return;
+
+	sec = (p[40] << 24) | (p[41] << 16) | (p[42] << 8) | p[43];
+	frac = (p[44] << 24) | (p[45] << 16) | (p[46] << 8) | p[47];
+	unixMs = (uint64_t)(sec - NTP_UNIX_OFFSET) * 1000 + (((uint64_t)frac * 1000) >> 32);
+	// the transmit stamp is half a round trip old by now
+	unixMs += (now - sentAt) / 2;
+
+	clock_anchor(now, unixMs);
+	sinceSync = 0;
+}
+
+LOCAL void ICACHE_FLASH_ATTR
+clock_send(void)
+{
+	uint8_t packet[NTP_PACKET_LEN];
+
+	os_memset(packet, 0, sizeof(packet));
+	packet[0] = 0x1B;	/* LI 0, version 3, client */
+
+	if (!connCreated) {
+		ntpConn.type = ESPCONN_UDP;
+		ntpConn.state = ESPCONN_NONE;
+		ntpConn.proto.udp = &ntpUdp;
+		ntpUdp.local_port = espconn_port();
+		espconn_regist_recvcb(&ntpConn, clock_recv);
+		espconn_create(&ntpConn);
+		connCreated = TRUE;
+	}
+	ntpUdp.remote_port = NTP_PORT;
+	os_memcpy(ntpUdp.remote_ip, &ntpIp.addr, 4);
+
+	sentAt = CLOCK_Millis();
+	espconn_sent(&ntpConn, packet, NTP_PACKET_LEN);
+}
+
+LOCAL void ICACHE_FLASH_ATTR
+clock_dns_found(const char *name, ip_addr_t *ipaddr, void *arg)
+{
+	if (ipaddr == NULL || ipaddr->addr == 0) {
+		INFO("SNTP: can not resolve %s\r\n", name);
+		return;
+	}
+	ntpIp.addr = ipaddr->addr;
+	clock_send();
+}
+
+/**
+  * @brief  Ask the server for the time now, e.g. right after getting an IP
+  */
+void ICACHE_FLASH_ATTR
+CLOCK_Sync(void)
+{
+	if (ntpServer == NULL || ntpServer[0] == 0)
+		return;
+	if (ntpIp.addr != 0) {
+		clock_send();
+		return;
+	}
+	ntpConn.proto.udp = &ntpUdp;
+	if (espconn_gethostbyname(&ntpConn, ntpServer, &ntpIp, clock_dns_found) == ESPCONN_OK)
+		clock_send();
+}
+
+LOCAL void ICACHE_FLASH_ATTR
+clock_tick(void *arg)
+{
+	CLOCK_Millis();
+	sinceSync += synced ? CLOCK_TICK_MS : CLOCK_RETRY_MS;
+	if (!synced || sinceSync >= syncInterval) {
+		sinceSync = 0;
+		// the server may have moved, resolve it again
+		ntpIp.addr = 0;
+		if (wifi_station_get_connect_status() == STATION_GOT_IP)
+			CLOCK_Sync();
+	}
+	os_timer_arm(&clockTimer, synced ? CLOCK_TICK_MS : CLOCK_RETRY_MS, 0);
+}
+
+/**
+  * @brief  Start keeping time
+  * @param  server:     NTP host name or dotted address, "" disables syncing
+  * @param  interval_s: seconds between syncs once the first one succeeded
+  * @retval None
+  */
+void ICACHE_FLASH_ATTR
+CLOCK_Init(const char *server, uint32_t interval_s)
+{
+	ntpServer = server;
+	syncInterval = interval_s * 1000;
+	sinceSync = 0;
+	ntpIp.addr = 0;
+	CLOCK_Millis();
+
+	os_timer_disarm(&clockTimer);
+	os_timer_setfn(&clockTimer, (os_timer_func_t *)clock_tick, NULL);
+	os_timer_arm(&clockTimer, CLOCK_RETRY_MS, 0);
+}
@@ -28,6 +28,7 @@
 * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
 * POSSIBILITY OF SUCH DAMAGE.
 */
+#include <stddef.h>
 #include "ets_sys.h"
 #include "os_type.h"
 #include "mem.h"
@@ -36,74 +37,134 @@
 
 #include "mqtt.h"
 #include "config.h"
+#include "cfgstore.h"
 #include "user_config.h"
+#include "metrics.h"
 #include "debug.h"
 
 SYSCFG config;
-SAVE_FLAG save_flag;
+LOCAL CFGSTORE store;
 
-void ICACHE_FLASH_ATTR
-config_save()
+LOCAL void ICACHE_FLASH_ATTR
+config_defaults()
 {
-	 spi_flash_read((CFG_LOCATION + 3) * SPI_FLASH_SEC_SIZE,
-	                   (uint32 *)&save_flag, sizeof(SAVE_FLAG));
-
-	if (save_flag.flag == 0) {
-		spi_flash_erase_sector(CFG_LOCATION + 1);
-		spi_flash_write((CFG_LOCATION + 1) * SPI_FLASH_SEC_SIZE,
-						(uint32 *)&config, sizeof(SYSCFG));
-		save_flag.flag = 1;
-		spi_flash_erase_sector(CFG_LOCATION + 3);
-		spi_flash_write((CFG_LOCATION + 3) * SPI_FLASH_SEC_SIZE,
-						(uint32 *)&save_flag, sizeof(SAVE_FLAG));
-	} else {
-		spi_flash_erase_sector(CFG_LOCATION + 0);
-		spi_flash_write((CFG_LOCATION + 0) * SPI_FLASH_SEC_SIZE,
-						(uint32 *)&config, sizeof(SYSCFG));
-		save_flag.flag = 0;
-		spi_flash_erase_sector(CFG_LOCATION + 3);
-		spi_flash_write((CFG_LOCATION + 3) * SPI_FLASH_SEC_SIZE,
-						(uint32 *)&save_flag, sizeof(SAVE_FLAG));
+	uint8_t i;
+
+	os_memset(&config, 0x00, sizeof config);
+
+	config.cfg_holder = CFG_HOLDER;
+
+	os_sprintf(config.sta_ssid, "%s", STA_SSID);
+	os_sprintf(config.sta_pwd, "%s", STA_PASS);
+	config.sta_type = STA_TYPE;
+
+	os_sprintf(config.device_id, MQTT_CLIENT_ID, system_get_chip_id());
+	os_sprintf(config.mqtt_topic, MQTT_TOPIC, system_get_chip_id());
+	os_sprintf(config.mqtt_host, "%s", MQTT_HOST);
+	config.mqtt_port = MQTT_PORT;
+	os_sprintf(config.mqtt_user, "%s", MQTT_USER);
+	os_sprintf(config.mqtt_pass, "%s", MQTT_PASS);
+
+	config.security = DEFAULT_SECURITY;	/* default non ssl */
+
+	config.mqtt_keepalive = MQTT_KEEPALIVE;
+
+	for (i = 0; i < SENSOR_MAX; i++) {
+		config.sensors[i].pin = SENSOR_NONE;
+		config.sensors[i].type = DHT22;
+		config.sensors[i].temp_filter.median = FILTER_MEDIAN;
+		config.sensors[i].temp_filter.deadband = FILTER_TEMP_DEADBAND;
+		config.sensors[i].temp_filter.heartbeat = FILTER_HEARTBEAT;
+		config.sensors[i].hum_filter.median = FILTER_MEDIAN;
+		config.sensors[i].hum_filter.deadband = FILTER_HUM_DEADBAND;
+		config.sensors[i].hum_filter.heartbeat = FILTER_HEARTBEAT;
 	}
+	// the first sensor keeps the topics of a single-sensor node
+	config.sensors[0].pin = DHT_PIN;
+	config.aggr_window = AGGR_WINDOW;
+	config.sampling.min_ms = SAMPLE_MIN;
+	config.sampling.max_ms = SAMPLE_MAX;
+	config.sampling.threshold = SAMPLE_THRESHOLD;
+	os_sprintf(config.sntp_host, "%s", SNTP_HOST);
+	config.sntp_interval = SNTP_INTERVAL;
+	config.batch_size = BATCH_SIZE;
+	config.roam_rssi = ROAM_RSSI;
+	config.power_mode = POWER_SLEEP;
 }
 
-void ICACHE_FLASH_ATTR
-config_load()
+/* Fields appended to SYSCFG after the given schema already hold their
+ * defaults; conversions of fields that changed meaning go here. */
+LOCAL void ICACHE_FLASH_ATTR
+config_migrate(uint16_t version)
 {
+	INFO("CFG: migrating schema %d to %d\r\n", version, CFG_VERSION);
+}
 
-	INFO("\r\nload ...\r\n");
-	spi_flash_read((CFG_LOCATION + 3) * SPI_FLASH_SEC_SIZE,
-				   (uint32 *)&save_flag, sizeof(SAVE_FLAG));
-	if (save_flag.flag == 0) {
-		spi_flash_read((CFG_LOCATION + 0) * SPI_FLASH_SEC_SIZE,
-					   (uint32 *)&config, sizeof(SYSCFG));
-	} else {
-		spi_flash_read((CFG_LOCATION + 1) * SPI_FLASH_SEC_SIZE,
-					   (uint32 *)&config, sizeof(SYSCFG));
-	}
-	if(config.cfg_holder != CFG_HOLDER){
-		os_memset(&config, 0x00, sizeof config);
+/* Every firmware that wrote the two-sector layout, from CFG_LEGACY_HOLDER on,
+ * had the fields up to security in today's order. Only those are imported,
+ * what came after them changed between builds and keeps its default. */
+#define CFG_LEGACY_HOLDER	0x00FF55A4
+#define CFG_LEGACY_WORDS	offsetof(SYSCFG, security)	/* word aligned, security is read on its own */
 
-		config.cfg_holder = CFG_HOLDER;
+/* The two-sector layout used before the record store, found on first boot */
+LOCAL BOOL ICACHE_FLASH_ATTR
+config_load_legacy()
+{
+	SAVE_FLAG save_flag;
+	uint32_t addr, tail;
 
-		os_sprintf(config.sta_ssid, "%s", STA_SSID);
-		os_sprintf(config.sta_pwd, "%s", STA_PASS);
-		config.sta_type = STA_TYPE;
+	if (!store.flash->read((CFG_LOCATION + 3) * SPI_FLASH_SEC_SIZE, &save_flag, sizeof(SAVE_FLAG)))
+		return FALSE;
+	// over the defaults, the flash past the old struct is erased or unrelated
+	addr = (CFG_LOCATION + (save_flag.flag == 0 ? 0 : 1)) * SPI_FLASH_SEC_SIZE;
+	if (!store.flash->read(addr, &config, CFG_LEGACY_WORDS) ||
+			!store.flash->read(addr + CFG_LEGACY_WORDS, &tail, 4))
+		return FALSE;
+	os_memcpy(&config.security, &tail, sizeof config.security);
+	if (config.cfg_holder < CFG_LEGACY_HOLDER || config.cfg_holder > CFG_HOLDER)
+		return FALSE;
+	config.cfg_holder = CFG_HOLDER;
+	return TRUE;
+}
 
-		os_sprintf(config.device_id, MQTT_CLIENT_ID, system_get_chip_id());
-		os_sprintf(config.mqtt_topic, MQTT_TOPIC, system_get_chip_id());
-		os_sprintf(config.mqtt_host, "%s", MQTT_HOST);
-		config.mqtt_port = MQTT_PORT;
-		os_sprintf(config.mqtt_user, "%s", MQTT_USER);
-		os_sprintf(config.mqtt_pass, "%s", MQTT_PASS);
+void ICACHE_FLASH_ATTR
+config_save()
+{
+	METRIC_INC(METRIC_CFG_SAVES);
+	if (!CFGSTORE_Save(&store, CFG_VERSION, &config, sizeof(SYSCFG))) {
+		METRIC_INC(METRIC_CFG_ERRORS);
+		INFO("CFG: save failed\r\n");
+	}
+}
 
-		config.security = DEFAULT_SECURITY;	/* default non ssl */
+void ICACHE_FLASH_ATTR
+config_load()
+{
+	uint16_t version;
+	int len;
 
-		config.mqtt_keepalive = MQTT_KEEPALIVE;
+	INFO("\r\nload ...\r\n");
+	CFGSTORE_Mount(&store, &CFGSTORE_SpiFlash, CFG_LOCATION, CFG_SECTORS);
 
-		INFO("Default configuration\r\n");
+	// stored bytes go over the defaults, so a shorter older record keeps defaults for new fields
+	config_defaults();
+	len = CFGSTORE_Load(&store, &version, &config, sizeof(SYSCFG));
+	if (len > 0 && config.cfg_holder == CFG_HOLDER) {
+		if (version < CFG_VERSION) {
+			config_migrate(version);
+			config_save();
+		}
+		return;
+	}
 
+	config_defaults();
+	if (len == 0 && config_load_legacy()) {
+		INFO("CFG: importing the old two-sector configuration\r\n");
 		config_save();
+		return;
 	}
 
+	config_defaults();
+	INFO("Default configuration\r\n");
+	config_save();
 }
@@ -0,0 +1,319 @@
+/*
+ * delta.c
+ *
+ *  Every state either eats one unpacked byte or produces output without
+ *  input (copying an unchanged run, hashing the old image), and each of
+ *  those counts against the budget so one call never holds the CPU for
+ *  more than about a sector erase. The running image is checked against
+ *  the digest in the header before anything is written.
+ */
+#include "ets_sys.h"
+#include "osapi.h"
+#include "os_type.h"
+#include "delta.h"
+
+enum {
+	DELTA_S_HEADER,
+	DELTA_S_BASE,			/* hashing the old image */
+	DELTA_S_ADD,
+	DELTA_S_INSERT_LEN,
+	DELTA_S_SEEK,
+	DELTA_S_ZERO,
+	DELTA_S_LITERALS,
+	DELTA_S_COPY,			/* old bytes that did not change */
+	DELTA_S_LITERAL,
+	DELTA_S_INSERT,
+	DELTA_S_DONE
+};
+
+LOCAL uint32_t ICACHE_FLASH_ATTR
+delta_le32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+LOCAL BOOL ICACHE_FLASH_ATTR
+delta_flush(DELTA *d)
+{
+	BOOL ok = d->outLen == 0 || d->write(d->out, d->outLen);
+
+	d->outLen = 0;
+	return ok;
+}
+
+LOCAL BOOL ICACHE_FLASH_ATTR
+delta_emit(DELTA *d, uint8_t c)
+{
+	d->out[d->outLen++] = c;
+	d->newPos++;
+	return d->outLen < DELTA_BLOCK || delta_flush(d);
+}
+
+/* Byte of the old image, one block is kept so runs read each block once */
+LOCAL BOOL ICACHE_FLASH_ATTR
+delta_old(DELTA *d, uint8_t *c)
+{
+	uint32_t base = d->oldPos & ~(DELTA_BLOCK - 1);
+
+	if (base != d->cacheBase) {
+		if (!d->read(base, d->cache, DELTA_BLOCK))
+			return FALSE;
+		d->cacheBase = base;
+	}
+	*c = ((uint8_t *)d->cache)[d->oldPos++ - base];
+	return TRUE;
+}
+
+/* Next byte of the unpacked record stream, FALSE once the input is used up */
+LOCAL BOOL ICACHE_FLASH_ATTR
+delta_unpack(DELTA *d, const uint8_t **p, const uint8_t *end, uint8_t *c)
+{
+	uint16_t token;
+
+	for (;;) {
+		if (d->matchLen) {
+			// distances past the start read zeros, the image digest catches that
+			*c = d->window[(d->windowPos - d->matchDist) & (DELTA_WINDOW - 1)];
+			d->matchLen--;
+			break;
+		}
+		if (*p == end)
+			return FALSE;
+		if (d->flags == 1) {
+			d->flags = 0x100 | *(*p)++;
+			continue;
+		}
+		if (d->flags & 1) {
+			*c = *(*p)++;
+			d->flags >>= 1;
+			break;
+		}
+		if (!d->held) {
+			d->held = 0x100 | *(*p)++;
+			continue;
+		}
+		token = ((d->held & 0xFF) << 8) | *(*p)++;
+		d->held = 0;
+		d->flags >>= 1;
+		d->matchDist = (token >> DELTA_LENGTH_BITS) + 1;
+		d->matchLen = (token & ((1 << DELTA_LENGTH_BITS) - 1)) + DELTA_MIN_MATCH;
+	}
+	d->window[d->windowPos++ & (DELTA_WINDOW - 1)] = *c;
+	return TRUE;
+}
+
+LOCAL DELTA_STATUS ICACHE_FLASH_ATTR
+delta_header(DELTA *d)
+{
+	const uint8_t *h = (const uint8_t *)d->cache;
+
+	if (os_memcmp(h, "ESPD", 4) != 0 || h[4] != DELTA_VERSION)
+		return DELTA_BAD_HEADER;
+	d->oldSize = delta_le32(h + 8);
+	d->newSize = delta_le32(h + 12);
+	if (d->newSize == 0)
+		return DELTA_BAD_HEADER;
+	os_memcpy(d->base, h + 16, SHA256_SIZE);
+	SHA256_Init(&d->sha);
+	d->run = 0;
+	d->state = DELTA_S_BASE;
+	return DELTA_MORE;
+}
+
+/* One block of the old image into the digest, compared once all is in */
+LOCAL DELTA_STATUS ICACHE_FLASH_ATTR
+delta_base(DELTA *d, uint32_t *work)
+{
+	uint8_t digest[SHA256_SIZE];
+	uint32_t n;
+
+	if (d->run < d->oldSize) {
+		n = d->oldSize - d->run < DELTA_BLOCK ? d->oldSize - d->run : DELTA_BLOCK;
+		if (!d->read(d->run, d->cache, DELTA_BLOCK))
+			return DELTA_IO;
+		SHA256_Update(&d->sha, d->cache, n);
+		d->run += n;
+		*work += n / 4;
+		return DELTA_MORE;
+	}
+	SHA256_Final(&d->sha, digest);
+	if (os_memcmp(digest, d->base, SHA256_SIZE) != 0)
+		return DELTA_WRONG_BASE;
+	d->cacheBase = 0xFFFFFFFF;
+	d->state = DELTA_S_ADD;
+	return DELTA_MORE;
+}
+
+/* Past the add and insert bytes of a record: seek, then the next record or the end */
+LOCAL DELTA_STATUS ICACHE_FLASH_ATTR
+delta_record_end(DELTA *d)
+{
+	int32_t pos = (int32_t)d->oldPos + d->seek;
+
+	if (pos < 0 || (uint32_t)pos > d->oldSize)
+		return DELTA_CORRUPT;
+	d->oldPos = pos;
+	if (d->newPos < d->newSize) {
+		d->state = DELTA_S_ADD;
+		return DELTA_MORE;
+	}
+	d->state = DELTA_S_DONE;
+	return delta_flush(d) ? DELTA_MORE : DELTA_IO;
+}
+
+/* Where to go once a zero or literal run is through */
+LOCAL DELTA_STATUS ICACHE_FLASH_ATTR
+delta_run_end(DELTA *d, uint8_t next)
+{
+	if (d->add) {
+		d->state = next;
+		return DELTA_MORE;
+	}
+	if (d->insert) {
+		d->state = DELTA_S_INSERT;
+		return DELTA_MORE;
+	}
+	return delta_record_end(d);
+}
+
+LOCAL DELTA_STATUS ICACHE_FLASH_ATTR
+delta_field(DELTA *d, uint32_t v)
+{
+	switch (d->state) {
+	case DELTA_S_ADD:
+		d->add = v;
+		d->state = DELTA_S_INSERT_LEN;
+		break;
+	case DELTA_S_INSERT_LEN:
+		d->insert = v;
+		d->state = DELTA_S_SEEK;
+		break;
+	case DELTA_S_SEEK:
+		d->seek = (v >> 1) ^ -(int32_t)(v & 1);
+		if (d->add > d->newSize - d->newPos || d->insert > d->newSize - d->newPos - d->add ||
+				d->add > d->oldSize - d->oldPos)
+			return DELTA_CORRUPT;
+		return delta_run_end(d, DELTA_S_ZERO);
+	case DELTA_S_ZERO:
+		if (v > d->add)
+			return DELTA_CORRUPT;
+		d->add -= v;
+		if (v) {
+			d->run = v;
+			d->state = DELTA_S_COPY;
+			break;
+		}
+		return delta_run_end(d, DELTA_S_LITERALS);
+	case DELTA_S_LITERALS:
+		if (v == 0 || v > d->add)
+			return DELTA_CORRUPT;
+		d->add -= v;
+		d->run = v;
+		d->state = DELTA_S_LITERAL;
+		break;
+	}
+	return DELTA_MORE;
+}
+
+/**
+  * @brief  Start applying a patch
+  * @param  d:     applier state
+  * @param  read:  reads the running image
+  * @param  write: takes the new image in order, DELTA_BLOCK bytes at a time
+  * @retval None
+  */
+void ICACHE_FLASH_ATTR
+DELTA_Init(DELTA *d, DELTA_READ read, DELTA_WRITE write)
+{
+	os_memset(d, 0, sizeof(DELTA));
+	d->read = read;
+	d->write = write;
+	d->state = DELTA_S_HEADER;
+	d->cacheBase = 0xFFFFFFFF;
+	d->flags = 1;
+}
+
+/**
+  * @brief  Apply the next part of the patch
+  * @param  d:    applier state
+  * @param  data: patch bytes following the ones already used
+  * @param  len:  number of them
+  * @param  used: set to how many were taken, all of them unless DELTA_BUSY or an error
+  * @retval DELTA_MORE or DELTA_BUSY to go on, DELTA_DONE once the whole image was written
+  */
+DELTA_STATUS ICACHE_FLASH_ATTR
+DELTA_Feed(DELTA *d, const uint8_t *data, uint32_t len, uint32_t *used)
+{
+	const uint8_t *p = data, *end = data + len;
+	DELTA_STATUS status = DELTA_MORE;
+	uint32_t work = 0, v;
+	uint8_t c, o;
+
+	while (status == DELTA_MORE) {
+		if (work >= DELTA_BUDGET) {
+			status = DELTA_BUSY;
+			break;
+		}
+		// states that work without input
+		if (d->state == DELTA_S_BASE) {
+			status = delta_base(d, &work);
+			continue;
+		}
+		if (d->state == DELTA_S_COPY) {
+			if (!delta_old(d, &c) || !delta_emit(d, c))
+				status = DELTA_IO;
+			else if (--d->run == 0)
+				status = delta_run_end(d, DELTA_S_LITERALS);
+			work++;
+			continue;
+		}
+		if (d->state == DELTA_S_DONE) {
+			status = p == end && d->matchLen == 0 ? DELTA_DONE : DELTA_CORRUPT;
+			break;
+		}
+		if (d->state == DELTA_S_HEADER) {
+			if (p == end)
+				break;
+			((uint8_t *)d->cache)[d->run++] = *p++;
+			if (d->run == DELTA_HEADER_LEN)
+				status = delta_header(d);
+			continue;
+		}
+		if (!delta_unpack(d, &p, end, &c))
+			break;
+
+		switch (d->state) {
+		case DELTA_S_LITERAL:
+			if (!delta_old(d, &o) || !delta_emit(d, o + c))
+				status = DELTA_IO;
+			else if (--d->run == 0)
+				status = delta_run_end(d, DELTA_S_ZERO);
+			work++;
+			break;
+		case DELTA_S_INSERT:
+			if (!delta_emit(d, c))
+				status = DELTA_IO;
+			else if (--d->insert == 0)
+				status = delta_record_end(d);
+			work++;
+			break;
+		default:
+			// varint fields, 7 bits at a time
+			if (d->shift > 28) {
+				status = DELTA_CORRUPT;
+				break;
+			}
+			d->value |= (uint32_t)(c & 0x7F) << d->shift;
+			d->shift += 7;
+			if (c & 0x80)
+				break;
+			v = d->value;
+			d->value = 0;
+			d->shift = 0;
+			status = delta_field(d, v);
+			break;
+		}
+	}
+	*used = p - data;
+	return status;
+}
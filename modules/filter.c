@@ -0,0 +1,112 @@
+/*
+ * filter.c
+ *
+ *  Decides per sample whether a metric is worth publishing. A single DHT
+ *  glitch is voted out by the median, jitter inside the dead-band is
+ *  swallowed and the heartbeat keeps a flat signal visible to the backend.
+ */
+#include "ets_sys.h"
+#include "osapi.h"
+#include "os_type.h"
+#include "user_interface.h"
+#include "filter.h"
+
+LOCAL int32_t ICACHE_FLASH_ATTR
+filter_median(FILTER *f)
+{
+	int32_t sorted[FILTER_MAX_MEDIAN];
+	int32_t v;
+	uint8_t i, j;
+
+	// insertion sort, the window is at most FILTER_MAX_MEDIAN long
+	for (i = 0; i < f->count; i++) {
+		v = f->window[i];
+		for (j = i; j > 0 && sorted[j - 1] > v; j--)
+			sorted[j] = sorted[j - 1];
+		sorted[j] = v;
+	}
+	return sorted[f->count / 2];
+}
+
+/**
+  * @brief  Attach a filter to its settings and clear its history
+  * @param  f:   filter state
+  * @param  cfg: settings, read on every update so they can change at runtime
+  * @retval None
+  */
+void ICACHE_FLASH_ATTR
+FILTER_Init(FILTER *f, const FILTER_CFG *cfg)
+{
+	f->cfg = cfg;
+	FILTER_Reset(f);
+}
+
+void ICACHE_FLASH_ATTR
+FILTER_Reset(FILTER *f)
+{
+	f->count = 0;
+	f->next = 0;
+	f->has_sent = FALSE;
+	f->last_sent = 0;
+	f->last_time = system_get_time();
+	f->silence_ms = 0;
+}
+
+/**
+  * @brief  Feed one raw sample
+  * @param  f:     filter state
+  * @param  value: raw sample
+  * @param  out:   filtered value to publish
+  * @retval TRUE if the filtered value should be published now
+  */
+BOOL ICACHE_FLASH_ATTR
+FILTER_Update(FILTER *f, int32_t value, int32_t *out)
+{
+	uint8_t n = f->cfg->median;
+	uint32_t now = system_get_time();
+	int32_t delta;
+
+	if (n < 1)
+		n = 1;
+	if (n > FILTER_MAX_MEDIAN)
+		n = FILTER_MAX_MEDIAN;
+	if (f->count > n || f->next >= n) {
+		// window shrunk at runtime, start over
+		f->count = 0;
+		f->next = 0;
+	}
+
+	f->window[f->next] = value;
+	f->next = (f->next + 1) % n;
+	if (f->count < n)
+		f->count++;
+	*out = filter_median(f);
+
+	// accumulate in ms so long heartbeats survive the 32 bit us wrap
+	f->silence_ms += (now - f->last_time) / 1000;
+	f->last_time = now;
+
+	if (!f->has_sent)
+		return TRUE;
+	if (f->cfg->heartbeat && f->silence_ms >= (uint32_t)f->cfg->heartbeat * 1000)
+		return TRUE;
+
+	delta = *out - f->last_sent;
+	if (delta < 0)
+		delta = -delta;
+	return delta > f->cfg->deadband;
+}
+
+/**
+  * @brief  Record that a value went out, resetting dead-band and heartbeat
+  * @param  f:     filter state
+  * @param  value: the value that was published
+  * @retval None
+  */
+void ICACHE_FLASH_ATTR
+FILTER_Sent(FILTER *f, int32_t value)
+{
+	f->has_sent = TRUE;
+	f->last_sent = value;
+	f->silence_ms = 0;
+}
@@ -0,0 +1,24 @@
+/*
+ * aggregate.h
+ *
+ *  Streaming min/max/mean/last/count of one metric over a tumbling window.
+ *  Integer only, constant memory per metric.
+ */
+
+#ifndef USER_AGGREGATE_H_
+#define USER_AGGREGATE_H_
+#include "os_type.h"
+
+typedef struct {
+	int32_t min;
+	int32_t max;
+	int32_t last;
+	int32_t sum;
+	uint16_t count;
+} AGGR;
+
+void ICACHE_FLASH_ATTR AGGR_Reset(AGGR *a);
+void ICACHE_FLASH_ATTR AGGR_Add(AGGR *a, int32_t value);
+int32_t ICACHE_FLASH_ATTR AGGR_Mean(const AGGR *a);
+
+#endif /* USER_AGGREGATE_H_ */
@@ -0,0 +1,30 @@
+/*
+ * batch.h
+ *
+ *  Timestamped samples of one sensor queued for a single publish.
+ */
+
+#ifndef USER_BATCH_H_
+#define USER_BATCH_H_
+#include "os_type.h"
+
+#define BATCH_MAX			16
+#define BATCH_SAMPLE_LEN	36	/* longest "[ts,temperature,humidity]," */
+
+typedef struct {
+	uint32_t millis;		/* CLOCK_Millis() when taken */
+	int16_t temperature;	/* tenths */
+	uint16_t humidity;		/* tenths */
+} BATCH_SAMPLE;
+
+typedef struct {
+	BATCH_SAMPLE samples[BATCH_MAX];
+	uint8_t first;
+	uint8_t count;
+} BATCH;
+
+void ICACHE_FLASH_ATTR BATCH_Reset(BATCH *b);
+void ICACHE_FLASH_ATTR BATCH_Add(BATCH *b, uint32_t millis, int16_t temperature, uint16_t humidity);
+int ICACHE_FLASH_ATTR BATCH_Format(const BATCH *b, char *buf);
+
+#endif /* USER_BATCH_H_ */
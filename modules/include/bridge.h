@@ -0,0 +1,15 @@
+/*
+ * bridge.h
+ *
+ *  Serial to MQTT bridge: PROTO framed packets received on UART0 are
+ *  published under config.mqtt_topic.
+ */
+
+#ifndef USER_BRIDGE_H_
+#define USER_BRIDGE_H_
+#include "os_type.h"
+#include "mqtt.h"
+
+void ICACHE_FLASH_ATTR BRIDGE_Init(MQTT_Client *client);
+
+#endif /* USER_BRIDGE_H_ */
@@ -0,0 +1,46 @@
+/*
+ * cfgstore.h
+ *
+ *  Append-only record store over a ring of flash sectors. Every save
+ *  appends a CRC protected record with a higher sequence number; a sector
+ *  is erased only when the ring wraps onto it.
+ */
+
+#ifndef USER_CFGSTORE_H_
+#define USER_CFGSTORE_H_
+#include "os_type.h"
+
+#define CFGSTORE_SECTOR_SIZE	4096
+#define CFGSTORE_ERASED			0xFFFFFFFF
+
+/* Flash access, the default goes to spi_flash_*; a file-backed fake can stand in */
+typedef struct {
+	BOOL (*read)(uint32_t addr, void *buf, uint32_t len);
+	BOOL (*write)(uint32_t addr, const void *buf, uint32_t len);
+	BOOL (*erase)(uint16_t sector);
+} CFGSTORE_FLASH;
+
+typedef struct {
+	uint32_t seq;			/* CFGSTORE_ERASED marks the free space behind the last record */
+	uint16_t version;		/* schema of the payload */
+	uint16_t len;			/* payload bytes, padded to 4 in flash */
+	uint32_t crc;			/* CRC-32 of seq, version, len and the payload */
+} CFGSTORE_RECORD;
+
+typedef struct {
+	const CFGSTORE_FLASH *flash;
+	uint16_t first;			/* first sector of the ring */
+	uint8_t sectors;
+	uint8_t head;			/* ring index of the sector being appended to */
+	uint16_t offset;		/* free space in that sector */
+	uint32_t seq;			/* of the newest valid record, 0 for none */
+	uint32_t addr;			/* of the newest valid record */
+} CFGSTORE;
+
+extern const CFGSTORE_FLASH CFGSTORE_SpiFlash;
+
+void ICACHE_FLASH_ATTR CFGSTORE_Mount(CFGSTORE *s, const CFGSTORE_FLASH *flash, uint16_t first, uint8_t sectors);
+int ICACHE_FLASH_ATTR CFGSTORE_Load(CFGSTORE *s, uint16_t *version, void *buf, uint16_t len);
+BOOL ICACHE_FLASH_ATTR CFGSTORE_Save(CFGSTORE *s, uint16_t version, const void *buf, uint16_t len);
+
+#endif /* USER_CFGSTORE_H_ */
@@ -0,0 +1,23 @@
+/*
+ * clock.h
+ *
+ *  Wall clock kept by SNTP and disciplined against system_get_time() so
+ *  it stays accurate between syncs.
+ */
+
+#ifndef USER_CLOCK_H_
+#define USER_CLOCK_H_
+#include "os_type.h"
+
+#define CLOCK_TICK_MS		60000	/* housekeeping period, well inside the 71 minute wrap of system_get_time() */
+#define CLOCK_RETRY_MS		10000	/* until the first answer */
+#define CLOCK_MAX_PPM		1000	/* larger drift estimates are treated as bad samples */
+#define CLOCK_MIN_SPAN_MS	600000	/* shortest sync interval the drift is estimated over */
+
+void ICACHE_FLASH_ATTR CLOCK_Init(const char *server, uint32_t interval_s);
+void ICACHE_FLASH_ATTR CLOCK_Sync(void);
+uint32_t ICACHE_FLASH_ATTR CLOCK_Millis(void);
+BOOL ICACHE_FLASH_ATTR CLOCK_Unix(uint32_t millis, uint32_t *sec, uint16_t *ms);
+int ICACHE_FLASH_ATTR CLOCK_Format(char *buf, uint32_t millis);
+
+#endif /* USER_CLOCK_H_ */
@@ -32,6 +32,14 @@
 #define USER_CONFIG_H_
 #include "os_type.h"
 #include "user_config.h"
+#include "sensor.h"
+#include "sched.h"
+
+typedef struct {
+	uint8_t ssid[32];			/* "" for an unused slot */
+	uint8_t pwd[64];
+} STA_NET;
+
 typedef struct{
 	uint32_t cfg_holder;
 	uint8_t device_id[16];
@@ -47,6 +55,18 @@ typedef struct{
 	uint8_t mqtt_pass[32];
 	uint32_t mqtt_keepalive;
 	uint8_t security;
+
+	SENSOR_CFG sensors[SENSOR_MAX];
+	uint32_t aggr_window;		/* seconds per summary, 0 publishes every sample */
+	SCHED_CFG sampling;			/* adaptive sampling interval bounds, ms */
+
+	uint8_t sntp_host[32];		/* "" leaves timestamps null */
+	uint32_t sntp_interval;		/* seconds between syncs */
+	uint16_t batch_size;		/* samples per batch publish, 0 or 1 publishes each one */
+	uint8_t ota_trial;			/* boots of an updated image not yet confirmed, 0 once it reached the broker */
+	STA_NET sta_nets[STA_NETS];	/* more networks to join besides sta_ssid, the strongest AP wins */
+	uint8_t roam_rssi;			/* look for a better AP below -roam_rssi dBm, 0 disables */
+	uint8_t power_mode;			/* POWER_MODE between samples and keepalives */
 } SYSCFG;
 
 typedef struct {
@@ -0,0 +1,80 @@
+/*
+ * delta.h
+ *
+ *  Streaming applier for the patches made by tools/otadelta.py. The new
+ *  image is rebuilt from the running one plus the patch in a single pass,
+ *  so the patch can be fed straight from the network; the state is the
+ *  LZSS window plus a few hundred bytes.
+ *
+ *  Patch layout, integers little-endian:
+ *    "ESPD", version, 3 reserved, old size, new size, SHA-256 of the old image
+ *    then LZSS packed: a flag byte before every eight items, LSB first, 1 for
+ *    a literal byte, 0 for a big-endian 16 bit match holding distance - 1
+ *    over DELTA_LENGTH_BITS and length - DELTA_MIN_MATCH; unpacked that is
+ *    records until the new image is complete:
+ *      varint add, varint insert, zigzag varint seek
+ *      add bytes as (varint zero run, varint literal run, literals) pairs,
+ *        each output byte is the old byte plus the literal
+ *      insert bytes as they are
+ *      then the old position moves by seek
+ */
+
+#ifndef USER_DELTA_H_
+#define USER_DELTA_H_
+#include "os_type.h"
+#include "sha256.h"
+
+#define DELTA_VERSION		1
+#define DELTA_HEADER_LEN	48
+#define DELTA_BLOCK			64		/* old image read size and output batch */
+#define DELTA_BUDGET		4096	/* output bytes per call, about one sector erase */
+#define DELTA_WINDOW		2048	/* LZSS, must match tools/otadelta.py */
+#define DELTA_LENGTH_BITS	5
+#define DELTA_MIN_MATCH		3
+
+typedef enum {
+	DELTA_MORE,				/* input used up, feed the next part */
+	DELTA_BUSY,				/* budget used up, call again to continue */
+	DELTA_DONE,
+	DELTA_BAD_HEADER,
+	DELTA_WRONG_BASE,		/* made against another image than the running one */
+	DELTA_CORRUPT,
+	DELTA_IO
+} DELTA_STATUS;
+
+/* Old image access in whole words: offset and len are multiples of 4 */
+typedef BOOL (*DELTA_READ)(uint32_t offset, uint32_t *buf, uint32_t len);
+typedef BOOL (*DELTA_WRITE)(const uint8_t *data, uint32_t len);
+
+typedef struct {
+	DELTA_READ read;
+	DELTA_WRITE write;
+	uint8_t state;
+	uint8_t shift;
+	uint8_t outLen;
+	uint8_t matchLen;		/* bytes of an LZSS match not yet unpacked */
+	uint16_t held;			/* first byte of a match token, 0x100 set when there is one */
+	uint16_t flags;			/* LZSS item kinds left, shifted down to 1 */
+	uint16_t matchDist;
+	uint16_t windowPos;
+	uint32_t value;			/* varint being collected */
+	uint32_t add;			/* add bytes of the record not yet started */
+	uint32_t insert;
+	int32_t seek;
+	uint32_t run;			/* left in the current run, header and hash progress before */
+	uint32_t oldPos;
+	uint32_t oldSize;
+	uint32_t newPos;
+	uint32_t newSize;
+	uint32_t cacheBase;
+	uint32_t cache[DELTA_BLOCK / 4];
+	uint8_t out[DELTA_BLOCK];
+	uint8_t base[SHA256_SIZE];
+	SHA256_CTX sha;
+	uint8_t window[DELTA_WINDOW];
+} DELTA;
+
+void ICACHE_FLASH_ATTR DELTA_Init(DELTA *d, DELTA_READ read, DELTA_WRITE write);
+DELTA_STATUS ICACHE_FLASH_ATTR DELTA_Feed(DELTA *d, const uint8_t *data, uint32_t len, uint32_t *used);
+
+#endif /* USER_DELTA_H_ */
@@ -0,0 +1,37 @@
+/*
+ * filter.h
+ *
+ *  Per-metric publish filter: median-of-N spike rejection, a dead-band
+ *  around the last published value and a maximum-silence heartbeat.
+ *  Values are fixed point integers (tenths).
+ */
+
+#ifndef USER_FILTER_H_
+#define USER_FILTER_H_
+#include "os_type.h"
+
+#define FILTER_MAX_MEDIAN	7
+
+typedef struct {
+	uint8_t median;			/* window for the median, 1 disables it */
+	uint16_t deadband;		/* publish only when the value moved more than this */
+	uint16_t heartbeat;		/* seconds of silence before republishing anyway, 0 disables */
+} FILTER_CFG;
+
+typedef struct {
+	const FILTER_CFG *cfg;
+	int32_t window[FILTER_MAX_MEDIAN];
+	uint8_t count;
+	uint8_t next;
+	BOOL has_sent;
+	int32_t last_sent;
+	uint32_t last_time;		/* system_get_time() of the previous update */
+	uint32_t silence_ms;	/* time since the last publish */
+} FILTER;
+
+void ICACHE_FLASH_ATTR FILTER_Init(FILTER *f, const FILTER_CFG *cfg);
+void ICACHE_FLASH_ATTR FILTER_Reset(FILTER *f);
+BOOL ICACHE_FLASH_ATTR FILTER_Update(FILTER *f, int32_t value, int32_t *out);
+void ICACHE_FLASH_ATTR FILTER_Sent(FILTER *f, int32_t value);
+
+#endif /* USER_FILTER_H_ */
@@ -0,0 +1,80 @@
+/*
+ * metrics.h
+ *
+ *  Counters and gauges of device health, one word each. Modules update
+ *  them with the macros below, nothing more than an add or a store; a
+ *  snapshot of all of them goes to <topic>$SYS/metrics every
+ *  METRICS_INTERVAL seconds while the broker is connected. Counters run
+ *  from boot, rates are left to the backend. Sample publishes are timed
+ *  from the reading to each stage on the way to the broker, into
+ *  histograms that go to <topic>$SYS/latency alongside.
+ */
+
+#ifndef USER_METRICS_H_
+#define USER_METRICS_H_
+#include "os_type.h"
+#include "mqtt.h"
+
+#define METRICS_INTERVAL	60		/* seconds between snapshots, 0 disables */
+#define METRICS_TICK_MS		1000	/* heap sampling and stall detection */
+#define METRICS_STALL_MS	50		/* a tick this late means something held the CPU */
+#define METRICS_SNAPSHOT_LEN	768		/* either topic, with every count at 10 digits */
+#define LATENCY_BUCKETS		16		/* 0 ms, 1 ms, then doubling: 2-3, 4-7 .. 16384 ms and up */
+
+typedef enum {
+	METRIC_TX_BYTES,
+	METRIC_TX_PACKETS,
+	METRIC_RX_BYTES,
+	METRIC_RX_PACKETS,
+	METRIC_QUEUE_DROPS,			/* oldest messages pushed out of a full queue, unqueued replies */
+	METRIC_DNS_FAIL,			/* reconnects, by reason */
+	METRIC_TCP_CLOSED,
+	METRIC_TCP_RESET,
+	METRIC_TCP_ABORT,
+	METRIC_TCP_TIMEOUT,
+	METRIC_TCP_ERROR,
+	METRIC_WIFI_NO_AP,			/* station disconnects, by reason */
+	METRIC_WIFI_AUTH,
+	METRIC_WIFI_BEACON,
+	METRIC_WIFI_OTHER,
+	METRIC_WIFI_ROAMS,
+	METRIC_DHT_READS,
+	METRIC_DHT_NO_RESPONSE,		/* failed reads, by DHTStatus */
+	METRIC_DHT_TOO_FEW_BITS,
+	METRIC_DHT_BAD_CHECKSUM,
+	METRIC_CFG_SAVES,
+	METRIC_CFG_ERRORS,
+	METRIC_BRIDGE_DROPS,		/* serial frames too long or arriving offline */
+	METRIC_STALLS,
+	METRIC_QUEUE_BYTES,			/* gauges from here on */
+	METRIC_QUEUE_MAX,
+	METRIC_DNS_MS,				/* of the last lookup */
+	METRIC_TCP_MS,				/* of the last connect */
+	METRIC_HEAP,
+	METRIC_HEAP_MIN,
+	METRIC_STALL_MAX_MS,
+	METRIC_COUNT
+} METRIC;
+
+typedef enum {
+	LATENCY_QUEUED,				/* reading to MQTT_Publish: formatting, batching */
+	LATENCY_SENDING,			/* to espconn_sent: queue wait and sendTimeout pacing */
+	LATENCY_SENT,				/* to the sent callback: TCP */
+	LATENCY_ACKED,				/* to PUBACK, QoS 1 only */
+	LATENCY_COUNT
+} LATENCY;
+
+extern uint32_t metrics[METRIC_COUNT];
+
+#define METRIC_INC(m)		(metrics[m]++)
+#define METRIC_ADD(m, n)	(metrics[m] += (n))
+#define METRIC_SET(m, v)	(metrics[m] = (v))
+#define METRIC_MAX(m, v)	do { if ((uint32_t)(v) > metrics[m]) metrics[m] = (v); } while (0)
+
+void ICACHE_FLASH_ATTR METRICS_Init(MQTT_Client *client);
+void ICACHE_FLASH_ATTR METRICS_Heap(void);
+int ICACHE_FLASH_ATTR METRICS_Format(char *buf);
+void ICACHE_FLASH_ATTR METRICS_Latency(LATENCY stage, uint32_t captured);
+int ICACHE_FLASH_ATTR METRICS_FormatLatency(char *buf);
+
+#endif /* USER_METRICS_H_ */
@@ -0,0 +1,30 @@
+/*
+ * ota.h
+ *
+ *  Firmware update streamed over MQTT into the slot that is not running,
+ *  with a trial boot that falls back to the previous image unless the new
+ *  one reaches the broker.
+ *
+ *  <topic>ota/begin     "size=<bytes>,sha256=<64 hex digits>", repeating it resumes;
+ *                       ",delta=<patch bytes>" when the chunks carry a patch
+ *                       from tools/otadelta.py against the running image
+ *  <topic>ota/chunk     4 byte big-endian offset followed by image or patch data
+ *  <topic>ota/commit    verify and reboot into the new image
+ *  <topic>ota/abort     drop the transfer
+ *  <topic>ota/rollback  reboot into the other slot
+ *  <topic>ota/ack       state, image to send and next expected offset after every message
+ */
+
+#ifndef USER_OTA_H_
+#define USER_OTA_H_
+#include "os_type.h"
+#include "mqtt.h"
+
+#define OTA_SECTOR_SIZE		4096
+#define OTA_BOUNCE			64
+
+void ICACHE_FLASH_ATTR OTA_Init(MQTT_Client *client);
+void ICACHE_FLASH_ATTR OTA_Connected(void);
+BOOL ICACHE_FLASH_ATTR OTA_Data(const char *topic, const uint8_t *data, uint32_t len);
+
+#endif /* USER_OTA_H_ */
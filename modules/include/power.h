@@ -0,0 +1,32 @@
+/*
+ * power.h
+ *
+ *  Radio sleep between the deadlines the firmware already knows about.
+ *  While nothing is in flight and the next sample or keepalive is far
+ *  enough off, the SDK's automatic modem or light sleep is enabled; it is
+ *  switched off again shortly before that deadline and for a while after
+ *  any traffic, so publishes and replies never wait for a DTIM beacon.
+ */
+
+#ifndef USER_POWER_H_
+#define USER_POWER_H_
+#include "os_type.h"
+
+#define POWER_MIN_IDLE_MS	1500	/* shorter gaps are not worth switching for */
+#define POWER_WAKE_AHEAD_MS	300		/* radio back up this long before a deadline, a few beacons */
+#define POWER_LINGER_MS		1000	/* stay up after traffic for replies and follow-ups */
+
+typedef enum {
+	POWER_OFF,				/* radio always on */
+	POWER_MODEM,			/* radio off between beacons */
+	POWER_LIGHT				/* CPU suspended as well */
+} POWER_MODE;
+
+/* Milliseconds until the radio is needed again, 0 while something is in flight */
+typedef uint32_t (*POWER_DEADLINE)(void);
+
+void ICACHE_FLASH_ATTR POWER_Init(uint8_t mode, POWER_DEADLINE deadline);
+void ICACHE_FLASH_ATTR POWER_SetMode(uint8_t mode);
+void ICACHE_FLASH_ATTR POWER_Wake(void);
+
+#endif /* USER_POWER_H_ */
@@ -0,0 +1,34 @@
+/*
+ * rtc_cache.h
+ *
+ *  Link state kept in RTC user memory across deep sleep so the next wake can
+ *  skip the scan, DHCP and DNS.
+ */
+
+#ifndef USER_RTC_CACHE_H_
+#define USER_RTC_CACHE_H_
+#include "os_type.h"
+#include "ip_addr.h"
+
+#define RTC_CACHE_MAGIC		0x52544332	/* "RTC2", bump when the layout changes */
+#define RTC_CACHE_BLOCK		64			/* first RTC block available to the user */
+
+typedef struct {
+	uint32_t magic;
+	uint32_t checksum;			/* over everything below */
+	uint32_t cfg_tag;			/* hash of ssid and broker host the entry belongs to */
+	uint8_t bssid[6];
+	uint8_t channel;
+	uint8_t net;				/* which of the known networks the AP belongs to, 0 the primary */
+	struct ip_info ip;			/* address, netmask and gateway from the last lease */
+	ip_addr_t broker_ip;
+	uint16_t mqtt_msg_id;
+	uint16_t wake_count;
+} RTC_CACHE;
+
+BOOL ICACHE_FLASH_ATTR RTC_CacheLoad(RTC_CACHE *cache, uint32_t cfg_tag);
+void ICACHE_FLASH_ATTR RTC_CacheSave(RTC_CACHE *cache);
+void ICACHE_FLASH_ATTR RTC_CacheInvalidate(void);
+uint32_t ICACHE_FLASH_ATTR RTC_CacheTag(const uint8_t *ssid, const uint8_t *host);
+
+#endif /* USER_RTC_CACHE_H_ */
@@ -0,0 +1,34 @@
+/*
+ * sched.h
+ *
+ *  Adaptive sampling interval: stretch it while the signal is flat, snap
+ *  back to the minimum when it starts moving.
+ */
+
+#ifndef USER_SCHED_H_
+#define USER_SCHED_H_
+#include "os_type.h"
+
+#define SCHED_MAX_METRICS	8		/* two per sensor */
+#define SCHED_FLOOR_MS		2000	/* DHT22 needs two seconds between reads */
+#define SCHED_CEIL_MS		2000000	/* the ticker compares deadlines as int32 us, 2^31 us is ~2147 s */
+
+typedef struct {
+	uint32_t min_ms;
+	uint32_t max_ms;
+	uint16_t threshold;		/* change in tenths per minute that counts as moving */
+} SCHED_CFG;
+
+typedef struct {
+	const SCHED_CFG *cfg;
+	uint32_t interval;
+	BOOL primed;
+	int32_t prev[SCHED_MAX_METRICS];
+} SCHED;
+
+void ICACHE_FLASH_ATTR SCHED_Init(SCHED *s, const SCHED_CFG *cfg, uint32_t initial_ms);
+uint32_t ICACHE_FLASH_ATTR SCHED_Next(SCHED *s, const int32_t *values, uint8_t count);
+uint32_t ICACHE_FLASH_ATTR SCHED_Interval(SCHED *s);
+uint32_t ICACHE_FLASH_ATTR SCHED_Step(SCHED *s);
+
+#endif /* USER_SCHED_H_ */
@@ -0,0 +1,45 @@
+/*
+ * sensor.h
+ *
+ *  Registry of the sensors wired to this node, each with its own pin,
+ *  type, topic level and publish filters.
+ */
+
+#ifndef USER_SENSOR_H_
+#define USER_SENSOR_H_
+#include "os_type.h"
+#include "driver/dht22.h"
+#include "filter.h"
+#include "aggregate.h"
+#include "batch.h"
+
+#define SENSOR_MAX		DHT_MAX_SENSORS
+#define SENSOR_NONE		0xFF	/* pin of an unused slot */
+
+typedef struct {
+	uint8_t pin;			/* GPIO, SENSOR_NONE leaves the slot empty */
+	uint8_t type;			/* enum DHTType */
+	uint8_t name[14];		/* topic level under mqtt_topic, "" publishes directly below it */
+	FILTER_CFG temp_filter;	/* tenths of a degree */
+	FILTER_CFG hum_filter;	/* tenths of a percent */
+} SENSOR_CFG;
+
+typedef struct {
+	const SENSOR_CFG *cfg;
+	struct dht_sensor_data *reading;
+	FILTER temp_filter;
+	FILTER hum_filter;
+	AGGR temp_aggr;
+	AGGR hum_aggr;
+	BATCH batch;
+} SENSOR;
+
+typedef void (*SENSOR_Callback)(void);
+
+uint8_t ICACHE_FLASH_ATTR SENSOR_Init(const SENSOR_CFG *cfgs, uint8_t count);
+BOOL ICACHE_FLASH_ATTR SENSOR_Scan(SENSOR_Callback cb);
+uint8_t ICACHE_FLASH_ATTR SENSOR_Count(void);
+SENSOR * ICACHE_FLASH_ATTR SENSOR_Get(uint8_t index);
+int ICACHE_FLASH_ATTR SENSOR_Topic(const SENSOR *s, char *buf, const char *prefix, const char *metric);
+
+#endif /* USER_SENSOR_H_ */
@@ -0,0 +1,28 @@
+/*
+ * settings.h
+ *
+ *  Typed schema over SYSCFG for updates received at runtime as
+ *  "key=value,key=value". Per-sensor keys are prefixed with the slot,
+ *  e.g. "s1.pin=4,s1.t_deadband=5".
+ */
+
+#ifndef USER_SETTINGS_H_
+#define USER_SETTINGS_H_
+#include "os_type.h"
+
+/* What has to be refreshed after an update */
+#define SETTINGS_SAMPLING	0x01
+#define SETTINGS_MQTT		0x02
+#define SETTINGS_TOPIC		0x04
+#define SETTINGS_AGGR		0x08
+#define SETTINGS_CLOCK		0x10
+#define SETTINGS_SENSORS	0x20
+#define SETTINGS_WIFI		0x40
+#define SETTINGS_CHANGED	0x80	/* anything at all, config needs saving */
+
+#define SETTINGS_ACK_SIZE	960		/* a full dump of four sensors, still inside MQTT_BUF_SIZE */
+
+uint8_t ICACHE_FLASH_ATTR SETTINGS_Apply(const char *data, uint32_t len, char *ack, uint16_t size);
+int ICACHE_FLASH_ATTR SETTINGS_Dump(char *buf, uint16_t size);
+
+#endif /* USER_SETTINGS_H_ */
@@ -0,0 +1,24 @@
+/*
+ * sha256.h
+ *
+ *  Incremental SHA-256 for verifying images as they stream in.
+ */
+
+#ifndef USER_SHA256_H_
+#define USER_SHA256_H_
+#include "os_type.h"
+
+#define SHA256_SIZE		32
+
+typedef struct {
+	uint32_t state[8];
+	uint32_t total;			/* bytes hashed so far, images stay far below 4 GB */
+	uint8_t block[64];
+	uint8_t used;
+} SHA256_CTX;
+
+void ICACHE_FLASH_ATTR SHA256_Init(SHA256_CTX *ctx);
+void ICACHE_FLASH_ATTR SHA256_Update(SHA256_CTX *ctx, const void *data, uint32_t len);
+void ICACHE_FLASH_ATTR SHA256_Final(SHA256_CTX *ctx, uint8_t *digest);
+
+#endif /* USER_SHA256_H_ */
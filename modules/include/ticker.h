@@ -0,0 +1,31 @@
+/*
+ * ticker.h
+ *
+ *  Sampling clock that runs on absolute deadlines, so the time a cycle
+ *  spends reading and publishing does not push the next sample back.
+ */
+
+#ifndef USER_TICKER_H_
+#define USER_TICKER_H_
+#include "os_type.h"
+
+#define TICKER_SPIN_US		2000	/* longest busy wait for an early timer */
+#define TICKER_MARGIN_US	500		/* armed this much earlier than the measured latency */
+
+typedef struct {
+	uint32_t deadline;		/* system_get_time() of the next sample */
+	uint32_t armed;			/* system_get_time() the timer should fire at */
+	int32_t latency;		/* smoothed lateness of the timer, us */
+	int32_t jitter;			/* how late the last sample started, us */
+	uint32_t jitter_max;	/* largest |jitter| so far, us */
+	uint32_t missed;		/* deadlines skipped because a cycle overran */
+} TICKER;
+
+void ICACHE_FLASH_ATTR TICKER_Start(TICKER *t, uint32_t delay_ms);
+int32_t ICACHE_FLASH_ATTR TICKER_Fired(TICKER *t);
+void ICACHE_FLASH_ATTR TICKER_Advance(TICKER *t, uint32_t interval_ms);
+void ICACHE_FLASH_ATTR TICKER_Shift(TICKER *t, int32_t us);
+int32_t ICACHE_FLASH_ATTR TICKER_Remaining(TICKER *t);
+uint32_t ICACHE_FLASH_ATTR TICKER_Arm(TICKER *t);
+
+#endif /* USER_TICKER_H_ */
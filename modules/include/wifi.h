@@ -8,8 +8,24 @@
 #ifndef USER_WIFI_H_
 #define USER_WIFI_H_
 #include "os_type.h"
+#include "ip_addr.h"
+
+#define WIFI_MAX_NETS		4	/* the primary network and up to three more */
+#define WIFI_CANDIDATES		6	/* strongest APs kept from a scan */
+
+typedef struct {
+	uint8_t bssid[6];
+	uint8_t channel;
+	sint8 rssi;
+	uint8_t net;				/* which of the known networks */
+} WIFI_CANDIDATE;
+
 typedef void (*WifiCallback)(uint8_t);
 void ICACHE_FLASH_ATTR WIFI_Connect(uint8_t* ssid, uint8_t* pass, WifiCallback cb);
+BOOL ICACHE_FLASH_ATTR WIFI_AddNetwork(const uint8_t *ssid, const uint8_t *pass);
+void ICACHE_FLASH_ATTR WIFI_SetRoaming(sint8 rssi);
+void ICACHE_FLASH_ATTR WIFI_SetFastLink(uint8_t net, const uint8_t *bssid, uint8_t channel, const struct ip_info *ip);
+BOOL ICACHE_FLASH_ATTR WIFI_GetLink(uint8_t *net, uint8_t *bssid, uint8_t *channel, struct ip_info *ip);
 
 
 #endif /* USER_WIFI_H_ */
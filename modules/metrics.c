@@ -0,0 +1,189 @@
+/*
+ * metrics.c
+ *
+ *  Keeps the metrics array and its tick: free heap and its low-water
+ *  mark are sampled, and a tick that fires late counts as a stall since
+ *  nothing else can run while a callback hogs the CPU. Every
+ *  METRICS_INTERVAL seconds the array goes out as one JSON object.
+ */
+#include "ets_sys.h"
+#include "osapi.h"
+#include "os_type.h"
+#include "user_interface.h"
+#include "config.h"
+#include "metrics.h"
+#include "debug.h"
+
+uint32_t metrics[METRIC_COUNT];
+LOCAL uint32_t latency[LATENCY_COUNT][LATENCY_BUCKETS];
+
+LOCAL const char * const metricNames[METRIC_COUNT] = {
+	[METRIC_TX_BYTES] = "tx",
+	[METRIC_TX_PACKETS] = "tx_pkts",
+	[METRIC_RX_BYTES] = "rx",
+	[METRIC_RX_PACKETS] = "rx_pkts",
+	[METRIC_QUEUE_DROPS] = "drops",
+	[METRIC_DNS_FAIL] = "dns_fail",
+	[METRIC_TCP_CLOSED] = "tcp_closed",
+	[METRIC_TCP_RESET] = "tcp_reset",
+	[METRIC_TCP_ABORT] = "tcp_abort",
+	[METRIC_TCP_TIMEOUT] = "tcp_timeout",
+	[METRIC_TCP_ERROR] = "tcp_error",
+	[METRIC_WIFI_NO_AP] = "wifi_no_ap",
+	[METRIC_WIFI_AUTH] = "wifi_auth",
+	[METRIC_WIFI_BEACON] = "wifi_beacon",
+	[METRIC_WIFI_OTHER] = "wifi_other",
+	[METRIC_WIFI_ROAMS] = "wifi_roams",
+	[METRIC_DHT_READS] = "dht_reads",
+	[METRIC_DHT_NO_RESPONSE] = "dht_no_response",
+	[METRIC_DHT_TOO_FEW_BITS] = "dht_few_bits",
+	[METRIC_DHT_BAD_CHECKSUM] = "dht_checksum",
+	[METRIC_CFG_SAVES] = "cfg_saves",
+	[METRIC_CFG_ERRORS] = "cfg_errors",
+	[METRIC_BRIDGE_DROPS] = "bridge_drops",
+	[METRIC_STALLS] = "stalls",
+	[METRIC_QUEUE_BYTES] = "queue",
+	[METRIC_QUEUE_MAX] = "queue_max",
+	[METRIC_DNS_MS] = "dns_ms",
+	[METRIC_TCP_MS] = "tcp_ms",
+	[METRIC_HEAP] = "heap",
+	[METRIC_HEAP_MIN] = "heap_min",
+	[METRIC_STALL_MAX_MS] = "stall_max_ms",
+};
+
+LOCAL const char * const latencyNames[LATENCY_COUNT] = {
+	[LATENCY_QUEUED] = "queued",
+	[LATENCY_SENDING] = "sending",
+	[LATENCY_SENT] = "sent",
+	[LATENCY_ACKED] = "acked",
+};
+
+LOCAL os_timer_t metricsTimer;
+LOCAL MQTT_Client *metricsClient;
+LOCAL uint32_t lastTick;
+LOCAL uint32_t uptimeMs;		/* system_get_time() wraps after 71 minutes */
+LOCAL uint16_t ticks;
+
+LOCAL void ICACHE_FLASH_ATTR
+metrics_publish(void)
+{
+	static char buf[METRICS_SNAPSHOT_LEN];
+	char topic[40];
+
+	if (metricsClient->connState != MQTT_DATA)
+		return;
+	os_sprintf(topic, "%s$SYS/metrics", config.mqtt_topic);
+	MQTT_Publish(metricsClient, topic, buf, METRICS_Format(buf), 0, 0);
+	// the queue holds a copy, the buffer is free again
+	os_sprintf(topic, "%s$SYS/latency", config.mqtt_topic);
+	MQTT_Publish(metricsClient, topic, buf, METRICS_FormatLatency(buf), 0, 0);
+}
+
+LOCAL void ICACHE_FLASH_ATTR
+metrics_tick(void *arg)
+{
+	uint32_t now = system_get_time();
+	uint32_t ms = (now - lastTick) / 1000;
+
+	// the sub-millisecond rest stays in the next interval, uptime does not fall behind
+	lastTick += ms * 1000;
+	uptimeMs += ms;
+	if (ms > METRICS_TICK_MS + METRICS_STALL_MS) {
+		METRIC_INC(METRIC_STALLS);
+		METRIC_MAX(METRIC_STALL_MAX_MS, ms - METRICS_TICK_MS);
+	}
+	METRICS_Heap();
+	if (METRICS_INTERVAL && ++ticks >= METRICS_INTERVAL * 1000 / METRICS_TICK_MS) {
+		ticks = 0;
+		metrics_publish();
+	}
+}
+
+/**
+  * @brief  Start sampling and publishing
+  * @param  client: connection the snapshots go out on
+  * @retval None
+  */
+void ICACHE_FLASH_ATTR
+METRICS_Init(MQTT_Client *client)
+{
+	metricsClient = client;
+	uptimeMs = system_get_time() / 1000;
+	lastTick = uptimeMs * 1000;
+	METRICS_Heap();
+	os_timer_disarm(&metricsTimer);
+	os_timer_setfn(&metricsTimer, (os_timer_func_t *)metrics_tick, NULL);
+	os_timer_arm(&metricsTimer, METRICS_TICK_MS, 1);
+}
+
+/**
+  * @brief  Sample the free heap, also where it runs lowest between ticks
+  * @retval None
+  */
+void ICACHE_FLASH_ATTR
+METRICS_Heap(void)
+{
+	uint32_t heap = system_get_free_heap_size();
+
+	METRIC_SET(METRIC_HEAP, heap);
+	if (metrics[METRIC_HEAP_MIN] == 0 || heap < metrics[METRIC_HEAP_MIN])
+		METRIC_SET(METRIC_HEAP_MIN, heap);
+}
+
+/**
+  * @brief  Write every metric as one JSON object
+  * @param  buf: at least METRICS_SNAPSHOT_LEN bytes
+  * @retval length written
+  */
+int ICACHE_FLASH_ATTR
+METRICS_Format(char *buf)
+{
+	char *p = buf;
+	uint8_t i;
+
+	p += os_sprintf(p, "{\"up\":%u,\"reset\":%u", uptimeMs / 1000, system_get_rst_info()->reason);
+	for (i = 0; i < METRIC_COUNT; i++)
+		p += os_sprintf(p, ",\"%s\":%u", metricNames[i], metrics[i]);
+	p += os_sprintf(p, "}");
+	return p - buf;
+}
+
+/**
+  * @brief  Count a sample reaching a stage in its histogram
+  * @param  stage: how far it got
+  * @param  captured: system_get_time() when the reading was taken
+  * @retval None
+  */
+void ICACHE_FLASH_ATTR
+METRICS_Latency(LATENCY stage, uint32_t captured)
+{
+	uint32_t ms = (system_get_time() - captured) / 1000;
+	uint8_t bucket = 0;
+
+	while (ms && bucket < LATENCY_BUCKETS - 1) {
+		ms >>= 1;
+		bucket++;
+	}
+	latency[stage][bucket]++;
+}
+
+/**
+  * @brief  Write the histograms as one JSON object of arrays
+  * @param  buf: at least METRICS_SNAPSHOT_LEN bytes
+  * @retval length written
+  */
+int ICACHE_FLASH_ATTR
+METRICS_FormatLatency(char *buf)
+{
+	char *p = buf;
+	uint8_t i, j;
+
+	for (i = 0; i < LATENCY_COUNT; i++) {
+		p += os_sprintf(p, "%s\"%s\":[", i ? "," : "{", latencyNames[i]);
+		for (j = 0; j < LATENCY_BUCKETS; j++)
+			p += os_sprintf(p, j ? ",%u" : "%u", latency[i][j]);
+		p += os_sprintf(p, "]");
+	}
+	p += os_sprintf(p, "}");
+	return p - buf;
+}
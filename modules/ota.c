@@ -0,0 +1,483 @@
+/*
+ * ota.c
+ *
+ *  Chunks go straight to flash: every sector is erased just before the
+ *  first write into it and the digest runs over the bytes as they come,
+ *  so nothing larger than a bounce buffer is held in RAM. The sender
+ *  resumes after a disconnect by repeating begin and continuing at the
+ *  offset in the ack.
+ *
+ *  A delta transfer carries a patch instead of the image; the applier
+ *  rebuilds the image from the running slot and hands it to the same
+ *  write path, so digest, trial boot and rollback do not tell the two
+ *  apart. Offsets in chunks and acks are then patch offsets.
+ *
+ *  The bootloader only knows "boot the other slot", so a trial counter in
+ *  config decides whether the new image gets to stay: it is set before
+ *  the switch and cleared once the new image is connected to the broker.
+ */
+#include "ets_sys.h"
+#include "osapi.h"
+#include "os_type.h"
+#include "mem.h"
+#include "user_interface.h"
+#include "spi_flash.h"
+#include "mqtt.h"
+#include "config.h"
+#include "sha256.h"
+#include "delta.h"
+#include "ota.h"
+#include "debug.h"
+
+typedef enum {
+	OTA_IDLE,
+	OTA_RECEIVING,
+	OTA_REBOOTING
+} OTA_STATE;
+
+LOCAL struct {
+	OTA_STATE state;
+	uint32_t base;			/* flash address of the slot being written */
+	uint32_t size;			/* announced image size */
+	uint32_t offset;		/* image bytes written */
+	uint32_t stream;		/* announced bytes on the wire, the patch size for a delta */
+	uint32_t received;
+	DELTA *delta;			/* while a patch is applied */
+	uint8_t *pending;		/* chunk bytes the applier has not taken yet */
+	uint32_t pendingLen;
+	uint32_t pendingOff;
+	uint32_t erased;		/* bytes of the slot erased, whole sectors */
+	uint8_t sha[SHA256_SIZE];
+	SHA256_CTX ctx;
+	uint8_t tail[4];		/* received bytes not yet forming a whole flash word */
+	uint8_t tailLen;
+} ota;
+
+LOCAL MQTT_Client *otaClient;
+LOCAL os_timer_t otaTimer;
+LOCAL os_timer_t patchTimer;
+LOCAL const char *otaError;
+
+LOCAL uint32_t ICACHE_FLASH_ATTR
+ota_inactive_slot(void)
+{
+	return system_upgrade_userbin_check() == UPGRADE_FW_BIN1 ? OTA_SLOT2 : OTA_SLOT1;
+}
+
+LOCAL BOOL ICACHE_FLASH_ATTR
+ota_running_read(uint32_t offset, uint32_t *buf, uint32_t len)
+{
+	uint32_t running = ota.base == OTA_SLOT1 ? OTA_SLOT2 : OTA_SLOT1;
+
+	return offset + len <= OTA_SLOT_SIZE &&
+			spi_flash_read(running + offset, buf, len) == SPI_FLASH_RESULT_OK;
+}
+
+/* Drop a transfer and what the applier holds */
+LOCAL void ICACHE_FLASH_ATTR
+ota_stop(OTA_STATE state)
+{
+	os_timer_disarm(&patchTimer);
+	if (ota.pending)
+		os_free(ota.pending);
+	if (ota.delta)
+		os_free(ota.delta);
+	ota.pending = NULL;
+	ota.delta = NULL;
+	ota.state = state;
+}
+
+LOCAL void ICACHE_FLASH_ATTR
+ota_reboot_cb(void *arg)
+{
+	system_upgrade_reboot();
+}
+
+/* Boot the other slot once the ack had a moment to leave */
+LOCAL void ICACHE_FLASH_ATTR
+ota_switch(uint8_t trial)
+{
+	config.ota_trial = trial;
+	config_save();
+	ota.state = OTA_REBOOTING;
+	system_upgrade_flag_set(UPGRADE_FLAG_FINISH);
+	os_timer_disarm(&otaTimer);
+	os_timer_setfn(&otaTimer, (os_timer_func_t *)ota_reboot_cb, NULL);
+	os_timer_arm(&otaTimer, 1000, 0);
+}
+
+LOCAL void ICACHE_FLASH_ATTR
+ota_trial_expired(void *arg)
+{
+	INFO("OTA: new image never reached the broker, rolling back\r\n");
+	ota_switch(0);
+}
+
+LOCAL void ICACHE_FLASH_ATTR
+ota_ack(void)
+{
+	static const char *names[] = { "idle", "receiving", "rebooting" };
+	char topic[40];
+	char buf[128];
+	int n;
+
+	os_sprintf(topic, "%sota/ack", config.mqtt_topic);
+	// tell the sender which of the two link addresses to send
+	n = os_sprintf(buf, "{\"state\":\"%s\",\"image\":\"user%d.bin\",\"offset\":%d,\"size\":%d",
+			names[ota.state], ota_inactive_slot() == OTA_SLOT1 ? 1 : 2, ota.received, ota.stream);
+	if (otaError)
+		n += os_sprintf(buf + n, ",\"error\":\"%s\"", otaError);
+	os_strcpy(buf + n, "}");
+	otaError = NULL;
+	MQTT_Publish(otaClient, topic, buf, os_strlen(buf), 0, 0);
+}
+
+LOCAL BOOL ICACHE_FLASH_ATTR
+ota_hex(const char *s, uint8_t *out, uint8_t len)
+{
+	uint8_t i, n, c;
+
+	for (i = 0; i < 2 * len; i++) {
+		c = s[i];
+		if (c >= '0' && c <= '9')
+			n = c - '0';
+		else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+			n = (c | 0x20) - 'a' + 10;
+		else
+			return FALSE;
+		out[i / 2] = (i & 1) ? out[i / 2] | n : n << 4;
+	}
+	return TRUE;
+}
+
+/* Write whole words at ota.offset - ota.tailLen, erasing each sector on first touch */
+LOCAL BOOL ICACHE_FLASH_ATTR
+ota_flash(const uint8_t *data, uint32_t len)
+{
+	uint32_t bounce[OTA_BOUNCE / 4];
+	uint8_t *b = (uint8_t *)bounce;
+	uint32_t written = ota.offset - ota.tailLen;
+	uint32_t n, whole;
+
+	while (len) {
+		os_memcpy(b, ota.tail, ota.tailLen);
+		n = OTA_BOUNCE - ota.tailLen < len ? OTA_BOUNCE - ota.tailLen : len;
+		os_memcpy(b + ota.tailLen, data, n);
+		data += n;
+		len -= n;
+		ota.offset += n;
+		n += ota.tailLen;
+		whole = n & ~3;
+		ota.tailLen = n - whole;
+		os_memcpy(ota.tail, b + whole, ota.tailLen);
+
+		// through the tail too, ota_commit pads it into the sector it starts in
+		while (ota.erased < written + whole + ota.tailLen) {
+			if (spi_flash_erase_sector((ota.base + ota.erased) / OTA_SECTOR_SIZE) != SPI_FLASH_RESULT_OK)
+				return FALSE;
+			ota.erased += OTA_SECTOR_SIZE;
+		}
+		if (whole && spi_flash_write(ota.base + written, bounce, whole) != SPI_FLASH_RESULT_OK)
+			return FALSE;
+		written += whole;
+	}
+	return TRUE;
+}
+
+/* Image bytes in order, from a chunk or from the applier */
+LOCAL BOOL ICACHE_FLASH_ATTR
+ota_write(const uint8_t *data, uint32_t len)
+{
+	if (ota.offset + len > ota.size)
+		return FALSE;
+	SHA256_Update(&ota.ctx, data, len);
+	return ota_flash(data, len);
+}
+
+/* Feed the applier, TRUE while it still holds part of the chunk */
+LOCAL BOOL ICACHE_FLASH_ATTR
+ota_patch(const uint8_t *data, uint32_t len)
+{
+	DELTA_STATUS status;
+	uint32_t used;
+
+	status = DELTA_Feed(ota.delta, data, len, &used);
+	if (status == DELTA_BUSY) {
+		if (ota.pending == NULL) {
+			ota.pending = (uint8_t *)os_malloc(len - used);
+			if (ota.pending == NULL) {
+				ota_stop(OTA_IDLE);
+				otaError = "no memory";
+				return FALSE;
+			}
+			os_memcpy(ota.pending, data + used, len - used);
+			ota.pendingLen = len - used;
+			ota.pendingOff = 0;
+		} else
+			ota.pendingOff += used;
+		// let the network run before the next slice
+		os_timer_arm(&patchTimer, 1, 0);
+		return TRUE;
+	}
+	if (status == DELTA_MORE || (status == DELTA_DONE && ota.offset == ota.size))
+		return FALSE;
+	ota_stop(OTA_IDLE);
+	system_upgrade_flag_set(UPGRADE_FLAG_IDLE);
+	if (status == DELTA_WRONG_BASE)
+		otaError = "wrong base";
+	else if (status == DELTA_IO)
+		otaError = "flash";
+	else
+		otaError = "bad patch";
+	return FALSE;
+}
+
+LOCAL void ICACHE_FLASH_ATTR
+ota_patch_cb(void *arg)
+{
+	if (ota.delta == NULL || ota.pending == NULL)
+		return;
+	if (ota_patch(ota.pending + ota.pendingOff, ota.pendingLen - ota.pendingOff))
+		return;
+	if (ota.pending) {
+		os_free(ota.pending);
+		ota.pending = NULL;
+	}
+	ota_ack();
+}
+
+LOCAL uint32_t ICACHE_FLASH_ATTR
+ota_number(const char *args, const char *key)
+{
+	const char *p = (const char *)os_strstr(args, key);
+	uint32_t n = 0;
+
+	for (p = p ? p + os_strlen(key) : NULL; p && *p >= '0' && *p <= '9'; p++)
+		n = n * 10 + (*p - '0');
+	return n;
+}
+
+LOCAL void ICACHE_FLASH_ATTR
+ota_begin(const char *args, uint32_t len)
+{
+	char buf[100];
+	uint8_t sha[SHA256_SIZE];
+	uint32_t size, patch;
+	char *p;
+
+	if (len >= sizeof(buf)) {
+		otaError = "bad begin";
+		return;
+	}
+	os_memcpy(buf, args, len);
+	buf[len] = 0;
+	size = ota_number(buf, "size=");
+	patch = ota_number(buf, "delta=");
+	p = (char *)os_strstr(buf, "sha256=");
+	if (size == 0 || p == NULL || !ota_hex(p + 7, sha, SHA256_SIZE)) {
+		otaError = "bad begin";
+		return;
+	}
+	if (size > OTA_SLOT_SIZE) {
+		otaError = "too large";
+		return;
+	}
+
+	// the same image again continues where the last connection stopped
+	if (ota.state == OTA_RECEIVING && ota.size == size && ota.stream == (patch ? patch : size) &&
+			os_memcmp(ota.sha, sha, SHA256_SIZE) == 0) {
+		INFO("OTA: resuming at %d of %d\r\n", ota.received, ota.stream);
+		return;
+	}
+
+	ota_stop(OTA_IDLE);
+	ota.base = ota_inactive_slot();
+	if (patch) {
+		ota.delta = (DELTA *)os_zalloc(sizeof(DELTA));
+		if (ota.delta == NULL) {
+			otaError = "no memory";
+			return;
+		}
+		DELTA_Init(ota.delta, ota_running_read, ota_write);
+	}
+	ota.state = OTA_RECEIVING;
+	ota.size = size;
+	ota.offset = 0;
+	ota.stream = patch ? patch : size;
+	ota.received = 0;
+	ota.erased = 0;
+	ota.tailLen = 0;
+	os_memcpy(ota.sha, sha, SHA256_SIZE);
+	SHA256_Init(&ota.ctx);
+	system_upgrade_flag_set(UPGRADE_FLAG_START);
+	INFO("OTA: receiving %d bytes%s into 0x%X\r\n", ota.stream, patch ? " of patch" : "", ota.base);
+}
+
+/* TRUE when the ack waits for the applier to finish the chunk */
+LOCAL BOOL ICACHE_FLASH_ATTR
+ota_chunk(const uint8_t *data, uint32_t len)
+{
+	uint32_t offset;
+
+	if (ota.state != OTA_RECEIVING || len < 4) {
+		otaError = "not receiving";
+		return FALSE;
+	}
+	if (ota.pending) {
+		otaError = "busy";
+		return FALSE;
+	}
+	offset = (data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+	data += 4;
+	len -= 4;
+	// duplicates and gaps are answered with the offset the sender should use
+	if (offset != ota.received) {
+		otaError = "offset";
+		return FALSE;
+	}
+	if (ota.received + len > ota.stream) {
+		otaError = "past size";
+		return FALSE;
+	}
+	ota.received += len;
+	if (ota.delta)
+		return ota_patch(data, len);
+	if (!ota_write(data, len)) {
+		ota_stop(OTA_IDLE);
+		otaError = "flash";
+	}
+	return FALSE;
+}
+
+/* Digest of the slot as written, catches bits the flash did not take */
+LOCAL BOOL ICACHE_FLASH_ATTR
+ota_verify(void)
+{
+	uint32_t bounce[OTA_BOUNCE / 4];
+	uint8_t digest[SHA256_SIZE];
+	SHA256_CTX ctx;
+	uint32_t done, n;
+
+	SHA256_Final(&ota.ctx, digest);
+	if (os_memcmp(digest, ota.sha, SHA256_SIZE) != 0)
+		return FALSE;
+
+	SHA256_Init(&ctx);
+	for (done = 0; done < ota.size; done += n) {
+		n = ota.size - done < OTA_BOUNCE ? ota.size - done : OTA_BOUNCE;
+		spi_flash_read(ota.base + done, bounce, (n + 3) & ~3);
+		SHA256_Update(&ctx, bounce, n);
+	}
+	SHA256_Final(&ctx, digest);
+	return os_memcmp(digest, ota.sha, SHA256_SIZE) == 0;
+}
+
+LOCAL void ICACHE_FLASH_ATTR
+ota_commit(void)
+{
+	uint32_t pad = 0xFFFFFFFF;
+
+	if (ota.state != OTA_RECEIVING || ota.pending || ota.received != ota.stream || ota.offset != ota.size) {
+		otaError = "incomplete";
+		return;
+	}
+	if (ota.tailLen) {
+		os_memcpy(&pad, ota.tail, ota.tailLen);
+		if (spi_flash_write(ota.base + ota.offset - ota.tailLen, &pad, 4) != SPI_FLASH_RESULT_OK) {
+			ota_stop(OTA_IDLE);
+			otaError = "flash";
+			return;
+		}
+		ota.tailLen = 0;
+	}
+	ota_stop(OTA_IDLE);
+	if (!ota_verify()) {
+		system_upgrade_flag_set(UPGRADE_FLAG_IDLE);
+		otaError = "sha256";
+		return;
+	}
+	INFO("OTA: image verified, rebooting into 0x%X\r\n", ota.base);
+	ota_switch(1);
+}
+
+/**
+  * @brief  Check how the running image was booted, call after config_load()
+  * @param  client: connection the transfer arrives on
+  * @retval None
+  */
+void ICACHE_FLASH_ATTR
+OTA_Init(MQTT_Client *client)
+{
+	otaClient = client;
+	ota.state = OTA_IDLE;
+	os_timer_disarm(&patchTimer);
+	os_timer_setfn(&patchTimer, (os_timer_func_t *)ota_patch_cb, NULL);
+	INFO("OTA: running from slot %d\r\n", system_upgrade_userbin_check() + 1);
+
+	if (config.ota_trial == 0)
+		return;
+	// repeated resets of a trial image never reach the confirm timer
+	if (config.ota_trial > OTA_MAX_BOOTS) {
+		ota_trial_expired(NULL);
+		return;
+	}
+	config.ota_trial++;
+	config_save();
+	os_timer_disarm(&otaTimer);
+	os_timer_setfn(&otaTimer, (os_timer_func_t *)ota_trial_expired, NULL);
+	os_timer_arm(&otaTimer, OTA_CONFIRM_MS, 0);
+}
+
+/**
+  * @brief  Call from the MQTT connected callback: confirms a trial image and subscribes
+  */
+void ICACHE_FLASH_ATTR
+OTA_Connected(void)
+{
+	char topic[40];
+
+	if (config.ota_trial && ota.state != OTA_REBOOTING) {
+		INFO("OTA: new image confirmed\r\n");
+		os_timer_disarm(&otaTimer);
+		config.ota_trial = 0;
+		config_save();
+	}
+	os_sprintf(topic, "%sota/+", config.mqtt_topic);
+	MQTT_Subscribe(otaClient, topic, 1);
+}
+
+/**
+  * @brief  Offer an incoming message to the updater
+  * @param  topic: full topic, terminated
+  * @param  data:  payload
+  * @param  len:   payload length
+  * @retval TRUE if the topic belonged to the updater
+  */
+BOOL ICACHE_FLASH_ATTR
+OTA_Data(const char *topic, const uint8_t *data, uint32_t len)
+{
+	uint16_t n = os_strlen(config.mqtt_topic);
+
+	if (os_strncmp(topic, config.mqtt_topic, n) != 0 || os_strncmp(topic + n, "ota/", 4) != 0)
+		return FALSE;
+	topic += n + 4;
+
+	if (ota.state == OTA_REBOOTING)
+		return TRUE;
+	if (os_strcmp(topic, "chunk") == 0) {
+		if (ota_chunk(data, len))
+			return TRUE;	/* acked once the applier has taken all of it */
+	} else if (os_strcmp(topic, "begin") == 0)
+		ota_begin((const char *)data, len);
+	else if (os_strcmp(topic, "commit") == 0)
+		ota_commit();
+	else if (os_strcmp(topic, "abort") == 0) {
+		ota_stop(OTA_IDLE);
+		system_upgrade_flag_set(UPGRADE_FLAG_IDLE);
+	} else if (os_strcmp(topic, "rollback") == 0 && ota.state == OTA_IDLE)
+		ota_switch(0);
+	else
+		return TRUE;	/* our own ack */
+	ota_ack();
+	return TRUE;
+}
@@ -0,0 +1,116 @@
+/*
+ * power.c
+ *
+ *  The SDK only offers automatic sleep: once enabled the radio dozes
+ *  between DTIM beacons while the station is idle and, for light sleep,
+ *  the CPU is suspended until the next timer. Sending still works at once
+ *  but anything addressed to us waits for the next beacon, so sleep is
+ *  only enabled across gaps with nothing in flight and dropped again
+ *  ahead of the deadline that ends the gap.
+ */
+#include "ets_sys.h"
+#include "osapi.h"
+#include "os_type.h"
+#include "user_interface.h"
+#include "power.h"
+#include "debug.h"
+
+LOCAL os_timer_t powerTimer;
+LOCAL POWER_DEADLINE powerDeadline;
+LOCAL uint8_t powerMode;
+LOCAL BOOL asleep;
+
+LOCAL void ICACHE_FLASH_ATTR
+power_arm(os_timer_func_t *fn, uint32_t ms)
+{
+	os_timer_disarm(&powerTimer);
+	os_timer_setfn(&powerTimer, fn, NULL);
+	os_timer_arm(&powerTimer, ms, 0);
+}
+
+LOCAL void ICACHE_FLASH_ATTR
+power_radio(BOOL sleep)
+{
+	if (sleep == asleep)
+		return;
+	asleep = sleep;
+	if (!sleep)
+		wifi_set_sleep_type(NONE_SLEEP_T);
+	else if (powerMode == POWER_LIGHT)
+		wifi_set_sleep_type(LIGHT_SLEEP_T);
+	else
+		wifi_set_sleep_type(MODEM_SLEEP_T);
+}
+
+LOCAL void ICACHE_FLASH_ATTR power_check(void *arg);
+
+/* A deadline is close: radio up, look again once it has been dealt with */
+LOCAL void ICACHE_FLASH_ATTR
+power_due(void *arg)
+{
+	power_radio(FALSE);
+	power_arm(power_check, POWER_WAKE_AHEAD_MS + POWER_LINGER_MS);
+}
+
+LOCAL void ICACHE_FLASH_ATTR
+power_check(void *arg)
+{
+	uint32_t ms = powerDeadline();
+
+	if (ms == 0) {
+		power_radio(FALSE);
+		power_arm(power_check, POWER_LINGER_MS);
+		return;
+	}
+	// not worth it, stay up through the deadline and decide after it
+	if (ms < POWER_MIN_IDLE_MS) {
+		power_radio(FALSE);
+		power_arm(power_check, ms + POWER_LINGER_MS);
+		return;
+	}
+	INFO("Power: sleep for %d ms\r\n", ms - POWER_WAKE_AHEAD_MS);
+	power_radio(TRUE);
+	power_arm(power_due, ms - POWER_WAKE_AHEAD_MS);
+}
+
+/**
+  * @brief  Start managing the radio
+  * @param  mode:     POWER_MODE to use between deadlines
+  * @param  deadline: tells how long the radio may sleep
+  * @retval None
+  */
+void ICACHE_FLASH_ATTR
+POWER_Init(uint8_t mode, POWER_DEADLINE deadline)
+{
+	powerDeadline = deadline;
+	POWER_SetMode(mode);
+}
+
+/**
+  * @brief  Switch the kind of sleep, the radio is up until the next check
+  * @param  mode: POWER_MODE
+  * @retval None
+  */
+void ICACHE_FLASH_ATTR
+POWER_SetMode(uint8_t mode)
+{
+	os_timer_disarm(&powerTimer);
+	powerMode = mode;
+	asleep = FALSE;
+	wifi_set_sleep_type(NONE_SLEEP_T);
+	if (mode != POWER_OFF)
+		power_arm(power_check, POWER_LINGER_MS);
+}
+
+/**
+  * @brief  Traffic now or soon: radio up for at least POWER_LINGER_MS
+  * @retval None
+  */
+void ICACHE_FLASH_ATTR
+POWER_Wake(void)
+{
+	if (powerMode == POWER_OFF)
+		return;
+	power_radio(FALSE);
+	power_arm(power_check, POWER_LINGER_MS);
+}
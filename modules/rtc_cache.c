@@ -0,0 +1,74 @@
+/*
+ * rtc_cache.c
+ *
+ *  RTC user memory survives deep sleep but not a power cycle, so every entry
+ *  carries a checksum and a tag of the configuration it was made under.
+ */
+#include "ets_sys.h"
+#include "osapi.h"
+#include "os_type.h"
+#include "user_interface.h"
+#include "debug.h"
+#include "rtc_cache.h"
+
+LOCAL uint32_t ICACHE_FLASH_ATTR
+rtc_cache_sum(const RTC_CACHE *cache)
+{
+	const uint8_t *p = (const uint8_t *)&cache->cfg_tag;
+	const uint8_t *end = (const uint8_t *)cache + sizeof(RTC_CACHE);
+	uint32_t a = 1, b = 0;
+
+	// Adler-32, cheap and good enough to reject power-on garbage
+	while (p < end) {
+		a = (a + *p++) % 65521;
+		b = (b + a) % 65521;
+	}
+	return (b << 16) | a;
+}
+
+uint32_t ICACHE_FLASH_ATTR
+RTC_CacheTag(const uint8_t *ssid, const uint8_t *host)
+{
+	uint32_t h = 2166136261UL;
+
+	// FNV-1a over "ssid\0host"
+	while (*ssid)
+		h = (h ^ *ssid++) * 16777619UL;
+	h *= 16777619UL;
+	while (*host)
+		h = (h ^ *host++) * 16777619UL;
+	return h;
+}
+
+BOOL ICACHE_FLASH_ATTR
+RTC_CacheLoad(RTC_CACHE *cache, uint32_t cfg_tag)
+{
+	if (!system_rtc_mem_read(RTC_CACHE_BLOCK, cache, sizeof(RTC_CACHE)))
+		return FALSE;
+
+	if (cache->magic != RTC_CACHE_MAGIC || cache->checksum != rtc_cache_sum(cache)
+			|| cache->cfg_tag != cfg_tag) {
+		os_memset(cache, 0, sizeof(RTC_CACHE));
+		cache->cfg_tag = cfg_tag;
+		return FALSE;
+	}
+	INFO("RTC: cached link ch %d, ip " IPSTR ", wake %d\r\n",
+			cache->channel, IP2STR(&cache->ip.ip), cache->wake_count);
+	return TRUE;
+}
+
+void ICACHE_FLASH_ATTR
+RTC_CacheSave(RTC_CACHE *cache)
+{
+	cache->magic = RTC_CACHE_MAGIC;
+	cache->checksum = rtc_cache_sum(cache);
+	system_rtc_mem_write(RTC_CACHE_BLOCK, cache, sizeof(RTC_CACHE));
+}
+
+void ICACHE_FLASH_ATTR
+RTC_CacheInvalidate(void)
+{
+	uint32_t magic = 0;
+
+	system_rtc_mem_write(RTC_CACHE_BLOCK, &magic, sizeof magic);
+}
@@ -0,0 +1,101 @@
+/*
+ * sched.c
+ *
+ *  The interval grows by half each flat sample and drops straight to the
+ *  minimum as soon as any metric changes faster than the threshold. Every
+ *  interval is a whole number of minimum intervals, so deadlines lined up
+ *  with that grid stay on it.
+ */
+#include "ets_sys.h"
+#include "osapi.h"
+#include "os_type.h"
+#include "sched.h"
+
+/**
+  * @brief  The grid every interval is a whole number of: the minimum interval
+  * @param  s: scheduler
+  * @retval milliseconds
+  */
+uint32_t ICACHE_FLASH_ATTR
+SCHED_Step(SCHED *s)
+{
+	uint32_t lo = s->cfg->min_ms < SCHED_FLOOR_MS ? SCHED_FLOOR_MS : s->cfg->min_ms;
+
+	return lo > SCHED_CEIL_MS ? SCHED_CEIL_MS : lo;
+}
+
+LOCAL uint32_t ICACHE_FLASH_ATTR
+sched_clamp(SCHED *s, uint32_t ms)
+{
+	uint32_t lo = SCHED_Step(s);
+	uint32_t hi = s->cfg->max_ms < lo ? lo : s->cfg->max_ms;
+
+	if (hi > SCHED_CEIL_MS)
+		hi = SCHED_CEIL_MS;
+	hi -= hi % lo;
+	// up to the next step, so the interval stays a whole number of them
+	ms = (ms + lo - 1) / lo * lo;
+	if (ms < lo)
+		return lo;
+	if (ms > hi)
+		return hi;
+	return ms;
+}
+
+void ICACHE_FLASH_ATTR
+SCHED_Init(SCHED *s, const SCHED_CFG *cfg, uint32_t initial_ms)
+{
+	s->cfg = cfg;
+	s->primed = FALSE;
+	s->interval = sched_clamp(s, initial_ms);
+}
+
+/**
+  * @brief  Current interval, clamped to the settings as they are now
+  * @param  s: scheduler
+  * @retval milliseconds until the next sample
+  */
+uint32_t ICACHE_FLASH_ATTR
+SCHED_Interval(SCHED *s)
+{
+	s->interval = sched_clamp(s, s->interval);
+	return s->interval;
+}
+
+/**
+  * @brief  Feed the latest sample and get the delay until the next one
+  * @param  s:      scheduler
+  * @param  values: one value per metric, in tenths
+  * @param  count:  number of metrics, at most SCHED_MAX_METRICS
+  * @retval milliseconds until the next sample
+  */
+uint32_t ICACHE_FLASH_ATTR
+SCHED_Next(SCHED *s, const int32_t *values, uint8_t count)
+{
+	BOOL moving = FALSE;
+	int64_t delta;
+	uint8_t i;
+
+	if (count > SCHED_MAX_METRICS)
+		count = SCHED_MAX_METRICS;
+
+	for (i = 0; s->primed && i < count; i++) {
+		delta = (int64_t)values[i] - s->prev[i];
+		if (delta < 0)
+			delta = -delta;
+		// |delta| / interval >= threshold / 60 s, kept in integers; a threshold
+		// of 0xFFFF over SCHED_CEIL_MS does not fit 32 bits
+		if ((uint64_t)delta * 60000 >= (uint64_t)s->cfg->threshold * s->interval)
+			moving = TRUE;
+	}
+	for (i = 0; i < count; i++)
+		s->prev[i] = values[i];
+
+	if (moving)
+		s->interval = 0;
+	else if (s->primed)
+		s->interval += s->interval / 2;
+	s->primed = TRUE;
+
+	return SCHED_Interval(s);
+}
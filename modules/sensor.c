@@ -0,0 +1,92 @@
+/*
+ * sensor.c
+ *
+ *  Keeps the driver state of every configured sensor in one array so a
+ *  single DHTScan() wakes them all at once, and pairs each with its
+ *  filters and summaries.
+ */
+#include "ets_sys.h"
+#include "osapi.h"
+#include "os_type.h"
+#include "sensor.h"
+
+LOCAL DHT_SENSOR dht[SENSOR_MAX];
+LOCAL SENSOR sensors[SENSOR_MAX];
+LOCAL uint8_t sensorCount;
+LOCAL SENSOR_Callback scanCb;
+
+LOCAL void ICACHE_FLASH_ATTR
+sensor_scan_done(DHT_SENSOR *list, uint8_t count)
+{
+	if (scanCb)
+		scanCb();
+}
+
+/**
+  * @brief  Register every configured slot that has a usable pin
+  * @param  cfgs:  slot settings, read on every publish so they can change at runtime
+  * @param  count: number of slots, at most SENSOR_MAX are used
+  * @retval Number of sensors registered
+  */
+uint8_t ICACHE_FLASH_ATTR
+SENSOR_Init(const SENSOR_CFG *cfgs, uint8_t count)
+{
+	uint8_t i;
+	SENSOR *s;
+
+	sensorCount = 0;
+	for (i = 0; i < count && i < SENSOR_MAX; i++) {
+		if (cfgs[i].pin == SENSOR_NONE)
+			continue;
+		if (!DHTInit(&dht[sensorCount], cfgs[i].pin, cfgs[i].type))
+			continue;
+		s = &sensors[sensorCount];
+		s->cfg = &cfgs[i];
+		s->reading = &dht[sensorCount].reading;
+		FILTER_Init(&s->temp_filter, &cfgs[i].temp_filter);
+		FILTER_Init(&s->hum_filter, &cfgs[i].hum_filter);
+		AGGR_Reset(&s->temp_aggr);
+		AGGR_Reset(&s->hum_aggr);
+		BATCH_Reset(&s->batch);
+		sensorCount++;
+	}
+	return sensorCount;
+}
+
+/**
+  * @brief  Read every registered sensor, the start sequences run concurrently
+  * @param  cb: called once all readings are filled in
+  * @retval FALSE if nothing is registered or a scan is still running
+  */
+BOOL ICACHE_FLASH_ATTR
+SENSOR_Scan(SENSOR_Callback cb)
+{
+	if (sensorCount == 0)
+		return FALSE;
+	scanCb = cb;
+	return DHTScan(dht, sensorCount, sensor_scan_done);
+}
+
+uint8_t ICACHE_FLASH_ATTR
+SENSOR_Count(void)
+{
+	return sensorCount;
+}
+
+SENSOR * ICACHE_FLASH_ATTR
+SENSOR_Get(uint8_t index)
+{
+	return index < sensorCount ? &sensors[index] : NULL;
+}
+
+/**
+  * @brief  Build "<prefix><name>/<metric>", or "<prefix><metric>" for an unnamed sensor
+  * @retval Length of the topic
+  */
+int ICACHE_FLASH_ATTR
+SENSOR_Topic(const SENSOR *s, char *buf, const char *prefix, const char *metric)
+{
+	if (s->cfg->name[0] == 0)
+		return os_sprintf(buf, "%s%s", prefix, metric);
+	return os_sprintf(buf, "%s%s/%s", prefix, s->cfg->name, metric);
+}
@@ -0,0 +1,315 @@
+/*
+ * settings.c
+ *
+ *  Every key maps to a field of SYSCFG with a type and a range. Valid
+ *  pairs are written straight into config and the caller gets a mask of
+ *  the subsystems to refresh; invalid ones are listed in the ack and
+ *  leave config untouched.
+ */
+#include <stddef.h>
+#include "ets_sys.h"
+#include "osapi.h"
+#include "os_type.h"
+#include "config.h"
+#include "settings.h"
+
+#define SETTINGS_KEY_LEN	24
+#define SETTINGS_VALUE_LEN	64
+#define SETTINGS_ITEM_LEN	(SETTINGS_KEY_LEN + SETTINGS_VALUE_LEN + 8)	/* "key":"value", */
+
+typedef enum {
+	SET_U8,
+	SET_U16,
+	SET_U32,
+	SET_STR,
+	SET_TOPIC,			/* string ending in '/' without wildcards */
+	SET_NAME,			/* one topic level: not empty, no '/' or wildcards */
+	SET_PIN				/* GPIO DHTInit takes and the console leaves free, or SENSOR_NONE */
+} SET_TYPE;
+
+typedef struct {
+	const char *key;
+	uint8_t type;
+	uint8_t apply;
+	uint16_t offset;	/* into SYSCFG, or into SENSOR_CFG for sensor keys */
+	uint16_t size;		/* buffer size of strings */
+	uint32_t min;
+	uint32_t max;
+} SETTING;
+
+#define NUM(k, t, f, lo, hi, a)	{ k, t, a, offsetof(SYSCFG, f), 0, lo, hi }
+#define STR(k, t, f, a)			{ k, t, a, offsetof(SYSCFG, f), sizeof(((SYSCFG *)0)->f), 0, 0 }
+#define SNUM(k, t, f, lo, hi, a)	{ k, t, a, offsetof(SENSOR_CFG, f), 0, lo, hi }
+#define SSTR(k, t, f, a)		{ k, t, a, offsetof(SENSOR_CFG, f), sizeof(((SENSOR_CFG *)0)->f), 0, 0 }
+
+LOCAL const SETTING globals[] = {
+	STR("topic", SET_TOPIC, mqtt_topic, SETTINGS_TOPIC),
+	NUM("keepalive", SET_U32, mqtt_keepalive, 10, 3600, SETTINGS_MQTT),
+	NUM("sample_min", SET_U32, sampling.min_ms, SCHED_FLOOR_MS, SCHED_CEIL_MS, SETTINGS_SAMPLING),
+	NUM("sample_max", SET_U32, sampling.max_ms, SCHED_FLOOR_MS, SCHED_CEIL_MS, SETTINGS_SAMPLING),
+	NUM("sample_threshold", SET_U16, sampling.threshold, 0, 0xFFFF, SETTINGS_SAMPLING),
+	NUM("aggr_window", SET_U32, aggr_window, 0, 86400, SETTINGS_AGGR),
+	NUM("batch_size", SET_U16, batch_size, 0, BATCH_MAX, 0),
+	STR("sntp_host", SET_STR, sntp_host, SETTINGS_CLOCK),
+	NUM("sntp_interval", SET_U32, sntp_interval, 60, 86400, SETTINGS_CLOCK),
+	NUM("roam_rssi", SET_U8, roam_rssi, 0, 100, SETTINGS_WIFI),
+	NUM("power_mode", SET_U8, power_mode, 0, 2, SETTINGS_WIFI),
+};
+
+LOCAL const SETTING sensorKeys[] = {
+	SNUM("pin", SET_PIN, pin, 0, SENSOR_NONE, SETTINGS_SENSORS),
+	SNUM("type", SET_U8, type, DHT11, DHT22, SETTINGS_SENSORS),
+	SSTR("name", SET_NAME, name, 0),
+	SNUM("t_median", SET_U8, temp_filter.median, 1, FILTER_MAX_MEDIAN, 0),
+	SNUM("t_deadband", SET_U16, temp_filter.deadband, 0, 0xFFFF, 0),
+	SNUM("t_heartbeat", SET_U16, temp_filter.heartbeat, 0, 0xFFFF, 0),
+	SNUM("h_median", SET_U8, hum_filter.median, 1, FILTER_MAX_MEDIAN, 0),
+	SNUM("h_deadband", SET_U16, hum_filter.deadband, 0, 0xFFFF, 0),
+	SNUM("h_heartbeat", SET_U16, hum_filter.heartbeat, 0, 0xFFFF, 0),
+};
+
+#define COUNT(a)	(sizeof(a) / sizeof((a)[0]))
+
+/* Resolve "key" or "s<slot>.key" to its schema entry and field address */
+LOCAL const SETTING * ICACHE_FLASH_ATTR
+settings_find(const char *key, uint8_t **field)
+{
+	const SETTING *table = globals;
+	uint8_t count = COUNT(globals);
+	uint8_t *base = (uint8_t *)&config;
+	uint8_t i;
+
+	if (key[0] == 's' && key[1] >= '0' && key[1] < '0' + SENSOR_MAX && key[2] == '.') {
+		base = (uint8_t *)&config.sensors[key[1] - '0'];
+		table = sensorKeys;
+		count = COUNT(sensorKeys);
+		key += 3;
+	}
+	for (i = 0; i < count; i++) {
+		if (os_strcmp(key, table[i].key) == 0) {
+			*field = base + table[i].offset;
+			return &table[i];
+		}
+	}
+	return NULL;
+}
+
+LOCAL BOOL ICACHE_FLASH_ATTR
+settings_parse_uint(const char *s, uint32_t *out)
+{
+	uint32_t v = 0;
+
+	if (*s == 0)
+		return FALSE;
+	for (; *s; s++) {
+		if (*s < '0' || *s > '9' || v > 429496728)
+			return FALSE;
+		v = v * 10 + (*s - '0');
+	}
+	*out = v;
+	return TRUE;
+}
+
+/* Whether s holds any of chars */
+LOCAL BOOL ICACHE_FLASH_ATTR
+settings_any(const char *s, const char *chars)
+{
+	const char *c;
+
+	for (; *s; s++) {
+		for (c = chars; *c; c++) {
+			if (*s == *c)
+				return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/* GPIO1 and GPIO3 are UART0, the console or the serial bridge; GPIO2 is the console under the bridge */
+LOCAL BOOL ICACHE_FLASH_ATTR
+settings_pin(uint32_t pin)
+{
+	if (pin == SENSOR_NONE)
+		return TRUE;
+	if (pin == 1 || pin == 3)
+		return FALSE;
+#ifdef SERIAL_BRIDGE
+	if (pin == 2)
+		return FALSE;
+#endif
+	return pin < 16 && DHTPinUsable(pin);
+}
+
+LOCAL BOOL ICACHE_FLASH_ATTR
+settings_set(const SETTING *set, uint8_t *field, const char *value)
+{
+	uint32_t v;
+	uint16_t i, n = os_strlen(value);
+
+	switch (set->type) {
+	case SET_TOPIC:
+	case SET_NAME:
+		if (n == 0 || settings_any(value, "+#"))
+			return FALSE;
+		if (set->type == SET_TOPIC ? value[n - 1] != '/' : settings_any(value, "/"))
+			return FALSE;
+		// fall through
+	case SET_STR:
+		// strings go back out between JSON quotes as they are
+		if (n >= set->size || settings_any(value, "\"\\"))
+			return FALSE;
+		for (i = 0; i < n; i++) {
+			if ((uint8_t)value[i] < ' ')
+				return FALSE;
+		}
+		os_memset(field, 0, set->size);
+		os_memcpy(field, value, n);
+		return TRUE;
+	default:
+		if (!settings_parse_uint(value, &v) || v < set->min || v > set->max)
+			return FALSE;
+		if (set->type == SET_PIN && !settings_pin(v))
+			return FALSE;
+		if (set->type == SET_U8 || set->type == SET_PIN)
+			*field = v;
+		else if (set->type == SET_U16)
+			*(uint16_t *)field = v;
+		else
+			*(uint32_t *)field = v;
+		return TRUE;
+	}
+}
+
+/* s between JSON quotes, '"' and '\\' escaped, control characters as '?' */
+LOCAL int ICACHE_FLASH_ATTR
+settings_quote(char *buf, const char *s)
+{
+	char *p = buf;
+
+	*p++ = '"';
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			*p++ = '\\';
+		*p++ = (uint8_t)*s < ' ' ? '?' : *s;
+	}
+	*p++ = '"';
+	*p = 0;
+	return p - buf;
+}
+
+LOCAL int ICACHE_FLASH_ATTR
+settings_format(char *buf, const char *prefix, const SETTING *set, const uint8_t *field)
+{
+	switch (set->type) {
+	case SET_U8:
+	case SET_PIN:
+		return os_sprintf(buf, "\"%s%s\":%d", prefix, set->key, *field);
+	case SET_U16:
+		return os_sprintf(buf, "\"%s%s\":%d", prefix, set->key, *(const uint16_t *)field);
+	case SET_U32:
+		return os_sprintf(buf, "\"%s%s\":%u", prefix, set->key, *(const uint32_t *)field);
+	default:
+		return os_sprintf(buf, "\"%s%s\":\"%s\"", prefix, set->key, field);
+	}
+}
+
+/**
+  * @brief  Apply "key=value" pairs separated by ',', ';' or newlines
+  * @param  data: payload, need not be terminated
+  * @param  len:  payload length
+  * @param  ack:  receives {"applied":{key:effective value,...},"rejected":[key,...]}
+  * @param  size: size of ack, SETTINGS_ACK_SIZE is plenty
+  * @retval Mask of SETTINGS_* subsystems whose fields changed
+  */
+uint8_t ICACHE_FLASH_ATTR
+SETTINGS_Apply(const char *data, uint32_t len, char *ack, uint16_t size)
+{
+	char key[SETTINGS_KEY_LEN];
+	char value[SETTINGS_VALUE_LEN];
+	char prefix[4];
+	char rejected[192];
+	char *r = rejected;
+	char *p = ack;
+	const SETTING *set;
+	uint8_t *field;
+	uint8_t mask = 0;
+	uint32_t i = 0, k, v;
+
+	p += os_sprintf(p, "{\"applied\":{");
+	*r = 0;
+	while (i < len) {
+		k = v = 0;
+		while (i < len && data[i] != '=' && data[i] != ',' && data[i] != ';' && data[i] != '\n') {
+			if (k < sizeof(key) - 1 && data[i] != ' ' && data[i] != '\r')
+				key[k++] = data[i];
+			i++;
+		}
+		key[k] = 0;
+		if (i < len && data[i] == '=') {
+			for (i++; i < len && data[i] != ',' && data[i] != ';' && data[i] != '\n'; i++) {
+				if (v < sizeof(value) - 1 && data[i] != '\r')
+					value[v++] = data[i];
+			}
+		}
+		value[v] = 0;
+		i++;
+		if (k == 0)
+			continue;
+
+		set = settings_find(key, &field);
+		if (set != NULL && settings_set(set, field, value)) {
+			mask |= set->apply | SETTINGS_CHANGED;
+			// sensor keys are echoed with their slot
+			prefix[0] = 0;
+			if (set >= sensorKeys && set < sensorKeys + COUNT(sensorKeys)) {
+				os_memcpy(prefix, key, 3);
+				prefix[3] = 0;
+			}
+			if (p + SETTINGS_ITEM_LEN < ack + size - sizeof(rejected) - 20) {
+				if (p[-1] != '{')
+					*p++ = ',';
+				p += settings_format(p, prefix, set, field);
+			}
+		} else if (r + 2 * SETTINGS_KEY_LEN + 4 < rejected + sizeof(rejected)) {
+			// unknown keys come back as sent, quotes and all
+			if (r != rejected)
+				*r++ = ',';
+			r += settings_quote(r, key);
+		}
+	}
+	os_sprintf(p, "},\"rejected\":[%s]}", rejected);
+	return mask;
+}
+
+/**
+  * @brief  Write the effective values of every key, sensor keys only for
+  *         slots in use, as a JSON object. Stops before overrunning buf.
+  * @retval Number of characters written
+  */
+int ICACHE_FLASH_ATTR
+SETTINGS_Dump(char *buf, uint16_t size)
+{
+	char prefix[4];
+	char *p = buf;
+	uint8_t i, slot;
+
+	*p++ = '{';
+	for (i = 0; i < COUNT(globals) && p + SETTINGS_ITEM_LEN + 2 < buf + size; i++) {
+		if (p[-1] != '{')
+			*p++ = ',';
+		p += settings_format(p, "", &globals[i], (uint8_t *)&config + globals[i].offset);
+	}
+	for (slot = 0; slot < SENSOR_MAX; slot++) {
+		if (config.sensors[slot].pin == SENSOR_NONE)
+			continue;
+		os_sprintf(prefix, "s%d.", slot);
+		for (i = 0; i < COUNT(sensorKeys) && p + SETTINGS_ITEM_LEN + 2 < buf + size; i++) {
+			*p++ = ',';
+			p += settings_format(p, prefix, &sensorKeys[i],
+					(uint8_t *)&config.sensors[slot] + sensorKeys[i].offset);
+		}
+	}
+	*p++ = '}';
+	*p = 0;
+	return p - buf;
+}
@@ -0,0 +1,111 @@
+/*
+ * ticker.c
+ *
+ *  os_timer only counts milliseconds from when it is armed and fires a
+ *  little late. The ticker arms it early by the latency it has measured,
+ *  spins out the last stretch and reports how far off each sample was.
+ *  All times are system_get_time() microseconds compared by signed
+ *  difference, which is safe across its wrap for intervals of minutes.
+ */
+#include "ets_sys.h"
+#include "osapi.h"
+#include "os_type.h"
+#include "user_interface.h"
+#include "ticker.h"
+
+/**
+  * @brief  Set the first deadline and clear the statistics
+  * @param  t:        ticker
+  * @param  delay_ms: time from now until the first sample
+  * @retval None
+  */
+void ICACHE_FLASH_ATTR
+TICKER_Start(TICKER *t, uint32_t delay_ms)
+{
+	t->deadline = system_get_time() + delay_ms * 1000;
+	t->armed = t->deadline;
+	t->latency = 0;
+	t->jitter = 0;
+	t->jitter_max = 0;
+	t->missed = 0;
+}
+
+/**
+  * @brief  Call first thing in the timer callback
+  * @param  t: ticker
+  * @retval Microseconds the sample is late, negative if early
+  */
+int32_t ICACHE_FLASH_ATTR
+TICKER_Fired(TICKER *t)
+{
+	uint32_t now = system_get_time();
+	int32_t late = (int32_t)(now - t->armed);
+	int32_t early;
+
+	t->latency += (late - t->latency) / 4;
+
+	early = (int32_t)(t->deadline - now);
+	if (early > 0 && early <= TICKER_SPIN_US) {
+		os_delay_us(early);
+		now = system_get_time();
+	}
+
+	t->jitter = (int32_t)(now - t->deadline);
+	if ((uint32_t)(t->jitter < 0 ? -t->jitter : t->jitter) > t->jitter_max)
+		t->jitter_max = t->jitter < 0 ? -t->jitter : t->jitter;
+	return t->jitter;
+}
+
+/**
+  * @brief  Move the deadline one interval on from the previous one, not from now.
+  *         Deadlines a long cycle already ran past are skipped.
+  * @param  t:           ticker
+  * @param  interval_ms: sampling interval
+  * @retval None
+  */
+void ICACHE_FLASH_ATTR
+TICKER_Advance(TICKER *t, uint32_t interval_ms)
+{
+	uint32_t now = system_get_time();
+
+	t->deadline += interval_ms * 1000;
+	while ((int32_t)(t->deadline - now) <= 0) {
+		t->deadline += interval_ms * 1000;
+		t->missed++;
+	}
+}
+
+/**
+  * @brief  Move the next deadline, e.g. to line it up with wall clock time
+  */
+void ICACHE_FLASH_ATTR
+TICKER_Shift(TICKER *t, int32_t us)
+{
+	t->deadline += us;
+}
+
+/**
+  * @brief  Microseconds until the next deadline, negative once it passed
+  */
+int32_t ICACHE_FLASH_ATTR
+TICKER_Remaining(TICKER *t)
+{
+	return (int32_t)(t->deadline - system_get_time());
+}
+
+/**
+  * @brief  Milliseconds to arm the timer for so it fires just before the deadline
+  * @param  t: ticker
+  * @retval delay for os_timer_arm, at least 1
+  */
+uint32_t ICACHE_FLASH_ATTR
+TICKER_Arm(TICKER *t)
+{
+	int32_t lead = (t->latency > 0 ? t->latency : 0) + TICKER_MARGIN_US;
+	int32_t delay = TICKER_Remaining(t) - lead;
+
+	if (delay < 1000)
+		delay = 1000;
+	t->armed = system_get_time() + (delay / 1000) * 1000;
+	return delay / 1000;
+}
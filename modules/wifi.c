@@ -14,86 +14,414 @@
 #include "debug.h"
 #include "user_config.h"
 #include "config.h"
+#include "metrics.h"
+
+#define WIFI_RETRY_MS		1000	/* after a failed attempt, nothing runs while connected */
+#define WIFI_ROAM_CHECK_MS	10000	/* RSSI sampling while roaming is enabled */
+#define WIFI_ROAM_CHECKS	3		/* weak samples in a row before looking for a better AP */
+#define WIFI_ROAM_GAIN		8		/* dB a candidate has to beat the current AP by */
+#define WIFI_SCAN_AGE_MS	120000	/* candidates older than this are scanned again */
+
+#ifndef MACSTR
+#define MACSTR "%02x:%02x:%02x:%02x:%02x:%02x"
+#define MAC2STR(a) (a)[0], (a)[1], (a)[2], (a)[3], (a)[4], (a)[5]
+#endif
 
 static ETSTimer WiFiLinker;
+static ETSTimer roamTimer;
 WifiCallback wifiCb = NULL;
-static uint8_t wifiStatus = STATION_IDLE, lastWifiStatus = STATION_IDLE;
-static void ICACHE_FLASH_ATTR wifi_check_ip(void *arg)
+static uint8_t wifiStatus = STATION_IDLE;
+
+/* Networks to look for, the one given to WIFI_Connect first */
+static const uint8_t *netSsid[WIFI_MAX_NETS];
+static const uint8_t *netPass[WIFI_MAX_NETS];
+static uint8_t netCount = 1;
+
+/* APs of those networks from the last scan, strongest first */
+static WIFI_CANDIDATE candidates[WIFI_CANDIDATES];
+static uint8_t candidateCount;
+static uint8_t candidateNext;		/* tried on the next connect */
+static uint8_t candidateActive;
+static uint32_t scanTime;
+static BOOL scanning = FALSE;
+
+static sint8 roamRssi;				/* 0 disables roaming */
+static uint8_t weakCount;
+static BOOL roaming = FALSE;
+
+/* AP and lease to reuse on connect, set by WIFI_SetFastLink() */
+static BOOL fastLinkValid = FALSE;
+static uint8_t fastLinkNet;
+static uint8_t fastLinkBssid[6];
+static uint8_t fastLinkChannel;
+static struct ip_info fastLinkIp;
+
+/* AP of the current association, reported by the SDK, and its network */
+static uint8_t linkNet;
+static uint8_t linkBssid[6];
+static uint8_t linkChannel;
+
+static void ICACHE_FLASH_ATTR wifi_set_status(uint8_t status)
 {
-	struct ip_info ipConfig;
+	if (status == wifiStatus)
+		return;
+	wifiStatus = status;
+	if (wifiCb)
+		wifiCb(wifiStatus);
+}
 
-	os_timer_disarm(&WiFiLinker);
-	wifi_get_ip_info(STATION_IF, &ipConfig);
-	wifiStatus = wifi_station_get_connect_status();
-	if (wifiStatus == STATION_GOT_IP && ipConfig.ip.addr != 0)
-	{
+/* Associate with a network, pinned to one AP when bssid is given */
+static void ICACHE_FLASH_ATTR wifi_join(uint8_t net, const uint8_t *bssid, uint8_t channel)
+{
+	struct station_config stationConf;
 
-		os_timer_setfn(&WiFiLinker, (os_timer_func_t *)wifi_check_ip, NULL);
-		os_timer_arm(&WiFiLinker, 2000, 0);
+	os_memset(&stationConf, 0, sizeof(struct station_config));
+	os_sprintf(stationConf.ssid, "%s", netSsid[net]);
+	os_sprintf(stationConf.password, "%s", netPass[net]);
+	linkNet = net;
+	if (bssid) {
+		stationConf.bssid_set = 1;
+		os_memcpy(stationConf.bssid, bssid, sizeof stationConf.bssid);
+		wifi_set_channel(channel);
+	}
+	// roaming changes the AP often, keep that out of the flash copy
+	wifi_station_set_config_current(&stationConf);
+	wifi_station_connect();
+}
 
+/* Index of the configured network a scanned AP belongs to, -1 for none */
+static int8_t ICACHE_FLASH_ATTR wifi_net_of(const struct bss_info *bss)
+{
+	uint8_t i, len;
 
+	// names of 32 characters come without a terminator
+	for (len = 0; len < sizeof bss->ssid && bss->ssid[len]; len++)
+		;
+	for (i = 0; i < netCount; i++) {
+		if (os_strlen(netSsid[i]) != len || os_memcmp(netSsid[i], bss->ssid, len) != 0)
+			continue;
+		// an open AP under the name of a protected network is not ours
+		if (bss->authmode == AUTH_OPEN && netPass[i][0] != 0)
+			continue;
+		return i;
 	}
-	else
-	{
-		if(wifi_station_get_connect_status() == STATION_WRONG_PASSWORD)
-		{
+	return -1;
+}
 
-			INFO("STATION_WRONG_PASSWORD\r\n");
-			wifi_station_connect();
+static void ICACHE_FLASH_ATTR wifi_scan_done(void *arg, STATUS status);
 
+static void ICACHE_FLASH_ATTR wifi_scan(void)
+{
+	if (scanning)
+		return;
+	scanning = TRUE;
+	if (!wifi_station_scan(NULL, wifi_scan_done)) {
+		scanning = FALSE;
+		wifi_join(0, NULL, 0);
+	}
+}
 
-		}
-		else if(wifi_station_get_connect_status() == STATION_NO_AP_FOUND)
-		{
+/* Next candidate from the cache, a scan once it is used up or stale */
+static void ICACHE_FLASH_ATTR wifi_try_next(void)
+{
+	WIFI_CANDIDATE *c;
 
-			INFO("STATION_NO_AP_FOUND\r\n");
-			wifi_station_connect();
+	if (candidateNext >= candidateCount || system_get_time() - scanTime > WIFI_SCAN_AGE_MS * 1000) {
+		wifi_scan();
+		return;
+	}
+	candidateActive = candidateNext++;
+	c = &candidates[candidateActive];
+	INFO("WIFI: joining " MACSTR " on channel %d, %d dBm\r\n", MAC2STR(c->bssid), c->channel, c->rssi);
+	wifi_join(c->net, c->bssid, c->channel);
+}
 
+/* Connected scan: move when the best AP beats the current one by enough */
+static void ICACHE_FLASH_ATTR wifi_roam_decide(void)
+{
+	sint8 rssi = wifi_station_get_rssi();
+	uint8_t i;
 
-		}
-		else if(wifi_station_get_connect_status() == STATION_CONNECT_FAIL)
-		{
+	candidateNext = candidateCount;
+	for (i = 0; i < candidateCount; i++) {
+		if (os_memcmp(candidates[i].bssid, linkBssid, sizeof linkBssid) == 0)
+			candidateNext = candidateActive = i;
+	}
+	if (candidateCount == 0 || os_memcmp(candidates[0].bssid, linkBssid, sizeof linkBssid) == 0 ||
+			candidates[0].rssi < rssi + WIFI_ROAM_GAIN)
+		return;
+	INFO("WIFI: roaming to " MACSTR ", %d dBm against %d dBm\r\n", MAC2STR(candidates[0].bssid),
+			candidates[0].rssi, rssi);
+	roaming = TRUE;
+	candidateNext = 0;
+	wifi_station_disconnect();
+}
 
-			INFO("STATION_CONNECT_FAIL\r\n");
-			wifi_station_connect();
+static void ICACHE_FLASH_ATTR wifi_scan_done(void *arg, STATUS status)
+{
+	struct bss_info *bss;
+	WIFI_CANDIDATE c;
+	int8_t net;
+	uint8_t i;
 
+	scanning = FALSE;
+	candidateCount = 0;
+	for (bss = status == OK ? (struct bss_info *)arg : NULL; bss; bss = STAILQ_NEXT(bss, next)) {
+		if ((net = wifi_net_of(bss)) < 0)
+			continue;
+		os_memcpy(c.bssid, bss->bssid, sizeof c.bssid);
+		c.channel = bss->channel;
+		c.rssi = bss->rssi;
+		c.net = net;
+		// insertion into the strongest-first list, the weakest falls off
+		for (i = candidateCount; i > 0 && candidates[i - 1].rssi < c.rssi; i--) {
+			if (i < WIFI_CANDIDATES)
+				candidates[i] = candidates[i - 1];
 		}
-		else
-		{
-			INFO("STATION_IDLE\r\n");
-		}
+		if (i < WIFI_CANDIDATES)
+			candidates[i] = c;
+		if (candidateCount < WIFI_CANDIDATES)
+			candidateCount++;
+	}
+	scanTime = system_get_time();
+	candidateNext = 0;
+	INFO("WIFI: scan found %d candidate APs\r\n", candidateCount);
 
-		os_timer_setfn(&WiFiLinker, (os_timer_func_t *)wifi_check_ip, NULL);
-		os_timer_arm(&WiFiLinker, 500, 0);
+	if (wifiStatus == STATION_GOT_IP) {
+		wifi_roam_decide();
+		return;
 	}
-	if(wifiStatus != lastWifiStatus){
-		lastWifiStatus = wifiStatus;
-		if(wifiCb)
-			wifiCb(wifiStatus);
+	if (candidateCount == 0) {
+		// nothing seen, a hidden network still answers a directed connect
+		wifi_join(0, NULL, 0);
+		return;
 	}
+	wifi_try_next();
 }
 
+static void ICACHE_FLASH_ATTR wifi_roam_check(void *arg)
+{
+	sint8 rssi = wifi_station_get_rssi();
+
+	// 31 is the SDK's error value
+	if (rssi == 31 || rssi >= roamRssi) {
+		weakCount = 0;
+		return;
+	}
+	if (++weakCount < WIFI_ROAM_CHECKS)
+		return;
+	weakCount = 0;
+	// a scan that found nothing better is trusted until it ages out
+	if (system_get_time() - scanTime > WIFI_SCAN_AGE_MS * 1000 || candidateCount == 0) {
+		INFO("WIFI: weak link, %d dBm, scanning\r\n", rssi);
+		wifi_scan();
+	}
+}
+
+/* the join that follows sets a config without the pinned AP */
+static void ICACHE_FLASH_ATTR wifi_fast_link_drop(void)
+{
+	INFO("WIFI: cached link failed, falling back to scan and DHCP\r\n");
+	fastLinkValid = FALSE;
+	wifi_station_dhcpc_start();
+}
+
+/* Runs once after a disconnect, outside the SDK event context */
+static void ICACHE_FLASH_ATTR wifi_retry(void *arg)
+{
+	if (fastLinkValid)
+		wifi_fast_link_drop();
+	roaming = FALSE;
+	wifi_try_next();
+}
+
+static uint8_t ICACHE_FLASH_ATTR wifi_reason_status(uint8_t reason)
+{
+	switch (reason) {
+	case REASON_NO_AP_FOUND:
+		return STATION_NO_AP_FOUND;
+	case REASON_AUTH_FAIL:
+	case REASON_4WAY_HANDSHAKE_TIMEOUT:
+	case REASON_HANDSHAKE_TIMEOUT:
+		return STATION_WRONG_PASSWORD;
+	default:
+		return STATION_CONNECT_FAIL;
+	}
+}
+
+static void ICACHE_FLASH_ATTR wifi_event_cb(System_Event_t *evt)
+{
+	struct ip_info ipConfig;
+	uint8_t status;
+
+	switch (evt->event) {
+	case EVENT_STAMODE_CONNECTED:
+		os_memcpy(linkBssid, evt->event_info.connected.bssid, sizeof linkBssid);
+		linkChannel = evt->event_info.connected.channel;
+		INFO("WIFI: associated on channel %d\r\n", linkChannel);
+		os_timer_disarm(&WiFiLinker);
+		// a reused lease has no DHCP round to wait for
+		if (fastLinkValid && wifi_get_ip_info(STATION_IF, &ipConfig) && ipConfig.ip.addr != 0)
+			wifi_set_status(STATION_GOT_IP);
+		else
+			wifi_set_status(STATION_CONNECTING);
+		break;
+	case EVENT_STAMODE_GOT_IP:
+		INFO("WIFI: got ip " IPSTR "\r\n", IP2STR(&evt->event_info.got_ip.ip));
+		wifi_set_status(STATION_GOT_IP);
+		// a lost link comes back to the same AP first
+		candidateNext = candidateActive;
+		weakCount = 0;
+		os_timer_disarm(&roamTimer);
+		if (roamRssi)
+			os_timer_arm(&roamTimer, WIFI_ROAM_CHECK_MS, 1);
+		break;
+	case EVENT_STAMODE_DISCONNECTED:
+		status = wifi_reason_status(evt->event_info.disconnected.reason);
+		INFO("WIFI: disconnected, reason %d\r\n", evt->event_info.disconnected.reason);
+		if (roaming)
+			METRIC_INC(METRIC_WIFI_ROAMS);
+		else if (evt->event_info.disconnected.reason == REASON_BEACON_TIMEOUT)
+			METRIC_INC(METRIC_WIFI_BEACON);
+		else if (status == STATION_NO_AP_FOUND)
+			METRIC_INC(METRIC_WIFI_NO_AP);
+		else if (status == STATION_WRONG_PASSWORD)
+			METRIC_INC(METRIC_WIFI_AUTH);
+		else
+			METRIC_INC(METRIC_WIFI_OTHER);
+		linkChannel = 0;
+		wifi_set_status(status);
+		os_timer_disarm(&roamTimer);
+		os_timer_disarm(&WiFiLinker);
+		os_timer_setfn(&WiFiLinker, (os_timer_func_t *)wifi_retry, NULL);
+		os_timer_arm(&WiFiLinker, roaming ? 1 : WIFI_RETRY_MS, 0);
+		break;
+	case EVENT_STAMODE_AUTHMODE_CHANGE:
+		// the SDK drops the association when the AP weakens its security, that arrives as a disconnect
+		INFO("WIFI: auth mode %d -> %d\r\n", evt->event_info.auth_change.old_mode,
+				evt->event_info.auth_change.new_mode);
+		break;
+	case EVENT_STAMODE_DHCP_TIMEOUT:
+		INFO("WIFI: DHCP timeout\r\n");
+		wifi_set_status(STATION_CONNECT_FAIL);
+		wifi_station_disconnect();
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+  * @brief  Reuse a known AP and lease on the next WIFI_Connect, skipping the
+  *         scan and DHCP. Falls back to a normal connect if the AP is gone.
+  * @param  net:     network the AP belongs to, as WIFI_GetLink reported it
+  * @param  bssid:   AP to pin
+  * @param  channel: channel the AP was on
+  * @param  ip:      address, netmask and gateway of the previous lease
+  * @retval None
+  */
+void ICACHE_FLASH_ATTR WIFI_SetFastLink(uint8_t net, const uint8_t *bssid, uint8_t channel, const struct ip_info *ip)
+{
+	fastLinkNet = net;
+	os_memcpy(fastLinkBssid, bssid, sizeof fastLinkBssid);
+	fastLinkChannel = channel;
+	fastLinkIp = *ip;
+	fastLinkValid = channel != 0 && ip->ip.addr != 0;
+}
+
+/**
+  * @brief  Report the network, AP and lease of the current connection
+  * @retval TRUE if associated and an address is assigned
+  */
+BOOL ICACHE_FLASH_ATTR WIFI_GetLink(uint8_t *net, uint8_t *bssid, uint8_t *channel, struct ip_info *ip)
+{
+	if (wifiStatus != STATION_GOT_IP || linkChannel == 0)
+		return FALSE;
+	*net = linkNet;
+	os_memcpy(bssid, linkBssid, sizeof linkBssid);
+	*channel = linkChannel;
+	return wifi_get_ip_info(STATION_IF, ip);
+}
+
+/**
+  * @brief  Add a network to look for besides the one given to WIFI_Connect
+  * @param  ssid: network name, has to stay valid
+  * @param  pass: its password, has to stay valid
+  * @retval FALSE if WIFI_MAX_NETS are known already
+  */
+BOOL ICACHE_FLASH_ATTR WIFI_AddNetwork(const uint8_t *ssid, const uint8_t *pass)
+{
+	if (netCount >= WIFI_MAX_NETS)
+		return FALSE;
+	netSsid[netCount] = ssid;
+	netPass[netCount] = pass;
+	netCount++;
+	return TRUE;
+}
+
+/**
+  * @brief  Look for a stronger AP once the link stays below a level
+  * @param  rssi: dBm, 0 disables roaming
+  * @retval None
+  */
+void ICACHE_FLASH_ATTR WIFI_SetRoaming(sint8 rssi)
+{
+	roamRssi = rssi;
+	weakCount = 0;
+	os_timer_disarm(&roamTimer);
+	if (roamRssi && wifiStatus == STATION_GOT_IP)
+		os_timer_arm(&roamTimer, WIFI_ROAM_CHECK_MS, 1);
+}
+
+/**
+  * @brief  Join the strongest AP of the known networks, or the cached fast link
+  * @param  ssid: primary network, has to stay valid
+  * @param  pass: its password, has to stay valid
+  * @param  cb:   called with the STATION_* status whenever it changes
+  * @retval None
+  */
 void ICACHE_FLASH_ATTR WIFI_Connect(uint8_t* ssid, uint8_t* pass, WifiCallback cb)
 {
 	struct station_config stationConf;
 
 	INFO("WIFI_INIT\r\n");
 	wifi_set_opmode(STATION_MODE);
-	wifi_station_set_auto_connect(FALSE);
+	// persisted by the SDK, only write it when it differs
+	if (wifi_station_get_auto_connect())
+		wifi_station_set_auto_connect(FALSE);
+	wifi_set_event_handler_cb(wifi_event_cb);
 	wifiCb = cb;
+	netSsid[0] = ssid;
+	netPass[0] = pass;
 
-	os_memset(&stationConf, 0, sizeof(struct station_config));
+	os_timer_disarm(&roamTimer);
+	os_timer_setfn(&roamTimer, (os_timer_func_t *)wifi_roam_check, NULL);
+	os_timer_disarm(&WiFiLinker);
+	wifiStatus = STATION_IDLE;
 
-	os_sprintf(stationConf.ssid, "%s", ssid);
-	os_sprintf(stationConf.password, "%s", pass);
+	// networks are added before this, one that is gone since can not be joined
+	if (fastLinkNet >= netCount)
+		fastLinkValid = FALSE;
+	if (!fastLinkValid) {
+		// scans only work once the SDK is up, which is after user_init
+		os_timer_setfn(&WiFiLinker, (os_timer_func_t *)wifi_retry, NULL);
+		os_timer_arm(&WiFiLinker, 100, 0);
+		return;
+	}
 
-	wifi_station_set_config(&stationConf);
+	os_memset(&stationConf, 0, sizeof(struct station_config));
 
-	os_timer_disarm(&WiFiLinker);
-	os_timer_setfn(&WiFiLinker, (os_timer_func_t *)wifi_check_ip, NULL);
-	os_timer_arm(&WiFiLinker, 1000, 0);
+	os_sprintf(stationConf.ssid, "%s", netSsid[fastLinkNet]);
+	os_sprintf(stationConf.password, "%s", netPass[fastLinkNet]);
+	linkNet = fastLinkNet;
+	stationConf.bssid_set = 1;
+	os_memcpy(stationConf.bssid, fastLinkBssid, sizeof fastLinkBssid);
+	wifi_set_channel(fastLinkChannel);
+	wifi_station_dhcpc_stop();
+	wifi_set_ip_info(STATION_IF, &fastLinkIp);
 
-	wifi_station_set_auto_connect(TRUE);
+	// _current keeps the per-wake join off the SDK's flash sectors
+	wifi_station_set_config_current(&stationConf);
 	wifi_station_connect();
 }
 
@@ -61,6 +61,23 @@ typedef struct mqtt_state_t
   int pending_publish_qos;
 } mqtt_state_t;
 
+#define MQTT_STAMPS		8		/* sample publishes followed through the queue at once */
+
+typedef struct {
+	uint32_t seq;			/* the queue's puts count when it went in */
+	uint32_t captured;		/* system_get_time() of the reading */
+} mqtt_stamp_t;
+
+/* Capture times of sample publishes on their way to the broker, 0 for none */
+typedef struct {
+	uint32_t next;			/* for the next MQTT_Publish */
+	mqtt_stamp_t queued[MQTT_STAMPS];
+	uint8_t count;
+	uint32_t sending;		/* the packet espconn has not confirmed yet */
+	uint32_t acking;		/* the QoS 1 publish awaiting PUBACK ackId */
+	uint16_t ackId;
+} mqtt_stamps_t;
+
 typedef enum {
 	WIFI_INIT,
 	WIFI_CONNECTING,
@@ -96,13 +113,16 @@ typedef struct  {
 	MqttCallback connectedCb;
 	MqttCallback disconnectedCb;
 	MqttCallback publishedCb;
+	MqttCallback ackedCb;
 	MqttDataCallback dataCb;
 	ETSTimer mqttTimer;
 	uint32_t keepAliveTick;
 	uint32_t reconnectTick;
 	uint32_t sendTimeout;
+	uint32_t connectTime;	/* system_get_time() the DNS lookup or TCP connect started */
 	tConnState connState;
 	QUEUE msgQueue;
+	mqtt_stamps_t stamps;
 	void* user_data;
 } MQTT_Client;
 
@@ -129,10 +149,15 @@ void ICACHE_FLASH_ATTR MQTT_InitLWT(MQTT_Client *mqttClient, uint8_t* will_topic
 void ICACHE_FLASH_ATTR MQTT_OnConnected(MQTT_Client *mqttClient, MqttCallback connectedCb);
 void ICACHE_FLASH_ATTR MQTT_OnDisconnected(MQTT_Client *mqttClient, MqttCallback disconnectedCb);
 void ICACHE_FLASH_ATTR MQTT_OnPublished(MQTT_Client *mqttClient, MqttCallback publishedCb);
+void ICACHE_FLASH_ATTR MQTT_OnAcked(MQTT_Client *mqttClient, MqttCallback ackedCb);
 void ICACHE_FLASH_ATTR MQTT_OnData(MQTT_Client *mqttClient, MqttDataCallback dataCb);
 BOOL ICACHE_FLASH_ATTR MQTT_Subscribe(MQTT_Client *client, char* topic, uint8_t qos);
+BOOL ICACHE_FLASH_ATTR MQTT_UnSubscribe(MQTT_Client *client, char* topic);
 void ICACHE_FLASH_ATTR MQTT_Connect(MQTT_Client *mqttClient);
 void ICACHE_FLASH_ATTR MQTT_Disconnect(MQTT_Client *mqttClient);
 BOOL ICACHE_FLASH_ATTR MQTT_Publish(MQTT_Client *client, const char* topic, const char* data, int data_length, int qos, int retain);
+void ICACHE_FLASH_ATTR MQTT_Stamp(MQTT_Client *client, uint32_t captured);
+BOOL ICACHE_FLASH_ATTR MQTT_Idle(MQTT_Client *client);
+uint32_t ICACHE_FLASH_ATTR MQTT_KeepaliveDue(MQTT_Client *client);
 
 #endif /* USER_AT_MQTT_H_ */
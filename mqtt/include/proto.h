@@ -19,6 +19,7 @@ typedef struct{
 	U16 dataLen;
 	U8 isEsc;
 	U8 isBegin;
+	U8 isOverflow;		/* part of the current frame did not fit in buf */
 	PROTO_PARSE_CALLBACK* callback;
 }PROTO_PARSER;
 
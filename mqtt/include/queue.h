@@ -35,6 +35,8 @@
 typedef struct {
 	uint8_t *buf;
 	RINGBUF rb;
+	uint32_t puts;		/* messages in and out so far, the nth message in is the nth out */
+	uint32_t gets;
 } QUEUE;
 
 void ICACHE_FLASH_ATTR QUEUE_Init(QUEUE *queue, int bufferSize);
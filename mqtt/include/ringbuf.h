@@ -5,15 +5,23 @@
 #include <stdlib.h>
 #include "typedef.h"
 
+/* Single producer / single consumer ring buffer. The producer only ever
+ * moves head and the consumer only ever moves tail, so one interrupt
+ * writer and one task reader can share a buffer without locking. */
 typedef struct{
 	U8* p_o;				/**< Original pointer */
-	U8* volatile p_r;		/**< Read pointer */
-	U8* volatile p_w;		/**< Write pointer */
-	volatile I32 fill_cnt;	/**< Number of filled slots */
-	I32 size;				/**< Buffer size */
+	volatile U32 head;		/**< Write index, owned by the producer */
+	volatile U32 tail;		/**< Read index, owned by the consumer */
+	U32 size;				/**< Buffer size */
+	U32 mask;				/**< size - 1 when size is a power of two, otherwise 0 */
 }RINGBUF;
 
 I16 ICACHE_FLASH_ATTR RINGBUF_Init(RINGBUF *r, U8* buf, I32 size);
-I16 ICACHE_FLASH_ATTR RINGBUF_Put(RINGBUF *r, U8 c);
+I16 RINGBUF_Put(RINGBUF *r, U8 c);
 I16 ICACHE_FLASH_ATTR RINGBUF_Get(RINGBUF *r, U8* c);
+I32 RINGBUF_Write(RINGBUF *r, const U8* data, I32 len);
+I32 ICACHE_FLASH_ATTR RINGBUF_Read(RINGBUF *r, U8* data, I32 len);
+I32 ICACHE_FLASH_ATTR RINGBUF_Peek(RINGBUF *r, U8* data, I32 len);
+I32 RINGBUF_Count(RINGBUF *r);
+I32 RINGBUF_Free(RINGBUF *r);
 #endif
@@ -6,4 +6,6 @@
 uint32_t ICACHE_FLASH_ATTR UTILS_Atoh(const int8_t *s);
 uint8_t ICACHE_FLASH_ATTR UTILS_StrToIP(const int8_t* str, void *ip);
 uint8_t ICACHE_FLASH_ATTR UTILS_IsIPV4 (int8_t *str);
+int ICACHE_FLASH_ATTR UTILS_FormatTenths(char *buf, int32_t value);
+uint32_t ICACHE_FLASH_ATTR UTILS_Crc32(uint32_t crc, const void *data, uint32_t len);
 #endif
@@ -39,6 +39,7 @@
 #include "user_config.h"
 #include "mqtt.h"
 #include "queue.h"
+#include "metrics.h"
 
 #define MQTT_TASK_PRIO        		0
 #define MQTT_TASK_QUEUE_SIZE    	1
@@ -65,6 +66,7 @@ mqtt_dns_found(const char *name, ip_addr_t *ipaddr, void *arg)
 	if(ipaddr == NULL)
 	{
 		INFO("DNS: Found, but got no ip, try to reconnect\r\n");
+		METRIC_INC(METRIC_DNS_FAIL);
 		client->connState = TCP_RECONNECT_REQ;
 		return;
 	}
@@ -77,6 +79,8 @@ mqtt_dns_found(const char *name, ip_addr_t *ipaddr, void *arg)
 
 	if(client->ip.addr == 0 && ipaddr->addr != 0)
 	{
+		METRIC_SET(METRIC_DNS_MS, (system_get_time() - client->connectTime) / 1000);
+		client->connectTime = system_get_time();
 		os_memcpy(client->pCon->proto.tcp->remote_ip, &ipaddr->addr, 4);
 		if(client->security){
 			espconn_secure_connect(client->pCon);
@@ -88,6 +92,8 @@ mqtt_dns_found(const char *name, ip_addr_t *ipaddr, void *arg)
 		client->connState = TCP_CONNECTING;
 		INFO("TCP: connecting...\r\n");
 	}
+	// remember the answer, reconnects go straight to this address
+	client->ip.addr = ipaddr->addr;
 
 	system_os_post(MQTT_TASK_PRIO, 0, (os_param_t)client);
 }
@@ -110,6 +116,35 @@ deliver_publish(MQTT_Client* client, uint8_t* message, int length)
 }
 
 
+/* The capture time of queued message seq if it is a sample, stale stamps of dropped messages go too */
+LOCAL uint32_t ICACHE_FLASH_ATTR
+mqtt_stamp_take(mqtt_stamps_t *stamps, uint32_t seq)
+{
+	uint32_t captured = 0;
+	uint8_t n = 0;
+
+	while(n < stamps->count && (int32_t)(stamps->queued[n].seq - seq) < 0)
+		n++;
+	if(n < stamps->count && stamps->queued[n].seq == seq)
+		captured = stamps->queued[n++].captured;
+	stamps->count -= n;
+	os_memmove(stamps->queued, stamps->queued + n, stamps->count * sizeof(mqtt_stamp_t));
+	return captured;
+}
+
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_send(MQTT_Client *client, uint8_t *data, uint16_t len)
+{
+	METRIC_ADD(METRIC_TX_BYTES, len);
+	METRIC_INC(METRIC_TX_PACKETS);
+	if(client->security){
+		espconn_secure_sent(client->pCon, data, len);
+	}
+	else{
+		espconn_sent(client->pCon, data, len);
+	}
+}
+
 /**
   * @brief  Client received callback function.
   * @param  arg: contain the ip link information
@@ -127,9 +162,13 @@ mqtt_tcpclient_recv(void *arg, char *pdata, unsigned short len)
 	struct espconn *pCon = (struct espconn*)arg;
 	MQTT_Client *client = (MQTT_Client *)pCon->reverse;
 
+	METRIC_ADD(METRIC_RX_BYTES, len);
+	// the SDK's receive buffers are still held, the heap is as low as it gets
+	METRICS_Heap();
 READPACKET:
 	INFO("TCP: data received %d bytes\r\n", len);
 	if(len < MQTT_BUF_SIZE && len > 0){
+		METRIC_INC(METRIC_RX_PACKETS);
 		os_memcpy(client->mqtt_state.in_buffer, pdata, len);
 
 		msg_type = mqtt_get_type(client->mqtt_state.in_buffer);
@@ -179,6 +218,7 @@ READPACKET:
 				if(msg_qos == 1 || msg_qos == 2){
 					INFO("MQTT: Queue response QoS: %d\r\n", msg_qos);
 					if(QUEUE_Puts(&client->msgQueue, client->mqtt_state.outbound_message->data, client->mqtt_state.outbound_message->length) == -1){
+						METRIC_INC(METRIC_QUEUE_DROPS);
 						INFO("MQTT: Queue full\r\n");
 					}
 				}
@@ -186,31 +226,42 @@ READPACKET:
 				deliver_publish(client, client->mqtt_state.in_buffer, client->mqtt_state.message_length_read);
 				break;
 			  case MQTT_MSG_TYPE_PUBACK:
+				if(client->stamps.acking && client->stamps.ackId == msg_id){
+				  METRICS_Latency(LATENCY_ACKED, client->stamps.acking);
+				  client->stamps.acking = 0;
+				}
 				if(client->mqtt_state.pending_msg_type == MQTT_MSG_TYPE_PUBLISH && client->mqtt_state.pending_msg_id == msg_id){
 				  INFO("MQTT: received MQTT_MSG_TYPE_PUBACK, finish QoS1 publish\r\n");
+				  if(client->ackedCb)
+					client->ackedCb((uint32_t*)client);
 				}
 
 				break;
 			  case MQTT_MSG_TYPE_PUBREC:
 				  client->mqtt_state.outbound_message = mqtt_msg_pubrel(&client->mqtt_state.mqtt_connection, msg_id);
 				  if(QUEUE_Puts(&client->msgQueue, client->mqtt_state.outbound_message->data, client->mqtt_state.outbound_message->length) == -1){
+				  	METRIC_INC(METRIC_QUEUE_DROPS);
 				  	INFO("MQTT: Queue full\r\n");
 				  }
 				break;
 			  case MQTT_MSG_TYPE_PUBREL:
 				  client->mqtt_state.outbound_message = mqtt_msg_pubcomp(&client->mqtt_state.mqtt_connection, msg_id);
 				  if(QUEUE_Puts(&client->msgQueue, client->mqtt_state.outbound_message->data, client->mqtt_state.outbound_message->length) == -1){
+					METRIC_INC(METRIC_QUEUE_DROPS);
 					INFO("MQTT: Queue full\r\n");
 				  }
 				break;
 			  case MQTT_MSG_TYPE_PUBCOMP:
 				if(client->mqtt_state.pending_msg_type == MQTT_MSG_TYPE_PUBLISH && client->mqtt_state.pending_msg_id == msg_id){
 				  INFO("MQTT: receive MQTT_MSG_TYPE_PUBCOMP, finish QoS2 publish\r\n");
+				  if(client->ackedCb)
+					client->ackedCb((uint32_t*)client);
 				}
 				break;
 			  case MQTT_MSG_TYPE_PINGREQ:
 				  client->mqtt_state.outbound_message = mqtt_msg_pingresp(&client->mqtt_state.mqtt_connection);
 				  if(QUEUE_Puts(&client->msgQueue, client->mqtt_state.outbound_message->data, client->mqtt_state.outbound_message->length) == -1){
+					METRIC_INC(METRIC_QUEUE_DROPS);
 					INFO("MQTT: Queue full\r\n");
 				  }
 				break;
@@ -257,6 +308,10 @@ mqtt_tcpclient_sent_cb(void *arg)
 	MQTT_Client* client = (MQTT_Client *)pCon->reverse;
 	INFO("TCP: Sent\r\n");
 	client->sendTimeout = 0;
+	if(client->stamps.sending){
+		METRICS_Latency(LATENCY_SENT, client->stamps.sending);
+		client->stamps.sending = 0;
+	}
 	if(client->connState == MQTT_DATA && client->mqtt_state.pending_msg_type == MQTT_MSG_TYPE_PUBLISH){
 		if(client->publishedCb)
 			client->publishedCb((uint32_t*)client);
@@ -281,12 +336,7 @@ void ICACHE_FLASH_ATTR mqtt_timer(void *arg)
 
 			client->sendTimeout = MQTT_SEND_TIMOUT;
 			INFO("MQTT: Sending, type: %d, id: %04X\r\n",client->mqtt_state.pending_msg_type, client->mqtt_state.pending_msg_id);
-			if(client->security){
-				espconn_secure_sent(client->pCon, client->mqtt_state.outbound_message->data, client->mqtt_state.outbound_message->length);
-			}
-			else{
-				espconn_sent(client->pCon, client->mqtt_state.outbound_message->data, client->mqtt_state.outbound_message->length);
-			}
+			mqtt_send(client, client->mqtt_state.outbound_message->data, client->mqtt_state.outbound_message->length);
 
 			client->mqtt_state.outbound_message = NULL;
 
@@ -313,6 +363,7 @@ mqtt_tcpclient_discon_cb(void *arg)
 	struct espconn *pespconn = (struct espconn *)arg;
 	MQTT_Client* client = (MQTT_Client *)pespconn->reverse;
 	INFO("TCP: Disconnected callback\r\n");
+	METRIC_INC(METRIC_TCP_CLOSED);
 	client->connState = TCP_RECONNECT_REQ;
 	if(client->disconnectedCb)
 		client->disconnectedCb((uint32_t*)client);
@@ -333,6 +384,7 @@ mqtt_tcpclient_connect_cb(void *arg)
 	struct espconn *pCon = (struct espconn *)arg;
 	MQTT_Client* client = (MQTT_Client *)pCon->reverse;
 
+	METRIC_SET(METRIC_TCP_MS, (system_get_time() - client->connectTime) / 1000);
 	espconn_regist_disconcb(client->pCon, mqtt_tcpclient_discon_cb);
 	espconn_regist_recvcb(client->pCon, mqtt_tcpclient_recv);////////
 	espconn_regist_sentcb(client->pCon, mqtt_tcpclient_sent_cb);///////
@@ -346,12 +398,7 @@ mqtt_tcpclient_connect_cb(void *arg)
 
 	client->sendTimeout = MQTT_SEND_TIMOUT;
 	INFO("MQTT: Sending, type: %d, id: %04X\r\n",client->mqtt_state.pending_msg_type, client->mqtt_state.pending_msg_id);
-	if(client->security){
-		espconn_secure_sent(client->pCon, client->mqtt_state.outbound_message->data, client->mqtt_state.outbound_message->length);
-	}
-	else{
-		espconn_sent(client->pCon, client->mqtt_state.outbound_message->data, client->mqtt_state.outbound_message->length);
-	}
+	mqtt_send(client, client->mqtt_state.outbound_message->data, client->mqtt_state.outbound_message->length);
 
 	client->mqtt_state.outbound_message = NULL;
 	client->connState = MQTT_CONNECT_SENDING;
@@ -370,7 +417,23 @@ mqtt_tcpclient_recon_cb(void *arg, sint8 errType)
 	MQTT_Client* client = (MQTT_Client *)pCon->reverse;
 
 	INFO("TCP: Reconnect to %s:%d\r\n", client->host, client->port);
+	switch(errType){
+	case ESPCONN_TIMEOUT:
+		METRIC_INC(METRIC_TCP_TIMEOUT);
+		break;
+	case ESPCONN_RST:
+		METRIC_INC(METRIC_TCP_RESET);
+		break;
+	case ESPCONN_ABRT:
+		METRIC_INC(METRIC_TCP_ABORT);
+		break;
+	default:
+		METRIC_INC(METRIC_TCP_ERROR);
+		break;
+	}
 
+	// the cached broker address may be stale, resolve again next time
+	client->ip.addr = 0;
 	client->connState = TCP_RECONNECT_REQ;
 
 	system_os_post(MQTT_TASK_PRIO, 0, (os_param_t)client);
@@ -392,26 +455,51 @@ MQTT_Publish(MQTT_Client *client, const char* topic, const char* data, int data_
 {
 	uint8_t dataBuffer[MQTT_BUF_SIZE];
 	uint16_t dataLen;
+	uint32_t captured = client->stamps.next;
+
+	client->stamps.next = 0;
 	client->mqtt_state.outbound_message = mqtt_msg_publish(&client->mqtt_state.mqtt_connection,
 										 topic, data, data_length,
 										 qos, retain,
 										 &client->mqtt_state.pending_msg_id);
 	if(client->mqtt_state.outbound_message->length == 0){
 		INFO("MQTT: Queuing publish failed\r\n");
+		METRIC_INC(METRIC_QUEUE_DROPS);
 		return FALSE;
 	}
-	INFO("MQTT: queuing publish, length: %d, queue size(%d/%d)\r\n", client->mqtt_state.outbound_message->length, client->msgQueue.rb.fill_cnt, client->msgQueue.rb.size);
+	INFO("MQTT: queuing publish, length: %d, queue size(%d/%d)\r\n", client->mqtt_state.outbound_message->length, RINGBUF_Count(&client->msgQueue.rb), client->msgQueue.rb.size);
 	while(QUEUE_Puts(&client->msgQueue, client->mqtt_state.outbound_message->data, client->mqtt_state.outbound_message->length) == -1){
+		METRIC_INC(METRIC_QUEUE_DROPS);
 		INFO("MQTT: Queue full\r\n");
 		if(QUEUE_Gets(&client->msgQueue, dataBuffer, &dataLen, MQTT_BUF_SIZE) == -1) {
 			INFO("MQTT: Serious buffer error\r\n");
 			return FALSE;
 		}
 	}
+	if(captured){
+		METRICS_Latency(LATENCY_QUEUED, captured);
+		// the oldest stamp goes unmeasured rather than the newest
+		if(client->stamps.count == MQTT_STAMPS)
+			mqtt_stamp_take(&client->stamps, client->stamps.queued[0].seq);
+		client->stamps.queued[client->stamps.count].seq = client->msgQueue.puts - 1;
+		client->stamps.queued[client->stamps.count++].captured = captured;
+	}
 	system_os_post(MQTT_TASK_PRIO, 0, (os_param_t)client);
 	return TRUE;
 }
 
+/**
+  * @brief  Tag the next publish as a sample, its way to the broker is timed
+  * @param  client: 	MQTT_Client reference
+  * @param  captured:	system_get_time() when the reading was taken
+  * @retval None
+  */
+void ICACHE_FLASH_ATTR
+MQTT_Stamp(MQTT_Client *client, uint32_t captured)
+{
+	client->stamps.next = captured;
+}
+
 /**
   * @brief  MQTT subscibe function.
   * @param  client: 	MQTT_Client reference
@@ -430,6 +518,35 @@ MQTT_Subscribe(MQTT_Client *client, char* topic, uint8_t qos)
 											&client->mqtt_state.pending_msg_id);
 	INFO("MQTT: queue subscribe, topic\"%s\", id: %d\r\n",topic, client->mqtt_state.pending_msg_id);
 	while(QUEUE_Puts(&client->msgQueue, client->mqtt_state.outbound_message->data, client->mqtt_state.outbound_message->length) == -1){
+		METRIC_INC(METRIC_QUEUE_DROPS);
+		INFO("MQTT: Queue full\r\n");
+		if(QUEUE_Gets(&client->msgQueue, dataBuffer, &dataLen, MQTT_BUF_SIZE) == -1) {
+			INFO("MQTT: Serious buffer error\r\n");
+			return FALSE;
+		}
+	}
+	system_os_post(MQTT_TASK_PRIO, 0, (os_param_t)client);
+	return TRUE;
+}
+
+/**
+  * @brief  MQTT unsubscribe function.
+  * @param  client: 	MQTT_Client reference
+  * @param  topic: 		string topic to stop receiving
+  * @retval TRUE if success queue
+  */
+BOOL ICACHE_FLASH_ATTR
+MQTT_UnSubscribe(MQTT_Client *client, char* topic)
+{
+	uint8_t dataBuffer[MQTT_BUF_SIZE];
+	uint16_t dataLen;
+
+	client->mqtt_state.outbound_message = mqtt_msg_unsubscribe(&client->mqtt_state.mqtt_connection,
+											topic,
+											&client->mqtt_state.pending_msg_id);
+	INFO("MQTT: queue unsubscribe, topic\"%s\", id: %d\r\n",topic, client->mqtt_state.pending_msg_id);
+	while(QUEUE_Puts(&client->msgQueue, client->mqtt_state.outbound_message->data, client->mqtt_state.outbound_message->length) == -1){
+		METRIC_INC(METRIC_QUEUE_DROPS);
 		INFO("MQTT: Queue full\r\n");
 		if(QUEUE_Gets(&client->msgQueue, dataBuffer, &dataLen, MQTT_BUF_SIZE) == -1) {
 			INFO("MQTT: Serious buffer error\r\n");
@@ -448,6 +565,9 @@ MQTT_Task(os_event_t *e)
 	uint16_t dataLen;
 	if(e->par == 0)
 		return;
+	// every enqueue posts here, so the depth is seen at its highest
+	METRIC_SET(METRIC_QUEUE_BYTES, RINGBUF_Count(&client->msgQueue.rb));
+	METRIC_MAX(METRIC_QUEUE_MAX, metrics[METRIC_QUEUE_BYTES]);
 	switch(client->connState){
 
 	case TCP_RECONNECT_REQ:
@@ -464,18 +584,23 @@ MQTT_Task(os_event_t *e)
 		if(QUEUE_Gets(&client->msgQueue, dataBuffer, &dataLen, MQTT_BUF_SIZE) == 0){
 			client->mqtt_state.pending_msg_type = mqtt_get_type(dataBuffer);
 			client->mqtt_state.pending_msg_id = mqtt_get_id(dataBuffer, dataLen);
+			client->stamps.sending = mqtt_stamp_take(&client->stamps, client->msgQueue.gets - 1);
+			if(client->stamps.sending){
+				METRICS_Latency(LATENCY_SENDING, client->stamps.sending);
+				if(mqtt_get_qos(dataBuffer) == 1){
+					client->stamps.acking = client->stamps.sending;
+					client->stamps.ackId = client->mqtt_state.pending_msg_id;
+				}
+			}
 
 
 			client->sendTimeout = MQTT_SEND_TIMOUT;
 			INFO("MQTT: Sending, type: %d, id: %04X\r\n",client->mqtt_state.pending_msg_type, client->mqtt_state.pending_msg_id);
-			if(client->security){
-				espconn_secure_sent(client->pCon, dataBuffer, dataLen);
-			}
-			else{
-				espconn_sent(client->pCon, dataBuffer, dataLen);
-			}
+			mqtt_send(client, dataBuffer, dataLen);
 
 			client->mqtt_state.outbound_message = NULL;
+			// any packet restarts the broker's keepalive timer, not only a ping
+			client->keepAliveTick = 0;
 			break;
 		}
 		break;
@@ -599,6 +724,10 @@ MQTT_Connect(MQTT_Client *mqttClient)
 	os_timer_setfn(&mqttClient->mqttTimer, (os_timer_func_t *)mqtt_timer, mqttClient);
 	os_timer_arm(&mqttClient->mqttTimer, 1000, 1);
 
+	mqttClient->connectTime = system_get_time();
+	// what was on the wire went down with the connection
+	mqttClient->stamps.sending = 0;
+	mqttClient->stamps.acking = 0;
 	if(UTILS_StrToIP(mqttClient->host, &mqttClient->pCon->proto.tcp->remote_ip)) {
 		INFO("TCP: Connect to ip  %s:%d\r\n", mqttClient->host, mqttClient->port);
 		if(mqttClient->security){
@@ -608,6 +737,16 @@ MQTT_Connect(MQTT_Client *mqttClient)
 			espconn_connect(mqttClient->pCon);
 		}
 	}
+	else if(mqttClient->ip.addr != 0) {
+		INFO("TCP: Connect to cached ip " IPSTR " for %s:%d\r\n", IP2STR(&mqttClient->ip), mqttClient->host, mqttClient->port);
+		os_memcpy(mqttClient->pCon->proto.tcp->remote_ip, &mqttClient->ip.addr, 4);
+		if(mqttClient->security){
+			espconn_secure_connect(mqttClient->pCon);
+		}
+		else {
+			espconn_connect(mqttClient->pCon);
+		}
+	}
 	else {
 		INFO("TCP: Connect to domain %s:%d\r\n", mqttClient->host, mqttClient->port);
 		espconn_gethostbyname(mqttClient->pCon, mqttClient->host, &mqttClient->ip, mqtt_dns_found);
@@ -651,3 +790,33 @@ MQTT_OnPublished(MQTT_Client *mqttClient, MqttCallback publishedCb)
 {
 	mqttClient->publishedCb = publishedCb;
 }
+
+/**
+  * @brief  Whether the client is connected with nothing queued or in flight
+  * @param  client: MQTT_Client reference
+  * @retval TRUE when the radio is not needed until the next ping
+  */
+BOOL ICACHE_FLASH_ATTR
+MQTT_Idle(MQTT_Client *client)
+{
+	return client->connState == MQTT_DATA && client->sendTimeout == 0 && QUEUE_IsEmpty(&client->msgQueue);
+}
+
+/**
+  * @brief  Time until mqtt_timer sends the next keepalive packet
+  * @param  client: MQTT_Client reference
+  * @retval seconds, 0 when not connected
+  */
+uint32_t ICACHE_FLASH_ATTR
+MQTT_KeepaliveDue(MQTT_Client *client)
+{
+	if (client->connState != MQTT_DATA || client->keepAliveTick > client->mqtt_state.connect_info->keepalive)
+		return 0;
+	return client->mqtt_state.connect_info->keepalive + 1 - client->keepAliveTick;
+}
+
+void ICACHE_FLASH_ATTR
+MQTT_OnAcked(MQTT_Client *mqttClient, MqttCallback ackedCb)
+{
+	mqttClient->ackedCb = ackedCb;
+}
@@ -7,6 +7,8 @@ I8 ICACHE_FLASH_ATTR PROTO_Init(PROTO_PARSER *parser, PROTO_PARSE_CALLBACK *comp
     parser->dataLen = 0;
     parser->callback = completeCallback;
     parser->isEsc = 0;
+    parser->isBegin = 0;
+    parser->isOverflow = 0;
     return 0;
 }
 
@@ -21,6 +23,7 @@ I8 ICACHE_FLASH_ATTR PROTO_ParseByte(PROTO_PARSER *parser, U8 value)
 			parser->dataLen = 0;
 			parser->isEsc = 0;
 			parser->isBegin = 1;
+			parser->isOverflow = 0;
 			break;
 		
 		case 0x7F:
@@ -40,6 +43,8 @@ I8 ICACHE_FLASH_ATTR PROTO_ParseByte(PROTO_PARSER *parser, U8 value)
 				
 			if(parser->dataLen < parser->bufSize)
 				parser->buf[parser->dataLen++] = value;
+			else
+				parser->isOverflow = 1;
 				
 			break;
 	}
@@ -106,24 +111,33 @@ I16 ICACHE_FLASH_ATTR PROTO_Add(U8 *buf, const U8 *packet, I16 bufSize)
 I16 ICACHE_FLASH_ATTR PROTO_AddRb(RINGBUF *rb, const U8 *packet, I16 len)
 {
     U16 i = 2;
-    if(RINGBUF_Put(rb, 0x7E) == -1) return -1;
-    while (len--) {
-        switch (*packet) {
-        case 0x7D:
-        case 0x7E:
-        case 0x7F:
-        	if(RINGBUF_Put(rb, 0x7D) == -1) return -1;
-        	if(RINGBUF_Put(rb, *packet++ ^ 0x20) == -1) return -1;
-            i += 2;
-            break;
-        default:
-        	if(RINGBUF_Put(rb, *packet++) == -1) return -1;
-            i++;
-            break;
+    I16 n;
+    const U8 *run;
+    U8 esc[2];
+
+    // size the escaped frame first so a full buffer never gets half a frame
+    for (n = 0; n < len; n++)
+        i += (packet[n] == 0x7D || packet[n] == 0x7E || packet[n] == 0x7F) ? 2 : 1;
+    if (RINGBUF_Free(rb) < i) return -1;
+
+    RINGBUF_Put(rb, 0x7E);
+    while (len > 0) {
+        // copy the longest run that needs no escaping in one go
+        run = packet;
+        while (len > 0 && *packet != 0x7D && *packet != 0x7E && *packet != 0x7F) {
+            packet++;
+            len--;
+        }
+        if (packet > run)
+            RINGBUF_Write(rb, run, packet - run);
+        if (len > 0) {
+            esc[0] = 0x7D;
+            esc[1] = *packet++ ^ 0x20;
+            RINGBUF_Write(rb, esc, 2);
+            len--;
         }
     }
-    if(RINGBUF_Put(rb, 0x7F) == -1) return -1;
+    RINGBUF_Put(rb, 0x7F);
 
     return i;
 }
-
@@ -38,20 +38,29 @@ void ICACHE_FLASH_ATTR QUEUE_Init(QUEUE *queue, int bufferSize)
 {
 	queue->buf = (uint8_t*)os_zalloc(bufferSize);
 	RINGBUF_Init(&queue->rb, queue->buf, bufferSize);
+	queue->puts = 0;
+	queue->gets = 0;
 }
 int32_t ICACHE_FLASH_ATTR QUEUE_Puts(QUEUE *queue, uint8_t* buffer, uint16_t len)
 {
-	return PROTO_AddRb(&queue->rb, buffer, len);
+	int32_t ret = PROTO_AddRb(&queue->rb, buffer, len);
+
+	if(ret != -1)
+		queue->puts++;
+	return ret;
 }
 int32_t ICACHE_FLASH_ATTR QUEUE_Gets(QUEUE *queue, uint8_t* buffer, uint16_t* len, uint16_t maxLen)
 {
+	int32_t ret = PROTO_ParseRb(&queue->rb, buffer, len, maxLen);
 
-	return PROTO_ParseRb(&queue->rb, buffer, len, maxLen);
+	if(ret == 0)
+		queue->gets++;
+	return ret;
 }
 
 BOOL ICACHE_FLASH_ATTR QUEUE_IsEmpty(QUEUE *queue)
 {
-	if(queue->rb.fill_cnt<=0)
+	if(RINGBUF_Count(&queue->rb) <= 0)
 		return TRUE;
 	return FALSE;
 }
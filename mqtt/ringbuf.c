@@ -1,10 +1,55 @@
 /**
 * \file
 *		Ring Buffer library
+*
+* head and tail run over [0, 2 * size) so that a full buffer and an empty one
+* can be told apart without a shared fill counter. For power of two sizes they
+* simply run free and are masked. The producer side (Put/Write) is kept out of
+* ICACHE_FLASH_ATTR so it can be called from an interrupt handler.
 */
 
+#include "osapi.h"
 #include "ringbuf.h"
 
+/* Producer and consumer share one core (task vs ISR), so only the compiler
+* and the Xtensa write buffer have to be kept from reordering. */
+#if defined(__XTENSA__)
+#define RINGBUF_BARRIER()	__asm__ __volatile__("memw" ::: "memory")
+#else
+#define RINGBUF_BARRIER()	__asm__ __volatile__("" ::: "memory")
+#endif
+
+static inline U32 rb_pos(const RINGBUF *r, U32 idx)
+{
+	if(r->mask) return idx & r->mask;
+	return idx < r->size ? idx : idx - r->size;
+}
+
+static inline U32 rb_advance(const RINGBUF *r, U32 idx, U32 n)
+{
+	idx += n;
+	if(!r->mask && idx >= 2 * r->size)
+		idx -= 2 * r->size;
+	return idx;
+}
+
+static inline U32 rb_count(const RINGBUF *r, U32 head, U32 tail)
+{
+	if(r->mask || head >= tail) return head - tail;
+	return head + 2 * r->size - tail;
+}
+
+/* copy len bytes out of the ring starting at index idx, in at most two spans */
+static inline void rb_copy_out(const RINGBUF *r, U32 idx, U8* data, U32 len)
+{
+	U32 pos = rb_pos(r, idx);
+	U32 first = r->size - pos;
+
+	if(first > len) first = len;
+	os_memcpy(data, r->p_o + pos, first);
+	if(len > first)
+		os_memcpy(data + first, r->p_o, len - first);
+}
 
 /**
 * \brief init a RINGBUF object
@@ -16,32 +61,48 @@
 I16 ICACHE_FLASH_ATTR RINGBUF_Init(RINGBUF *r, U8* buf, I32 size)
 {
 	if(r == NULL || buf == NULL || size < 2) return -1;
-	
-	r->p_o = r->p_r = r->p_w = buf;
-	r->fill_cnt = 0;
+
+	r->p_o = buf;
+	r->head = r->tail = 0;
 	r->size = size;
-	
+	r->mask = (size & (size - 1)) == 0 ? size - 1 : 0;
+
 	return 0;
 }
 /**
+* \brief number of bytes waiting to be read
+* \param r pointer to a ringbuf object
+* \return filled slots
+*/
+I32 RINGBUF_Count(RINGBUF *r)
+{
+	return rb_count(r, r->head, r->tail);
+}
+/**
+* \brief number of bytes that can still be written
+* \param r pointer to a ringbuf object
+* \return free slots
+*/
+I32 RINGBUF_Free(RINGBUF *r)
+{
+	return r->size - rb_count(r, r->head, r->tail);
+}
+/**
 * \brief put a character into ring buffer
 * \param r pointer to a ringbuf object
 * \param c character to be put
 * \return 0 if successfull, otherwise failed
 */
-I16 ICACHE_FLASH_ATTR RINGBUF_Put(RINGBUF *r, U8 c)
+I16 RINGBUF_Put(RINGBUF *r, U8 c)
 {
-	if(r->fill_cnt>=r->size)return -1;		// ring buffer is full, this should be atomic operation
-	
+	U32 head = r->head;
+
+	if(rb_count(r, head, r->tail) >= r->size) return -1;	// ring buffer is full
 
-	r->fill_cnt++;							// increase filled slots count, this should be atomic operation
+	r->p_o[rb_pos(r, head)] = c;
+	RINGBUF_BARRIER();										// data before index
+	r->head = rb_advance(r, head, 1);
 
-	
-	*r->p_w++ = c;							// put character into buffer
-	
-	if(r->p_w >= r->p_o + r->size)			// rollback if write pointer go pass
-		r->p_w = r->p_o;					// the physical boundary
-	
 	return 0;
 }
 /**
@@ -52,16 +113,78 @@ I16 ICACHE_FLASH_ATTR RINGBUF_Put(RINGBUF *r, U8 c)
 */
 I16 ICACHE_FLASH_ATTR RINGBUF_Get(RINGBUF *r, U8* c)
 {
-	if(r->fill_cnt<=0)return -1;				// ring buffer is empty, this should be atomic operation
-	
+	U32 tail = r->tail;
+
+	if(r->head == tail) return -1;							// ring buffer is empty
 
-	r->fill_cnt--;								// decrease filled slots count
+	RINGBUF_BARRIER();										// index before data
+	*c = r->p_o[rb_pos(r, tail)];
+	RINGBUF_BARRIER();
+	r->tail = rb_advance(r, tail, 1);
 
-	
-	*c = *r->p_r++;								// get the character out
-	
-	if(r->p_r >= r->p_o + r->size)				// rollback if write pointer go pass
-		r->p_r = r->p_o;						// the physical boundary
-	
 	return 0;
 }
+/**
+* \brief write as much of a block as fits into the ring buffer
+* \param r pointer to a ringbuf object
+* \param data bytes to write
+* \param len number of bytes in data
+* \return number of bytes written
+*/
+I32 RINGBUF_Write(RINGBUF *r, const U8* data, I32 len)
+{
+	U32 head = r->head;
+	U32 space = r->size - rb_count(r, head, r->tail);
+	U32 pos, first;
+
+	if(len <= 0 || space == 0) return 0;
+	if((U32)len > space) len = space;
+
+	pos = rb_pos(r, head);
+	first = r->size - pos;
+	if(first > (U32)len) first = len;
+	os_memcpy(r->p_o + pos, data, first);
+	if((U32)len > first)
+		os_memcpy(r->p_o, data + first, len - first);
+
+	RINGBUF_BARRIER();
+	r->head = rb_advance(r, head, len);
+	return len;
+}
+/**
+* \brief copy bytes out of the ring buffer without consuming them
+* \param r pointer to a ringbuf object
+* \param data destination
+* \param len maximum number of bytes to copy
+* \return number of bytes copied
+*/
+I32 ICACHE_FLASH_ATTR RINGBUF_Peek(RINGBUF *r, U8* data, I32 len)
+{
+	U32 tail = r->tail;
+	U32 avail = rb_count(r, r->head, tail);
+
+	if(len <= 0 || avail == 0) return 0;
+	if((U32)len > avail) len = avail;
+
+	RINGBUF_BARRIER();
+	rb_copy_out(r, tail, data, len);
+	return len;
+}
+/**
+* \brief read and consume a block from the ring buffer
+* \param r pointer to a ringbuf object
+* \param data destination
+* \param len maximum number of bytes to read
+* \return number of bytes read
+*/
+I32 ICACHE_FLASH_ATTR RINGBUF_Read(RINGBUF *r, U8* data, I32 len)
+{
+	U32 tail = r->tail;
+
+	len = RINGBUF_Peek(r, data, len);
+	if(len > 0){
+		RINGBUF_BARRIER();
+		r->tail = rb_advance(r, tail, len);
+	}
+	return len;
+}
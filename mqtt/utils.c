@@ -147,3 +147,59 @@ uint32_t ICACHE_FLASH_ATTR UTILS_Atoh(const int8_t *s)
 	return value;
 }
 
+/**
+  * @brief  Render a fixed point value in tenths as a decimal string, e.g.
+  *         -5 as "-0.5" and 2105 as "210.5". Integer only, no os_sprintf.
+  * @param  buf:   destination, 13 bytes cover any int32_t
+  * @param  value: value in tenths
+  * @retval length written, excluding the terminating zero
+  */
+int ICACHE_FLASH_ATTR UTILS_FormatTenths(char *buf, int32_t value)
+{
+	char digits[10];
+	uint32_t v;
+	int n = 0, len = 0;
+
+	if (value < 0) {
+		buf[len++] = '-';
+		v = -(uint32_t)value;
+	} else {
+		v = value;
+	}
+
+	digits[n++] = '0' + v % 10;		// the fraction
+	v /= 10;
+	do {
+		digits[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v);
+
+	while (n > 1)
+		buf[len++] = digits[--n];
+	buf[len++] = '.';
+	buf[len++] = digits[0];
+	buf[len] = 0;
+	return len;
+}
+
+/**
+  * @brief  CRC-32 (IEEE 802.3, as zlib), bitwise to stay out of RAM.
+  *         Chain calls by passing the previous result as crc, start with 0.
+  * @param  crc:  result of the previous block, 0 for the first
+  * @param  data: bytes to add
+  * @param  len:  number of bytes
+  * @retval running CRC
+  */
+uint32_t ICACHE_FLASH_ATTR UTILS_Crc32(uint32_t crc, const void *data, uint32_t len)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	int bit;
+
+	crc = ~crc;
+	while (len--) {
+		crc ^= *p++;
+		for (bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+	}
+	return ~crc;
+}
@@ -0,0 +1,281 @@
+/*
+ * cfgstore_test.c
+ *
+ *  The record store and config_load over the file-backed flash: round
+ *  trips, wrapping the ring, saves cut short at every byte, a corrupted
+ *  record, and the import of the two-sector layout older firmware left.
+ */
+#include <stddef.h>
+#include <string.h>
+#include "test.h"
+#include "flashfake.h"
+#include "spi_flash.h"
+#include "cfgstore.h"
+#include "config.h"
+#include "metrics.h"
+
+#define FLASH_PATH		"build/cfgstore_flash.bin"
+#define RING_FIRST		0x10
+#define RING_SECTORS	4
+
+uint32_t metrics[METRIC_COUNT];
+
+uint32 system_get_chip_id(void)
+{
+	return 0x00C0FFEE;
+}
+
+/* SYSCFG as the baseline firmware wrote it */
+typedef struct {
+	uint32_t cfg_holder;
+	uint8_t device_id[16];
+	uint8_t mqtt_topic[20];
+	uint8_t sta_ssid[64];
+	uint8_t sta_pwd[64];
+	uint32_t sta_type;
+	uint8_t mqtt_host[64];
+	uint32_t mqtt_port;
+	uint8_t mqtt_user[32];
+	uint8_t mqtt_pass[32];
+	uint32_t mqtt_keepalive;
+	uint8_t security;
+} LEGACY_SYSCFG;
+
+static void fill(uint8_t *buf, int len, int seed)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = seed * 31 + i * 7;
+}
+
+static void test_roundtrip(void)
+{
+	CFGSTORE s;
+	uint8_t in[37], out[64];
+	uint16_t version = 0;
+
+	FLASHFAKE_Open(FLASH_PATH);
+	CFGSTORE_Mount(&s, &CFGSTORE_SpiFlash, RING_FIRST, RING_SECTORS);
+	CHECK_EQ(CFGSTORE_Load(&s, &version, out, sizeof out), 0);
+
+	fill(in, sizeof in, 1);
+	CHECK(CFGSTORE_Save(&s, 7, in, sizeof in));
+	CFGSTORE_Mount(&s, &CFGSTORE_SpiFlash, RING_FIRST, RING_SECTORS);
+	memset(out, 0, sizeof out);
+	CHECK_EQ(CFGSTORE_Load(&s, &version, out, sizeof out), sizeof in);
+	CHECK_EQ(version, 7);
+	CHECK(memcmp(in, out, sizeof in) == 0);
+
+	// a shorter buffer gets the start of the record
+	memset(out, 0, sizeof out);
+	CHECK_EQ(CFGSTORE_Load(&s, &version, out, 10), 10);
+	CHECK(memcmp(in, out, 10) == 0);
+	CHECK_EQ(out[10], 0);
+	FLASHFAKE_Close();
+}
+
+static void test_wrap(void)
+{
+	CFGSTORE s;
+	uint8_t in[300], out[300];
+	uint16_t version;
+	uint32_t least = ~0u, most = 0;
+	int i;
+
+	FLASHFAKE_Open(FLASH_PATH);
+	CFGSTORE_Mount(&s, &CFGSTORE_SpiFlash, RING_FIRST, RING_SECTORS);
+	for (i = 1; i <= 500; i++) {
+		fill(in, sizeof in, i);
+		CHECK(CFGSTORE_Save(&s, 1, in, sizeof in));
+		if (i % 50 == 0) {
+			CFGSTORE_Mount(&s, &CFGSTORE_SpiFlash, RING_FIRST, RING_SECTORS);
+			CHECK_EQ(CFGSTORE_Load(&s, &version, out, sizeof out), sizeof out);
+			CHECK(memcmp(in, out, sizeof in) == 0);
+			CHECK_EQ(s.seq, i);
+		}
+	}
+	// the ring spreads the erases, nothing outside it is touched
+	for (i = 0; i < RING_SECTORS; i++) {
+		uint32_t n = FLASHFAKE_Erases(RING_FIRST + i);
+		least = n < least ? n : least;
+		most = n > most ? n : most;
+	}
+	CHECK(most - least <= 1);
+	CHECK(least > 0);
+	CHECK_EQ(FLASHFAKE_Erases(RING_FIRST - 1) + FLASHFAKE_Erases(RING_FIRST + RING_SECTORS), 0);
+	FLASHFAKE_Close();
+}
+
+static void test_power_cut(void)
+{
+	CFGSTORE s;
+	uint8_t a[40], b[40], c[40], out[40];
+	uint16_t version;
+	long cut, size = sizeof(CFGSTORE_RECORD) + sizeof b;
+
+	fill(a, sizeof a, 1);
+	fill(b, sizeof b, 2);
+	fill(c, sizeof c, 3);
+	for (cut = 0; cut < size; cut++) {
+		FLASHFAKE_Open(FLASH_PATH);
+		CFGSTORE_Mount(&s, &CFGSTORE_SpiFlash, RING_FIRST, RING_SECTORS);
+		CHECK(CFGSTORE_Save(&s, 1, a, sizeof a));
+
+		FLASHFAKE_CutAfter(cut);
+		CHECK(!CFGSTORE_Save(&s, 1, b, sizeof b));
+		FLASHFAKE_CutAfter(-1);
+
+		// after the reset the previous record is current and saving goes on
+		CFGSTORE_Mount(&s, &CFGSTORE_SpiFlash, RING_FIRST, RING_SECTORS);
+		CHECK_EQ(CFGSTORE_Load(&s, &version, out, sizeof out), sizeof out);
+		CHECK(memcmp(a, out, sizeof a) == 0);
+		CHECK(CFGSTORE_Save(&s, 1, c, sizeof c));
+		CFGSTORE_Mount(&s, &CFGSTORE_SpiFlash, RING_FIRST, RING_SECTORS);
+		CHECK_EQ(CFGSTORE_Load(&s, &version, out, sizeof out), sizeof out);
+		CHECK(memcmp(c, out, sizeof c) == 0);
+		FLASHFAKE_Close();
+	}
+}
+
+static void test_corrupt(void)
+{
+	CFGSTORE s;
+	uint8_t a[40], b[40], out[40];
+	uint32_t word = 0;
+	uint16_t version;
+
+	FLASHFAKE_Open(FLASH_PATH);
+	CFGSTORE_Mount(&s, &CFGSTORE_SpiFlash, RING_FIRST, RING_SECTORS);
+	fill(a, sizeof a, 1);
+	fill(b, sizeof b, 2);
+	CHECK(CFGSTORE_Save(&s, 1, a, sizeof a));
+	CHECK(CFGSTORE_Save(&s, 1, b, sizeof b));
+
+	// clear every bit of a payload word in the newest record
+	spi_flash_write(s.addr + sizeof(CFGSTORE_RECORD) + 8, &word, 4);
+	CFGSTORE_Mount(&s, &CFGSTORE_SpiFlash, RING_FIRST, RING_SECTORS);
+	CHECK_EQ(CFGSTORE_Load(&s, &version, out, sizeof out), sizeof out);
+	CHECK(memcmp(a, out, sizeof a) == 0);
+	FLASHFAKE_Close();
+}
+
+/* a flash with the two-sector layout as the baseline firmware left it */
+static void write_legacy(uint32_t holder, uint8_t flag)
+{
+	LEGACY_SYSCFG old;
+	SAVE_FLAG saveFlag;
+
+	memset(&old, 0, sizeof old);
+	old.cfg_holder = holder;
+	strcpy((char *)old.device_id, "Node_1");
+	strcpy((char *)old.mqtt_topic, "/node/1/");
+	strcpy((char *)old.sta_ssid, "HomeNet");
+	strcpy((char *)old.sta_pwd, "secret");
+	old.sta_type = AUTH_WPA2_PSK;
+	strcpy((char *)old.mqtt_host, "broker.local");
+	old.mqtt_port = 8883;
+	strcpy((char *)old.mqtt_user, "user");
+	strcpy((char *)old.mqtt_pass, "pass");
+	old.mqtt_keepalive = 60;
+	old.security = 1;
+
+	FLASHFAKE_Open(FLASH_PATH);
+	memset(&saveFlag, 0, sizeof saveFlag);
+	saveFlag.flag = flag;
+	spi_flash_write((CFG_LOCATION + 3) * SPI_FLASH_SEC_SIZE, (uint32 *)&saveFlag, sizeof saveFlag);
+	spi_flash_write((CFG_LOCATION + flag) * SPI_FLASH_SEC_SIZE, (uint32 *)&old, sizeof old);
+}
+
+static void check_imported(void)
+{
+	CHECK_EQ(config.cfg_holder, CFG_HOLDER);
+	CHECK(strcmp((char *)config.device_id, "Node_1") == 0);
+	CHECK(strcmp((char *)config.sta_ssid, "HomeNet") == 0);
+	CHECK(strcmp((char *)config.sta_pwd, "secret") == 0);
+	CHECK(strcmp((char *)config.mqtt_host, "broker.local") == 0);
+	CHECK_EQ(config.mqtt_port, 8883);
+	CHECK_EQ(config.mqtt_keepalive, 60);
+	CHECK_EQ(config.security, 1);
+	// the fields the old struct did not have hold their defaults, not 0xFF
+	CHECK_EQ(config.sensors[0].pin, DHT_PIN);
+	CHECK_EQ(config.sensors[1].pin, SENSOR_NONE);
+	CHECK_EQ(config.sampling.min_ms, SAMPLE_MIN);
+	CHECK(strcmp((char *)config.sntp_host, SNTP_HOST) == 0);
+	CHECK_EQ(config.batch_size, BATCH_SIZE);
+	CHECK_EQ(config.ota_trial, 0);
+	CHECK_EQ(config.sta_nets[0].ssid[0], 0);
+	CHECK_EQ(config.roam_rssi, ROAM_RSSI);
+	CHECK_EQ(config.power_mode, POWER_SLEEP);
+}
+
+static void test_legacy_import(void)
+{
+	uint32_t holder, saves;
+	uint8_t flag;
+
+	for (holder = 0x00FF55A4; holder <= CFG_HOLDER; holder++) {
+		for (flag = 0; flag <= 1; flag++) {
+			write_legacy(holder, flag);
+			config_load();
+			check_imported();
+
+			// imported once into the store, the next boot loads the record
+			saves = metrics[METRIC_CFG_SAVES];
+			memset(&config, 0, sizeof config);
+			config_load();
+			check_imported();
+			CHECK_EQ(metrics[METRIC_CFG_SAVES], saves);
+			FLASHFAKE_Close();
+		}
+	}
+
+	// holders that are not ours, or an erased flash, give the defaults
+	write_legacy(0x00FF55A3, 0);
+	config_load();
+	CHECK(strcmp((char *)config.sta_ssid, STA_SSID) == 0);
+	FLASHFAKE_Close();
+	write_legacy(0xFFFFFFFF, 1);
+	config_load();
+	CHECK(strcmp((char *)config.sta_ssid, STA_SSID) == 0);
+	CHECK_EQ(config.sensors[0].pin, DHT_PIN);
+	FLASHFAKE_Close();
+}
+
+static void test_schema_upgrade(void)
+{
+	CFGSTORE s;
+	uint16_t version;
+	SYSCFG old;
+
+	// a record from before roam_rssi and power_mode were appended
+	FLASHFAKE_Open(FLASH_PATH);
+	config_load();
+	os_sprintf((char *)config.sta_ssid, "Upgraded");
+	config.roam_rssi = 0xAA;
+	config.power_mode = 0xAA;
+	CFGSTORE_Mount(&s, &CFGSTORE_SpiFlash, CFG_LOCATION, CFG_SECTORS);
+	CHECK(CFGSTORE_Save(&s, CFG_VERSION - 1, &config, offsetof(SYSCFG, roam_rssi)));
+
+	config_load();
+	CHECK(strcmp((char *)config.sta_ssid, "Upgraded") == 0);
+	CHECK_EQ(config.roam_rssi, ROAM_RSSI);
+	CHECK_EQ(config.power_mode, POWER_SLEEP);
+
+	// and saved back whole with the current schema
+	CFGSTORE_Mount(&s, &CFGSTORE_SpiFlash, CFG_LOCATION, CFG_SECTORS);
+	CHECK_EQ(CFGSTORE_Load(&s, &version, &old, sizeof old), sizeof(SYSCFG));
+	CHECK_EQ(version, CFG_VERSION);
+	FLASHFAKE_Close();
+}
+
+int main(void)
+{
+	test_roundtrip();
+	test_wrap();
+	test_power_cut();
+	test_corrupt();
+	test_legacy_import();
+	test_schema_upgrade();
+	return TEST_Done("cfgstore");
+}
@@ -0,0 +1,145 @@
+/*
+ * delta_test.c
+ *
+ *  modules/delta.c applies a patch made by tools/otadelta.py and the result
+ *  has to be the new image byte for byte. The patch goes in as ota.c feeds
+ *  it, in chunks of odd sizes and picking up where DELTA_BUSY stopped, then
+ *  once against a different base and once cut short.
+ *
+ *  delta_test old.bin new.bin patch
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "test.h"
+#include "delta.h"
+
+static uint8_t *oldImage, *newImage, *patch, *out;
+static long oldSize, newSize, patchSize, outLen;
+static int badReads, overruns;
+
+static uint8_t *load(const char *path, long *size, long pad)
+{
+	FILE *f = fopen(path, "rb");
+	uint8_t *buf;
+
+	if (!f) {
+		perror(path);
+		exit(2);
+	}
+	fseek(f, 0, SEEK_END);
+	*size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	// the slot past the image reads as erased flash
+	buf = malloc(*size + pad);
+	memset(buf + *size, 0xFF, pad);
+	if (fread(buf, 1, *size, f) != (size_t)*size) {
+		perror(path);
+		exit(2);
+	}
+	fclose(f);
+	return buf;
+}
+
+static BOOL old_read(uint32_t offset, uint32_t *buf, uint32_t len)
+{
+	if ((offset & 3) || (len & 3) || offset + len > oldSize + DELTA_BLOCK) {
+		badReads++;
+		return FALSE;
+	}
+	memcpy(buf, oldImage + offset, len);
+	return TRUE;
+}
+
+static BOOL new_write(const uint8_t *data, uint32_t len)
+{
+	if (outLen + len > newSize) {
+		overruns++;
+		return FALSE;
+	}
+	memcpy(out + outLen, data, len);
+	outLen += len;
+	return TRUE;
+}
+
+/* the whole patch in chunks of chunk bytes, resumed like ota_patch does */
+static DELTA_STATUS apply(long len, long chunk, int *busy)
+{
+	static DELTA d;
+	DELTA_STATUS status = DELTA_MORE;
+	uint32_t used;
+	long pos = 0, n;
+
+	DELTA_Init(&d, old_read, new_write);
+	outLen = 0;
+	*busy = 0;
+	while (pos < len && status == DELTA_MORE) {
+		n = len - pos < chunk ? len - pos : chunk;
+		do {
+			status = DELTA_Feed(&d, patch + pos, n, &used);
+			if (used > (uint32_t)n)
+				return DELTA_CORRUPT;
+			pos += used;
+			n -= used;
+			if (status == DELTA_BUSY)
+				(*busy)++;
+		} while (status == DELTA_BUSY);
+		if (status == DELTA_MORE && n != 0)
+			return DELTA_CORRUPT;
+	}
+	return status;
+}
+
+int main(int argc, char **argv)
+{
+	static const long chunks[] = { 1, 3, 7, 61, 509, 1021, 4093, 1L << 30 };
+	DELTA_STATUS status;
+	unsigned i;
+	int busy;
+	clock_t start;
+	double ms;
+
+	if (argc != 4) {
+		fprintf(stderr, "usage: %s old.bin new.bin patch\n", argv[0]);
+		return 2;
+	}
+	oldImage = load(argv[1], &oldSize, DELTA_BLOCK);
+	newImage = load(argv[2], &newSize, 0);
+	patch = load(argv[3], &patchSize, 0);
+	out = malloc(newSize + 1);
+	printf("delta: %s %ld -> %s %ld with %ld bytes of patch\n", argv[1], oldSize,
+			argv[2], newSize, patchSize);
+
+	for (i = 0; i < sizeof chunks / sizeof chunks[0]; i++) {
+		start = clock();
+		status = apply(patchSize, chunks[i], &busy);
+		ms = (double)(clock() - start) * 1000 / CLOCKS_PER_SEC;
+		if (status != DELTA_DONE || outLen != newSize || memcmp(out, newImage, newSize) != 0)
+			printf("delta: chunks of %ld: status %d, %ld of %ld bytes\n", chunks[i], status, outLen, newSize);
+		CHECK_EQ(status, DELTA_DONE);
+		CHECK_EQ(outLen, newSize);
+		CHECK(memcmp(out, newImage, outLen) == 0);
+		// fed at once, the output alone has to be sliced every DELTA_BUDGET bytes
+		if (chunks[i] >= patchSize)
+			CHECK(busy >= newSize / DELTA_BUDGET);
+		if (chunks[i] == 61 || i == sizeof chunks / sizeof chunks[0] - 1)
+			printf("delta: chunks of %ld: %d busy returns, %.1f ms\n",
+					chunks[i] > patchSize ? patchSize : chunks[i], busy, ms);
+	}
+
+	// made against another image, nothing may be written
+	oldImage[oldSize / 2] ^= 0x01;
+	status = apply(patchSize, 509, &busy);
+	CHECK_EQ(status, DELTA_WRONG_BASE);
+	CHECK_EQ(outLen, 0);
+	oldImage[oldSize / 2] ^= 0x01;
+
+	// cut short, it keeps asking for more and never claims to be done
+	status = apply(patchSize - 1, 509, &busy);
+	CHECK_EQ(status, DELTA_MORE);
+	CHECK(outLen < newSize);
+
+	CHECK_EQ(badReads, 0);
+	CHECK_EQ(overruns, 0);
+	return TEST_Done("delta");
+}
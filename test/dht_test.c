@@ -0,0 +1,184 @@
+/*
+ * dht_test.c
+ *
+ *  Replays the traces in dht_traces.txt through DHTDecode and checks status
+ *  and values against the expect line above each. Then a jitter sweep of
+ *  random frames: how many decode, how many the checksum rejects and how
+ *  many come out wrong without it noticing.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "test.h"
+#include "driver/dht22.h"
+
+static const char *statusNames[] = { "OK", "NO_RESPONSE", "TOO_FEW_BITS", "BAD_CHECKSUM" };
+
+/* the scaling of dht22.c, in tenths */
+static void scale(enum DHTType type, const uint8_t *data, int *humidity, int *temperature)
+{
+	if (type == DHT11) {
+		*humidity = data[0] * 10;
+		*temperature = data[2] * 10;
+	} else {
+		*humidity = (data[0] << 8) | data[1];
+		*temperature = ((data[2] & 0x7f) << 8) | data[3];
+		if (data[2] & 0x80)
+			*temperature = -*temperature;
+	}
+}
+
+static int parse_status(const char *name)
+{
+	int i;
+
+	for (i = 0; i < 4; i++)
+		if (strcmp(name, statusNames[i]) == 0)
+			return i;
+	return -1;
+}
+
+static void test_corpus(const char *path)
+{
+	char line[1024], typeName[8], statusName[16], *p, *end;
+	uint16_t pulses[DHT_MAX_PULSES];
+	int lineNo = 0, expectLine = 0, wantStatus = -1, wantHum = 0, wantTemp = 0;
+	int frames = 0, passed = 0, byStatus[4] = { 0 };
+	enum DHTType type = DHT22;
+	uint8_t data[5];
+	FILE *f = fopen(path, "r");
+
+	CHECK(f != NULL);
+	if (!f)
+		return;
+	while (fgets(line, sizeof line, f)) {
+		lineNo++;
+		if (strncmp(line, "expect ", 7) == 0) {
+			wantHum = wantTemp = 0;
+			if (sscanf(line + 7, "%7s %15s %d %d", typeName, statusName, &wantHum, &wantTemp) < 2) {
+				printf("%s:%d: bad expect line\n", path, lineNo);
+				CHECK(0);
+				continue;
+			}
+			type = strcmp(typeName, "dht11") == 0 ? DHT11 : DHT22;
+			wantStatus = parse_status(statusName);
+			CHECK(wantStatus >= 0);
+			expectLine = lineNo;
+			continue;
+		}
+		if (strncmp(line, "DHT: trace ", 11) != 0)
+			continue;
+
+		// "DHT: trace <count>: <us> <us> ...", as DHT_CAPTURE prints it
+		int count = strtol(line + 11, &p, 10), n = 0, ok;
+		if (*p == ':')
+			p++;
+		while (n < DHT_MAX_PULSES) {
+			long us = strtol(p, &end, 10);
+			if (end == p)
+				break;
+			pulses[n++] = us;
+			p = end;
+		}
+		CHECK_EQ(n, count);
+		if (expectLine == 0) {
+			printf("%s:%d: trace without an expect line\n", path, lineNo);
+			CHECK(0);
+			continue;
+		}
+
+		DHTStatus status = DHTDecode(pulses, n, data);
+		ok = (int)status == wantStatus;
+		if (ok && status == DHT_OK) {
+			int humidity, temperature;
+			scale(type, data, &humidity, &temperature);
+			ok = humidity == wantHum && temperature == wantTemp;
+			if (!ok)
+				printf("%s:%d: decoded %d %d, expected %d %d\n", path, lineNo,
+						humidity, temperature, wantHum, wantTemp);
+		} else if (!ok) {
+			printf("%s:%d: decoded %s, expected %s\n", path, lineNo,
+					statusNames[status], statusNames[wantStatus]);
+		}
+		CHECK(ok);
+		frames++;
+		passed += ok;
+		byStatus[status]++;
+		expectLine = 0;
+	}
+	fclose(f);
+
+	CHECK(frames > 0);
+	printf("dht: %d of %d traces as expected (OK %d, NO_RESPONSE %d, TOO_FEW_BITS %d, BAD_CHECKSUM %d)\n",
+			passed, frames, byStatus[DHT_OK], byStatus[DHT_NO_RESPONSE],
+			byStatus[DHT_TOO_FEW_BITS], byStatus[DHT_BAD_CHECKSUM]);
+}
+
+#define SWEEP_FRAMES	20000
+
+static uint16_t jittered(int us, int jitter)
+{
+	int v = us + (jitter ? rand() % (2 * jitter + 1) - jitter : 0);
+
+	return v < 1 ? 1 : v;
+}
+
+/* a frame with the nominal datasheet timing, every level off by up to +-jitter us */
+static uint16_t make_frame(uint16_t *pulses, const uint8_t *data, int jitter)
+{
+	uint16_t n = 0;
+	int bit;
+
+	pulses[n++] = jittered(80, jitter);
+	pulses[n++] = jittered(80, jitter);
+	for (bit = 0; bit < DHT_BITS; bit++) {
+		pulses[n++] = jittered(50, jitter);
+		pulses[n++] = jittered(data[bit / 8] & (0x80 >> bit % 8) ? 70 : 27, jitter);
+	}
+	pulses[n++] = jittered(50, jitter);
+	return n;
+}
+
+static void test_jitter_sweep(void)
+{
+	uint16_t pulses[DHT_MAX_PULSES];
+	uint8_t sent[5], data[5];
+	int jitter, i, k;
+	clock_t start = clock();
+	long decoded = 0;
+
+	printf("dht: jitter sweep, %d random frames per level\n", SWEEP_FRAMES);
+	printf("  +-us    correct   checksum   wrong\n");
+	srand(34);
+	for (jitter = 0; jitter <= 30; jitter += 5) {
+		int correct = 0, rejected = 0, wrong = 0;
+
+		for (i = 0; i < SWEEP_FRAMES; i++) {
+			for (k = 0; k < 4; k++)
+				sent[k] = rand();
+			sent[4] = sent[0] + sent[1] + sent[2] + sent[3];
+
+			DHTStatus status = DHTDecode(pulses, make_frame(pulses, sent, jitter), data);
+			decoded++;
+			if (status == DHT_BAD_CHECKSUM)
+				rejected++;
+			else if (status == DHT_OK && memcmp(sent, data, 5) == 0)
+				correct++;
+			else
+				wrong++;
+		}
+		printf("  %4d  %8.2f%%  %8.2f%%  %6.2f%%\n", jitter, 100.0 * correct / SWEEP_FRAMES,
+				100.0 * rejected / SWEEP_FRAMES, 100.0 * wrong / SWEEP_FRAMES);
+		// a 1 high stays longer than its low while both are off by less than 10us
+		if (jitter < 10)
+			CHECK_EQ(correct, SWEEP_FRAMES);
+	}
+	printf("dht: %.0f ns per frame\n", (double)(clock() - start) / CLOCKS_PER_SEC * 1e9 / decoded);
+}
+
+int main(int argc, char **argv)
+{
+	test_corpus(argc > 1 ? argv[1] : "dht_traces.txt");
+	test_jitter_sweep();
+	return TEST_Done("dht");
+}
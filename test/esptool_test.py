@@ -0,0 +1,158 @@
+#!/usr/bin/env python
+#
+# esptool.py write_flash against tools/esprom_sim.py: three simulated chips
+# at once through the stub, a second run that finds every sector in place,
+# one changed sector, per-device images and the ROM loader path, each
+# compared byte for byte with the chip's flash file.
+#
+#   esptool_test.py [--python2 python2]
+#
+# esptool.py is Python 2 and needs pyserial there, without it the test is
+# skipped with a note rather than failed.
+
+import sys
+import os
+import re
+import shutil
+import random
+import argparse
+import threading
+import subprocess
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+TOOLS = os.path.join(os.path.dirname(HERE), 'tools')
+WORK = os.path.join(HERE, 'build', 'esptool')
+SIM = os.path.join(WORK, 'sim')
+CHIPS = 3
+FIRST_ID = 0x00A1B200
+SECTOR = 4096
+
+checks = failures = 0
+
+
+def check(cond, what):
+    global checks, failures
+    checks += 1
+    if not cond:
+        failures += 1
+        print('esptool_test.py: check failed: %s' % what)
+
+
+def run(cmd, timeout=60):
+    """Exit status and output, killed after timeout seconds"""
+    p = subprocess.Popen(cmd, stdout=subprocess.PIPE, stderr=subprocess.STDOUT, cwd=WORK)
+    timer = threading.Timer(timeout, p.kill)
+    timer.start()
+    out = p.communicate()[0].decode('latin-1')
+    timer.cancel()
+    return p.returncode, out
+
+
+def image(path, size, seed):
+    r = random.Random(seed)
+    data = bytearray(r.randint(0, 255) for i in range(size))
+    with open(os.path.join(WORK, path), 'wb') as f:
+        f.write(data)
+    return data
+
+
+def flash(chip):
+    with open(os.path.join(SIM, '%08X.flash' % (FIRST_ID + chip)), 'rb') as f:
+        return bytearray(f.read())
+
+
+def holds(chip, address, data):
+    return flash(chip)[address:address + len(data)] == data
+
+
+def wrote(out, written, total):
+    """Every port reported written of total sectors"""
+    return len(re.findall(r'Wrote %d of %d sectors' % (written, total), out)) == CHIPS
+
+
+def main():
+    parser = argparse.ArgumentParser(description='esptool.py against the loader simulator')
+    parser.add_argument('--python2', default='python2', help='interpreter for esptool.py')
+    args = parser.parse_args()
+
+    try:
+        status = subprocess.call([args.python2, '-c', 'import serial'],
+                                 stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+    except OSError:
+        status = -1
+    if status != 0:
+        print('esptool: skipped, %s with pyserial is needed for esptool.py' % args.python2)
+        return 0
+
+    if os.path.isdir(WORK):
+        shutil.rmtree(WORK)
+    os.makedirs(WORK)
+    sim = subprocess.Popen([sys.executable, os.path.join(TOOLS, 'esprom_sim.py'), '--count', str(CHIPS), SIM],
+                           stdout=subprocess.PIPE)
+    try:
+        # one line per chip once its link is there
+        for i in range(CHIPS):
+            sim.stdout.readline()
+        esptool = [args.python2, os.path.join(TOOLS, 'esptool.py')]
+        ports = os.path.join(SIM, 'tty*')
+
+        image('stub.seg', 1500, 0)
+        status, out = run(esptool + ['make_image', '-f', 'stub.seg', '-a', '0x40100000', '-e', '0x40100000', 'stub.bin'])
+        check(status == 0, 'make_image of the stub: ' + out)
+        app = image('app.bin', 20000, 1)
+        data = image('data.bin', 9000, 2)
+        write = esptool + ['-p', ports, 'write_flash', '--stub', 'stub.bin', '0x00000', 'app.bin', '0x40000', 'data.bin']
+
+        # a blank flash takes every sector, on all ports at once
+        status, out = run(write)
+        check(status == 0, 'write_flash exit status %d' % status)
+        check(wrote(out, 8, 8), 'first write: ' + out)
+        check('%d of %d ports written' % (CHIPS, CHIPS) in out, 'first write: ' + out)
+        for chip in range(CHIPS):
+            check(holds(chip, 0x00000, app) and holds(chip, 0x40000, data), 'chip %d after the first write' % chip)
+            check(flash(chip)[0x40000 + len(data):0x40000 + 3 * SECTOR] == b'\xff' * (3 * SECTOR - len(data)),
+                  'chip %d: the tail of the last sector is erased' % chip)
+
+        # the same images again: nothing to send
+        status, out = run(write)
+        check(status == 0 and wrote(out, 0, 8), 'second write: ' + out)
+        check('0 bytes sent' in out, 'second write: ' + out)
+
+        # one changed byte, one sector
+        data[SECTOR + 17] ^= 0x5a
+        with open(os.path.join(WORK, 'data.bin'), 'wb') as f:
+            f.write(data)
+        status, out = run(write)
+        check(status == 0 and wrote(out, 1, 8), 'changed sector: ' + out)
+        for chip in range(CHIPS):
+            check(holds(chip, 0x40000, data) and holds(chip, 0x00000, app), 'chip %d after the changed sector' % chip)
+
+        # --force sends everything even though it matches
+        status, out = run(write + ['--force'])
+        check(status == 0 and wrote(out, 8, 8), '--force: ' + out)
+
+        # {chip_id} picks every chip's own image
+        for chip in range(CHIPS):
+            image('cfg_%08X.bin' % (FIRST_ID + chip), 300, 10 + chip)
+        status, out = run(esptool + ['-p', ports, 'write_flash', '--stub', 'stub.bin', '0x7C000', 'cfg_{chip_id}.bin'])
+        check(status == 0 and wrote(out, 1, 1), 'per-device images: ' + out)
+        for chip in range(CHIPS):
+            with open(os.path.join(WORK, 'cfg_%08X.bin' % (FIRST_ID + chip)), 'rb') as f:
+                check(holds(chip, 0x7C000, bytearray(f.read())), 'chip %d has its own configuration' % chip)
+
+        # the ROM loader writes one port everything as it is
+        rom = image('rom.bin', 5000, 3)
+        status, out = run(esptool + ['-p', os.path.join(SIM, 'tty0'), 'write_flash', '--no-stub', '0x10000', 'rom.bin'])
+        check(status == 0, '--no-stub: ' + out)
+        check(holds(0, 0x10000, rom), 'chip 0 after the ROM loader write')
+        check(holds(1, 0x10000, b'\xff' * len(rom)), 'chip 1 untouched by the ROM loader write')
+    finally:
+        sim.terminate()
+        sim.wait()
+
+    print('esptool: %d checks, %d failed' % (checks, failures))
+    return failures != 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,101 @@
+/*
+ * flashfake.c
+ *
+ *  spi_flash_* over a file, see flashfake.h.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "spi_flash.h"
+#include "flashfake.h"
+
+static FILE *flashFile;
+static long cutAfter = -1;
+static uint32 erases[FLASHFAKE_SECTORS];
+
+void FLASHFAKE_Open(const char *path)
+{
+	static uint8 erased[SPI_FLASH_SEC_SIZE];
+	int i;
+
+	flashFile = fopen(path, "w+b");
+	if (!flashFile) {
+		perror(path);
+		exit(2);
+	}
+	memset(erased, 0xFF, sizeof erased);
+	for (i = 0; i < FLASHFAKE_SECTORS; i++)
+		fwrite(erased, 1, sizeof erased, flashFile);
+	memset(erases, 0, sizeof erases);
+	cutAfter = -1;
+}
+
+void FLASHFAKE_Close(void)
+{
+	fclose(flashFile);
+	flashFile = NULL;
+}
+
+void FLASHFAKE_CutAfter(long bytes)
+{
+	cutAfter = bytes;
+}
+
+uint32 FLASHFAKE_Erases(uint16 sector)
+{
+	return sector < FLASHFAKE_SECTORS ? erases[sector] : 0;
+}
+
+static BOOL flash_range(uint32 addr, uint32 size)
+{
+	return flashFile && (addr & 3) == 0 && (size & 3) == 0 &&
+			addr + size <= FLASHFAKE_SECTORS * SPI_FLASH_SEC_SIZE;
+}
+
+SpiFlashOpResult spi_flash_erase_sector(uint16 sec)
+{
+	static uint8 erased[SPI_FLASH_SEC_SIZE];
+
+	if (sec >= FLASHFAKE_SECTORS || cutAfter == 0)
+		return SPI_FLASH_RESULT_ERR;
+	memset(erased, 0xFF, sizeof erased);
+	fseek(flashFile, (long)sec * SPI_FLASH_SEC_SIZE, SEEK_SET);
+	fwrite(erased, 1, sizeof erased, flashFile);
+	erases[sec]++;
+	return SPI_FLASH_RESULT_OK;
+}
+
+SpiFlashOpResult spi_flash_write(uint32 des_addr, uint32 *src_addr, uint32 size)
+{
+	uint8 old[SPI_FLASH_SEC_SIZE];
+	const uint8 *src = (const uint8 *)src_addr;
+	uint32 done, n, i;
+
+	if (!flash_range(des_addr, size))
+		return SPI_FLASH_RESULT_ERR;
+	for (done = 0; done < size; done += n) {
+		n = size - done < sizeof old ? size - done : sizeof old;
+		if (cutAfter >= 0 && n > (uint32)cutAfter)
+			n = cutAfter;
+		if (n == 0)
+			return SPI_FLASH_RESULT_ERR;
+		fseek(flashFile, des_addr + done, SEEK_SET);
+		if (fread(old, 1, n, flashFile) != n)
+			return SPI_FLASH_RESULT_ERR;
+		for (i = 0; i < n; i++)
+			old[i] &= src[done + i];
+		fseek(flashFile, des_addr + done, SEEK_SET);
+		fwrite(old, 1, n, flashFile);
+		if (cutAfter >= 0)
+			cutAfter -= n;
+	}
+	return SPI_FLASH_RESULT_OK;
+}
+
+SpiFlashOpResult spi_flash_read(uint32 src_addr, uint32 *des_addr, uint32 size)
+{
+	if (!flash_range(src_addr, size))
+		return SPI_FLASH_RESULT_ERR;
+	fseek(flashFile, src_addr, SEEK_SET);
+	return fread(des_addr, 1, size, flashFile) == size ? SPI_FLASH_RESULT_OK : SPI_FLASH_RESULT_ERR;
+}
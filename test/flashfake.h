@@ -0,0 +1,20 @@
+/*
+ * flashfake.h
+ *
+ *  SPI flash over a file for the host tests, behind spi_flash.h and so
+ *  behind CFGSTORE_SpiFlash. Writes can only clear bits like NOR flash,
+ *  erases set a sector back to 0xFF and unaligned access fails.
+ */
+#ifndef FLASHFAKE_H_
+#define FLASHFAKE_H_
+#include "c_types.h"
+
+#define FLASHFAKE_SECTORS	256		/* 1 MB */
+
+void FLASHFAKE_Open(const char *path);
+void FLASHFAKE_Close(void);
+/* writes after this many more bytes fail and leave the rest erased, -1 never */
+void FLASHFAKE_CutAfter(long bytes);
+uint32 FLASHFAKE_Erases(uint16 sector);
+
+#endif /* FLASHFAKE_H_ */
@@ -0,0 +1,92 @@
+#
+# The host link the tool tests run on, laid out like the firmware: a few
+# firmware units and linkapp.c compiled a section per function with their
+# .su files, made ELF32 with objcopy, archived and linked with a script
+# like ld/eagle.app.v6.ld, a stand-in for the SDK's with the same memory
+# map. The objects go to build/link in a tree mirroring the sources, as
+# tools/iram.py expects of the firmware's build directory.
+
+import sys
+import os
+import subprocess
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+ROOT = os.path.dirname(HERE)
+sys.path.insert(0, os.path.join(ROOT, 'tools'))
+
+WORK = os.path.join(HERE, 'build', 'link')
+SDK_LD = os.path.join(HERE, 'ld', 'eagle.app.v6.ld')
+ARCHIVE = 'app_test.a'
+SOURCES = ['test/linkapp.c', 'mqtt/ringbuf.c', 'mqtt/utils.c', 'modules/sha256.c', 'driver/dht_decode.c']
+CFLAGS = ['-O2', '-std=gnu99', '-ffunction-sections', '-fdata-sections', '-fstack-usage', '-fno-pic',
+          '-fno-asynchronous-unwind-tables', '-fno-stack-protector', '-fno-reorder-blocks-and-partition',
+          '-I' + os.path.join(HERE, 'include')] + \
+         ['-I' + os.path.join(ROOT, d) for d in ('include', 'driver', 'mqtt/include', 'modules/include')]
+
+IRAM = (0x40100000, 0x40108000)
+DRAM = (0x3FFE8000, 0x40000000)
+FLASH = (0x40240000, 0x4027C000)
+
+# what the sources mark ICACHE_FLASH_ATTR and ICACHE_RODATA_ATTR, and the rest of the code
+FLASH_FUNCTIONS = ['RINGBUF_Init', 'RINGBUF_Get', 'RINGBUF_Peek', 'RINGBUF_Read', 'UTILS_IsIPV4',
+                   'UTILS_StrToIP', 'UTILS_Atoh', 'UTILS_FormatTenths', 'UTILS_Crc32', 'SHA256_Init',
+                   'SHA256_Update', 'SHA256_Final', 'sha256_block', 'DHTDecode', 'rx_task', 'user_init']
+FLASH_TABLES = ['banner', 'k']
+IRAM_FUNCTIONS = ['RINGBUF_Put', 'RINGBUF_Write', 'RINGBUF_Count', 'RINGBUF_Free', 'rx_intr_handler']
+
+
+def arguments(parser):
+    parser.add_argument('--cc', default='gcc')
+    parser.add_argument('--objcopy', default='objcopy')
+    parser.add_argument('--ld', default='ld')
+    parser.add_argument('--ar', default='ar')
+
+
+def usable(args):
+    """Whether ld links elf32_x86_64, the host's ELF32"""
+    try:
+        out = subprocess.Popen([args.ld, '-V'], stdout=subprocess.PIPE).communicate()[0].decode('latin-1')
+    except OSError:
+        return False
+    return 'elf32_x86_64' in out
+
+
+def run(cmd, status=0):
+    """Output of a command that has to exit with status"""
+    p = subprocess.Popen(cmd, stdout=subprocess.PIPE, stderr=subprocess.STDOUT, cwd=WORK)
+    out = p.communicate()[0].decode('latin-1')
+    if status is not None and p.returncode != status:
+        raise SystemExit('%s exited with %d:\n%s' % (' '.join(cmd), p.returncode, out))
+    return out
+
+
+def tool(name, *args):
+    return [sys.executable, os.path.join(ROOT, 'tools', name)] + list(args)
+
+
+def build(args):
+    """The objects, archived in WORK"""
+    objects = []
+    for source in SOURCES:
+        obj = os.path.join(WORK, source[:-2] + '.o')
+        if not os.path.isdir(os.path.dirname(obj)):
+            os.makedirs(os.path.dirname(obj))
+        run([args.cc] + CFLAGS + ['-c', os.path.join(ROOT, source), '-o', obj[:-2] + '.o64'])
+        run([args.objcopy, '-O', 'elf32-x86-64', obj[:-2] + '.o64', obj])
+        objects.append(obj)
+    if os.path.exists(os.path.join(WORK, ARCHIVE)):
+        os.remove(os.path.join(WORK, ARCHIVE))
+    run([args.ar, 'rcs', ARCHIVE] + objects)
+    return objects
+
+
+def link(args, script, name):
+    """WORK/name.out and its map, linked from the archive with script"""
+    image = os.path.join(WORK, name + '.out')
+    run([args.ld, '-m', 'elf32_x86_64', '-T', script, '-Map', image + '.map',
+         '--start-group', ARCHIVE, '--end-group', '-o', image])
+    return image
+
+
+def within(value, area):
+    return area[0] <= value < area[1]
@@ -0,0 +1,53 @@
+/*
+ * c_types.h
+ *
+ *  Host stand-in for the SDK header: the tests build the firmware sources
+ *  with the host compiler, so only the types and attributes they use.
+ */
+#ifndef _C_TYPES_H_
+#define _C_TYPES_H_
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef uint8_t uint8;
+typedef int8_t sint8;
+typedef int8_t int8;
+typedef uint16_t uint16;
+typedef int16_t sint16;
+typedef int16_t int16;
+typedef uint32_t uint32;
+typedef int32_t sint32;
+typedef int32_t int32;
+typedef uint64_t uint64;
+typedef int64_t sint64;
+typedef unsigned char BOOL;
+
+#define TRUE	1
+#define FALSE	0
+#define LOCAL	static
+
+#define ICACHE_FLASH_ATTR
+#define ICACHE_RODATA_ATTR
+#define IRAM_ATTR
+#define STORE_ATTR		__attribute__((aligned(4)))
+
+#define BIT(nr)	(1UL << (nr))
+#define BIT0	BIT(0)
+#define BIT1	BIT(1)
+#define BIT2	BIT(2)
+#define BIT3	BIT(3)
+#define BIT4	BIT(4)
+#define BIT5	BIT(5)
+#define BIT6	BIT(6)
+#define BIT7	BIT(7)
+
+typedef enum {
+	OK = 0,
+	FAIL,
+	PENDING,
+	BUSY,
+	CANCEL,
+} STATUS;
+
+#endif
@@ -0,0 +1,30 @@
+/*
+ * eagle_soc.h
+ *
+ *  Host stand-in for the SDK header. Peripheral registers are reached
+ *  through the test's mock register file.
+ */
+#ifndef _EAGLE_SOC_H_
+#define _EAGLE_SOC_H_
+#include "c_types.h"
+
+uint32 mock_reg_read(uint32 addr);
+void mock_reg_write(uint32 addr, uint32 value);
+
+#define READ_PERI_REG(addr)				mock_reg_read(addr)
+#define WRITE_PERI_REG(addr, val)		mock_reg_write((addr), (val))
+#define SET_PERI_REG_MASK(reg, mask)	WRITE_PERI_REG((reg), (READ_PERI_REG(reg) | (mask)))
+#define CLEAR_PERI_REG_MASK(reg, mask)	WRITE_PERI_REG((reg), (READ_PERI_REG(reg) & (~(mask))))
+
+#define UART_CLK_FREQ			80000000
+#define PERIPHS_IO_MUX_GPIO2_U	0
+#define PERIPHS_IO_MUX_U0TXD_U	0
+#define PERIPHS_IO_MUX_MTDO_U	0
+#define FUNC_U1TXD_BK			2
+#define FUNC_U0TXD				0
+#define FUNC_U0RTS				4
+#define PIN_FUNC_SELECT(pin, func)	((void)0)
+#define PIN_PULLUP_DIS(pin)		((void)0)
+#define PIN_PULLUP_EN(pin)		((void)0)
+
+#endif
@@ -0,0 +1,22 @@
+/*
+ * ets_sys.h
+ *
+ *  Host stand-in for the SDK header. Interrupt masking calls into the
+ *  test, which counts or ignores them.
+ */
+#ifndef _ETS_SYS_H
+#define _ETS_SYS_H
+#include "c_types.h"
+#include "eagle_soc.h"
+
+void mock_intr_mask(BOOL masked);
+
+#define ETS_UART_INTR_ATTACH(func, arg)	((void)(func), (void)(arg))
+#define ETS_UART_INTR_ENABLE()			mock_intr_mask(FALSE)
+#define ETS_UART_INTR_DISABLE()			mock_intr_mask(TRUE)
+#define ETS_INTR_LOCK()					mock_intr_mask(TRUE)
+#define ETS_INTR_UNLOCK()				mock_intr_mask(FALSE)
+
+void uart_div_modify(uint8 uart_no, uint32 div);
+
+#endif
@@ -0,0 +1,10 @@
+/*
+ * gpio.h
+ *
+ *  Host stand-in for the SDK header, only what the driver headers need.
+ */
+#ifndef _GPIO_H_
+#define _GPIO_H_
+#include "c_types.h"
+
+#endif
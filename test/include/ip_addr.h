@@ -0,0 +1,21 @@
+/*
+ * ip_addr.h
+ *
+ *  Host stand-in for the SDK header.
+ */
+#ifndef __IP_ADDR_H__
+#define __IP_ADDR_H__
+#include "c_types.h"
+
+struct ip_addr {
+	uint32 addr;
+};
+typedef struct ip_addr ip_addr_t;
+
+struct ip_info {
+	struct ip_addr ip;
+	struct ip_addr netmask;
+	struct ip_addr gw;
+};
+
+#endif
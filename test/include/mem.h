@@ -0,0 +1,15 @@
+/*
+ * mem.h
+ *
+ *  Host stand-in for the SDK header, the heap calls map to libc.
+ */
+#ifndef __MEM_H__
+#define __MEM_H__
+#include <stdlib.h>
+
+#define os_malloc	malloc
+#define os_zalloc(s)	calloc(1, s)
+#define os_free		free
+#define os_realloc	realloc
+
+#endif
@@ -0,0 +1,31 @@
+/*
+ * os_type.h
+ *
+ *  Host stand-in for the SDK header.
+ */
+#ifndef _OS_TYPES_H_
+#define _OS_TYPES_H_
+#include "c_types.h"
+
+typedef void ETSTimerFunc(void *arg);
+typedef struct _ETSTIMER_ {
+	struct _ETSTIMER_ *timer_next;
+	uint32_t timer_expire;
+	uint32_t timer_period;
+	ETSTimerFunc *timer_func;
+	void *timer_arg;
+} ETSTimer;
+
+typedef uint32_t os_signal_t;
+typedef uint32_t os_param_t;
+typedef struct {
+	os_signal_t sig;
+	os_param_t par;
+} os_event_t;
+typedef void (*os_task_t)(os_event_t *e);
+
+#define os_timer_func_t	ETSTimerFunc
+#define os_timer_t		ETSTimer
+#define os_event_t		os_event_t
+
+#endif
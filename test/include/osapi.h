@@ -0,0 +1,35 @@
+/*
+ * osapi.h
+ *
+ *  Host stand-in for the SDK header, the os_ calls map to libc.
+ */
+#ifndef _OSAPI_H_
+#define _OSAPI_H_
+#include <stdio.h>
+#include <string.h>
+#include "os_type.h"
+
+#define os_memcmp	memcmp
+#define os_memcpy	memcpy
+#define os_memmove	memmove
+#define os_memset	memset
+#define os_strcat	strcat
+#define os_strchr	strchr
+#define os_strcmp	strcmp
+#define os_strcpy	strcpy
+#define os_strlen	strlen
+#define os_strncmp	strncmp
+#define os_strncpy	strncpy
+#define os_strstr	strstr
+#define os_sprintf	sprintf
+#ifndef os_printf
+#define os_printf	printf
+#endif
+
+void os_delay_us(uint16 us);
+void os_install_putc1(void (*p)(char c));
+void os_timer_arm(ETSTimer *ptimer, uint32_t ms, bool repeat);
+void os_timer_disarm(ETSTimer *ptimer);
+void os_timer_setfn(ETSTimer *ptimer, ETSTimerFunc *pfunction, void *parg);
+
+#endif
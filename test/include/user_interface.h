@@ -0,0 +1,25 @@
+/*
+ * user_interface.h
+ *
+ *  Host stand-in for the SDK header.
+ */
+#ifndef __USER_INTERFACE_H__
+#define __USER_INTERFACE_H__
+#include "os_type.h"
+#include "ip_addr.h"
+#include "spi_flash.h"
+
+typedef enum _auth_mode {
+	AUTH_OPEN = 0,
+	AUTH_WEP,
+	AUTH_WPA_PSK,
+	AUTH_WPA2_PSK,
+	AUTH_WPA_WPA2_PSK,
+	AUTH_MAX
+} AUTH_MODE;
+
+bool system_os_post(uint8 prio, os_signal_t sig, os_param_t par);
+uint32 system_get_time(void);
+uint32 system_get_chip_id(void);
+
+#endif
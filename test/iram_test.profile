@@ -0,0 +1,10 @@
+# Profile for the IRAM placement test, hottest first by weight
+
+RINGBUF_Get         900
+UTILS_Crc32         800
+sha256_block        700     # static, found by its section
+SHA256_Update       600
+RINGBUF_Put         500     # not ICACHE_FLASH_ATTR, in IRAM already
+DHTDecode           400
+no_such_function    300
+RINGBUF_Read                # no weight, after all that have one
@@ -0,0 +1,145 @@
+#!/usr/bin/env python
+#
+# tools/iram.py place and report on the host link of hostlink.py. The
+# profile is iram_test.profile; with a budget for its first three functions
+# only those may leave flash, with a large one all of them, and every
+# symbol is checked against the region it has to be in.
+#
+#   iram_test.py [--cc gcc] [--objcopy objcopy] [--ld ld] [--ar ar]
+#
+# Without a linker for elf32_x86_64 the test is skipped with a note.
+
+import sys
+import os
+import re
+import argparse
+
+from hostlink import (WORK, SDK_LD, ARCHIVE, IRAM, DRAM, FLASH, FLASH_FUNCTIONS, FLASH_TABLES, IRAM_FUNCTIONS,
+                      arguments, usable, run, tool, build, link, within)
+from iram import Elf, STT_FUNC
+
+PROFILE = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'iram_test.profile')
+
+HOTTEST = ['RINGBUF_Get', 'UTILS_Crc32', 'sha256_block']
+PROFILED = HOTTEST + ['SHA256_Update', 'DHTDecode', 'RINGBUF_Read']
+
+checks = failures = 0
+
+
+def check(cond, what):
+    global checks, failures
+    checks += 1
+    if not cond:
+        failures += 1
+        print('iram_test.py: check failed: %s' % what)
+
+
+def sizes(objects):
+    """Bytes each function takes, its sections word aligned as iram.py counts them"""
+    found = {}
+    for obj in objects:
+        for s in Elf(obj).sections:
+            if s['name'].startswith('.text.'):
+                name = s['name'].split('.')[2]
+                found[name] = found.get(name, 0) + (s['size'] + 3) // 4 * 4
+    return found
+
+
+def place_and_link(args, objects, budget, name):
+    script = os.path.join(WORK, name + '.ld')
+    out = run(tool('iram.py', 'place', '--ld', SDK_LD, '--archive', ARCHIVE, '--build', WORK,
+                   '--budget', str(budget), '-o', script, PROFILE, *objects))
+    return out, script, link(args, script, name)
+
+
+def test_budget(args, objects, fn_sizes):
+    budget = sum(fn_sizes[n] for n in HOTTEST) + 4
+    out, script, image = place_and_link(args, objects, budget, 'hot3')
+
+    m = re.search(r'IRAM: (\d+) of (\d+) bytes budget for (\d+) hot functions', out)
+    check(m is not None, 'place summary: ' + out)
+    if m:
+        check(int(m.group(1)) == budget - 4 and int(m.group(2)) == budget, 'bytes used of the budget: ' + out)
+        check(int(m.group(3)) == len(HOTTEST), 'hot functions: ' + out)
+    for name in PROFILED[len(HOTTEST):]:
+        check('IRAM: %s (%d bytes) does not fit' % (name, fn_sizes[name]) in out, '%s over the budget: %s' % (name, out))
+    check('IRAM: RINGBUF_Put is not ICACHE_FLASH_ATTR' in out, 'RINGBUF_Put in IRAM already: ' + out)
+    check('IRAM: no_such_function not found' in out, 'missing function: ' + out)
+
+    with open(script) as f:
+        text = f.read()
+    check(text.startswith('/* generated by tools/iram.py'), 'generated script header')
+    include = re.search(r'INCLUDE "([^"]+)"', text)
+    check(include is not None and os.path.isabs(include.group(1)) and os.path.exists(include.group(1)),
+          'INCLUDE made absolute')
+    check(text.index('.irom0.text') < text.index('.data :'), '.irom0.text hoisted to the top')
+
+    elf = Elf(image)
+    symbols = dict((s['name'], s) for s in elf.symbols if s['name'])
+    for name in FLASH_FUNCTIONS:
+        area = IRAM if name in HOTTEST else FLASH
+        check(name in symbols and within(symbols[name]['value'], area),
+              '%s at %08x' % (name, symbols.get(name, {}).get('value', 0)))
+    for name in IRAM_FUNCTIONS:
+        check(name in symbols and within(symbols[name]['value'], IRAM), '%s in IRAM' % name)
+    # ICACHE_RODATA_ATTR tables stay in flash, the rest of the data in DRAM
+    for name in FLASH_TABLES:
+        check(within(symbols[name]['value'], FLASH), '%s in flash' % name)
+    for name in ('rxBuf', 'rxRing', 'crc', 'digest', 'intrHandlers'):
+        check(within(symbols[name]['value'], DRAM), '%s in DRAM' % name)
+
+    # report agrees with the image
+    out = run(tool('iram.py', 'report', '--profile', PROFILE, image))
+    text_size = sum(s['size'] for s in elf.sections if s['name'] == '.text')
+    check('IRAM: %d of 32768 bytes used, %d free' % (text_size, 32768 - text_size) in out, 'report total: ' + out)
+    for name in PROFILED:
+        where = 'IRAM' if name in HOTTEST else 'flash'
+        check(re.search(r'^  %s +%d  %s ' % (name, symbols[name]['size'], where), out, re.M) is not None,
+              'report of %s: %s' % (name, out))
+    check(re.search(r'^  no_such_function +inlined$', out, re.M) is not None, 'report of a missing function')
+    hot = sum(symbols[n]['size'] for n in HOTTEST) + symbols['RINGBUF_Put']['size']
+    check('IRAM: %d bytes of profiled functions' % hot in out, 'profiled bytes in IRAM: ' + out)
+
+
+def test_everything(args, objects, fn_sizes):
+    out, script, image = place_and_link(args, objects, 0x8000, 'all')
+    check('IRAM: %d of 32768 bytes budget for %d hot functions' %
+          (sum(fn_sizes[n] for n in PROFILED), len(PROFILED)) in out, 'large budget: ' + out)
+    check('does not fit' not in out, 'large budget: ' + out)
+    symbols = dict((s['name'], s) for s in Elf(image).symbols if s['type'] == STT_FUNC)
+    for name in FLASH_FUNCTIONS:
+        area = IRAM if name in PROFILED else FLASH
+        check(within(symbols[name]['value'], area), '%s with the large budget' % name)
+
+
+def test_nothing(args, objects):
+    out, script, image = place_and_link(args, objects, 0, 'none')
+    check('IRAM: 0 of 0 bytes budget for 0 hot functions' in out, 'no budget: ' + out)
+    symbols = dict((s['name'], s) for s in Elf(image).symbols if s['type'] == STT_FUNC)
+    for name in FLASH_FUNCTIONS:
+        check(within(symbols[name]['value'], FLASH), '%s without a budget' % name)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='tools/iram.py on a host link')
+    arguments(parser)
+    args = parser.parse_args()
+
+    if not usable(args):
+        print('iram: skipped, %s cannot link elf32_x86_64' % args.ld)
+        return 0
+
+    if not os.path.isdir(WORK):
+        os.makedirs(WORK)
+    objects = build(args)
+    fn_sizes = sizes(objects)
+    test_budget(args, objects, fn_sizes)
+    test_everything(args, objects, fn_sizes)
+    test_nothing(args, objects)
+
+    print('iram: %d checks, %d failed' % (checks, failures))
+    return failures != 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
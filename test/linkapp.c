@@ -0,0 +1,52 @@
+/*
+ * linkapp.c
+ *
+ *  user_init of the image the tool tests link from a few firmware units
+ *  (hostlink.py): a ring filled by an interrupt handler and drained by a
+ *  task that checksums and hashes what comes out, and a table in flash.
+ */
+#include "ets_sys.h"
+#include "osapi.h"
+#include "ringbuf.h"
+#include "utils.h"
+#include "sha256.h"
+#include "driver/dht22.h"
+
+LOCAL RINGBUF rxRing;
+LOCAL U8 rxBuf[256];
+LOCAL uint16_t pulses[2 + 2 * DHT_BITS];
+uint8_t digest[SHA256_SIZE];
+uint32_t crc;
+
+LOCAL const uint8_t banner[16] ICACHE_RODATA_ATTR = "linkapp";
+
+/* runs with the cache possibly off, it stays in IRAM */
+void rx_intr_handler(void *arg)
+{
+	RINGBUF_Put(&rxRing, *(volatile U8 *)arg);
+}
+
+void ICACHE_FLASH_ATTR rx_task(void)
+{
+	SHA256_CTX ctx;
+	U8 buf[64];
+	uint8_t data[5];
+	I32 n;
+
+	SHA256_Init(&ctx);
+	while ((n = RINGBUF_Read(&rxRing, buf, sizeof buf)) > 0) {
+		crc = UTILS_Crc32(crc, buf, n);
+		SHA256_Update(&ctx, buf, n);
+	}
+	SHA256_Final(&ctx, digest);
+	DHTDecode(pulses, sizeof pulses / sizeof pulses[0], data);
+}
+
+void (*intrHandlers[1])(void *) = { rx_intr_handler };
+
+void ICACHE_FLASH_ATTR user_init(void)
+{
+	RINGBUF_Init(&rxRing, rxBuf, sizeof rxBuf);
+	crc = UTILS_Crc32(0, banner, sizeof banner);
+	rx_task();
+}
@@ -0,0 +1,150 @@
+#!/usr/bin/env python
+#
+# tools/memreport.py on the host link of hostlink.py, laid out by
+# tools/iram.py with nothing hot so ICACHE_FLASH_ATTR code and tables are
+# in flash: the region totals against the image's sections, every module's
+# row of the map against its object, the largest symbols, the deepest stack
+# chains against the .su files, and the exit status of --check with each
+# budget met exactly and missed by a byte.
+#
+#   memreport_test.py [--cc gcc] [--objcopy objcopy] [--ld ld] [--ar ar]
+#
+# Without a linker for elf32_x86_64 the test is skipped with a note.
+
+import sys
+import os
+import re
+import argparse
+
+from hostlink import (WORK, SDK_LD, ARCHIVE, FLASH_FUNCTIONS, FLASH_TABLES, arguments, usable, run, tool,
+                      build, link)
+from iram import Elf, SHF_ALLOC, SHT_NOBITS
+
+REGIONS = ('iram', 'data', 'rodata', 'bss', 'flash')
+
+checks = failures = 0
+
+
+def check(cond, what):
+    global checks, failures
+    checks += 1
+    if not cond:
+        failures += 1
+        print('memreport_test.py: check failed: %s' % what)
+
+
+def expected(obj):
+    """Bytes of each region an object should add to the image"""
+    sizes = dict((r, 0) for r in REGIONS)
+    for s in Elf(obj).sections:
+        if not s['flags'] & SHF_ALLOC or not s['size']:
+            continue
+        name = s['name'].split('.')[2] if s['name'].count('.') >= 2 else None
+        if s['name'].startswith('.text'):
+            where = 'flash' if name in FLASH_FUNCTIONS else 'iram'
+        elif s['name'].startswith('.rodata'):
+            where = 'flash' if name in FLASH_TABLES else 'rodata'
+        elif s['type'] == SHT_NOBITS:
+            where = 'bss'
+        else:
+            where = 'data'
+        sizes[where] += s['size']
+    return sizes
+
+
+def frames(objects):
+    """{function: bytes} from the .su files"""
+    found = {}
+    for obj in objects:
+        with open(obj[:-2] + '.su') as f:
+            for line in f:
+                fields = line.split('\t')
+                found[fields[0].split(':')[-1]] = int(fields[1])
+    return found
+
+
+def test_report(image, objects):
+    out = run(tool('memreport.py', '--map', image + '.map', image, *objects))
+    elf = Elf(image)
+    section = dict((s['name'], s['size']) for s in elf.sections)
+    used = {'iram': section['.text'], 'data': section['.data'], 'rodata': section['.rodata'],
+            'bss': section['.bss'], 'flash': section['.irom0.text']}
+
+    dram = used['data'] + used['rodata'] + used['bss']
+    for name, value in (('IRAM', used['iram']), ('DRAM', dram), ('flash', used['flash'])):
+        check(re.search(r'^%-8s %8d +-$' % (name, value), out, re.M) is not None, '%s total: %s' % (name, out))
+    check('DRAM: %d .data, %d .rodata, %d .bss' % (used['data'], used['rodata'], used['bss']) in out,
+          'DRAM split: ' + out)
+
+    # a row per object of the archive, as the map has them
+    for obj in objects:
+        sizes = expected(obj)
+        row = '%-24s %7d %7d %7d %7d %7d' % ((os.path.basename(obj),) + tuple(sizes[r] for r in REGIONS))
+        check(row in out, 'module row %s: %s' % (row, out))
+
+    symbols = dict((s['name'], s) for s in elf.symbols if s['name'])
+    largest = re.search(r'^largest in flash:\n +(\d+)  (\S+) +(\S+)$', out, re.M)
+    check(largest is not None and largest.groups() == (str(symbols['sha256_block']['size']), 'sha256_block', 'sha256.o'),
+          'largest in flash: ' + out)
+    check(re.search(r'^ +%d  rxBuf +linkapp.o$' % symbols['rxBuf']['size'], out, re.M) is not None,
+          'rxBuf among the largest in bss: ' + out)
+
+    # the static callee is a node of its object, the table makes the handler a root
+    frame = frames(objects)
+    chains = dict((m.group(3).split(' > ')[0], (int(m.group(1)), m.group(2), m.group(3).split(' > ')))
+                  for m in re.finditer(r'^ +(\d+)([ +]) (.+)$', out[out.index('stack, deepest'):], re.M))
+    depth, flagged, chain = chains.get('user_init', (0, '', ['']))
+    check(chain[:2] == ['user_init', 'rx_task'] and chain[-1] == 'sha256.o:sha256_block',
+          'deepest chain from user_init: ' + out)
+    check(depth == sum(frame[n.split(':')[-1]] for n in chain), 'depth of the chain from user_init: ' + out)
+    check(chains.get('rx_intr_handler', (0,))[0] == frame['rx_intr_handler'] + frame['RINGBUF_Put'],
+          'chain from the interrupt handler: ' + out)
+    check(len(chains) == 2, 'roots: ' + out)
+    check('frames of 1 SDK functions not known' in out, 'memcpy from ROM: ' + out)
+    return used, chains['user_init'][0]
+
+
+def test_check(image, objects, used, stack):
+    """Each budget met exactly passes, a byte less fails"""
+    budgets = (('IRAM', '--iram', used['iram']),
+               ('DRAM', '--dram', used['data'] + used['rodata'] + used['bss']),
+               ('flash', '--flash', used['flash']),
+               ('stack', '--stack', stack))
+    exact = sum(([option, str(value)] for name, option, value in budgets), [])
+    out = run(tool('memreport.py', '--check', '--map', image + '.map', *(exact + [image] + objects)))
+    check('OVER' not in out, 'budgets met: ' + out)
+    check('stack: user_init > rx_task' in out, '--check shows the deepest chain: ' + out)
+    for name, option, value in budgets:
+        out = run(tool('memreport.py', '--check', option, str(value - 1), image, *objects), status=1)
+        check('OVER BUDGET %s: %d bytes, 1 over the budget of %d' % (name, value, value - 1) in out,
+              '%s over budget: %s' % (name, out))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='tools/memreport.py on a host link')
+    arguments(parser)
+    args = parser.parse_args()
+
+    if not usable(args):
+        print('memreport: skipped, %s cannot link elf32_x86_64' % args.ld)
+        return 0
+
+    if not os.path.isdir(WORK):
+        os.makedirs(WORK)
+    objects = build(args)
+    profile = os.path.join(WORK, 'empty.profile')
+    open(profile, 'w').close()
+    script = os.path.join(WORK, 'memreport.ld')
+    run(tool('iram.py', 'place', '--ld', SDK_LD, '--archive', ARCHIVE, '--build', WORK, '--budget', '0',
+             '-o', script, profile, *objects))
+    image = link(args, script, 'memreport')
+
+    used, stack = test_report(image, objects)
+    test_check(image, objects, used, stack)
+
+    print('memreport: %d checks, %d failed' % (checks, failures))
+    return failures != 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
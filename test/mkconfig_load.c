@@ -0,0 +1,131 @@
+/*
+ * mkconfig_load.c
+ *
+ *  config_load over a flash holding an image of tools/mkconfig.py at
+ *  CFG_LOCATION, then every SYSCFG field as "path offset value" with the
+ *  paths mkconfig.py names them by, for mkconfig_test.py to compare.
+ *
+ *    mkconfig_load <image, - for a blank flash> <chip id in hex>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include "flashfake.h"
+#include "spi_flash.h"
+#include "config.h"
+#include "metrics.h"
+
+#define FLASH_PATH		"build/mkconfig_flash.bin"
+
+uint32_t metrics[METRIC_COUNT];
+static uint32 chipId;
+
+uint32 system_get_chip_id(void)
+{
+	return chipId;
+}
+
+static void put_image(const char *path)
+{
+	static uint32 buf[CFG_SECTORS * SPI_FLASH_SEC_SIZE / 4];
+	FILE *f = fopen(path, "rb");
+	size_t len;
+
+	if (!f) {
+		perror(path);
+		exit(2);
+	}
+	len = fread(buf, 1, sizeof buf, f);
+	fclose(f);
+	if (spi_flash_write(CFG_LOCATION * SPI_FLASH_SEC_SIZE, buf, len & ~3) != SPI_FLASH_RESULT_OK) {
+		fprintf(stderr, "%s: %u bytes do not fit the flash\n", path, (unsigned)len);
+		exit(2);
+	}
+}
+
+#define NUM(path, base, field) \
+	printf("%s %u %u\n", path, (unsigned)((const uint8_t *)&(base)->field - (const uint8_t *)&config), \
+			(unsigned)(base)->field)
+#define STR(path, base, field) \
+	printf("%s %u %.*s\n", path, (unsigned)((const uint8_t *)(base)->field - (const uint8_t *)&config), \
+			(int)sizeof((base)->field), (const char *)(base)->field)
+
+static void dump_filter(const char *prefix, const FILTER_CFG *f)
+{
+	char path[48];
+
+	sprintf(path, "%smedian", prefix);
+	NUM(path, f, median);
+	sprintf(path, "%sdeadband", prefix);
+	NUM(path, f, deadband);
+	sprintf(path, "%sheartbeat", prefix);
+	NUM(path, f, heartbeat);
+}
+
+static void dump(void)
+{
+	char path[48];
+	int i;
+
+	NUM("cfg_holder", &config, cfg_holder);
+	STR("device_id", &config, device_id);
+	STR("mqtt_topic", &config, mqtt_topic);
+	STR("sta_ssid", &config, sta_ssid);
+	STR("sta_pwd", &config, sta_pwd);
+	NUM("sta_type", &config, sta_type);
+	STR("mqtt_host", &config, mqtt_host);
+	NUM("mqtt_port", &config, mqtt_port);
+	STR("mqtt_user", &config, mqtt_user);
+	STR("mqtt_pass", &config, mqtt_pass);
+	NUM("mqtt_keepalive", &config, mqtt_keepalive);
+	NUM("security", &config, security);
+	for (i = 0; i < SENSOR_MAX; i++) {
+		const SENSOR_CFG *s = &config.sensors[i];
+
+		sprintf(path, "sensors[%d].pin", i);
+		NUM(path, s, pin);
+		sprintf(path, "sensors[%d].type", i);
+		NUM(path, s, type);
+		sprintf(path, "sensors[%d].name", i);
+		STR(path, s, name);
+		sprintf(path, "sensors[%d].temp_filter.", i);
+		dump_filter(path, &s->temp_filter);
+		sprintf(path, "sensors[%d].hum_filter.", i);
+		dump_filter(path, &s->hum_filter);
+	}
+	NUM("aggr_window", &config, aggr_window);
+	NUM("sampling.min_ms", &config, sampling.min_ms);
+	NUM("sampling.max_ms", &config, sampling.max_ms);
+	NUM("sampling.threshold", &config, sampling.threshold);
+	STR("sntp_host", &config, sntp_host);
+	NUM("sntp_interval", &config, sntp_interval);
+	NUM("batch_size", &config, batch_size);
+	NUM("ota_trial", &config, ota_trial);
+	for (i = 0; i < STA_NETS; i++) {
+		sprintf(path, "sta_nets[%d].ssid", i);
+		STR(path, &config.sta_nets[i], ssid);
+		sprintf(path, "sta_nets[%d].pwd", i);
+		STR(path, &config.sta_nets[i], pwd);
+	}
+	NUM("roam_rssi", &config, roam_rssi);
+	NUM("power_mode", &config, power_mode);
+	// how config_load took it: an image is used as it is, a blank flash gets the defaults saved
+	printf("sizeof %u\n", (unsigned)sizeof(SYSCFG));
+	printf("saves %u\n", (unsigned)metrics[METRIC_CFG_SAVES]);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s <image, - for a blank flash> <chip id in hex>\n", argv[0]);
+		return 2;
+	}
+	chipId = strtoul(argv[2], NULL, 16);
+	FLASHFAKE_Open(FLASH_PATH);
+	if (argv[1][0] != '-')
+		put_image(argv[1]);
+	config_load();
+	dump();
+	FLASHFAKE_Close();
+	return 0;
+}
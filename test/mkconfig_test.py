@@ -0,0 +1,128 @@
+#!/usr/bin/env python
+#
+# tools/mkconfig.py images through config_load: rows of a CSV rendered,
+# each image put at CFG_LOCATION of a file-backed flash and loaded by
+# mkconfig_load, built from modules/config.c and modules/cfgstore.c over
+# flashfake.c, and every SYSCFG field compared with the row over the
+# defaults, at the offset mkconfig.py puts it. A blank flash has to load
+# the same defaults, which keeps defaults() in step with config_defaults().
+#
+#   mkconfig_test.py [--load build/mkconfig_load]
+
+import sys
+import os
+import argparse
+import subprocess
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+ROOT = os.path.dirname(HERE)
+sys.path.insert(0, os.path.join(ROOT, 'tools'))
+
+from mkconfig import Headers, defaults
+
+WORK = os.path.join(HERE, 'build', 'mkconfig')
+CSV = os.path.join(WORK, 'devices.csv')
+
+# a row setting strings, numbers in hex, nested fields and a string as long as its field allows
+COLUMNS = ['chip_id', 'sta_ssid', 'sta_pwd', 'sta_type', 'mqtt_host', 'mqtt_port', 'mqtt_topic', 'security',
+           'sensors[1].pin', 'sensors[1].type', 'sensors[1].name', 'sensors[1].temp_filter.deadband',
+           'sampling.min_ms', 'sampling.threshold', 'sta_nets[0].ssid', 'sta_nets[2].pwd', 'roam_rssi']
+SITE = ['00A1B2C3', 'site4', 'secret pw', '0x3', '10.4.0.2', '8883', '/site4/a/', '1',
+        '5', '0', 'annex', '3', '4000', '65535', 'site4-annex', 'p' * 63, '75']
+# every cell empty: the defaults for its chip
+BARE = ['00c0ffee'] + [''] * (len(COLUMNS) - 1)
+
+checks = failures = 0
+
+
+def check(cond, what):
+    global checks, failures
+    checks += 1
+    if not cond:
+        failures += 1
+        print('mkconfig_test.py: check failed: %s' % what)
+
+
+def mkconfig(*args):
+    p = subprocess.Popen([sys.executable, os.path.join(ROOT, 'tools', 'mkconfig.py')] + list(args),
+                         stdout=subprocess.PIPE, stderr=subprocess.STDOUT, cwd=HERE)
+    out = p.communicate()[0].decode('latin-1')
+    return p.returncode, out
+
+
+def load(loader, image, chip_id):
+    """{path: (offset, value)} of config after config_load"""
+    out = subprocess.Popen([loader, image, '%08X' % chip_id], stdout=subprocess.PIPE,
+                           cwd=HERE).communicate()[0].decode('latin-1')
+    found = {}
+    for line in out.splitlines():
+        fields = line.split(' ', 2)
+        found[fields[0]] = (int(fields[1]), fields[2] if len(fields) > 2 else '')
+    return found
+
+
+def compare(h, fields, loaded, chip_id, row, what):
+    expected = defaults(h, chip_id)
+    for name, cell in zip(COLUMNS[1:], row[1:]):
+        if cell:
+            expected[name] = cell if isinstance(fields[name][1], int) else int(cell, 0)
+    check(set(loaded) - set(['sizeof', 'saves']) == set(fields), '%s: fields %s' % (what, sorted(loaded)))
+    check(loaded.get('sizeof', (0,))[0] == h.struct('SYSCFG')['size'], '%s: sizeof(SYSCFG) %s' %
+          (what, loaded.get('sizeof')))
+    for path, (offset, kind) in fields.items():
+        got_offset, got = loaded.get(path, (None, None))
+        if isinstance(kind, int):
+            want = str(expected.get(path, ''))[:kind]
+        else:
+            want = str(expected.get(path, 0) & 0xffffffff)
+        check(got_offset == offset, '%s: %s at %s, mkconfig.py has %d' % (what, path, got_offset, offset))
+        check(got == want, '%s: %s is "%s", not "%s"' % (what, path, got, want))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='tools/mkconfig.py images through config_load')
+    parser.add_argument('--load', default=os.path.join(HERE, 'build', 'mkconfig_load'))
+    args = parser.parse_args()
+    loader = os.path.abspath(args.load)
+
+    if not os.path.isdir(WORK):
+        os.makedirs(WORK)
+    h = Headers()
+    fields = h.flatten('SYSCFG')
+
+    with open(CSV, 'w') as f:
+        for row in (COLUMNS, SITE, BARE):
+            f.write(','.join(row) + '\n')
+    status, out = mkconfig(CSV, WORK)
+    check(status == 0 and out.startswith('2 images of %d bytes' % (h.value('CFG_SECTORS') * 4096)),
+          'rendering: ' + out)
+
+    for row in (SITE, BARE):
+        chip_id = int(row[0], 16)
+        loaded = load(loader, os.path.join(WORK, '%08X.bin' % chip_id), chip_id)
+        check(loaded.get('saves') == (0, ''), 'chip %08X: the image is taken as it is, %s' %
+              (chip_id, loaded.get('saves')))
+        compare(h, fields, loaded, chip_id, row, 'chip %08X' % chip_id)
+
+    # no record at all: config_defaults() has to match defaults()
+    chip_id = int(BARE[0], 16)
+    loaded = load(loader, '-', chip_id)
+    check(loaded.get('saves') == (1, ''), 'blank flash: defaults saved once, %s' % (loaded.get('saves'),))
+    compare(h, fields, loaded, chip_id, BARE, 'blank flash')
+
+    # a string one byte too long and an unknown field stop the tool
+    with open(CSV, 'w') as f:
+        f.write('chip_id,sensors[0].name\n00A1B2C3,%s\n' % ('n' * 14))
+    status, out = mkconfig(CSV, WORK)
+    check(status != 0 and 'sensors[0].name is longer than 13 bytes' in out, 'long string: ' + out)
+    with open(CSV, 'w') as f:
+        f.write('chip_id,no_such_field\n00A1B2C3,1\n')
+    status, out = mkconfig(CSV, WORK)
+    check(status != 0 and 'no SYSCFG field "no_such_field"' in out, 'unknown field: ' + out)
+
+    print('mkconfig: %d checks, %d failed' % (checks, failures))
+    return failures != 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,187 @@
+/*
+ * ringbuf_test.c
+ *
+ *  RINGBUF against a byte-by-byte model, at power of two sizes and not,
+ *  then the per-byte cost of moving data through it: the byte calls and
+ *  the bulk calls against the fill_cnt implementation they replaced.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "test.h"
+#include "ringbuf.h"
+
+/* The ring buffer before the SPSC rewrite, for the benchmark */
+typedef struct {
+	U8 *p_o;
+	U8 *volatile p_r;
+	U8 *volatile p_w;
+	volatile I32 fill_cnt;
+	I32 size;
+} OLD_RINGBUF;
+
+static void old_init(OLD_RINGBUF *r, U8 *buf, I32 size)
+{
+	r->p_o = r->p_r = r->p_w = buf;
+	r->fill_cnt = 0;
+	r->size = size;
+}
+
+static I16 old_put(OLD_RINGBUF *r, U8 c)
+{
+	if (r->fill_cnt >= r->size)
+		return -1;
+	r->fill_cnt++;
+	*r->p_w++ = c;
+	if (r->p_w >= r->p_o + r->size)
+		r->p_w = r->p_o;
+	return 0;
+}
+
+static I16 old_get(OLD_RINGBUF *r, U8 *c)
+{
+	if (r->fill_cnt <= 0)
+		return -1;
+	r->fill_cnt--;
+	*c = *r->p_r++;
+	if (r->p_r >= r->p_o + r->size)
+		r->p_r = r->p_o;
+	return 0;
+}
+
+static void test_model(I32 size)
+{
+	U8 buf[1024], model[4096], out[1100], peek[1100];
+	RINGBUF rb;
+	U32 head = 0, tail = 0;		/* model indices into model[], never wrap */
+	int round, i, n, got;
+
+	srand(size);
+	CHECK_EQ(RINGBUF_Init(&rb, buf, size), 0);
+	for (round = 0; round < 20000; round++) {
+		n = rand() % (size + 8);
+		switch (rand() % 4) {
+		case 0:		/* bulk write */
+			for (i = 0; i < n; i++)
+				out[i] = rand();
+			got = RINGBUF_Write(&rb, out, n);
+			CHECK_EQ(got, n < (int)(size - (head - tail)) ? n : (int)(size - (head - tail)));
+			for (i = 0; i < got; i++)
+				model[(head + i) % sizeof model] = out[i];
+			head += got;
+			break;
+		case 1:		/* byte writes */
+			for (i = 0; i < n % 16; i++) {
+				U8 c = rand();
+				if (RINGBUF_Put(&rb, c) == 0)
+					model[head++ % sizeof model] = c;
+				else
+					CHECK_EQ(head - tail, size);
+			}
+			break;
+		case 2:		/* peek then read */
+			got = RINGBUF_Peek(&rb, peek, n);
+			CHECK_EQ(got, n < (int)(head - tail) ? n : (int)(head - tail));
+			CHECK_EQ(RINGBUF_Read(&rb, out, n), got);
+			CHECK(memcmp(peek, out, got) == 0);
+			for (i = 0; i < got; i++)
+				CHECK_EQ(out[i], model[(tail + i) % sizeof model]);
+			tail += got;
+			break;
+		case 3:		/* byte reads */
+			for (i = 0; i < n % 16; i++) {
+				U8 c;
+				if (RINGBUF_Get(&rb, &c) == 0)
+					CHECK_EQ(c, model[tail++ % sizeof model]);
+				else
+					CHECK_EQ(head, tail);
+			}
+			break;
+		}
+		CHECK_EQ(RINGBUF_Count(&rb), head - tail);
+		CHECK_EQ(RINGBUF_Free(&rb), size - (head - tail));
+	}
+}
+
+#define BENCH_BYTES		(64 << 20)
+#define BENCH_CHUNK		64
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Best of a few runs, in nanoseconds per byte written and read back */
+#define BENCH(result, body) do { \
+	int _run; \
+	result = 1e9; \
+	for (_run = 0; _run < 3; _run++) { \
+		double _t = now(); \
+		body; \
+		_t = (now() - _t) * 1e9 / BENCH_BYTES; \
+		if (_t < result) \
+			result = _t; \
+	} \
+} while (0)
+
+static void bench(void)
+{
+	static U8 buf[1024];
+	U8 chunk[BENCH_CHUNK], c;
+	volatile U8 sink = 0;
+	OLD_RINGBUF old;
+	RINGBUF rb;
+	double oldByte, newByte, newBulk;
+	long n;
+	int i;
+
+	for (i = 0; i < BENCH_CHUNK; i++)
+		chunk[i] = i;
+
+	old_init(&old, buf, sizeof buf);
+	BENCH(oldByte, for (n = 0; n < BENCH_BYTES; n += BENCH_CHUNK) {
+		for (i = 0; i < BENCH_CHUNK; i++)
+			old_put(&old, chunk[i]);
+		for (i = 0; i < BENCH_CHUNK; i++) {
+			old_get(&old, &c);
+			sink += c;
+		}
+	});
+
+	RINGBUF_Init(&rb, buf, sizeof buf);
+	BENCH(newByte, for (n = 0; n < BENCH_BYTES; n += BENCH_CHUNK) {
+		for (i = 0; i < BENCH_CHUNK; i++)
+			RINGBUF_Put(&rb, chunk[i]);
+		for (i = 0; i < BENCH_CHUNK; i++) {
+			RINGBUF_Get(&rb, &c);
+			sink += c;
+		}
+	});
+
+	BENCH(newBulk, for (n = 0; n < BENCH_BYTES; n += BENCH_CHUNK) {
+		RINGBUF_Write(&rb, chunk, BENCH_CHUNK);
+		RINGBUF_Read(&rb, chunk, BENCH_CHUNK);
+		sink += chunk[0];
+	});
+
+	printf("ringbuf: ns per byte in and out, %d byte chunks through a %d byte ring\n",
+			BENCH_CHUNK, (int)sizeof buf);
+	printf("  fill_cnt Put/Get   %6.2f\n", oldByte);
+	printf("  SPSC Put/Get       %6.2f\n", newByte);
+	printf("  SPSC Write/Read    %6.2f  (%.1fx)\n", newBulk, oldByte / newBulk);
+	// by a wide margin, a loaded machine does not turn it around
+	CHECK(newBulk < oldByte);
+}
+
+int main(int argc, char **argv)
+{
+	test_model(1024);
+	test_model(100);
+	test_model(2);
+	if (argc < 2 || strcmp(argv[1], "--no-bench") != 0)
+		bench();
+	return TEST_Done("ringbuf");
+}
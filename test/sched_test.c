@@ -0,0 +1,104 @@
+/*
+ * sched_test.c
+ *
+ *  SCHED_Next against a 64-bit reference of the moving test over the full
+ *  range settings.c accepts: thresholds up to 0xFFFF, intervals up to
+ *  SCHED_CEIL_MS, deltas across the int32_t range. Then the intervals a
+ *  flat signal walks through, every one a whole number of minimum intervals.
+ */
+#include <stdlib.h>
+#include "test.h"
+#include "sched.h"
+
+/* the interval SCHED_Next returns for a sample moving by delta since the last */
+static uint32_t next(SCHED_CFG *cfg, uint32_t interval, int32_t prev, int32_t value)
+{
+	SCHED s;
+
+	SCHED_Init(&s, cfg, interval);
+	SCHED_Next(&s, &prev, 1);
+	s.interval = interval;
+	return SCHED_Next(&s, &value, 1);
+}
+
+static void check_decision(uint16_t threshold, uint32_t interval, int32_t prev, int32_t value)
+{
+	SCHED_CFG cfg = { SCHED_FLOOR_MS, SCHED_CEIL_MS, threshold };
+	long double delta = (long double)value - prev;
+	int moving = (delta < 0 ? -delta : delta) * 60000 >= (long double)threshold * interval;
+	uint32_t got = next(&cfg, interval, prev, value);
+	uint32_t grown = (interval + interval / 2 + SCHED_FLOOR_MS - 1) / SCHED_FLOOR_MS * SCHED_FLOOR_MS;
+
+	if (grown > SCHED_CEIL_MS)
+		grown = SCHED_CEIL_MS;
+
+	if (got != (moving ? SCHED_FLOOR_MS : grown))
+		printf("sched: threshold %u, interval %u, %ld -> %ld gave %u\n", threshold, interval,
+				(long)prev, (long)value, got);
+	CHECK_EQ(got, moving ? SCHED_FLOOR_MS : grown);
+}
+
+static void test_edges(void)
+{
+	// a threshold of 5000 over 1000 s was 5e9 and wrapped in 32 bits
+	check_decision(5000, 1000000, 0, 83333);
+	check_decision(5000, 1000000, 0, 83334);
+	check_decision(0xFFFF, SCHED_CEIL_MS, 0, 2184500);
+	check_decision(0xFFFF, SCHED_CEIL_MS, 0, 2184499);
+	check_decision(0xFFFF, SCHED_CEIL_MS, 0, -2184500);
+	// a delta over 71582 tenths wrapped the left side
+	check_decision(5, 2000, 0, 100000);
+	check_decision(0xFFFF, SCHED_FLOOR_MS, INT32_MIN, INT32_MAX);
+	check_decision(0, SCHED_FLOOR_MS, 7, 7);
+	check_decision(1, SCHED_CEIL_MS, 7, 7);
+}
+
+static void test_random(void)
+{
+	int i;
+
+	srand(1);
+	for (i = 0; i < 200000; i++) {
+		uint16_t threshold = rand() & 0xFFFF;
+		uint32_t interval = SCHED_FLOOR_MS + (uint32_t)rand() % (SCHED_CEIL_MS - SCHED_FLOOR_MS + 1);
+		int32_t prev = (int32_t)(((uint32_t)rand() << 16) ^ (uint32_t)rand()) >> (rand() % 32);
+		int32_t value = (int32_t)(((uint32_t)rand() << 16) ^ (uint32_t)rand()) >> (rand() % 32);
+
+		check_decision(threshold, interval, prev, value);
+	}
+}
+
+static void test_grid(uint32_t min_ms, uint32_t max_ms)
+{
+	SCHED_CFG cfg = { min_ms, max_ms, 1 };
+	uint32_t step = min_ms < SCHED_FLOOR_MS ? SCHED_FLOOR_MS : min_ms;
+	uint32_t top = (max_ms < step ? step : max_ms) / step * step;
+	uint32_t interval, last = 0;
+	int32_t value = 7;
+	SCHED s;
+	int i;
+
+	SCHED_Init(&s, &cfg, 2500);
+	CHECK_EQ(SCHED_Step(&s), step);
+	for (i = 0; i < 40; i++) {
+		interval = SCHED_Next(&s, &value, 1);
+		CHECK_EQ(interval % step, 0);
+		CHECK(interval >= last && interval <= top);
+		last = interval;
+	}
+	CHECK_EQ(last, top);
+	value += 1000;
+	CHECK_EQ(SCHED_Next(&s, &value, 1), step);
+}
+
+int main(void)
+{
+	test_edges();
+	test_random();
+	test_grid(SCHED_FLOOR_MS, 600000);
+	test_grid(3000, 60000);
+	test_grid(7000, 60000);
+	test_grid(1000, 1500);
+	test_grid(45000, 45001);
+	return TEST_Done("sched");
+}
@@ -0,0 +1,36 @@
+/*
+ * test.h
+ *
+ *  Checks for the host tests. A failed check prints where and carries on,
+ *  TEST_Done() turns the tally into the exit status.
+ */
+#ifndef TEST_H_
+#define TEST_H_
+#include <stdio.h>
+
+static int testChecks, testFailures;
+
+#define CHECK(cond) do { \
+	testChecks++; \
+	if (!(cond)) { \
+		testFailures++; \
+		printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+	} \
+} while (0)
+
+#define CHECK_EQ(a, b) do { \
+	long long _a = (long long)(a), _b = (long long)(b); \
+	testChecks++; \
+	if (_a != _b) { \
+		testFailures++; \
+		printf("%s:%d: %s is %lld, expected %lld\n", __FILE__, __LINE__, #a, _a, _b); \
+	} \
+} while (0)
+
+static int TEST_Done(const char *name)
+{
+	printf("%s: %d checks, %d failed\n", name, testChecks, testFailures);
+	return testFailures != 0;
+}
+
+#endif /* TEST_H_ */
@@ -0,0 +1,202 @@
+/*
+ * uart_test.c
+ *
+ *  The UART0 TX ring against a mock register file. Writes to UART_FIFO
+ *  land in a 128 byte hardware FIFO, the wire takes bytes out of it when
+ *  the test lets it run, and the TX interrupt is raised whenever it is
+ *  armed and the FIFO is below the refill level.
+ */
+#include "test.h"
+#include "../driver/uart.c"
+
+#define HW_FIFO		128
+
+UartDevice UartDev;
+
+LOCAL uint8 hwFifo[HW_FIFO];
+LOCAL uint16 hwCount;
+LOCAL uint32 intEna;
+LOCAL BOOL wireRunning;		/* every UART_STATUS read sends one byte, busy waits make progress */
+LOCAL uint8 wire[8192];
+LOCAL uint16 wireLen;
+LOCAL int masked, maskCount, nestedMasks, overruns;
+
+LOCAL void wire_send(uint16 n)
+{
+	while (n-- && hwCount) {
+		if (wireLen < sizeof wire)
+			wire[wireLen++] = hwFifo[0];
+		memmove(hwFifo, hwFifo + 1, --hwCount);
+	}
+}
+
+uint32 mock_reg_read(uint32 addr)
+{
+	if (addr == UART_STATUS(UART0)) {
+		if (wireRunning)
+			wire_send(1);
+		return (uint32)hwCount << UART_TXFIFO_CNT_S;
+	}
+	if (addr == UART_INT_ENA(UART0))
+		return intEna;
+	if (addr == UART_INT_ST(UART0))
+		return (intEna & UART_TXFIFO_EMPTY_INT_ENA) && hwCount < UART_TX_EMPTY_THRHD ? UART_TXFIFO_EMPTY_INT_ST : 0;
+	return 0;
+}
+
+void mock_reg_write(uint32 addr, uint32 value)
+{
+	if (addr == UART_FIFO(UART0)) {
+		if (hwCount < HW_FIFO)
+			hwFifo[hwCount++] = value;
+		else
+			overruns++;
+	} else if (addr == UART_INT_ENA(UART0)) {
+		intEna = value;
+	}
+}
+
+void mock_intr_mask(BOOL on)
+{
+	if (on) {
+		nestedMasks += masked;
+		maskCount++;
+	}
+	masked = on;
+}
+
+void uart_div_modify(uint8 uart_no, uint32 div) {}
+void os_install_putc1(void (*p)(char c)) {}
+bool system_os_post(uint8 prio, os_signal_t sig, os_param_t par) { return true; }
+
+/* Let the wire and the interrupt run until the TX interrupt disarms itself */
+LOCAL void drain(void)
+{
+	int guard = 10000;
+
+	CHECK(!masked);
+	while ((intEna & UART_TXFIFO_EMPTY_INT_ENA) && guard--) {
+		wire_send(HW_FIFO - UART_TX_EMPTY_THRHD + 1);
+		uart0_rx_intr_handler(NULL);
+	}
+	wire_send(HW_FIFO);
+	CHECK(guard > 0);
+	CHECK_EQ(overruns, 0);
+	CHECK_EQ(nestedMasks, 0);
+}
+
+LOCAL void reset(UartTxOverflow policy)
+{
+	uart0_tx_head = uart0_tx_tail = 0;
+	hwCount = wireLen = 0;
+	intEna = 0;
+	wireRunning = FALSE;
+	maskCount = 0;
+	uart0_set_tx_overflow(policy);
+}
+
+LOCAL void pattern(uint8 *buf, uint16 len, uint8 seed)
+{
+	uint16 i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = (uint8)(i * 7 + seed);
+}
+
+LOCAL void test_order(void)
+{
+	reset(UART_TX_DROP_NEW);
+	CHECK_EQ(uart0_tx_write((const uint8 *)"hello", 5), 5);
+	CHECK(intEna & UART_TXFIFO_EMPTY_INT_ENA);
+	CHECK_EQ(uart0_tx_free(), TX_BUFF_SIZE - 5);
+	drain();
+	CHECK_EQ(wireLen, 5);
+	CHECK(memcmp(wire, "hello", 5) == 0);
+	CHECK(!(intEna & UART_TXFIFO_EMPTY_INT_ENA));
+	CHECK_EQ(uart0_tx_free(), TX_BUFF_SIZE);
+}
+
+LOCAL void test_drop_new(void)
+{
+	uint8 buf[3000];
+
+	reset(UART_TX_DROP_NEW);
+	pattern(buf, sizeof buf, 1);
+	CHECK_EQ(uart0_tx_write(buf, sizeof buf), TX_BUFF_SIZE);
+	CHECK_EQ(uart0_tx_free(), 0);
+	CHECK_EQ(uart0_tx_write(buf, 1), 0);
+	drain();
+	CHECK_EQ(wireLen, TX_BUFF_SIZE);
+	CHECK(memcmp(wire, buf, TX_BUFF_SIZE) == 0);
+}
+
+LOCAL void test_drop_old(void)
+{
+	uint8 buf[3000];
+
+	reset(UART_TX_DROP_OLD);
+	pattern(buf, sizeof buf, 2);
+	CHECK_EQ(uart0_tx_write(buf, sizeof buf), sizeof buf);
+	CHECK_EQ(uart0_tx_free(), 0);
+	drain();
+	CHECK_EQ(wireLen, TX_BUFF_SIZE);
+	CHECK(memcmp(wire, buf + sizeof buf - TX_BUFF_SIZE, TX_BUFF_SIZE) == 0);
+}
+
+LOCAL void test_block(void)
+{
+	uint8 buf[3000];
+
+	reset(UART_TX_BLOCK);
+	wireRunning = TRUE;
+	pattern(buf, sizeof buf, 3);
+	CHECK_EQ(uart0_tx_write(buf, sizeof buf), sizeof buf);
+	wireRunning = FALSE;
+	drain();
+	CHECK_EQ(wireLen, sizeof buf);
+	CHECK(memcmp(wire, buf, sizeof buf) == 0);
+}
+
+LOCAL void test_putc_masks_once(void)
+{
+	const char *line = "Deep sleep for 60000 ms\n";
+
+	reset(UART_TX_DROP_NEW);
+	while (*line)
+		uart0_write_char(*line++);
+	CHECK_EQ(maskCount, 1);
+	drain();
+	CHECK_EQ(wireLen, 25);
+	CHECK(memcmp(wire, "Deep sleep for 60000 ms\r\n", 25) == 0);
+
+	// once the interrupt has disarmed itself the next burst arms it again
+	uart0_write_char('x');
+	CHECK_EQ(maskCount, 2);
+	CHECK(intEna & UART_TXFIFO_EMPTY_INT_ENA);
+}
+
+LOCAL void test_flush(void)
+{
+	uint8 buf[600];
+
+	reset(UART_TX_DROP_NEW);
+	pattern(buf, sizeof buf, 4);
+	uart0_tx_write(buf, sizeof buf);
+	wireRunning = TRUE;
+	uart0_tx_flush();
+	CHECK_EQ(uart0_tx_free(), TX_BUFF_SIZE);
+	CHECK_EQ(hwCount, 0);
+	CHECK_EQ(wireLen, sizeof buf);
+	CHECK(memcmp(wire, buf, sizeof buf) == 0);
+}
+
+int main(void)
+{
+	test_order();
+	test_drop_new();
+	test_drop_old();
+	test_block();
+	test_putc_masks_once();
+	test_flush();
+	return TEST_Done("uart");
+}
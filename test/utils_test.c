@@ -0,0 +1,86 @@
+/*
+ * utils_test.c
+ *
+ *  UTILS_FormatTenths against a printf reference, byte for byte, over the
+ *  edges of int32_t and a sweep of the rest.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "test.h"
+#include "utils.h"
+
+/* what the firmware used to print with "%d.%d" before the integer formatter */
+static int ref_tenths(char *buf, int32_t value)
+{
+	long long v = value;
+
+	return sprintf(buf, "%s%lld.%lld", v < 0 ? "-" : "", llabs(v) / 10, llabs(v) % 10);
+}
+
+static void check_tenths(int32_t value)
+{
+	char got[16], want[16];
+	int len, wantLen;
+
+	memset(got, 0x55, sizeof got);
+	len = UTILS_FormatTenths(got, value);
+	wantLen = ref_tenths(want, value);
+
+	CHECK_EQ(len, wantLen);
+	CHECK(len < 13);
+	if (strcmp(got, want) != 0)
+		printf("%s:%d: %ld gave \"%s\", expected \"%s\"\n", __FILE__, __LINE__,
+				(long)value, got, want);
+	CHECK(strcmp(got, want) == 0);
+	CHECK_EQ(got[len + 1], 0x55);		// nothing past the terminator
+}
+
+static void test_edges(void)
+{
+	static const int32_t values[] = {
+		0, 1, 9, 10, 11, 99, 100, 2105,
+		-1, -5, -9, -10, -11, -99, -100, -2105,
+		INT32_MAX, INT32_MAX - 1, INT32_MIN, INT32_MIN + 1,
+	};
+	char buf[16];
+	unsigned i;
+
+	for (i = 0; i < sizeof values / sizeof values[0]; i++)
+		check_tenths(values[i]);
+
+	// the cases the "%d.%d" it replaced got wrong
+	UTILS_FormatTenths(buf, -5);
+	CHECK(strcmp(buf, "-0.5") == 0);
+	CHECK_EQ(UTILS_FormatTenths(buf, INT32_MIN), 12);
+	CHECK(strcmp(buf, "-214748364.8") == 0);
+}
+
+static void test_sweep(void)
+{
+	int64_t v;
+	int i;
+
+	for (v = -100000; v <= 100000; v++)
+		check_tenths(v);
+	for (v = INT32_MIN; v <= INT32_MAX; v += 65521)
+		check_tenths(v);
+	srand(1);
+	for (i = 0; i < 100000; i++)
+		check_tenths((int32_t)(((uint32_t)rand() << 16) ^ (uint32_t)rand()));
+}
+
+static void test_crc32(void)
+{
+	CHECK_EQ(UTILS_Crc32(0, "123456789", 9), 0xCBF43926);
+	CHECK_EQ(UTILS_Crc32(UTILS_Crc32(0, "12345", 5), "6789", 4), 0xCBF43926);
+	CHECK_EQ(UTILS_Crc32(0, "", 0), 0);
+}
+
+int main(void)
+{
+	test_edges();
+	test_sweep();
+	test_crc32();
+	return TEST_Done("utils");
+}
@@ -0,0 +1,249 @@
+#!/usr/bin/env python
+#
+# ESP8266 serial loader simulator for trying esptool.py without hardware
+#
+# Every simulated chip is a pseudo terminal with its own chip ID and a
+# flash image in a file. It answers the ROM loader commands esptool.py
+# uses and, once a RAM image is started, those of the flasher stub
+# (tools/stub/stub.c), so both write paths and several ports at once can
+# be run and the result compared byte for byte:
+#
+#   esprom_sim.py --count 4 /tmp/sim &
+#   esptool.py -p '/tmp/sim/tty*' write_flash 0x00000 firmware/0x00000.bin ...
+#   cmp /tmp/sim/00A1B200.flash ...
+#
+# --throttle holds every frame for as long as the bytes take on the wire
+# at the current baud rate, the rate the ROM synced at before CHANGE_BAUD,
+# so the timings say something about real adapters. Closing the port
+# resets the chip into the ROM loader, as the next esptool.py run would.
+
+import sys
+import os
+import time
+import mmap
+import struct
+import hashlib
+import threading
+import argparse
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import otadelta
+
+SECTOR = 4096
+OTP_MAC0 = 0x3ff00050
+OTP_MAC1 = 0x3ff00054
+
+SYNC, WRITE_REG, READ_REG = 0x08, 0x09, 0x0a
+FLASH_BEGIN, FLASH_DATA, FLASH_END = 0x02, 0x03, 0x04
+MEM_BEGIN, MEM_END, MEM_DATA = 0x05, 0x06, 0x07
+CHANGE_BAUD, FLASH_PACKED, FLASH_DIGEST = 0x0f, 0x10, 0x11
+
+# stub status bytes
+OK, BAD_COMMAND, BAD_LENGTH, BAD_CHECKSUM, BAD_DATA = 0, 1, 2, 3, 4
+
+
+def slip(frame):
+    return b'\xc0' + bytes(frame).replace(b'\xdb', b'\xdb\xdd').replace(b'\xc0', b'\xdb\xdc') + b'\xc0'
+
+
+def checksum(data):
+    state = 0xef
+    for b in bytearray(data):
+        state ^= b
+    return state
+
+
+class Chip(threading.Thread):
+
+    def __init__(self, chip_id, path, flash_size, baud, throttle):
+        threading.Thread.__init__(self)
+        self.daemon = True
+        self.chip_id = chip_id
+        self.baud = baud
+        self.rom_baud = baud
+        self.throttle = throttle
+        self.master, slave = os.openpty()
+        self.tty = os.ttyname(slave)
+        # with no slave open reads fail, which is how a closed port is noticed
+        os.close(slave)
+        self.flash_file = os.path.join(path, '%08X.flash' % chip_id)
+        if not os.path.exists(self.flash_file) or os.path.getsize(self.flash_file) != flash_size:
+            with open(self.flash_file, 'wb') as f:
+                f.write(b'\xff' * flash_size)
+        self.fd = os.open(self.flash_file, os.O_RDWR)
+        self.flash = mmap.mmap(self.fd, flash_size)
+        self.reset()
+
+    def reset(self):
+        self.stub = False
+        self.baud = self.rom_baud
+        self.begin = None
+
+    def wire(self, count):
+        if self.throttle:
+            time.sleep(count * 10.0 / self.baud)
+
+    def send(self, frame):
+        data = slip(frame)
+        self.wire(len(data))
+        os.write(self.master, data)
+
+    def reply(self, op, body, value=0):
+        self.send(struct.pack('<BBHI', 1, op, len(body), value) + bytes(body))
+
+    def frames(self):
+        """Frames as they arrive, None once the port has been closed"""
+        frame = None
+        escape = False
+        while True:
+            try:
+                data = bytearray(os.read(self.master, 4096))
+            except OSError:
+                frame = None
+                escape = False
+                yield None
+                continue
+            for c in data:
+                if c == 0xc0:
+                    if frame:
+                        self.wire(len(frame) + 2)
+                        yield frame
+                    frame = bytearray()
+                elif frame is None:
+                    continue
+                elif escape:
+                    frame.append(0xc0 if c == 0xdc else 0xdb)
+                    escape = False
+                elif c == 0xdb:
+                    escape = True
+                else:
+                    frame.append(c)
+
+    def run(self):
+        opened = False
+        for frame in self.frames():
+            if frame is None:
+                if opened:
+                    self.reset()
+                    opened = False
+                time.sleep(0.02)
+                continue
+            opened = True
+            if len(frame) < 8 or frame[0] != 0:
+                continue
+            op, size, chk = struct.unpack_from('<xBHI', bytes(frame[:8]))
+            data = frame[8:]
+            if self.stub:
+                self.stub_command(op, data, chk)
+            else:
+                self.rom_command(op, data, chk)
+
+    def rom_command(self, op, data, chk):
+        ok = b'\0\0'
+        if op == SYNC:
+            for i in range(8):
+                self.reply(op, ok)
+        elif op == READ_REG:
+            addr = struct.unpack_from('<I', bytes(data))[0]
+            value = {OTP_MAC0: (self.chip_id & 0xff) << 24, OTP_MAC1: self.chip_id >> 8}.get(addr, 0)
+            self.reply(op, ok, value)
+        elif op == FLASH_BEGIN:
+            size, blocks, block, offset = struct.unpack_from('<IIII', bytes(data))
+            end = offset + (size + SECTOR - 1) // SECTOR * SECTOR
+            self.flash[offset:end] = b'\xff' * (end - offset)
+            self.begin = (offset, block)
+            self.reply(op, ok)
+        elif op == FLASH_DATA:
+            size, seq = struct.unpack_from('<II', bytes(data))
+            block = bytes(data[16:16 + size])
+            if self.begin is None or checksum(block) != chk & 0xff:
+                self.reply(op, b'\1\7')
+                return
+            offset = self.begin[0] + seq * self.begin[1]
+            # flash only clears bits
+            old = bytearray(self.flash[offset:offset + size])
+            self.flash[offset:offset + size] = bytes(bytearray(a & b for a, b in zip(old, bytearray(block))))
+            self.reply(op, ok)
+        elif op == MEM_END:
+            self.reply(op, ok)
+            if struct.unpack_from('<II', bytes(data))[0] == 0:
+                self.stub = True
+                self.send(b'OHAI')
+        elif op in (WRITE_REG, FLASH_END, MEM_BEGIN, MEM_DATA):
+            self.reply(op, ok)
+        else:
+            self.reply(op, b'\1\5')
+
+    def stub_command(self, op, data, chk):
+        body = b''
+        status = OK
+        if op == SYNC:
+            pass
+        elif op == CHANGE_BAUD:
+            if len(data) < 8:
+                status = BAD_LENGTH
+            else:
+                self.reply(op, b'\0\0')
+                self.baud = struct.unpack_from('<I', bytes(data))[0]
+                return
+        elif op == FLASH_PACKED:
+            size, addr = struct.unpack_from('<II', bytes(data)) if len(data) >= 16 else (None, None)
+            packed = data[16:]
+            if size != len(packed) or addr % SECTOR:
+                status = BAD_LENGTH
+            elif checksum(packed) != chk & 0xff:
+                status = BAD_CHECKSUM
+            else:
+                sector = otadelta.unpack(packed)
+                if len(sector) != SECTOR:
+                    status = BAD_DATA
+                else:
+                    self.flash[addr:addr + SECTOR] = bytes(sector)
+        elif op == FLASH_DIGEST:
+            addr, count = struct.unpack_from('<II', bytes(data)) if len(data) >= 8 else (1, 0)
+            if count > 64 or addr % SECTOR:
+                status = BAD_LENGTH
+            else:
+                body = b''.join(hashlib.sha256(self.flash[a:a + SECTOR]).digest()
+                                for a in range(addr, addr + count * SECTOR, SECTOR))
+        else:
+            status = BAD_COMMAND
+        self.reply(op, (body if status == OK else b'') + struct.pack('BB', status != OK, status))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='ESP8266 serial loader simulator')
+    parser.add_argument('dir', help='where the ttyN links and <chip id>.flash images go')
+    parser.add_argument('--count', type=int, default=1, help='chips to simulate')
+    parser.add_argument('--flash-size', type=lambda x: int(x, 0), default=0x100000)
+    parser.add_argument('--chip-id', type=lambda x: int(x, 16), default=0x00A1B200,
+                        help='of the first chip, the others count up')
+    parser.add_argument('--baud', type=int, default=115200, help='rate the ROM syncs at, for --throttle')
+    parser.add_argument('--throttle', action='store_true', help='take as long as a real UART')
+    args = parser.parse_args()
+
+    if not os.path.isdir(args.dir):
+        os.makedirs(args.dir)
+    chips = []
+    for i in range(args.count):
+        chip = Chip(args.chip_id + i, args.dir, args.flash_size, args.baud, args.throttle)
+        link = os.path.join(args.dir, 'tty%d' % i)
+        if os.path.lexists(link):
+            os.remove(link)
+        os.symlink(chip.tty, link)
+        chip.start()
+        chips.append(chip)
+        print('%s -> %s, chip %08X' % (link, chip.tty, chip.chip_id))
+    sys.stdout.flush()
+    try:
+        while True:
+            time.sleep(1)
+    except KeyboardInterrupt:
+        pass
+    for chip in chips:
+        chip.flash.flush()
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -25,6 +25,12 @@ import time
 import argparse
 import os
 import subprocess
+import glob
+import hashlib
+import threading
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import otadelta
 
 class ESPROM:
 
@@ -39,10 +45,19 @@ class ESPROM:
     ESP_WRITE_REG   = 0x09
     ESP_READ_REG    = 0x0a
 
+    # Added by the flasher stub, tools/stub/stub.c
+    ESP_CHANGE_BAUD = 0x0f
+    ESP_FLASH_PACKED = 0x10
+    ESP_FLASH_DIGEST = 0x11
+
     # Maximum block sized for RAM and Flash writes, respectively.
     ESP_RAM_BLOCK   = 0x1800
     ESP_FLASH_BLOCK = 0x100
 
+    # The stub writes and hashes whole sectors, this many digests per request
+    ESP_FLASH_SECTOR = 0x1000
+    ESP_DIGEST_SECTORS = 32
+
     # Default baudrate. The ROM auto-bauds, so we can use more or less whatever we want.
     ESP_ROM_BAUD    = 115200
 
@@ -78,16 +93,24 @@ class ESPROM:
 
     """ Write bytes to the serial port while performing SLIP escaping """
     def write(self, packet):
-        buf = '\xc0'
-        for b in packet:
-            if b == '\xc0':
-                buf += '\xdb\xdc'
-            elif b == '\xdb':
-                buf += '\xdb\xdd'
-            else:
-                buf += b
-        buf += '\xc0'
-        self._port.write(buf)
+        self._port.write('\xc0' + packet.replace('\xdb', '\xdb\xdd').replace('\xc0', '\xdb\xdc') + '\xc0')
+
+    """ Read a whole SLIP frame that is not a command response """
+    def read_frame(self):
+        if self._port.read(1) != '\xc0':
+            raise Exception('Invalid head of packet')
+        frame = ''
+        while True:
+            c = self._port.read(1)
+            if c == '':
+                raise Exception('Timed out')
+            if c == '\xc0':
+                return frame
+            if c == '\xdb':
+                c = {'\xdc': '\xc0', '\xdd': '\xdb'}.get(self._port.read(1))
+                if c is None:
+                    raise Exception('Invalid SLIP escape')
+            frame += c
 
     """ Calculate checksum of a blob, as it is defined by the ROM """
     @staticmethod
@@ -132,11 +155,14 @@ class ESPROM:
 
         # RTS = CH_PD (i.e reset)
         # DTR = GPIO0
-        self._port.setRTS(True)
-        self._port.setDTR(True)
-        self._port.setRTS(False)
-        time.sleep(0.1)
-        self._port.setDTR(False)
+        try:
+            self._port.setRTS(True)
+            self._port.setDTR(True)
+            self._port.setRTS(False)
+            time.sleep(0.1)
+            self._port.setDTR(False)
+        except (IOError, ValueError, serial.SerialException):
+            pass    # no modem lines, e.g. a pseudo terminal
 
         self._port.timeout = 0.5
         for i in xrange(10):
@@ -163,6 +189,12 @@ class ESPROM:
                 struct.pack('<IIII', addr, value, mask, delay_us))[1] != "\0\0":
             raise Exception('Failed to write target memory')
 
+    """ Read the chip ID, the same value as system_get_chip_id() """
+    def chip_id(self):
+        id0 = self.read_reg(self.ESP_OTP_MAC0)
+        id1 = self.read_reg(self.ESP_OTP_MAC1)
+        return (id0 >> 24) | ((id1 & 0xffffff) << 8)
+
     """ Start downloading an application image to RAM """
     def mem_begin(self, size, blocks, blocksize, offset):
         if self.command(ESPROM.ESP_MEM_BEGIN,
@@ -209,6 +241,62 @@ class ESPROM:
         self.flash_begin(0, 0)
         self.flash_finish(reboot)
 
+    """ Pulse CH_PD with GPIO0 high, the chip boots from flash """
+    def hard_reset(self):
+        try:
+            self._port.setDTR(False)
+            self._port.setRTS(True)
+            time.sleep(0.1)
+            self._port.setRTS(False)
+        except (IOError, ValueError, serial.SerialException):
+            pass
+
+    """ Load the flasher stub into RAM and wait for it to say hello """
+    def run_stub(self, image):
+        for (offset, size, data) in image.segments:
+            self.mem_begin(size, (size + ESPROM.ESP_RAM_BLOCK - 1) / ESPROM.ESP_RAM_BLOCK, ESPROM.ESP_RAM_BLOCK, offset)
+            seq = 0
+            while len(data) > 0:
+                self.mem_block(data[0:ESPROM.ESP_RAM_BLOCK], seq)
+                data = data[ESPROM.ESP_RAM_BLOCK:]
+                seq += 1
+        self.mem_finish(image.entrypoint)
+        if self.read_frame() != 'OHAI':
+            raise Exception('Flasher stub did not start')
+
+    """ Request to the stub, returns the data in front of the status bytes """
+    def stub_command(self, op, data, chk = 0):
+        body = self.command(op, data, chk)[1]
+        if body[-2:] != '\0\0':
+            raise Exception('Flasher stub failed command 0x%02x, status %d' % (op, ord(body[-1:] or '\xff')))
+        return body[:-2]
+
+    """ Move both ends to another baud rate, the stub answers at the old one """
+    def change_baud(self, baud):
+        self.stub_command(ESPROM.ESP_CHANGE_BAUD, struct.pack('<II', baud, self._port.baudrate))
+        self._port.baudrate = baud
+        time.sleep(0.05)
+        self._port.flushInput()
+        self.stub_command(ESPROM.ESP_SYNC, '\x07\x07\x12\x20'+32*'\x55')
+
+    """ SHA-256 of each sector from offset on, as the stub reads them """
+    def flash_digests(self, offset, sectors):
+        digests = []
+        while sectors > 0:
+            n = min(sectors, ESPROM.ESP_DIGEST_SECTORS)
+            body = self.stub_command(ESPROM.ESP_FLASH_DIGEST, struct.pack('<II', offset, n))
+            if len(body) != 32 * n:
+                raise Exception('Short digest reply')
+            digests += [body[i:i+32] for i in xrange(0, len(body), 32)]
+            offset += n * ESPROM.ESP_FLASH_SECTOR
+            sectors -= n
+        return digests
+
+    """ Erase and write one sector from its otadelta.pack() form """
+    def flash_packed(self, packed, offset):
+        self.stub_command(ESPROM.ESP_FLASH_PACKED,
+                struct.pack('<IIII', len(packed), offset, 0, 0)+packed, ESPROM.checksum(packed))
+
 
 class ESPFirmwareImage:
     
@@ -297,6 +385,127 @@ class ELFFile:
         return data
 
 
+class Flasher(threading.Thread):
+    """ write_flash on one port, several of them run side by side """
+
+    lock = threading.Lock()
+    packed = {}     # sector digest -> [lock, packed sector], shared by all ports
+
+    def __init__(self, port, args, stub, prefix = ''):
+        threading.Thread.__init__(self)
+        self.daemon = True
+        self.port = port
+        self.args = args
+        self.stub = stub
+        self.prefix = prefix
+        self.error = None
+
+    def log(self, msg):
+        with Flasher.lock:
+            print self.prefix + msg
+            sys.stdout.flush()
+
+    """ Progress on a single line, only when flashing one port """
+    def progress(self, msg):
+        if not self.prefix:
+            print '\r' + msg,
+            sys.stdout.flush()
+
+    """ A sector packed once for every port that needs it """
+    @staticmethod
+    def pack(data, key):
+        with Flasher.lock:
+            entry = Flasher.packed.setdefault(key, [threading.Lock(), None])
+        with entry[0]:
+            if entry[1] is None:
+                entry[1] = str(otadelta.pack(bytearray(data)))
+        return entry[1]
+
+    def run(self):
+        try:
+            self.flash()
+        except Exception as e:
+            self.error = str(e) or e.__class__.__name__
+            self.log('Failed: %s' % self.error)
+
+    def flash(self):
+        esp = ESPROM(self.port, self.args.baud)
+        esp.connect()
+        pairs = self.args.addr_filename
+        if any('{chip_id}' in f for f in pairs[1::2]):
+            # per-device images, e.g. the configuration from tools/mkconfig.py
+            chip_id = '%08X' % esp.chip_id()
+            self.log('Chip ID %s' % chip_id)
+            pairs = [f.replace('{chip_id}', chip_id) for f in pairs]
+            for f in pairs[1::2]:
+                if not os.path.exists(f):
+                    raise Exception('%s not found, nothing written' % f)
+        regions = [(int(pairs[i], 0), file(pairs[i+1], 'rb').read()) for i in xrange(0, len(pairs), 2)]
+        if self.stub is None:
+            self.write_rom(esp, regions)
+        else:
+            self.write_stub(esp, regions)
+
+    """ Through the ROM loader: everything erased and sent as it is, at the sync rate """
+    def write_rom(self, esp, regions):
+        for (address, image) in regions:
+            self.log('Erasing flash...')
+            blocks = math.ceil(len(image)/float(esp.ESP_FLASH_BLOCK))
+            esp.flash_begin(blocks*esp.ESP_FLASH_BLOCK, address)
+            seq = 0
+            while len(image) > 0:
+                self.progress('Writing at 0x%08x... (%d %%)' % (address + seq*esp.ESP_FLASH_BLOCK, 100*(seq+1)/blocks))
+                block = image[0:esp.ESP_FLASH_BLOCK]
+                block = block + '\xe0' * (esp.ESP_FLASH_BLOCK-len(block))
+                esp.flash_block(block, seq)
+                image = image[esp.ESP_FLASH_BLOCK:]
+                seq += 1
+            self.progress('\n')
+        self.log('Leaving...')
+        esp.flash_finish(False)
+
+    """ Through the stub: sectors that already match are skipped, the rest go packed """
+    def write_stub(self, esp, regions):
+        start = time.time()
+        esp.run_stub(self.stub)
+        if self.args.flash_baud and self.args.flash_baud != self.args.baud:
+            esp.change_baud(self.args.flash_baud)
+        sector = esp.ESP_FLASH_SECTOR
+        total = written = sent = 0
+        for (address, image) in regions:
+            if address % sector:
+                raise Exception('0x%x is not on a sector boundary, write it with --no-stub' % address)
+            image += '\xff' * (-len(image) % sector)
+            count = len(image) / sector
+            keys = [hashlib.sha256(image[i*sector:(i+1)*sector]).digest() for i in xrange(count)]
+            digests = [None] * count if self.args.force else esp.flash_digests(address, count)
+            for i in xrange(count):
+                self.progress('Writing at 0x%08x... (%d %%)' % (address + i*sector, 100*(i+1)/count))
+                if keys[i] == digests[i]:
+                    continue
+                packed = Flasher.pack(image[i*sector:(i+1)*sector], keys[i])
+                esp.flash_packed(packed, address + i*sector)
+                written += 1
+                sent += len(packed)
+            self.progress('\n')
+            if esp.flash_digests(address, count) != keys:
+                raise Exception('Verify failed in 0x%x-0x%x' % (address, address + len(image)))
+            total += count
+        self.log('Wrote %d of %d sectors, %d bytes sent, verified, %.1f s' % (written, total, sent, time.time() - start))
+        esp.hard_reset()
+
+
+def serial_ports(spec):
+    """ Comma separated devices or globs, /dev/ttyUSB* is every adapter plugged in """
+    ports = []
+    for name in spec.split(','):
+        found = sorted(glob.glob(name)) if any(c in name for c in '*?[') else [name]
+        ports += [p for p in found if p not in ports]
+    return ports
+
+
+STUB = os.path.join(os.path.dirname(os.path.dirname(os.path.abspath(__file__))), 'firmware', 'stub.bin')
+
 def arg_auto_int(x):
     return int(x, 0)
 
@@ -305,7 +514,7 @@ if __name__ == '__main__':
 
     parser.add_argument(
             '--port', '-p',
-            help = 'Serial port device',
+            help = 'Serial port device; write_flash takes several, comma separated or as a glob',
             default = '/dev/ttyUSB0')
 
     parser.add_argument(
@@ -345,7 +554,11 @@ if __name__ == '__main__':
     parser_write_flash = subparsers.add_parser(
             'write_flash',
             help = 'Write a binary blob to flash')
-    parser_write_flash.add_argument('addr_filename', nargs = '+', help = 'Address and binary file to write there, separated by space')
+    parser_write_flash.add_argument('addr_filename', nargs = '+', help = 'Address and binary file to write there, separated by space; {chip_id} in a file name becomes the ID of the connected chip')
+    parser_write_flash.add_argument('--stub', help = 'Flasher stub image (make stub)', default = STUB)
+    parser_write_flash.add_argument('--no-stub', help = 'Write through the ROM loader, every byte at the sync rate', action = 'store_true')
+    parser_write_flash.add_argument('--flash-baud', help = 'Baud rate once the stub runs, 0 keeps --baud', type = arg_auto_int, default = 921600)
+    parser_write_flash.add_argument('--force', help = 'Write sectors that already hold the same data', action = 'store_true')
 
     parser_run = subparsers.add_parser(
             'run',
@@ -370,16 +583,31 @@ if __name__ == '__main__':
     parser_elf2image.add_argument('input', help = 'Input ELF file')
     parser_elf2image.add_argument('--output', '-o', help = 'Output filename prefix', type = str)
 
+    parser_elf2stub = subparsers.add_parser(
+            'elf2stub',
+            help = 'Create the flasher stub image from its ELF file')
+    parser_elf2stub.add_argument('input', help = 'Input ELF file')
+    parser_elf2stub.add_argument('output', help = 'Output image file')
+
     parser_read_mac = subparsers.add_parser(
             'read_mac',
             help = 'Read MAC address from OTP ROM')
 
+    parser_chip_id = subparsers.add_parser(
+            'chip_id',
+            help = 'Read the chip ID the firmware names itself after')
+
     args = parser.parse_args()
 
     # Create the ESPROM connection object, if needed
     esp = None
-    if args.operation not in ('image_info','make_image','elf2image'):
-        esp = ESPROM(args.port, args.baud)
+    ports = serial_ports(args.port)
+    if not ports:
+        raise Exception('No serial port matches %s' % args.port)
+    if len(ports) > 1 and args.operation != 'write_flash':
+        raise Exception('Only write_flash takes several ports')
+    if args.operation not in ('image_info','make_image','elf2image','elf2stub','write_flash'):
+        esp = ESPROM(ports[0], args.baud)
         esp.connect()
 
     # Do the actual work. Should probably be split into separate functions.
@@ -421,30 +649,40 @@ if __name__ == '__main__':
 
     elif args.operation == 'write_flash':
         assert len(args.addr_filename) % 2 == 0
-        while args.addr_filename:
-            address = int(args.addr_filename[0], 0)
-            filename = args.addr_filename[1]
-            args.addr_filename = args.addr_filename[2:]
-            image = file(filename, 'rb').read()
-            print 'Erasing flash...'
-            blocks = math.ceil(len(image)/float(esp.ESP_FLASH_BLOCK))
-            esp.flash_begin(blocks*esp.ESP_FLASH_BLOCK, address)
-            seq = 0
-            while len(image) > 0:
-                print '\rWriting at 0x%08x... (%d %%)' % (address + seq*esp.ESP_FLASH_BLOCK, 100*(seq+1)/blocks),
-                sys.stdout.flush()
-                block = image[0:esp.ESP_FLASH_BLOCK]
-                block = block + '\xe0' * (esp.ESP_FLASH_BLOCK-len(block))
-                esp.flash_block(block, seq)
-                image = image[esp.ESP_FLASH_BLOCK:]
-                seq += 1
-            print
-        print '\nLeaving...'
-        esp.flash_finish(False)
+        stub = None
+        if not args.no_stub:
+            if os.path.exists(args.stub):
+                stub = ESPFirmwareImage(args.stub)
+            elif args.stub != STUB:
+                raise Exception('%s not found' % args.stub)
+            else:
+                print 'No flasher stub, make stub builds it; writing through the ROM loader'
+        if len(ports) == 1:
+            flashers = [Flasher(ports[0], args, stub)]
+            flashers[0].run()
+        else:
+            flashers = [Flasher(p, args, stub, '%s: ' % p) for p in ports]
+            for f in flashers:
+                f.start()
+            while any(f.is_alive() for f in flashers):
+                time.sleep(0.1)     # joined this way, Ctrl-C still gets through
+            failed = [f.port for f in flashers if f.error]
+            print '%d of %d ports written%s' % (len(ports) - len(failed), len(ports),
+                    (', failed: ' + ' '.join(failed)) if failed else '')
+        if any(f.error for f in flashers):
+            sys.exit(1)
 
     elif args.operation == 'run':
         esp.run()
 
+    elif args.operation == 'elf2stub':
+        e = ELFFile(args.input)
+        image = ESPFirmwareImage()
+        image.entrypoint = e.get_symbol_addr('stub_main')
+        for (section, start) in ((".text", "_text_start"), (".data", "_data_start")):
+            image.add_segment(e.get_symbol_addr(start), e.load_section(section))
+        image.save(args.output)
+
     elif args.operation == 'image_info':
         image = ESPFirmwareImage(args.filename)
         print ('Entry point: %08x' % image.entrypoint) if image.entrypoint != 0 else 'Entry point not set'
@@ -490,3 +728,6 @@ if __name__ == '__main__':
         mac0 = esp.read_reg(esp.ESP_OTP_MAC0)
         mac1 = esp.read_reg(esp.ESP_OTP_MAC1)
         print 'MAC: 18:fe:34:%02x:%02x:%02x' % ((mac1 >> 8) & 0xff, mac1 & 0xff, (mac0 >> 24) & 0xff)
+
+    elif args.operation == 'chip_id':
+        print 'Chip ID: %08X' % esp.chip_id()
@@ -0,0 +1,18 @@
+# Hot functions for make IRAM_PROFILE=tools/iram.profile
+#
+# name, then an optional weight (calls or samples from any profiler);
+# tools/iram.py moves them to IRAM hottest first until IRAM_BUDGET is
+# spent. Functions without ICACHE_FLASH_ATTR are in IRAM already.
+
+dht_read                # bit-banged DHT pulse timing (dht_capture is inlined), misses read as wrong bits
+RINGBUF_Get             # per byte on the receive and queue paths
+RINGBUF_Peek
+RINGBUF_Read
+PROTO_ParseByte
+PROTO_ParseRb
+PROTO_AddRb
+QUEUE_Puts
+QUEUE_Gets
+mqtt_get_total_length
+mqtt_get_id
+mqtt_tcpclient_recv
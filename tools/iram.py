@@ -0,0 +1,278 @@
+#!/usr/bin/env python
+#
+# Profile-guided placement of hot functions in IRAM
+#
+# ICACHE_FLASH_ATTR puts a function in .irom0.text, where it runs from SPI
+# flash through the 32 KB instruction cache; a miss stalls for the flash
+# read, which makes tight loops slow and bit-banged timing jittery. For a
+# build with IRAM_PROFILE set the Makefile compiles without ICACHE_FLASH
+# and with -ffunction-sections, so every function has a section of its
+# own, and this tool writes the linker script that decides:
+#
+#   - functions the sources mark ICACHE_FLASH_ATTR go to flash as before,
+#     except the hottest ones of the profile, as far as the budget goes
+#   - everything else, interrupt handlers included, stays in IRAM
+#   - ICACHE_RODATA_ATTR tables stay in flash
+#
+#   iram.py place --ld eagle.app.v6.ld --archive app_app.a -o build/iram.ld profile build/*/*.o
+#   iram.py report --profile profile build/app.out
+#
+# The profile lists one function per line with an optional weight, calls
+# or samples from whatever profiler, hottest first where there is none.
+# report shows how much of IRAM the linked image uses and where the
+# profiled functions ended up.
+
+import sys
+import os
+import re
+import struct
+import argparse
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+IRAM = (0x40100000, 0x8000)
+SHT_SYMTAB, SHT_RELA, SHT_NOBITS, SHT_REL = 2, 4, 8, 9
+SHF_ALLOC = 2
+STT_FUNC = 2
+
+FLASH_ATTR = re.compile(r'ICACHE_FLASH_ATTR[\s*]*(\w+)\s*\(')
+RODATA_ATTR = re.compile(r'(\w+)\s*(?:\[[^\]]*\]\s*)*ICACHE_RODATA_ATTR')
+
+
+class Elf(object):
+    """Sections and symbols of a little-endian ELF32 file"""
+
+    def __init__(self, path):
+        with open(path, 'rb') as f:
+            data = f.read()
+        if data[:4] != b'\x7fELF':
+            raise SystemExit('%s: not an ELF file' % path)
+        self.machine = struct.unpack_from('<H', data, 0x12)[0]
+        shoff = struct.unpack_from('<I', data, 0x20)[0]
+        entsize, count, names = struct.unpack_from('<HHH', data, 0x2e)
+        heads = [struct.unpack_from('<IIIIIIIIII', data, shoff + i * entsize) for i in range(count)]
+        self.data = data
+
+        def string(table, offset):
+            start = heads[table][4] + offset
+            return data[start:data.index(b'\0', start)].decode('latin-1')
+
+        self.sections = []
+        for h in heads:
+            self.sections.append({'name': string(names, h[0]), 'type': h[1], 'flags': h[2],
+                                  'addr': h[3], 'offset': h[4], 'size': h[5], 'link': h[6], 'info': h[7]})
+        # indexed as relocations refer to them, the null symbol included
+        self.symbols = []
+        for h in heads:
+            if h[1] != SHT_SYMTAB:
+                continue
+            for offset in range(h[4], h[4] + h[5], 16):
+                name, value, size, info, other, shndx = struct.unpack_from('<IIIBBH', data, offset)
+                self.symbols.append({'name': string(h[6], name), 'value': value, 'size': size,
+                                     'type': info & 0xf, 'bind': info >> 4, 'shndx': shndx})
+
+    def section_of(self, sym):
+        return self.sections[sym['shndx']]['name'] if 0 < sym['shndx'] < len(self.sections) else None
+
+    def relocations(self):
+        """(section index relocated, offset, symbol index, type, addend) of every REL and RELA section"""
+        for s in self.sections:
+            if s['type'] not in (SHT_RELA, SHT_REL):
+                continue
+            size = 12 if s['type'] == SHT_RELA else 8
+            for offset in range(s['offset'], s['offset'] + s['size'], size):
+                r_offset, info = struct.unpack_from('<II', self.data, offset)
+                addend = struct.unpack_from('<i', self.data, offset + 8)[0] if size == 12 else 0
+                yield s['info'], r_offset, info >> 8, info & 0xff, addend
+
+
+def read_profile(path):
+    """[(name, weight)], hottest first"""
+    entries = []
+    with open(path) as f:
+        for n, line in enumerate(f):
+            fields = line.split('#')[0].split()
+            if not fields:
+                continue
+            weight = float(fields[1]) if len(fields) > 1 else None
+            entries.append((fields[0], weight, n))
+    entries.sort(key=lambda e: (e[1] is None, -(e[1] or 0), e[2]))
+    return [(name, weight) for name, weight, n in entries]
+
+
+def strip_comments(text):
+    return re.sub(r'//[^\n]*', '', re.sub(r'/\*.*?\*/', ' ', text, flags=re.S))
+
+
+def attributes(path):
+    with open(path) as f:
+        text = strip_comments(f.read())
+    return set(FLASH_ATTR.findall(text)), set(RODATA_ATTR.findall(text))
+
+
+def header_attributes():
+    functions = set()
+    for base, dirs, files in os.walk(ROOT):
+        if os.path.basename(base) == 'include' or base.endswith(os.path.join('include', 'driver')):
+            for name in files:
+                if name.endswith('.h'):
+                    functions |= attributes(os.path.join(base, name))[0]
+    return functions
+
+
+def function_of(section):
+    """.text.foo, .literal.foo and clones such as .text.foo.constprop.0 belong to foo"""
+    for prefix in ('.text.', '.literal.'):
+        if section.startswith(prefix):
+            return section[len(prefix):].split('.')[0]
+    return None
+
+
+def block(script, output):
+    """Start and end of an output section statement's braces"""
+    m = re.search(r'^[ \t]*' + re.escape(output) + r'\s[^{]*\{', script, re.M)
+    if not m:
+        raise SystemExit('no %s output section in the linker script' % output)
+    depth, end = 1, m.end()
+    while depth:
+        depth += {'{': 1, '}': -1}.get(script[end], 0)
+        end += 1
+    return m, end
+
+
+def insert(script, output, lines, after):
+    """Add input section lines to an output section, after the line holding after"""
+    m, end = block(script, output)
+    at = script.find(after, m.end(), end)
+    if at < 0:
+        raise SystemExit('%s has no %s line in the linker script' % (output, after))
+    at = script.index('\n', at) + 1
+    return script[:at] + ''.join('    %s\n' % l for l in lines) + script[at:]
+
+
+def hoist(script, output):
+    """Move an output section to the top of SECTIONS, its patterns then match first"""
+    m, end = block(script, output)
+    end = script.index('\n', end) + 1
+    statement = script[m.start():end]
+    script = script[:m.start()] + script[end:]
+    top = re.search(r'^\s*SECTIONS\s*\{[^\n]*\n', script, re.M).end()
+    return script[:top] + statement + script[top:]
+
+
+def place(args):
+    profile = read_profile(args.profile)
+    headers = header_attributes()
+    objects = {}
+    sizes = {}
+    for path in args.objects:
+        source = os.path.relpath(path, args.build)[:-2] + '.c'
+        flash, rodata = attributes(os.path.join(ROOT, source))
+        flash |= headers
+        elf = Elf(path)
+        member = os.path.basename(path)
+        objects[member] = (elf, flash, rodata)
+        for s in elf.sections:
+            fn = function_of(s['name'])
+            if fn in flash:
+                sizes[fn] = sizes.get(fn, 0) + (s['size'] + 3) // 4 * 4
+
+    hot, over, missing, iram = [], [], [], []
+    used = 0
+    for name, weight in profile:
+        if name not in sizes:
+            defined = any(fn == name for elf, flash, rodata in objects.values()
+                          for fn in (function_of(s['name']) for s in elf.sections))
+            (iram if defined else missing).append(name)
+        elif used + sizes[name] <= args.budget:
+            hot.append(name)
+            used += sizes[name]
+        else:
+            over.append(name)
+
+    flash_lines, rodata_lines = [], []
+    for member in sorted(objects):
+        elf, flash, rodata = objects[member]
+        spec = '*%s:%s' % (args.archive, member)
+        for n in sorted(set(function_of(s['name']) for s in elf.sections) & (flash - set(hot))):
+            flash_lines.append('%s(.literal.%s .literal.%s.* .text.%s .text.%s.*)' % (spec, n, n, n, n))
+        tables = [s['name'] for s in elf.sections if s['name'].split('.')[-1] in rodata
+                  and s['name'].startswith('.rodata.')]
+        if tables:
+            rodata_lines.append('%s(%s)' % (spec, ' '.join(tables)))
+
+    with open(args.ld) as f:
+        script = f.read()
+    # INCLUDEs are relative to the SDK's ld directory
+    script = re.sub(r'INCLUDE\s+"?([^"\s]+)"?',
+                    lambda m: 'INCLUDE "%s"' % os.path.normpath(os.path.join(os.path.dirname(os.path.abspath(args.ld)), m.group(1))),
+                    script)
+    script = hoist(script, '.irom0.text')
+    script = insert(script, '.irom0.text', flash_lines + rodata_lines, '.irom0.literal')
+    # the rest stays where it was, whether or not the SDK's patterns cover the split sections
+    for output, after, line in (('.text', '*(.literal .text', '*(.literal.* .text.*)'),
+                                ('.data', '*(.data)', '*(.data.*)'),
+                                ('.rodata', '*(.rodata)', '*(.rodata.*)'),
+                                ('.bss', '*(.bss)', '*(.bss.*)')):
+        script = insert(script, output, [line], after)
+    with open(args.output, 'w') as f:
+        f.write('/* generated by tools/iram.py from %s and %s */\n' % (os.path.basename(args.ld), args.profile))
+        f.write(script)
+
+    print('IRAM: %d of %d bytes budget for %d hot functions' % (used, args.budget, len(hot)))
+    for name in over:
+        print('IRAM: %s (%d bytes) does not fit, stays in flash' % (name, sizes[name]))
+    for name in iram:
+        print('IRAM: %s is not ICACHE_FLASH_ATTR, in IRAM already' % name)
+    for name in missing:
+        print('IRAM: %s not found, inlined or misspelt' % name)
+    return 0
+
+
+def report(args):
+    elf = Elf(args.elf)
+    start, size = IRAM
+    used = sum(s['size'] for s in elf.sections if s['flags'] & SHF_ALLOC and s['type'] != SHT_NOBITS
+               and start <= s['addr'] < start + size)
+    print('IRAM: %d of %d bytes used, %d free' % (used, size, size - used))
+    if not args.profile:
+        return 0
+    functions = dict((s['name'], s) for s in elf.symbols if s['type'] == STT_FUNC)
+    total = 0
+    for name, weight in read_profile(args.profile):
+        sym = functions.get(name)
+        if sym is None:
+            print('  %-28s  inlined' % name)
+            continue
+        where = 'IRAM' if start <= sym['value'] < start + size else 'flash'
+        if where == 'IRAM':
+            total += sym['size']
+        print('  %-28s %5d  %-5s %08x' % (name, sym['size'], where, sym['value']))
+    print('IRAM: %d bytes of profiled functions' % total)
+    return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Profile-guided placement of hot functions in IRAM')
+    sub = parser.add_subparsers(dest='command')
+    p = sub.add_parser('place', help='write the linker script for a profile')
+    p.add_argument('profile')
+    p.add_argument('objects', nargs='+', help='compiled with -ffunction-sections -fdata-sections')
+    p.add_argument('--ld', required=True, help="the SDK's linker script")
+    p.add_argument('--archive', required=True, help='name of the archive the objects are linked from')
+    p.add_argument('--build', default='build', help='object tree, mirrors the sources')
+    p.add_argument('--budget', type=int, default=2048, help='bytes of IRAM for profiled functions')
+    p.add_argument('-o', '--output', required=True)
+    r = sub.add_parser('report', help='IRAM use of a linked image')
+    r.add_argument('elf')
+    r.add_argument('--profile', help='also show where its functions ended up')
+    args = parser.parse_args()
+    if args.command == 'place':
+        return place(args)
+    if args.command == 'report':
+        return report(args)
+    parser.print_help()
+    return 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,319 @@
+#!/usr/bin/env python
+#
+# Memory budget report and gate for a linked image
+#
+# Every link passes the image, its linker map and the objects; this tool
+# adds up what each object and library takes of
+#
+#   IRAM    .text, code without ICACHE_FLASH_ATTR, 32 KB
+#   DRAM    .data, .rodata (string literals included) and .bss, what is
+#           left of the 80 KB is the heap
+#   flash   .irom0.text, ICACHE_FLASH_ATTR code and ICACHE_RODATA_ATTR tables
+#
+# and the worst stack chain from user_init and from every function whose
+# address is taken, callbacks and interrupt handlers, using the .su files
+# of -fstack-usage and the calls in the objects' relocations. Frames of
+# SDK functions are not known and count as nothing, recursion is cut and
+# flagged. The exit status is 1 when a budget is exceeded:
+#
+#   memreport.py --map build/app.out.map --dram 65536 --stack 2048 build/app.out build/*/*.o
+#
+# --check prints the totals and what is over budget only, the full report
+# lists the objects and the largest symbols of every region.
+
+import sys
+import os
+import re
+import bisect
+import argparse
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from iram import Elf, SHT_NOBITS, SHF_ALLOC, STT_FUNC
+
+STT_OBJECT, STT_SECTION = 1, 3
+STB_LOCAL = 0
+EM_XTENSA = 94
+# call8 foo is l32r + callx8 with -mlongcalls, ASM_EXPAND marks the callx;
+# a direct call is SLOT0_OP against the function, R_XTENSA_32 a literal
+R_XTENSA_32, R_XTENSA_ASM_EXPAND, R_XTENSA_SLOT0_OP = 1, 11, 20
+# the host link of the tests: a call's displacement counts from the end of
+# the instruction, a static callee is its section symbol - 4
+EM_X86_64 = 62
+R_X86_64_PC32, R_X86_64_PLT32 = 2, 4
+# code and data, not the property tables and debug info that also point at functions
+REFERRING = ('.text', '.literal', '.irom', '.data', '.rodata', '.bss')
+
+REGIONS = ('iram', 'data', 'rodata', 'bss', 'flash')
+IRAM = (0x40100000, 0x40108000)
+DRAM = (0x3FFE8000, 0x40000000)
+FLASH = (0x40200000, 0x40300000)
+
+
+def region(addr, name, nobits):
+    if IRAM[0] <= addr < IRAM[1]:
+        return 'iram'
+    if FLASH[0] <= addr < FLASH[1]:
+        return 'flash'
+    if DRAM[0] <= addr < DRAM[1]:
+        if nobits or name.startswith(('.bss', 'COMMON')):
+            return 'bss'
+        return 'rodata' if name.startswith('.rodata') else 'data'
+    return None
+
+
+def module(path):
+    """build/app_app.a(wifi.o) is wifi.o, the SDK's lib/libmain.a(app_main.o) libmain.a"""
+    m = re.match(r'(.*)\((.*)\)$', path)
+    if not m:
+        return os.path.basename(path)
+    archive = os.path.basename(m.group(1))
+    return archive if archive.startswith('lib') else m.group(2)
+
+
+def read_map(path):
+    """[(address, size, region, module)] of the input sections GNU ld placed"""
+    pieces = []
+    started = False
+    pending = None
+    with open(path) as f:
+        for line in f:
+            if not started:
+                started = line.startswith('Linker script and memory map')
+                continue
+            m = re.match(r'^ (\S+)?\s+0x([0-9a-fA-F]+)\s+0x([0-9a-fA-F]+)\s+(\S.*)$', line.rstrip())
+            if m and (m.group(1) or pending):
+                name = m.group(1) or pending
+                addr, size = int(m.group(2), 16), int(m.group(3), 16)
+                where = region(addr, name, False)
+                if size and where:
+                    pieces.append((addr, size, where, module(m.group(4).strip())))
+            pending = line.strip() if re.match(r'^ \S+$', line.rstrip()) else None
+    pieces.sort()
+    return pieces
+
+
+def read_stack_usage(path):
+    """{function: (bytes, dynamic)} from a .su file, file:line:column:name or just name first"""
+    usage = {}
+    if not os.path.exists(path):
+        return usage
+    with open(path) as f:
+        for line in f:
+            fields = line.rstrip('\n').split('\t')
+            if len(fields) < 3:
+                continue
+            name = fields[0].split(':')[-1]
+            usage[name] = (int(fields[1]), 'dynamic' in fields[2])
+    return usage
+
+
+class Graph(object):
+    """Calls between the functions of the objects, a node per global name or object and static name"""
+
+    def __init__(self, objects):
+        self.frames = {}
+        self.calls = {}
+        self.taken = set()
+        self.external = set()
+        units = []
+        globals_ = {}
+        defined = set()
+        for path in objects:
+            elf = Elf(path)
+            su = read_stack_usage(path[:-2] + '.su')
+            obj = os.path.basename(path)
+            nodes = {}
+            for i, sym in enumerate(elf.symbols):
+                if sym['shndx'] and sym['bind'] != STB_LOCAL:
+                    defined.add(sym['name'])
+                if sym['type'] != STT_FUNC or not sym['shndx'] or sym['shndx'] >= len(elf.sections):
+                    continue
+                key = sym['name'] if sym['bind'] != STB_LOCAL else '%s:%s' % (obj, sym['name'])
+                nodes[i] = key
+                self.frames[key] = su.get(sym['name'], (0, False))
+                self.calls.setdefault(key, set())
+                if sym['bind'] != STB_LOCAL:
+                    globals_[sym['name']] = key
+            units.append((elf, nodes))
+        for elf, nodes in units:
+            self.add_references(elf, nodes, globals_, defined)
+
+    def add_references(self, elf, nodes, globals_, defined):
+        by_section = {}
+        for i, key in nodes.items():
+            sym = elf.symbols[i]
+            by_section.setdefault(sym['shndx'], []).append((sym['value'], sym['size'], key))
+        for functions in by_section.values():
+            functions.sort()
+        refs = {}
+        for shndx, offset, symbol, rtype, addend in elf.relocations():
+            if not elf.sections[shndx]['name'].startswith(REFERRING):
+                continue
+            if elf.machine == EM_X86_64 and rtype in (R_X86_64_PC32, R_X86_64_PLT32):
+                addend += 4
+            target = self.target(elf, nodes, globals_, defined, symbol, addend, by_section)
+            if target is None:
+                continue
+            source = self.owner(by_section.get(shndx, []), offset)
+            if source is None:
+                if elf.sections[shndx]['name'].startswith(('.data', '.rodata', '.irom.', '.bss')):
+                    # a function pointer in a table
+                    self.taken.add(target)
+                continue
+            calls, literals = refs.setdefault(source, (set(), set()))
+            if elf.machine != EM_XTENSA or rtype == R_XTENSA_ASM_EXPAND or rtype == R_XTENSA_SLOT0_OP:
+                calls.add(target)
+            elif rtype == R_XTENSA_32:
+                literals.add(target)
+        for source, (calls, literals) in refs.items():
+            self.calls[source] |= calls
+            # a literal the function never calls through is an address handed on
+            self.taken |= literals - calls
+
+    def target(self, elf, nodes, globals_, defined, symbol, addend, by_section):
+        sym = elf.symbols[symbol]
+        if sym['type'] == STT_SECTION:
+            for value, size, key in by_section.get(sym['shndx'], []):
+                if value == addend:
+                    return key
+            return None
+        if symbol in nodes:
+            return nodes[symbol]
+        if sym['shndx'] or sym['type'] not in (STT_FUNC, 0) or not sym['name']:
+            return None
+        if sym['name'] in globals_:
+            return globals_[sym['name']]
+        if sym['name'] not in defined:
+            self.external.add(sym['name'])
+        return None
+
+    @staticmethod
+    def owner(functions, offset):
+        """Function an offset belongs to; with -mtext-section-literals the literals come just before it"""
+        for value, size, key in functions:
+            if offset < value + size:
+                return key
+        return None
+
+    def worst(self, root):
+        """(bytes, chain, dynamic or recursive on the way) of the deepest path from root"""
+        memo = {}
+
+        def walk(key, path):
+            if key in memo:
+                return memo[key]
+            frame, dynamic = self.frames.get(key, (0, False))
+            best = (0, [], False)
+            flagged = dynamic
+            for callee in sorted(self.calls.get(key, ())):
+                if callee in path:
+                    flagged = True
+                    continue
+                below = walk(callee, path | set([callee]))
+                flagged = flagged or below[2]
+                if below[0] > best[0]:
+                    best = below
+            memo[key] = (frame + best[0], [key] + best[1], flagged)
+            return memo[key]
+
+        return walk(root, set([root]))
+
+
+def symbols(elf, pieces):
+    """[(size, region, name, module)] of the image's functions and variables"""
+    starts = [p[0] for p in pieces]
+    found = []
+    seen = set()
+    for sym in elf.symbols:
+        if sym['type'] not in (STT_FUNC, STT_OBJECT) or not sym['size'] or not sym['name']:
+            continue
+        if (sym['name'], sym['value']) in seen or not 0 < sym['shndx'] < len(elf.sections):
+            continue
+        seen.add((sym['name'], sym['value']))
+        section = elf.sections[sym['shndx']]
+        where = region(sym['value'], section['name'], section['type'] == SHT_NOBITS)
+        if not where:
+            continue
+        i = bisect.bisect_right(starts, sym['value']) - 1
+        owner = pieces[i][3] if i >= 0 and sym['value'] < pieces[i][0] + pieces[i][1] else '?'
+        found.append((sym['size'], where, sym['name'], owner))
+    found.sort(reverse=True)
+    return found
+
+
+def totals(elf):
+    used = dict((r, 0) for r in REGIONS)
+    for s in elf.sections:
+        if s['flags'] & SHF_ALLOC:
+            where = region(s['addr'], s['name'], s['type'] == SHT_NOBITS)
+            if where:
+                used[where] += s['size']
+    return used
+
+
+def main():
+    number = lambda x: int(x, 0) if x else None
+    parser = argparse.ArgumentParser(description='Memory budget report and gate for a linked image')
+    parser.add_argument('elf')
+    parser.add_argument('objects', nargs='*', help='with their .su files beside them, for the stack chains')
+    parser.add_argument('--map', help='linker map of the image, for the objects and libraries')
+    parser.add_argument('--iram', type=number, help='budget in bytes')
+    parser.add_argument('--dram', type=number, help='budget for .data, .rodata and .bss together')
+    parser.add_argument('--flash', type=number, help='budget for .irom0.text')
+    parser.add_argument('--stack', type=number, help='budget for the deepest chain')
+    parser.add_argument('--top', type=int, default=10, help='largest symbols per region and deepest roots to list')
+    parser.add_argument('--check', action='store_true', help='totals and what is over budget only')
+    args = parser.parse_args()
+
+    elf = Elf(args.elf)
+    used = totals(elf)
+    dram = used['data'] + used['rodata'] + used['bss']
+    chains = []
+    if args.objects:
+        graph = Graph(args.objects)
+        roots = set(['user_init']) | graph.taken
+        chains = sorted((graph.worst(r) + (r,) for r in roots if r in graph.frames), reverse=True)
+    deepest = chains[0][0] if chains else 0
+
+    over = []
+    print('%-8s %8s %8s' % ('', 'used', 'budget'))
+    for name, value, budget in (('IRAM', used['iram'], args.iram), ('DRAM', dram, args.dram),
+                                ('flash', used['flash'], args.flash), ('stack', deepest, args.stack)):
+        print('%-8s %8d %8s%s' % (name, value, budget if budget is not None else '-',
+                                  '  OVER' if budget is not None and value > budget else ''))
+        if budget is not None and value > budget:
+            over.append('%s: %d bytes, %d over the budget of %d' % (name, value, value - budget, budget))
+    print('DRAM: %d .data, %d .rodata, %d .bss' % (used['data'], used['rodata'], used['bss']))
+
+    if not args.check:
+        pieces = read_map(args.map) if args.map else []
+        if pieces:
+            modules = {}
+            for addr, size, where, owner in pieces:
+                modules.setdefault(owner, dict((r, 0) for r in REGIONS))[where] += size
+            print('\n%-24s %7s %7s %7s %7s %7s' % (('module',) + REGIONS))
+            ram = lambda m: -(m[1]['iram'] + m[1]['data'] + m[1]['rodata'] + m[1]['bss'])
+            for owner, sizes in sorted(modules.items(), key=lambda m: (ram(m), m[0])):
+                print('%-24s %7d %7d %7d %7d %7d' % ((owner,) + tuple(sizes[r] for r in REGIONS)))
+        found = symbols(elf, pieces)
+        for where in REGIONS:
+            print('\nlargest in %s:' % where)
+            for size, w, name, owner in [s for s in found if s[1] == where][:args.top]:
+                print('  %6d  %-32s %s' % (size, name, owner))
+        if chains:
+            print('\nstack, deepest chains of %d roots (+ dynamic frame or recursion on the way):' % len(chains))
+            for depth, chain, flagged, root in chains[:args.top]:
+                print('  %6d%s %s' % (depth, '+' if flagged else ' ', ' > '.join(chain)))
+            if graph.external:
+                print('  frames of %d SDK functions not known, counted as 0' % len(graph.external))
+    elif chains:
+        depth, chain, flagged, root = chains[0]
+        print('stack: %s' % ' > '.join(chain))
+
+    for line in over:
+        print('OVER BUDGET %s' % line)
+    return 1 if over else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,262 @@
+#!/usr/bin/env python
+#
+# Per-device configuration images for provisioning
+#
+# Renders the record config_load() finds at CFG_LOCATION for every row of
+# a CSV, so a site's WiFi and broker settings need no build of their own.
+# The SYSCFG layout is read from the headers; the defaults below mirror
+# config_defaults() in modules/config.c and are checked against
+# CFG_VERSION, so a field appended to SYSCFG stops this tool until it
+# gets its default here too.
+#
+#   mkconfig.py devices.csv firmware/config
+#
+# The first column is the chip ID as system_get_chip_id() and
+# esptool.py chip_id report it, the others name SYSCFG fields, nested ones
+# with dots and indices. Empty cells keep the default:
+#
+#   chip_id,sta_ssid,sta_pwd,mqtt_host,sensors[1].pin,sta_nets[0].ssid
+#   00A1B2C3,site4,secret,10.4.0.2,5,site4-annex
+#
+# Every image is written as <chip id>.bin and spans the whole record ring,
+# erased apart from the one record, so nothing stored before survives.
+# esptool.py replaces {chip_id} in file names with the connected chip's:
+#
+#   esptool.py write_flash 0x00000 firmware/0x00000.bin 0x40000 firmware/0x40000.bin \
+#       0x3C000 'firmware/config/{chip_id}.bin'
+#
+# 0x3C000 is CFG_LOCATION * 4096, 0x7C000 for OTA builds; make provision
+# does both steps.
+
+import sys
+import os
+import re
+import csv
+import struct
+import zlib
+import argparse
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+HEADERS = ('include/user_config.h', 'include/driver/dht22.h', 'modules/include/filter.h',
+           'modules/include/sched.h', 'modules/include/sensor.h', 'modules/include/config.h')
+SECTOR = 4096
+DEFAULTS_VERSION = 4    # CFG_VERSION the defaults below are complete for
+
+# from the SDK headers, which are not part of the tree
+CONSTANTS = {
+    'AUTH_OPEN': 0, 'AUTH_WEP': 1, 'AUTH_WPA_PSK': 2, 'AUTH_WPA2_PSK': 3, 'AUTH_WPA_WPA2_PSK': 4,
+    'DHT11': 0, 'DHT22': 1,
+}
+SCALARS = {
+    'uint8_t': 1, 'uint8': 1, 'int8_t': 1, 'sint8': 1, 'BOOL': 1,
+    'uint16_t': 2, 'uint16': 2, 'int16_t': 2, 'sint16': 2,
+    'uint32_t': 4, 'uint32': 4, 'int32_t': 4, 'sint32': 4,
+}
+DECL = re.compile(r'^(?:const\s+)?((?:enum\s+)?\w+)\s+(\w+)((?:\s*\[[^\]]+\])*)$')
+
+
+class Headers(object):
+    """#defines and struct layouts as the xtensa compiler lays them out"""
+
+    def __init__(self):
+        self.defines = {}
+        self.structs = {}
+        text = ''
+        for name in HEADERS:
+            with open(os.path.join(ROOT, name)) as f:
+                text += f.read() + '\n'
+        text = re.sub(r'/\*.*?\*/', ' ', text, flags=re.S)
+        text = re.sub(r'//[^\n]*', '', text)
+        for m in re.finditer(r'^[ \t]*#define[ \t]+(\w+)[ \t]+([^\n]+)$', text, re.M):
+            self.defines[m.group(1)] = m.group(2).strip()
+        self.bodies = dict((m.group(2), m.group(1)) for m in
+                           re.finditer(r'typedef\s+struct\s*\w*\s*\{(.*?)\}\s*(\w+)\s*;', text, re.S))
+
+    def struct(self, name):
+        # laid out on first use, only SYSCFG and what it holds has to parse
+        if name not in self.structs:
+            self.structs[name] = self.layout(self.bodies[name])
+        return self.structs[name]
+
+    def value(self, name):
+        if name in CONSTANTS:
+            return CONSTANTS[name]
+        text = self.defines[name]
+        if text.startswith('"'):
+            return text[1:-1]
+        expr = re.sub(r'\b(?!0x)[A-Za-z_]\w*', lambda m: str(self.value(m.group(0))), text)
+        return int(eval(expr, {'__builtins__': {}}))
+
+    def sizeof(self, t):
+        if t in SCALARS:
+            return SCALARS[t], SCALARS[t]
+        if t.startswith('enum '):
+            return 4, 4
+        s = self.struct(t)
+        return s['size'], s['align']
+
+    def layout(self, body):
+        offset = 0
+        align = 1
+        fields = []
+        for decl in body.split(';'):
+            decl = ' '.join(decl.split())
+            if not decl:
+                continue
+            m = DECL.match(decl)
+            if not m:
+                raise SystemExit('can not parse "%s"' % decl)
+            t, name, dims = m.groups()
+            dims = [self.value(d.strip()) if not d.strip().isdigit() else int(d)
+                    for d in re.findall(r'\[([^\]]+)\]', dims)]
+            size, a = self.sizeof(t)
+            offset = (offset + a - 1) // a * a
+            fields.append((name, offset, t, dims))
+            for d in dims:
+                size *= d
+            offset += size
+            align = max(align, a)
+        return {'fields': fields, 'size': (offset + align - 1) // align * align, 'align': align}
+
+    def flatten(self, t, prefix='', base=0, out=None):
+        """Every leaf of a struct: path -> (offset, pack format) or (offset, string size)"""
+        out = {} if out is None else out
+        for name, offset, ftype, dims in self.struct(t)['fields']:
+            path = prefix + name
+            if len(dims) == 1 and ftype in ('uint8_t', 'uint8'):
+                out[path] = (base + offset, dims[0])
+            elif dims:
+                size = self.sizeof(ftype)[0]
+                for i in range(dims[0]):
+                    self.leaf(ftype, '%s[%d]' % (path, i), base + offset + i * size, out)
+            else:
+                self.leaf(ftype, path, base + offset, out)
+        return out
+
+    def leaf(self, t, path, offset, out):
+        if t in self.bodies:
+            self.flatten(t, path + '.', offset, out)
+            return
+        size = self.sizeof(t)[0]
+        fmt = {1: 'B', 2: 'H', 4: 'I'}[size]
+        out[path] = (offset, '<' + (fmt.lower() if t.startswith(('int', 'sint')) else fmt))
+
+
+def defaults(h, chip_id):
+    """config_defaults() in modules/config.c"""
+    v = h.value
+    d = {
+        'cfg_holder': v('CFG_HOLDER'),
+        'sta_ssid': v('STA_SSID'),
+        'sta_pwd': v('STA_PASS'),
+        'sta_type': v('STA_TYPE'),
+        'device_id': v('MQTT_CLIENT_ID') % chip_id,
+        'mqtt_topic': v('MQTT_TOPIC') % chip_id,
+        'mqtt_host': v('MQTT_HOST'),
+        'mqtt_port': v('MQTT_PORT'),
+        'mqtt_user': v('MQTT_USER'),
+        'mqtt_pass': v('MQTT_PASS'),
+        'security': v('DEFAULT_SECURITY'),
+        'mqtt_keepalive': v('MQTT_KEEPALIVE'),
+        'aggr_window': v('AGGR_WINDOW'),
+        'sampling.min_ms': v('SAMPLE_MIN'),
+        'sampling.max_ms': v('SAMPLE_MAX'),
+        'sampling.threshold': v('SAMPLE_THRESHOLD'),
+        'sntp_host': v('SNTP_HOST'),
+        'sntp_interval': v('SNTP_INTERVAL'),
+        'batch_size': v('BATCH_SIZE'),
+        'roam_rssi': v('ROAM_RSSI'),
+        'power_mode': v('POWER_SLEEP'),
+    }
+    for i in range(v('SENSOR_MAX')):
+        s = 'sensors[%d].' % i
+        d[s + 'pin'] = v('SENSOR_NONE')
+        d[s + 'type'] = v('DHT22')
+        for f, band in (('temp_filter.', 'FILTER_TEMP_DEADBAND'), ('hum_filter.', 'FILTER_HUM_DEADBAND')):
+            d[s + f + 'median'] = v('FILTER_MEDIAN')
+            d[s + f + 'deadband'] = v(band)
+            d[s + f + 'heartbeat'] = v('FILTER_HEARTBEAT')
+    # the first sensor keeps the topics of a single-sensor node
+    d['sensors[0].pin'] = v('DHT_PIN')
+    return d
+
+
+def render(h, fields, values):
+    payload = bytearray(h.struct('SYSCFG')['size'])
+    for path, value in values.items():
+        offset, kind = fields[path]
+        if isinstance(kind, int):
+            # like os_sprintf into the field, a default that fills it has no room for the NUL
+            data = (value.encode('utf-8') if not isinstance(value, bytes) else value)[:kind]
+            payload[offset:offset + len(data)] = data
+        else:
+            payload[offset:offset + struct.calcsize(kind)] = struct.pack(kind, value)
+    return bytes(payload)
+
+
+def record(h, payload):
+    """cfgstore.c: seq, version, len, CRC-32 over those and the payload, payload padded to 4"""
+    head = struct.pack('<IHH', 1, h.value('CFG_VERSION'), len(payload))
+    crc = zlib.crc32(payload, zlib.crc32(head)) & 0xffffffff
+    image = head + struct.pack('<I', crc) + payload + b'\xff' * (-len(payload) % 4)
+    return image + b'\xff' * (h.value('CFG_SECTORS') * SECTOR - len(image))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Per-device configuration images for provisioning')
+    parser.add_argument('devices', help='CSV, chip_id then SYSCFG fields')
+    parser.add_argument('outdir', help='where <chip id>.bin goes')
+    parser.add_argument('--fields', action='store_true', help='list the field names and exit')
+    args = parser.parse_args()
+
+    h = Headers()
+    fields = h.flatten('SYSCFG')
+    if args.fields:
+        for path in sorted(fields, key=lambda p: fields[p][0]):
+            print(path)
+        return 0
+    if h.value('CFG_VERSION') != DEFAULTS_VERSION:
+        raise SystemExit('CFG_VERSION is %d, the defaults here are for %d: add the new SYSCFG fields '
+                         'to defaults() and bump DEFAULTS_VERSION' % (h.value('CFG_VERSION'), DEFAULTS_VERSION))
+
+    if not os.path.isdir(args.outdir):
+        os.makedirs(args.outdir)
+    with open(args.devices) as f:
+        rows = list(csv.reader(f))
+    columns = [c.strip() for c in rows[0]]
+    if not columns or columns[0] != 'chip_id':
+        raise SystemExit('%s: the first column must be chip_id' % args.devices)
+    for name in columns[1:]:
+        if name not in fields:
+            raise SystemExit('%s: no SYSCFG field "%s", see --fields' % (args.devices, name))
+
+    count = 0
+    for line, row in enumerate(rows[1:], 2):
+        if not row or not row[0].strip() or row[0].startswith('#'):
+            continue
+        chip_id = int(row[0], 16)
+        values = defaults(h, chip_id)
+        for name, cell in zip(columns[1:], row[1:]):
+            cell = cell.strip()
+            if not cell:
+                continue
+            if not isinstance(fields[name][1], int):
+                values[name] = int(cell, 0)
+            elif len(cell.encode('utf-8')) < fields[name][1]:
+                values[name] = cell
+            else:
+                raise SystemExit('%s:%d: %s is longer than %d bytes' % (args.devices, line, name, fields[name][1] - 1))
+        try:
+            image = record(h, render(h, fields, values))
+        except (ValueError, struct.error) as e:
+            raise SystemExit('%s:%d: %s' % (args.devices, line, e))
+        with open(os.path.join(args.outdir, '%08X.bin' % chip_id), 'wb') as f:
+            f.write(image)
+        count += 1
+    print('%d images of %d bytes, schema %d, in %s' % (count, len(image) if count else 0,
+                                                       h.value('CFG_VERSION'), args.outdir))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
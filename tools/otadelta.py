@@ -0,0 +1,342 @@
+#!/usr/bin/env python
+#
+# Binary delta between two firmware images for the OTA updater
+#
+# The patch rebuilds the new image from the one running on the device
+# (modules/delta.c has the applier and the format). Matches are found
+# through an index of 8 byte strings in the old image and widened the way
+# bsdiff does: an alignment keeps going across bytes that differ as long
+# as more than half still match, so code that only moved or whose
+# addresses shifted costs a few literals instead of a full copy.
+#
+# A device running user1.bin needs the new user2.bin and the other way
+# round, the ack on <topic>ota/ack names the one to build the patch for:
+#
+#   otadelta.py diff old/user1.bin new/user2.bin user2.patch
+#   otadelta.py apply old/user1.bin user2.patch out.bin
+#   otadelta.py check old/user1.bin new/user2.bin
+#
+# check makes the patch, applies it and compares the result, run it on
+# the build artefacts before sending anything out. make otadelta also has
+# modules/delta.c rebuild each image from its patch on the host, fed in
+# odd chunk sizes the way the device gets it (test/delta_test.c). An ELF (build/user2.out)
+# stands for the image built from it (firmware/user2.bin).
+
+import sys
+import os
+import struct
+import hashlib
+import argparse
+
+MAGIC = b'ESPD'
+VERSION = 1
+KEY = 8             # length of the strings indexed in the old image
+MAX_CANDIDATES = 16 # positions kept per string, padding repeats a lot
+MIN_GAIN = 8        # bytes a new alignment must win over the current one
+WINDOW_BITS = 11    # LZSS window, the device keeps this much of the unpacked stream
+LENGTH_BITS = 5
+MIN_MATCH = 3
+MAX_MATCH = (1 << LENGTH_BITS) + MIN_MATCH - 1
+CHAIN = 64          # earlier positions tried per match
+
+
+def load_image(path):
+    with open(path, 'rb') as f:
+        data = f.read()
+    if data[:4] != b'\x7fELF':
+        return bytearray(data)
+    stem = os.path.splitext(os.path.basename(path))[0]
+    image = os.path.join(os.path.dirname(os.path.dirname(os.path.abspath(path))), 'firmware', stem + '.bin')
+    if not os.path.exists(image):
+        raise SystemExit('%s is an ELF and %s is missing, run make ota first' % (path, image))
+    with open(image, 'rb') as f:
+        return bytearray(f.read())
+
+
+def varint(n):
+    out = bytearray()
+    while True:
+        b = n & 0x7f
+        n >>= 7
+        if n:
+            out.append(b | 0x80)
+        else:
+            out.append(b)
+            return out
+
+
+def zigzag(n):
+    return (n << 1) if n >= 0 else ((-n << 1) - 1)
+
+
+def read_varint(data, pos):
+    n = shift = 0
+    while True:
+        b = data[pos]
+        pos += 1
+        n |= (b & 0x7f) << shift
+        shift += 7
+        if not b & 0x80:
+            return n, pos
+
+
+def match_length(old, o, new, n):
+    limit = min(len(old) - o, len(new) - n)
+    length = 0
+    step = 256
+    while step:
+        while length + step <= limit and old[o + length:o + length + step] == new[n + length:n + length + step]:
+            length += step
+        step //= 4
+    return length
+
+
+def pack(data):
+    """LZSS: a flag byte before every eight items, LSB first, 1 for a literal,
+    0 for a big-endian 16 bit match of distance - 1 and length - MIN_MATCH"""
+    window = 1 << WINDOW_BITS
+    out = bytearray()
+    chains = {}
+    flags = 0
+    items = 8
+    i = 0
+    while i < len(data):
+        if items == 8:
+            flags = len(out)
+            out.append(0)
+            items = 0
+        best, distance = 0, 0
+        for j in reversed(chains.get(bytes(data[i:i + MIN_MATCH]), [])[-CHAIN:]):
+            if i - j > window:
+                break
+            length = 0
+            while length < MAX_MATCH and i + length < len(data) and data[j + length] == data[i + length]:
+                length += 1
+            if length > best:
+                best, distance = length, i - j
+                if length == MAX_MATCH:
+                    break
+        if best < MIN_MATCH:
+            best = 1
+            out[flags] |= 1 << items
+            out.append(data[i])
+        else:
+            token = ((distance - 1) << LENGTH_BITS) | (best - MIN_MATCH)
+            out += struct.pack('>H', token)
+        for k in range(i, i + best):
+            chains.setdefault(bytes(data[k:k + MIN_MATCH]), []).append(k)
+        items += 1
+        i += best
+    return out
+
+
+def unpack(data):
+    out = bytearray()
+    i = 0
+    while i < len(data):
+        flags = data[i]
+        i += 1
+        for bit in range(8):
+            if i == len(data):
+                break
+            if flags & (1 << bit):
+                out.append(data[i])
+                i += 1
+                continue
+            token = struct.unpack('>H', bytes(data[i:i + 2]))[0]
+            i += 2
+            distance = (token >> LENGTH_BITS) + 1
+            for k in range((token & ((1 << LENGTH_BITS) - 1)) + MIN_MATCH):
+                out.append(out[-distance])
+    return out
+
+
+def find_anchors(old, new):
+    """Starts of alignments (new position, old position) in order of new position"""
+    index = {}
+    for o in range(len(old) - KEY + 1):
+        positions = index.setdefault(bytes(old[o:o + KEY]), [])
+        if len(positions) < MAX_CANDIDATES:
+            positions.append(o)
+
+    anchors = [(0, 0)]
+    shift = 0
+    n = 0
+    while n < len(new):
+        o = n + shift
+        current = match_length(old, o, new, n) if 0 <= o < len(old) else 0
+        best, best_o = 0, 0
+        for candidate in index.get(bytes(new[n:n + KEY]), ()):
+            length = match_length(old, candidate, new, n)
+            if length > best:
+                best, best_o = length, candidate
+        if best >= KEY and best_o - n != shift and best > current + MIN_GAIN:
+            anchors.append((n, best_o))
+            shift = best_o - n
+            n += best
+        else:
+            n += max(current, 1)
+    return anchors
+
+
+def encode_add(out, old, o, new, n, length):
+    diff = bytearray((new[n + i] - old[o + i]) & 0xff for i in range(length))
+    i = 0
+    while i < length:
+        start = i
+        while i < length and diff[i] == 0:
+            i += 1
+        out += varint(i - start)
+        if i == length:
+            break
+        start = i
+        while i < length:
+            if diff[i]:
+                i += 1
+                continue
+            # a zero run shorter than 3 costs more as a new pair than as literals
+            j = i
+            while j < length and j - i < 3 and diff[j] == 0:
+                j += 1
+            if j == length or diff[j] == 0 or j - i > 2:
+                break
+            i = j
+        out += varint(i - start)
+        out += diff[start:i]
+
+
+def diff(old, new):
+    anchors = find_anchors(old, new)
+    anchors.append((len(new), None))
+    out = bytearray()
+
+    last_n, last_o = anchors[0]
+    for n, o in anchors[1:]:
+        # widen the previous alignment forward
+        score = best = length_f = 0
+        i = 0
+        while last_n + i < n and last_o + i < len(old):
+            if old[last_o + i] == new[last_n + i]:
+                score += 1
+            i += 1
+            if score * 2 - i > best * 2 - length_f:
+                best, length_f = score, i
+
+        # and the next one backward
+        length_b = 0
+        if o is not None:
+            score = best = 0
+            i = 1
+            while n - i >= last_n and o - i >= 0:
+                if old[o - i] == new[n - i]:
+                    score += 1
+                if score * 2 - i > best * 2 - length_b:
+                    best, length_b = score, i
+                i += 1
+
+        # where both reach over the same bytes, split where the two fit best
+        overlap = last_n + length_f - (n - length_b)
+        if overlap > 0:
+            score = best = split = 0
+            for i in range(overlap):
+                if new[last_n + length_f - overlap + i] == old[last_o + length_f - overlap + i]:
+                    score += 1
+                if new[n - length_b + i] == old[o - length_b + i]:
+                    score -= 1
+                if score > best:
+                    best, split = score, i + 1
+            length_f += split - overlap
+            length_b -= split
+
+        insert_start = last_n + length_f
+        insert_end = n - length_b
+        next_o = (o - length_b) if o is not None else last_o + length_f
+        out += varint(length_f)
+        out += varint(insert_end - insert_start)
+        out += varint(zigzag(next_o - (last_o + length_f)))
+        encode_add(out, old, last_o, new, last_n, length_f)
+        out += new[insert_start:insert_end]
+        last_n, last_o = insert_end, next_o
+    header = MAGIC + struct.pack('<B3xII', VERSION, len(old), len(new)) + hashlib.sha256(bytes(old)).digest()
+    return bytearray(header) + pack(out)
+
+
+def apply(old, patch):
+    if patch[:4] != MAGIC or patch[4] != VERSION:
+        raise ValueError('not a patch')
+    old_size, new_size = struct.unpack('<II', bytes(patch[8:16]))
+    if old_size != len(old) or patch[16:48] != hashlib.sha256(bytes(old)).digest():
+        raise ValueError('patch was made against another image')
+    new = bytearray()
+    patch = unpack(patch[48:])
+    pos = 0
+    o = 0
+    while len(new) < new_size:
+        add, pos = read_varint(patch, pos)
+        insert, pos = read_varint(patch, pos)
+        seek, pos = read_varint(patch, pos)
+        seek = (seek >> 1) ^ -(seek & 1)
+        while add:
+            zeros, pos = read_varint(patch, pos)
+            new += old[o:o + zeros]
+            o += zeros
+            add -= zeros
+            if not add:
+                break
+            literals, pos = read_varint(patch, pos)
+            new += bytearray((old[o + i] + patch[pos + i]) & 0xff for i in range(literals))
+            o += literals
+            pos += literals
+            add -= literals
+        new += patch[pos:pos + insert]
+        pos += insert
+        o += seek
+    if pos != len(patch) or len(new) != new_size:
+        raise ValueError('patch is corrupt')
+    return new
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Binary delta between firmware images for OTA updates')
+    sub = parser.add_subparsers(dest='command')
+    p = sub.add_parser('diff', help='Make a patch from the running image to the new one')
+    p.add_argument('old')
+    p.add_argument('new')
+    p.add_argument('patch')
+    p = sub.add_parser('apply', help='Rebuild the new image from the old one and a patch')
+    p.add_argument('old')
+    p.add_argument('patch')
+    p.add_argument('new')
+    p = sub.add_parser('check', help='Make a patch, apply it and compare')
+    p.add_argument('old')
+    p.add_argument('new')
+    args = parser.parse_args()
+
+    if args.command == 'diff':
+        old, new = load_image(args.old), load_image(args.new)
+        patch = diff(old, new)
+        with open(args.patch, 'wb') as f:
+            f.write(patch)
+        print('%d bytes, %d%% of the image' % (len(patch), 100 * len(patch) // len(new)))
+    elif args.command == 'apply':
+        old = load_image(args.old)
+        with open(args.patch, 'rb') as f:
+            patch = bytearray(f.read())
+        new = apply(old, patch)
+        with open(args.new, 'wb') as f:
+            f.write(new)
+        print('%d bytes, sha256=%s' % (len(new), hashlib.sha256(bytes(new)).hexdigest()))
+    elif args.command == 'check':
+        old, new = load_image(args.old), load_image(args.new)
+        patch = diff(old, new)
+        if apply(old, patch) != new:
+            raise SystemExit('round trip failed')
+        print('%d bytes for an image of %d, round trip ok' % (len(patch), len(new)))
+    else:
+        parser.print_help()
+        return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
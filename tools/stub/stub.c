@@ -0,0 +1,284 @@
+/*
+ * stub.c
+ *
+ *  Flasher that tools/esptool.py runs from RAM in place of the ROM
+ *  loader, for what the ROM can not do: sectors sent LZSS packed (the
+ *  format of tools/otadelta.py, each one packed on its own), SHA-256 of
+ *  sectors already in flash so unchanged ones are skipped, and a faster
+ *  baud rate once it is running. Built without ICACHE_FLASH, everything
+ *  sits in IRAM and DRAM; the ROM supplies the SPI flash routines.
+ *
+ *  Same SLIP framing and packet layout as the ROM loader. The response
+ *  body ends in two status bytes, 0 0 for success, after any data.
+ *    0x08 SYNC
+ *    0x0F CHANGE_BAUD   new baud, current baud
+ *    0x10 FLASH_PACKED  len, flash address of the sector, 0, 0, packed data
+ *    0x11 FLASH_DIGEST  flash address, sectors; data is 32 bytes per sector
+ */
+#include "ets_sys.h"
+#include "os_type.h"
+#include "sha256.h"
+
+#define REG(a)			(*(volatile uint32_t *)(a))
+#define UART_FIFO		0x60000000
+#define UART_INT_ENA	0x6000000C
+#define UART_INT_CLR	0x60000010
+#define UART_CLKDIV		0x60000014
+#define UART_STATUS		0x6000001C	/* RX count in bits 0-7, TX count in 16-23 */
+
+#define SECTOR			4096
+#define DIGEST_MAX		64			/* sectors per FLASH_DIGEST */
+#define LENGTH_BITS		5			/* LZSS, must match tools/otadelta.py */
+#define MIN_MATCH		3
+
+enum {
+	CMD_SYNC = 0x08,
+	CMD_CHANGE_BAUD = 0x0F,
+	CMD_FLASH_PACKED = 0x10,
+	CMD_FLASH_DIGEST = 0x11
+};
+
+enum {
+	STATUS_OK,
+	STATUS_BAD_COMMAND,
+	STATUS_BAD_LENGTH,
+	STATUS_BAD_CHECKSUM,
+	STATUS_BAD_DATA,
+	STATUS_FLASH
+};
+
+extern void SelectSpiFunction(uint32_t mode);
+extern int SPIParamCfg(uint32_t id, uint32_t size, uint32_t block, uint32_t sector, uint32_t page, uint32_t mask);
+extern int SPIUnlock(void);
+extern int SPIEraseSector(uint32_t sector);
+extern int SPIWrite(uint32_t addr, const uint32_t *src, uint32_t size);
+extern int SPIRead(uint32_t addr, uint32_t *dst, uint32_t size);
+
+extern uint32_t _bss_start, _bss_end;
+
+/* operation, direction, length, checksum, four words of parameters, data */
+LOCAL uint8_t packet[8 + 16 + SECTOR + SECTOR / 8 + 8];
+LOCAL uint32_t sector[SECTOR / 4];
+LOCAL uint8_t digests[DIGEST_MAX * SHA256_SIZE];
+
+LOCAL uint8_t
+uart_rx(void)
+{
+	while ((REG(UART_STATUS) & 0xFF) == 0)
+		;
+	return REG(UART_FIFO) & 0xFF;
+}
+
+LOCAL void
+uart_tx(uint8_t c)
+{
+	while (((REG(UART_STATUS) >> 16) & 0xFF) >= 126)
+		;
+	REG(UART_FIFO) = c;
+}
+
+LOCAL void
+slip_send(const uint8_t *p, uint32_t len)
+{
+	while (len--) {
+		if (*p == 0xC0) {
+			uart_tx(0xDB);
+			uart_tx(0xDC);
+		} else if (*p == 0xDB) {
+			uart_tx(0xDB);
+			uart_tx(0xDD);
+		} else {
+			uart_tx(*p);
+		}
+		p++;
+	}
+}
+
+/* Next whole frame, 0 if it did not fit */
+LOCAL uint32_t
+slip_recv(uint8_t *buf, uint32_t size)
+{
+	uint32_t len = 0;
+	BOOL overflow = FALSE;
+	uint8_t c;
+
+	while (uart_rx() != 0xC0)
+		;
+	while ((c = uart_rx()) != 0xC0) {
+		if (c == 0xDB)
+			c = uart_rx() == 0xDC ? 0xC0 : 0xDB;
+		if (len == size)
+			overflow = TRUE;
+		else
+			buf[len++] = c;
+	}
+	return overflow ? 0 : len;
+}
+
+LOCAL void
+reply(uint8_t op, const uint8_t *data, uint16_t len, uint8_t status)
+{
+	uint8_t head[8] = { 0x01, op, (len + 2) & 0xFF, (len + 2) >> 8, 0, 0, 0, 0 };
+	uint8_t tail[2] = { status != STATUS_OK, status };
+
+	uart_tx(0xC0);
+	slip_send(head, sizeof(head));
+	slip_send(data, len);
+	slip_send(tail, sizeof(tail));
+	uart_tx(0xC0);
+}
+
+LOCAL uint32_t
+le32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* One sector's worth of packed data into sector[], FALSE unless it is exactly that */
+LOCAL BOOL
+unpack(const uint8_t *p, uint32_t len)
+{
+	const uint8_t *end = p + len;
+	uint8_t *out = (uint8_t *)sector;
+	uint32_t n = 0, dist, count;
+	uint8_t flags = 0, items = 8;
+	uint16_t token;
+
+	while (p < end) {
+		if (items == 8) {
+			flags = *p++;
+			items = 0;
+			continue;
+		}
+		if (flags & (1 << items)) {
+			if (n == SECTOR)
+				return FALSE;
+			out[n++] = *p++;
+		} else {
+			if (end - p < 2)
+				return FALSE;
+			token = (p[0] << 8) | p[1];
+			p += 2;
+			dist = (token >> LENGTH_BITS) + 1;
+			count = (token & ((1 << LENGTH_BITS) - 1)) + MIN_MATCH;
+			if (dist > n || n + count > SECTOR)
+				return FALSE;
+			while (count--) {
+				out[n] = out[n - dist];
+				n++;
+			}
+		}
+		items++;
+	}
+	return n == SECTOR;
+}
+
+LOCAL uint8_t
+flash_packed(const uint8_t *params, const uint8_t *data, uint32_t len, uint8_t checksum)
+{
+	uint32_t addr = le32(params + 4);
+	uint32_t i;
+
+	if (le32(params) != len || (addr & (SECTOR - 1)))
+		return STATUS_BAD_LENGTH;
+	for (i = 0; i < len; i++)
+		checksum ^= data[i];
+	if (checksum != 0xEF)
+		return STATUS_BAD_CHECKSUM;
+	if (!unpack(data, len))
+		return STATUS_BAD_DATA;
+	if (SPIEraseSector(addr / SECTOR) != 0 || SPIWrite(addr, sector, SECTOR) != 0)
+		return STATUS_FLASH;
+	return STATUS_OK;
+}
+
+LOCAL uint8_t
+flash_digest(const uint8_t *params, uint16_t *len)
+{
+	uint32_t addr = le32(params);
+	uint32_t count = le32(params + 4);
+	SHA256_CTX sha;
+	uint32_t i;
+
+	if (count > DIGEST_MAX || (addr & (SECTOR - 1)))
+		return STATUS_BAD_LENGTH;
+	for (i = 0; i < count; i++) {
+		if (SPIRead(addr + i * SECTOR, sector, SECTOR) != 0)
+			return STATUS_FLASH;
+		SHA256_Init(&sha);
+		SHA256_Update(&sha, (const uint8_t *)sector, SECTOR);
+		SHA256_Final(&sha, digests + i * SHA256_SIZE);
+	}
+	*len = count * SHA256_SIZE;
+	return STATUS_OK;
+}
+
+/* Answered at the old rate, the host switches once it has the reply */
+LOCAL void
+change_baud(const uint8_t *params)
+{
+	// the divider the ROM measured while syncing gives the UART clock, whatever the crystal
+	uint32_t clock = (REG(UART_CLKDIV) & 0xFFFFF) * le32(params + 4);
+	uint32_t i;
+
+	reply(CMD_CHANGE_BAUD, NULL, 0, STATUS_OK);
+	while ((REG(UART_STATUS) >> 16) & 0xFF)
+		;
+	// the FIFO is empty but the last byte may still be shifting out
+	for (i = 0; i < 10000; i++)
+		REG(UART_STATUS);
+	REG(UART_CLKDIV) = clock / le32(params);
+}
+
+void
+stub_main(void)
+{
+	uint32_t *p;
+	uint32_t len;
+	uint16_t out;
+	uint8_t status;
+
+	for (p = &_bss_start; p < &_bss_end; p++)
+		*p = 0;
+	// the ROM's UART interrupt would take bytes meant for the loop below
+	REG(UART_INT_ENA) = 0;
+	REG(UART_INT_CLR) = 0x1FF;
+	SelectSpiFunction(0);
+	SPIParamCfg(0, 16 * 1024 * 1024, 64 * 1024, SECTOR, 256, 0xFFFF);
+	SPIUnlock();
+
+	uart_tx(0xC0);
+	slip_send((const uint8_t *)"OHAI", 4);
+	uart_tx(0xC0);
+
+	for (;;) {
+		len = slip_recv(packet, sizeof(packet));
+		if (len < 8 || packet[0] != 0x00)
+			continue;
+		out = 0;
+		len -= 8;
+		switch (packet[1]) {
+		case CMD_SYNC:
+			status = STATUS_OK;
+			break;
+		case CMD_CHANGE_BAUD:
+			if (len < 8) {
+				status = STATUS_BAD_LENGTH;
+				break;
+			}
+			change_baud(packet + 8);
+			continue;
+		case CMD_FLASH_PACKED:
+			status = len < 16 ? STATUS_BAD_LENGTH :
+					flash_packed(packet + 8, packet + 24, len - 16, packet[4]);
+			break;
+		case CMD_FLASH_DIGEST:
+			status = len < 8 ? STATUS_BAD_LENGTH : flash_digest(packet + 8, &out);
+			break;
+		default:
+			status = STATUS_BAD_COMMAND;
+			break;
+		}
+		reply(packet[1], digests, status == STATUS_OK ? out : 0, status);
+	}
+}
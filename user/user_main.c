@@ -8,6 +8,8 @@
  *  DHT22 4 (GND) to GND
  *
  *  Between Vcc and DATA_OUT needs to connect a pull-up resistor of 10 kOhm.
+ *  Up to SENSOR_MAX sensors can be wired the same way, each to its own GPIO
+ *  listed in config.sensors.
  *
  *  (c) 2015 by Mikhail Grigorev <sleuthhound@gmail.com>
  *
@@ -19,17 +21,147 @@
 #include "mqtt.h"
 #include "wifi.h"
 #include "config.h"
+#include "bridge.h"
+#include "rtc_cache.h"
+#include "sensor.h"
+#include "sched.h"
+#include "clock.h"
+#include "ticker.h"
+#include "settings.h"
+#include "ota.h"
+#include "power.h"
+#include "metrics.h"
 #include "debug.h"
+#include "utils.h"
 #include "user_interface.h"
 #include "mem.h"
 
 MQTT_Client mqttClient;
 LOCAL os_timer_t dhtTimer;
+LOCAL SCHED sampler;
+LOCAL TICKER ticker;
+LOCAL os_timer_t aggrTimer;
+LOCAL BOOL sensorsChanged;
+LOCAL BOOL scanning;
+
+#ifdef DEEP_SLEEP_MODE
+LOCAL RTC_CACHE rtcCache;
+LOCAL os_timer_t sleepTimer;
+LOCAL BOOL sampled, published;
+LOCAL uint16_t lastMsgId;
+
+LOCAL void ICACHE_FLASH_ATTR go_to_sleep(BOOL linkOk)
+{
+	os_timer_disarm(&sleepTimer);
+	os_timer_disarm(&dhtTimer);
+
+	// only a cycle that got all the way to the broker leaves a cache behind
+	if (linkOk && WIFI_GetLink(&rtcCache.net, rtcCache.bssid, &rtcCache.channel, &rtcCache.ip)) {
+		rtcCache.broker_ip = mqttClient.ip;
+		rtcCache.mqtt_msg_id = mqttClient.mqtt_state.mqtt_connection.message_id;
+		rtcCache.wake_count++;
+		RTC_CacheSave(&rtcCache);
+	} else {
+		RTC_CacheInvalidate();
+	}
+	INFO("Deep sleep for %d ms\r\n", DEEP_SLEEP_US / 1000);
+	// the log is still queued for the TX interrupt, which sleep would cut short
+	uart0_tx_flush();
+	system_deep_sleep(DEEP_SLEEP_US);
+}
+
+LOCAL void ICACHE_FLASH_ATTR sleep_timeout_cb(void *arg)
+{
+	INFO("Wake cycle timed out\r\n");
+	go_to_sleep(FALSE);
+}
+#else
+/* Until the next sample or keepalive, whichever comes first */
+LOCAL uint32_t ICACHE_FLASH_ATTR power_deadline(void)
+{
+	int32_t sample = TICKER_Remaining(&ticker) / 1000;
+	uint32_t ping = MQTT_KeepaliveDue(&mqttClient) * 1000;
+
+	if (scanning || sample <= 0 || !MQTT_Idle(&mqttClient))
+		return 0;
+	return (uint32_t)sample < ping ? (uint32_t)sample : ping;
+}
+
+LOCAL uint8_t ICACHE_FLASH_ATTR power_mode(void)
+{
+#ifdef SERIAL_BRIDGE
+	// UART input arriving while the CPU is suspended is lost
+	if (config.power_mode == POWER_LIGHT)
+		return POWER_MODEM;
+#endif
+	return config.power_mode;
+}
+#endif
+
+LOCAL void ICACHE_FLASH_ATTR format_reading(struct dht_sensor_data *r, char *temp, char *hum)
+{
+	UTILS_FormatTenths(temp, r->temperature);
+	UTILS_FormatTenths(hum, r->humidity);
+}
+
+LOCAL BOOL ICACHE_FLASH_ATTR publish_value(const SENSOR *s, const char *name, const char *value, int qos)
+{
+	char topic[64];
+
+	SENSOR_Topic(s, topic, config.mqtt_topic, name);
+	return MQTT_Publish(&mqttClient, topic, value, strlen(value), qos, 0);
+}
+
+/* Carries the sensor's latest reading, its way to the broker is timed from the read */
+LOCAL BOOL ICACHE_FLASH_ATTR publish_sample(const SENSOR *s, const char *name, const char *value, int qos)
+{
+	MQTT_Stamp(&mqttClient, s->reading->time);
+	return publish_value(s, name, value, qos);
+}
+
+#ifdef DEEP_SLEEP_MODE
+/* Runs once both the sample and the broker connection are there, whichever
+ * comes last. The cycle ends when the broker acknowledges the last message. */
+LOCAL void ICACHE_FLASH_ATTR duty_publish(void)
+{
+	char temp[10];
+	char hum[10];
+	SENSOR *s;
+	uint8_t i;
+
+	if (!sampled || published || mqttClient.connState != MQTT_DATA)
+		return;
+	published = TRUE;
+
+	lastMsgId = 0;
+	for (i = 0; (s = SENSOR_Get(i)) != NULL; i++) {
+		if (!s->reading->success)
+			continue;
+		format_reading(s->reading, temp, hum);
+		publish_sample(s, "temperature", temp, 1);
+		publish_sample(s, "humidity", hum, 1);
+		lastMsgId = mqttClient.mqtt_state.pending_msg_id;
+	}
+	if (lastMsgId == 0)
+		go_to_sleep(TRUE);
+}
+
+void mqtt_acked_cb(uint32_t *args)
+{
+	MQTT_Client* client = (MQTT_Client*)args;
+
+	if (published && client->mqtt_state.pending_msg_id == lastMsgId)
+		go_to_sleep(TRUE);
+}
+#endif
 
 void wifi_connect_cb(uint8_t status)
 {
 	if(status == STATION_GOT_IP){
 		MQTT_Connect(&mqttClient);
+#ifndef DEEP_SLEEP_MODE
+		CLOCK_Sync();
+#endif
 	} else {
 		MQTT_Disconnect(&mqttClient);
 	}
@@ -37,21 +169,39 @@ void wifi_connect_cb(uint8_t status)
 void mqtt_connected_cb(uint32_t *args)
 {
 	MQTT_Client* client = (MQTT_Client*)args;
+	char topic[32];
+
 	INFO("MQTT: Connected\r\n");
+	os_sprintf(topic, "%sconfig", config.mqtt_topic);
+	MQTT_Subscribe(client, topic, 1);
+#ifdef OTA_UPDATE
+	OTA_Connected();
+#endif
+#ifdef DEEP_SLEEP_MODE
+	duty_publish();
+#endif
 }
 
 void mqtt_disconnected_cb(uint32_t *args)
 {
 	MQTT_Client* client = (MQTT_Client*)args;
 	INFO("MQTT: Disconnected\r\n");
+	// a longer keepalive only takes effect with the next CONNECT
+	client->connect_info.keepalive = config.mqtt_keepalive;
 }
 
 void mqtt_published_cb(uint32_t *args)
 {
 	MQTT_Client* client = (MQTT_Client*)args;
 	INFO("MQTT: Published\r\n");
+#ifndef DEEP_SLEEP_MODE
+	// the ack and whatever the broker answers should not wait for a beacon
+	POWER_Wake();
+#endif
 }
 
+LOCAL void ICACHE_FLASH_ATTR settings_received(const char *data, uint32_t len);
+
 void mqtt_data_cb(uint32_t *args, const char* topic, uint32_t topic_len, const char *data, uint32_t data_len)
 {
 	char *topicBuf = (char*)os_zalloc(topic_len+1),
@@ -59,76 +209,353 @@ void mqtt_data_cb(uint32_t *args, const char* topic, uint32_t topic_len, const c
 
 	MQTT_Client* client = (MQTT_Client*)args;
 
+#ifndef DEEP_SLEEP_MODE
+	// more tends to follow: OTA chunks, a config ack to send
+	POWER_Wake();
+#endif
 	os_memcpy(topicBuf, topic, topic_len);
 	topicBuf[topic_len] = 0;
 
 	os_memcpy(dataBuf, data, data_len);
 	dataBuf[data_len] = 0;
 
+#ifdef OTA_UPDATE
+	// image chunks are binary and arrive by the hundred, keep them out of the log
+	if (OTA_Data(topicBuf, dataBuf, data_len)) {
+		os_free(topicBuf);
+		os_free(dataBuf);
+		return;
+	}
+#endif
 	INFO("Receive topic: %s, data: %s \r\n", topicBuf, dataBuf);
+	if (topic_len == os_strlen(config.mqtt_topic) + 6 &&
+			os_strncmp(topicBuf, config.mqtt_topic, topic_len - 6) == 0 &&
+			os_strcmp(topicBuf + topic_len - 6, "config") == 0)
+		settings_received(dataBuf, data_len);
 	os_free(topicBuf);
 	os_free(dataBuf);
 }
 
-LOCAL void ICACHE_FLASH_ATTR dhtCb(void *arg)
+LOCAL void ICACHE_FLASH_ATTR filter_publish(SENSOR *s, FILTER *f, const char *name, int32_t value)
 {
-	static char data[256];
-	static char temp[10];
-	static char hum[10];
-	uint8_t status;
-	os_timer_disarm(&dhtTimer);
-	struct dht_sensor_data* r = DHTRead();
-	float curTemp = r->temperature;
-	float curHum = r->humidity;
-	static float lastTemp;
-	static float lastHum;
-	uint8_t topic[32];
-	if(r->success)
-	{
-		os_sprintf(temp, "%d.%d",(int)(curTemp),(int)((curTemp - (int)curTemp)*100));
-		os_sprintf(hum, "%d.%d",(int)(curHum),(int)((curHum - (int)curHum)*100));
-		INFO("Temperature: %s *C, Humidity: %s %%\r\n", temp, hum);
-		if (mqttClient.connState == MQTT_DATA && lastTemp != curTemp) {
-			os_sprintf(topic, "%s%s", config.mqtt_topic, "temperature");
-			MQTT_Publish(&mqttClient, topic, temp, strlen(temp), 0, 0);
-			lastTemp = curTemp;
-		}
-		if (mqttClient.connState == MQTT_DATA && lastHum != curHum) {
-			os_sprintf(topic, "%s%s", config.mqtt_topic, "humidity");
-			MQTT_Publish(&mqttClient, topic, hum, strlen(hum), 0, 0);
-			lastHum = curHum;
+	char buf[10];
+	int32_t out;
+
+	if (!FILTER_Update(f, value, &out) || mqttClient.connState != MQTT_DATA)
+		return;
+	UTILS_FormatTenths(buf, out);
+	if (publish_sample(s, name, buf, 0))
+		FILTER_Sent(f, out);
+}
+
+LOCAL char * ICACHE_FLASH_ATTR format_aggr(char *p, const char *name, const AGGR *a)
+{
+	p += os_sprintf(p, "\"%s\":{\"min\":", name);
+	p += UTILS_FormatTenths(p, a->min);
+	p += os_sprintf(p, ",\"max\":");
+	p += UTILS_FormatTenths(p, a->max);
+	p += os_sprintf(p, ",\"mean\":");
+	p += UTILS_FormatTenths(p, AGGR_Mean(a));
+	p += os_sprintf(p, ",\"last\":");
+	p += UTILS_FormatTenths(p, a->last);
+	p += os_sprintf(p, "}");
+	return p;
+}
+
+LOCAL void ICACHE_FLASH_ATTR aggrCb(void *arg)
+{
+	char buf[224];
+	char *p;
+	SENSOR *s;
+	uint8_t i;
+
+	// while offline the window just keeps growing so no extremes are lost
+	if (mqttClient.connState != MQTT_DATA)
+		return;
+
+	for (i = 0; (s = SENSOR_Get(i)) != NULL; i++) {
+		if (s->temp_aggr.count == 0)
+			continue;
+		p = buf;
+		p += os_sprintf(p, "{");
+		p = format_aggr(p, "temperature", &s->temp_aggr);
+		p += os_sprintf(p, ",");
+		p = format_aggr(p, "humidity", &s->hum_aggr);
+		p += os_sprintf(p, ",\"n\":%d,\"ts\":", s->temp_aggr.count);
+		p += CLOCK_Format(p, CLOCK_Millis());
+		p += os_sprintf(p, "}");
+
+		if (publish_value(s, "summary", buf, 0)) {
+			AGGR_Reset(&s->temp_aggr);
+			AGGR_Reset(&s->hum_aggr);
 		}
 	}
+}
+
+LOCAL void ICACHE_FLASH_ATTR aggr_start(void)
+{
+	SENSOR *s;
+	uint8_t i;
+
+	os_timer_disarm(&aggrTimer);
+	for (i = 0; (s = SENSOR_Get(i)) != NULL; i++) {
+		AGGR_Reset(&s->temp_aggr);
+		AGGR_Reset(&s->hum_aggr);
+	}
+	if (config.aggr_window == 0)
+		return;
+	os_timer_setfn(&aggrTimer, (os_timer_func_t *)aggrCb, (void *)0);
+	os_timer_arm(&aggrTimer, config.aggr_window * 1000, 1);
+}
+
+/* Sent once the batch is full; while offline it keeps the newest BATCH_MAX samples */
+LOCAL void ICACHE_FLASH_ATTR batch_publish(SENSOR *s)
+{
+	static char buf[BATCH_MAX * BATCH_SAMPLE_LEN + 2];
+	uint16_t size = config.batch_size < BATCH_MAX ? config.batch_size : BATCH_MAX;
+
+	if (s->batch.count < size || mqttClient.connState != MQTT_DATA)
+		return;
+	BATCH_Format(&s->batch, buf);
+	if (publish_sample(s, "batch", buf, 0))
+		BATCH_Reset(&s->batch);
+}
+
+/*
+ * Lines samples up with the minimum interval in Unix time so nodes sample
+ * together. Every interval is a whole number of those steps, so once on the
+ * grid a deadline only moves by the drift of the clock.
+ */
+LOCAL void ICACHE_FLASH_ATTR align_to_wall(void)
+{
+	uint32_t step = SCHED_Step(&sampler);
+	int32_t left = TICKER_Remaining(&ticker);
+	uint32_t sec;
+	uint16_t ms;
+	uint32_t r;
+
+	if (!CLOCK_Unix(CLOCK_Millis() + left / 1000, &sec, &ms))
+		return;
+	r = ((uint64_t)sec * 1000 + ms) % step;
+	if (r == 0)
+		return;
+	// back to the grid point before only if that is still ahead
+	if (r < step / 2 && (int64_t)r * 1000 <= left)
+		TICKER_Shift(&ticker, -(int32_t)r * 1000);
 	else
-	{
-		INFO("Error reading temperature and humidity.\r\n");
+		TICKER_Shift(&ticker, (int32_t)(step - r) * 1000);
+}
+
+LOCAL void ICACHE_FLASH_ATTR dhtCb(void *arg);
+
+LOCAL void ICACHE_FLASH_ATTR sensors_read_cb(void)
+{
+	char temp[10];
+	char hum[10];
+	int32_t values[SCHED_MAX_METRICS];
+	uint32_t next = SCHED_Interval(&sampler);
+	BOOL any = FALSE;
+	SENSOR *s;
+	uint8_t i;
+
+	scanning = FALSE;
+#ifdef DEEP_SLEEP_MODE
+	sampled = TRUE;
+	duty_publish();
+	return;
+#endif
+	for (i = 0; (s = SENSOR_Get(i)) != NULL; i++) {
+		// a failed sensor keeps its last values so the others stay in their slots
+		values[2 * i] = s->reading->temperature;
+		values[2 * i + 1] = s->reading->humidity;
+		if(s->reading->success)
+		{
+			any = TRUE;
+			format_reading(s->reading, temp, hum);
+			INFO("GPIO%d Temperature: %s *C, Humidity: %s %%\r\n", s->cfg->pin, temp, hum);
+			if (config.aggr_window) {
+				AGGR_Add(&s->temp_aggr, s->reading->temperature);
+				AGGR_Add(&s->hum_aggr, s->reading->humidity);
+			} else if (config.batch_size > 1) {
+				BATCH_Add(&s->batch, CLOCK_Millis(), s->reading->temperature, s->reading->humidity);
+				batch_publish(s);
+			} else {
+				filter_publish(s, &s->temp_filter, "temperature", s->reading->temperature);
+				filter_publish(s, &s->hum_filter, "humidity", s->reading->humidity);
+			}
+		}
+		else
+		{
+			INFO("GPIO%d Error reading temperature and humidity.\r\n", s->cfg->pin);
+		}
 	}
+	if (any)
+		next = SCHED_Next(&sampler, values, 2 * i);
+	INFO("Sample jitter %d us, max %d us, missed %d\r\n", ticker.jitter, ticker.jitter_max, ticker.missed);
+
+	// the next deadline counts from the previous one, not from how long this cycle took
+	TICKER_Advance(&ticker, next);
+	align_to_wall();
+	os_timer_disarm(&dhtTimer);
 	os_timer_setfn(&dhtTimer, (os_timer_func_t *)dhtCb, (void *)0);
-	os_timer_arm(&dhtTimer, DELAY, 1);
+	os_timer_arm(&dhtTimer, TICKER_Arm(&ticker), 0);
+}
+
+LOCAL void ICACHE_FLASH_ATTR dhtCb(void *arg)
+{
+	os_timer_disarm(&dhtTimer);
+#ifndef DEEP_SLEEP_MODE
+	TICKER_Fired(&ticker);
+#endif
+	// the scan in flight re-arms the timer when it completes
+	if (scanning)
+		return;
+	// pins are only switched between scans
+	if (sensorsChanged) {
+		sensorsChanged = FALSE;
+		SENSOR_Init(config.sensors, SENSOR_MAX);
+	}
+	if (SENSOR_Scan(sensors_read_cb)) {
+		scanning = TRUE;
+		return;
+	}
+	INFO("No sensor to read.\r\n");
+#ifdef DEEP_SLEEP_MODE
+	sampled = TRUE;
+	duty_publish();
+#else
+	// keep ticking so sensors configured later get picked up
+	TICKER_Advance(&ticker, SCHED_Interval(&sampler));
+	os_timer_arm(&dhtTimer, TICKER_Arm(&ticker), 0);
+#endif
+}
+
+/* "key=value,..." on <topic>config, an empty message or "?" just asks for the current values */
+LOCAL void ICACHE_FLASH_ATTR settings_received(const char *data, uint32_t len)
+{
+	static char ack[SETTINGS_ACK_SIZE];
+	char topic[40];
+	char old[sizeof(config.mqtt_topic)];
+	uint8_t changed = 0;
+
+	os_memcpy(old, config.mqtt_topic, sizeof(old));
+
+	if (len == 0 || (len == 1 && data[0] == '?'))
+		SETTINGS_Dump(ack, sizeof(ack));
+	else
+		changed = SETTINGS_Apply(data, len, ack, sizeof(ack));
+
+	if (changed & SETTINGS_CHANGED)
+		config_save();
+	if (changed & SETTINGS_MQTT && config.mqtt_keepalive < mqttClient.connect_info.keepalive)
+		mqttClient.connect_info.keepalive = config.mqtt_keepalive;
+	if (changed & SETTINGS_SENSORS)
+		sensorsChanged = TRUE;
+#ifndef DEEP_SLEEP_MODE
+	if (changed & SETTINGS_SAMPLING) {
+		// a scan in flight re-arms the timer itself when it completes
+		os_timer_disarm(&dhtTimer);
+		TICKER_Start(&ticker, SCHED_Interval(&sampler));
+		os_timer_setfn(&dhtTimer, (os_timer_func_t *)dhtCb, (void *)0);
+		os_timer_arm(&dhtTimer, TICKER_Arm(&ticker), 0);
+	}
+	if (changed & SETTINGS_AGGR)
+		aggr_start();
+	if (changed & SETTINGS_CLOCK) {
+		CLOCK_Init(config.sntp_host, config.sntp_interval);
+		CLOCK_Sync();
+	}
+	if (changed & SETTINGS_WIFI) {
+		WIFI_SetRoaming(-(sint8)config.roam_rssi);
+		POWER_SetMode(power_mode());
+	}
+#endif
+	if (changed & SETTINGS_TOPIC && os_strcmp(old, config.mqtt_topic) != 0) {
+		// the broker keeps delivering the old prefix until told otherwise
+		os_sprintf(topic, "%sconfig", old);
+		MQTT_UnSubscribe(&mqttClient, topic);
+		os_sprintf(topic, "%sconfig", config.mqtt_topic);
+		MQTT_Subscribe(&mqttClient, topic, 1);
+#ifdef OTA_UPDATE
+		os_sprintf(topic, "%sota/+", old);
+		MQTT_UnSubscribe(&mqttClient, topic);
+		os_sprintf(topic, "%sota/+", config.mqtt_topic);
+		MQTT_Subscribe(&mqttClient, topic, 1);
+#endif
+	}
+
+	os_sprintf(topic, "%sconfig/ack", config.mqtt_topic);
+	MQTT_Publish(&mqttClient, topic, ack, os_strlen(ack), 0, 0);
 }
 
 void user_init(void)
 {
+	uint8_t i;
+
+#ifdef SERIAL_BRIDGE
+	uart_init(SERIAL_BRIDGE_BAUD, BIT_RATE_115200);
+#else
 	uart_init(BIT_RATE_115200, BIT_RATE_115200);
+#endif
 	os_delay_us(1000000);
 
 	config_load();
 
-	DHTInit(DHT22);
+	SENSOR_Init(config.sensors, SENSOR_MAX);
+	SCHED_Init(&sampler, &config.sampling, DELAY);
 
 	MQTT_InitConnection(&mqttClient, config.mqtt_host, config.mqtt_port, config.security);
 	MQTT_InitClient(&mqttClient, config.device_id, config.mqtt_user, config.mqtt_pass, config.mqtt_keepalive, 1);
+#ifdef DEEP_SLEEP_MODE
+	if (RTC_CacheLoad(&rtcCache, RTC_CacheTag(config.sta_ssid, config.mqtt_host))) {
+		WIFI_SetFastLink(rtcCache.net, rtcCache.bssid, rtcCache.channel, &rtcCache.ip);
+		mqttClient.ip = rtcCache.broker_ip;
+		mqttClient.mqtt_state.mqtt_connection.message_id = rtcCache.mqtt_msg_id;
+	}
+	MQTT_OnAcked(&mqttClient, mqtt_acked_cb);
+#else
+	// a duty cycle ends every wake without a DISCONNECT, the will would fire each time
 	MQTT_InitLWT(&mqttClient, "/lwt", "offline", 0, 0);
+#endif
 	MQTT_OnConnected(&mqttClient, mqtt_connected_cb);
 	MQTT_OnDisconnected(&mqttClient, mqtt_disconnected_cb);
 	MQTT_OnPublished(&mqttClient, mqtt_published_cb);
 	MQTT_OnData(&mqttClient, mqtt_data_cb);
 
+#ifdef SERIAL_BRIDGE
+	BRIDGE_Init(&mqttClient);
+#endif
+#ifdef OTA_UPDATE
+	OTA_Init(&mqttClient);
+#endif
+
+	for (i = 0; i < STA_NETS; i++) {
+		if (config.sta_nets[i].ssid[0])
+			WIFI_AddNetwork(config.sta_nets[i].ssid, config.sta_nets[i].pwd);
+	}
+#ifndef DEEP_SLEEP_MODE
+	// a duty cycle is over before roaming could pay off
+	WIFI_SetRoaming(-(sint8)config.roam_rssi);
+#endif
 	WIFI_Connect(config.sta_ssid, config.sta_pwd, wifi_connect_cb);
 
 	os_timer_disarm(&dhtTimer);
 	os_timer_setfn(&dhtTimer, (os_timer_func_t *)dhtCb, (void *)0);
-	os_timer_arm(&dhtTimer, DELAY, 1);
+#ifdef DEEP_SLEEP_MODE
+	// sample while the station associates
+	os_timer_arm(&dhtTimer, 1, 0);
+
+	os_timer_disarm(&sleepTimer);
+	os_timer_setfn(&sleepTimer, (os_timer_func_t *)sleep_timeout_cb, (void *)0);
+	os_timer_arm(&sleepTimer, DEEP_SLEEP_TIMEOUT, 0);
+#else
+	TICKER_Start(&ticker, DELAY);
+	os_timer_arm(&dhtTimer, TICKER_Arm(&ticker), 0);
+	aggr_start();
+	CLOCK_Init(config.sntp_host, config.sntp_interval);
+	POWER_Init(power_mode(), power_deadline);
+	METRICS_Init(&mqttClient);
+#endif
 
 	INFO("\r\nSystem started ...\r\n");
 }